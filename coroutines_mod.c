@@ -4,6 +4,7 @@
 #include <signal.h>
 #include <sys/mman.h>
 #include <time.h>
+#include <string.h>
 
 /*
 * Here you have 3 contexts - one for each coroutine. First
@@ -40,6 +41,134 @@ struct timespec end;
 // Available time in microseconds of working for each coroutine
 long int target_latency, tv;
 
+/*
+ * Adaptive target latency. When the first argument is "auto" (or
+ * "auto=<ceiling %>[,<fairness %>]") the slice length is not
+ * fixed: every epoch (one round over the ready coroutines) the
+ * controller compares time spent inside swapcontext with the
+ * epoch length and the spread of progress between coroutines,
+ * then moves the slice toward the shortest value that keeps
+ * switching overhead under the ceiling, shortening it while
+ * fairness is below the target.
+ */
+#define ADAPT_DEFAULT_CEILING 0.02
+#define ADAPT_DEFAULT_FAIRNESS 0.9
+#define ADAPT_START_LATENCY 100
+#define ADAPT_MIN_LATENCY 1
+#define ADAPT_MAX_LATENCY 1000000
+
+int adaptive = 0;
+// Maximal share of time allowed to be spent on switching
+double overhead_ceiling = ADAPT_DEFAULT_CEILING;
+// Fairness index below which the slice is shortened
+double fairness_target = ADAPT_DEFAULT_FAIRNESS;
+// Time when the last switch was started, for measuring its cost
+struct timespec switch_begin;
+// Average cost of one switch in nanoseconds (EWMA)
+double switch_cost_ns = 0;
+// Current epoch: start time, switching time, progress of each coro
+long long epoch_start_ns = 0;
+long long epoch_switch_ns = 0;
+int epoch_switches = 0;
+long int* epoch_worktime;
+// Whole run totals for the final report
+long long total_switch_ns = 0;
+long int latency_min, latency_max;
+int num_adjustments = 0;
+double last_overhead = 0, last_fairness = 1;
+
+static long long
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+/* Account a finished switch into the coroutine which called it */
+static void
+adapt_switch_done()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	long long cost = (ts.tv_sec - switch_begin.tv_sec)*1000000000LL + (ts.tv_nsec - switch_begin.tv_nsec);
+	if(cost < 0)
+		return;
+	epoch_switch_ns += cost;
+	total_switch_ns += cost;
+	epoch_switches ++;
+	if(switch_cost_ns == 0)
+		switch_cost_ns = cost;
+	else
+		switch_cost_ns = 0.9*switch_cost_ns + 0.1*cost;
+}
+
+/* Jain's fairness index of the progress made by ready coroutines */
+static double
+adapt_fairness()
+{
+	double sum = 0, sum_sq = 0;
+	int n = 0;
+	for(int i=0; i<num_coros; i++) {
+		if(!ready_coro[i])
+			continue;
+		sum += epoch_worktime[i];
+		sum_sq += (double)epoch_worktime[i]*epoch_worktime[i];
+		n ++;
+	}
+	if(n < 2 || sum_sq == 0)
+		return 1;
+	return sum*sum/(n*sum_sq);
+}
+
+/* Close the epoch if every ready coroutine had a chance to run */
+static void
+adapt_epoch()
+{
+	int ready = 0;
+	for(int i=0; i<num_coros; i++)
+		ready += ready_coro[i];
+	// With a single ready coroutine there is nothing to balance
+	if(ready < 2 || epoch_switches < ready)
+		return;
+	long long now = now_ns();
+	long long length = now - epoch_start_ns;
+	if(length <= 0)
+		return;
+	last_overhead = (double)epoch_switch_ns/length;
+	last_fairness = adapt_fairness();
+
+	// The shortest slice that still fits into the overhead budget
+	long int floor_latency = (long int)(switch_cost_ns/overhead_ceiling/1000) + 1;
+	long int new_latency = target_latency;
+	if(last_overhead > overhead_ceiling)
+		new_latency = target_latency*2;
+	else if(last_fairness < fairness_target)
+		new_latency = target_latency/2;
+	else
+		new_latency = target_latency - target_latency/8;
+	if(new_latency < floor_latency)
+		new_latency = floor_latency;
+	if(new_latency < ADAPT_MIN_LATENCY)
+		new_latency = ADAPT_MIN_LATENCY;
+	if(new_latency > ADAPT_MAX_LATENCY)
+		new_latency = ADAPT_MAX_LATENCY;
+	if(new_latency != target_latency) {
+		target_latency = new_latency;
+		num_adjustments ++;
+		if(target_latency < latency_min)
+			latency_min = target_latency;
+		if(target_latency > latency_max)
+			latency_max = target_latency;
+	}
+
+	epoch_start_ns = now;
+	epoch_switch_ns = 0;
+	epoch_switches = 0;
+	for(int i=0; i<num_coros; i++)
+		epoch_worktime[i] = 0;
+}
+
 // id = 0 - main context, id > 0 = coroutine context 
 void swap(int id)
 {
@@ -48,6 +177,9 @@ void swap(int id)
 	if(id == -1) {
 		for(int j=0; j<num_coros; j++) {
 			if (ready_coro[j]) {
+				// The resumed coroutine accounts this switch too
+				if(adaptive)
+					clock_gettime(CLOCK_MONOTONIC, &switch_begin);
 				clock_gettime(CLOCK_REALTIME, &start);
 				if (swapcontext(&uctx_main, uctx_func+j) == -1)
 	        			handle_error("swapcontext");
@@ -61,16 +193,28 @@ void swap(int id)
 	if(tv < target_latency)
 		return;
 	worktime[id] += tv; 
+	if(adaptive) {
+		epoch_worktime[id] += tv;
+		adapt_epoch();
+	}
 	for(int j=1; j<num_coros; j++)
 	{
 		if (ready_coro[(id+j)%num_coros]) {
 			num_swaps[id] ++;
+			if(adaptive)
+				clock_gettime(CLOCK_MONOTONIC, &switch_begin);
 			clock_gettime(CLOCK_REALTIME, &start);
 			if (swapcontext(uctx_func+id, uctx_func+(id+j)%num_coros) == -1)
 	        		handle_error("swapcontext");
-			break;
+			if(adaptive)
+				adapt_switch_done();
+			return;
 		}	
 	}
+	// Nobody else is ready, so the slice just goes on. Its time up to
+	// now is in worktime already, in every mode, and must not be
+	// counted again on the next check
+	start = end;
 }
 
 int* merge(int* arr1, int* arr2, int size1, int size2, int id)
@@ -186,20 +330,66 @@ my_coroutine(int id, char* filename, int** arr_sorted, int* pnum_el)
 }
 
 
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s <latency>|auto[=<ceiling %%>[,<fairness %%>]] <file>...\n", name);
+	exit(EXIT_FAILURE);
+}
+
+/* Parse "=<ceiling %>[,<fairness %>]" after "auto", -1 if it is bad */
+static int
+parse_auto(const char *arg)
+{
+	if(*arg == '\0')
+		return 0;
+	if(*arg != '=')
+		return -1;
+	char *end;
+	double ceiling = strtod(arg + 1, &end);
+	if(end == arg + 1 || !(ceiling > 0 && ceiling < 100))
+		return -1;
+	double fairness = fairness_target*100;
+	if(*end == ',') {
+		const char *from = end + 1;
+		fairness = strtod(from, &end);
+		if(end == from || !(fairness > 0 && fairness <= 100))
+			return -1;
+	}
+	if(*end != '\0')
+		return -1;
+	overhead_ceiling = ceiling/100;
+	fairness_target = fairness/100;
+	return 0;
+}
+
 int main (int argc, char *argv[])
 {
 	struct timespec start_time;
 	struct timespec end_time;
 	clock_gettime(CLOCK_REALTIME, &start_time);
 	
+	if(argc < 3)
+		usage(argv[0]);
 	num_coros = argc - 2;
 	printf("Number of coros: %d\n", num_coros);
 	char** str = argv + 2;
 	uctx_func = (ucontext_t*)malloc(sizeof(ucontext_t)*num_coros);
 	ready_coro = (int*)malloc(sizeof(int)*num_coros);
-	target_latency = atoi(argv[1]);
-	printf("Target latency: %ld\n", target_latency);
+	if(strncmp(argv[1], "auto", 4) == 0) {
+		if(parse_auto(argv[1] + 4) != 0)
+			usage(argv[0]);
+		adaptive = 1;
+		target_latency = ADAPT_START_LATENCY;
+		latency_min = latency_max = target_latency;
+		printf("Target latency: auto, overhead ceiling %.2f%%, fairness target %.2f\n", overhead_ceiling*100, fairness_target);
+	}
+	else {
+		target_latency = atoi(argv[1]);
+		printf("Target latency: %ld\n", target_latency);
+	}
 	worktime = (long int*)malloc(sizeof(long int)*num_coros);
+	epoch_worktime = (long int*)calloc(num_coros, sizeof(long int));
 	num_swaps = (int*)malloc(sizeof(int)*num_coros);
 	int** arr_sorted = (int**)malloc(sizeof(int*)*num_coros);
 	int* num_el = (int*)malloc(sizeof(int)*num_coros); 
@@ -225,6 +415,7 @@ int main (int argc, char *argv[])
 	
 	/* Here coroutines start */
 	printf("main: start\n");
+	epoch_start_ns = now_ns();
 	if (swapcontext(&uctx_main, uctx_func) == -1)
 		handle_error("swapcontext");
 	for(int i=0; i<num_coros; i++)
@@ -252,6 +443,13 @@ int main (int argc, char *argv[])
 	printf("Coroutines execution time and number of swaps:\n");
 	for(int i=0; i<num_coros; i++)
 		printf("\tcoro%d: %ld microsec, %d swaps\n", i, worktime[i], num_swaps[i]);
+	if(adaptive) {
+		long int run_time = (end_time.tv_sec - start_time.tv_sec)*1000000 + (end_time.tv_nsec - start_time.tv_nsec)/1000;
+		printf("Adaptive target latency:\n");
+		printf("\tfinal: %ld microsec (min %ld, max %ld), %d adjustments\n", target_latency, latency_min, latency_max, num_adjustments);
+		printf("\tswitch cost: %.0f nanosec, switching time: %lld microsec (%.2f%% of run)\n", switch_cost_ns, total_switch_ns/1000, run_time > 0 ? 100.0*total_switch_ns/1000/run_time : 0);
+		printf("\tlast epoch: overhead %.2f%% (ceiling %.2f%%), fairness %.3f (target %.2f)\n", last_overhead*100, overhead_ceiling*100, last_fairness, fairness_target);
+	}
 	return 0;
 }
 
@@ -1,71 +1,941 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+extern char **environ;
 
 struct cmd
 {
 	const char *name;
+	/* Arguments with the name first, ended by NULL as for execvp() */
 	const char **argv;
 	int argc;
+	/* Redirections of stdin and stdout, NULL when there are none */
+	const char *in_file;
+	const char *out_file;
+	/* '>>' instead of '>' */
+	bool append;
+};
+
+/* How the pipeline after a pipeline runs */
+enum pipeline_next {
+	NEXT_NONE,
+	/* '&&': if this one succeeds */
+	NEXT_AND,
+	/* '||': if this one fails */
+	NEXT_OR,
+};
+
+/* Commands connected with '|' */
+struct pipeline
+{
+	struct cmd *cmds;
+	int count;
+	enum pipeline_next next;
 };
 
-void print_cmd (struct cmd command)
+/* Pipelines of one line, connected with '&&' and '||' */
+struct cmd_line
 {
-	printf("Command: %s\nArguments:", command.name);
-	for(int i=0; i<command.argc; i++)
-		printf(" %s", command.argv[i]);
-	printf("\n");
+	struct pipeline *pipes;
+	int count;
+};
+
+enum {
+	/* Bytes of one read from the input */
+	READ_SIZE = 64 * 1024,
+	/* The first arena chunk, the next ones double */
+	ARENA_CHUNK = 4096,
+	/* Pipelines up to that long keep their pids on the stack */
+	PIPELINE_SHORT = 16,
+	/* Max lines of a batch run at once */
+	BATCH_MAX_JOBS = 1024,
+};
+
+#define handle_error(msg) do { perror(msg); exit(EXIT_FAILURE); } while (0)
+
+/*
+ * Bump allocator of one line. Everything parsed from a line lives
+ * here and is freed at once by arena_reset(), which keeps the
+ * biggest chunk, so usual lines cost no malloc() at all.
+ */
+struct arena_chunk
+{
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+struct arena
+{
+	struct arena_chunk *head;
+};
+
+static void *
+arena_alloc(struct arena *arena, size_t size)
+{
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	struct arena_chunk *chunk = arena->head;
+	if(chunk == NULL || chunk->size - chunk->used < size) {
+		size_t chunk_size = chunk == NULL ? ARENA_CHUNK : chunk->size * 2;
+		while(chunk_size < size)
+			chunk_size *= 2;
+		chunk = (struct arena_chunk *)malloc(sizeof(*chunk) + chunk_size);
+		if(chunk == NULL)
+			handle_error("malloc");
+		chunk->next = arena->head;
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		arena->head = chunk;
+	}
+	void *mem = chunk->data + chunk->used;
+	chunk->used += size;
+	return mem;
 }
 
-int main (int argc, char* argv[])
+static void
+arena_reset(struct arena *arena)
 {
-	struct cmd command;
-	int words_num = 100;
-	char **words = (char **)malloc(sizeof(char*)*words_num);
-	for(int i=0; i<words_num; i++)
-		words[i] = (char*)malloc(sizeof(char)*100);
-	char ch;
-	char buf[100];
-	int count_words = 0;
-	while(1) {
-		printf("\n> ");
-		count_words = 0;
-		while(scanf("%c", &ch)) {
-			if(ch == '\"') {	
-				if(scanf("%[^\"]\"", buf)){
-					sprintf(words[count_words], "\"%s\"", buf);
-					while(*(buf + strlen(buf) - 1) == '\\') {
-						if(scanf("%[^\"]\"", buf))
-							sprintf(words[count_words], "%s%s\"", words[count_words], buf);
-						else {
-							sprintf(words[count_words], "%s\"", words[count_words]);
-							scanf("\"");
-							break;
-						}
-					}
-				}
-				else {
-					sprintf(words[count_words], "\"\"");
-					scanf("\"");
-				}
-				count_words ++;
+	struct arena_chunk *chunk = arena->head;
+	if(chunk == NULL)
+		return;
+	while(chunk->next != NULL) {
+		struct arena_chunk *next = chunk->next->next;
+		free(chunk->next);
+		chunk->next = next;
+	}
+	chunk->used = 0;
+}
+
+static void
+arena_destroy(struct arena *arena)
+{
+	while(arena->head != NULL) {
+		struct arena_chunk *next = arena->head->next;
+		free(arena->head);
+		arena->head = next;
+	}
+}
+
+/*
+ * Input read in big blocks. Tokens are cut from the block in
+ * runs, a token crossing its end continues in the next block.
+ * A regular file can be mapped whole instead, then it is the
+ * only block.
+ */
+struct reader
+{
+	int fd;
+	char *buf;
+	size_t pos;
+	size_t end;
+	bool eof;
+	/* buf is a mapping of that many bytes */
+	size_t mapped;
+};
+
+/* Map the input if it is a regular file, else keep reading it */
+static void
+reader_map(struct reader *in)
+{
+	struct stat st;
+	if(fstat(in->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return;
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+	if(map == MAP_FAILED)
+		return;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	free(in->buf);
+	in->buf = (char *)map;
+	in->pos = 0;
+	in->end = st.st_size;
+	in->eof = true;
+	in->mapped = st.st_size;
+}
+
+/* Read the next block, false on the end of input */
+static bool
+reader_fill(struct reader *in)
+{
+	while(!in->eof) {
+		ssize_t rc = read(in->fd, in->buf, READ_SIZE);
+		if(rc > 0) {
+			in->pos = 0;
+			in->end = rc;
+			return true;
+		}
+		if(rc < 0 && errno == EINTR)
+			continue;
+		if(rc < 0)
+			perror("read");
+		in->eof = true;
+	}
+	return false;
+}
+
+/* The next byte, or -1 on the end of input */
+static inline int
+reader_peek(struct reader *in)
+{
+	if(in->pos == in->end && !reader_fill(in))
+		return -1;
+	return (unsigned char)in->buf[in->pos];
+}
+
+/*
+ * Classes of bytes, a run of plain ones is copied at once. The
+ * ones from CH_SPACE to CH_GT end a word.
+ */
+enum char_class {
+	CH_PLAIN = 0,
+	CH_SPACE,
+	CH_NEWLINE,
+	CH_PIPE,
+	CH_AMP,
+	CH_LT,
+	CH_GT,
+	CH_DQUOTE,
+	CH_SQUOTE,
+	CH_ESCAPE,
+	CH_COMMENT,
+};
+
+static const unsigned char char_class[256] = {
+	[' '] = CH_SPACE,
+	['\t'] = CH_SPACE,
+	['\r'] = CH_SPACE,
+	['\n'] = CH_NEWLINE,
+	['|'] = CH_PIPE,
+	['&'] = CH_AMP,
+	['<'] = CH_LT,
+	['>'] = CH_GT,
+	['"'] = CH_DQUOTE,
+	['\''] = CH_SQUOTE,
+	['\\'] = CH_ESCAPE,
+	['#'] = CH_COMMENT,
+};
+
+enum token {
+	TOKEN_WORD,
+	/* '|' */
+	TOKEN_PIPE,
+	/* '||' */
+	TOKEN_OR,
+	/* '&&' */
+	TOKEN_AND,
+	/* '<' */
+	TOKEN_IN,
+	/* '>' */
+	TOKEN_OUT,
+	/* '>>' */
+	TOKEN_APPEND,
+	/* The end of a line */
+	TOKEN_END,
+	TOKEN_EOF,
+	TOKEN_ERROR,
+};
+
+/*
+ * Tokenizer state. A word and the arguments of a command are
+ * gathered in buffers reused from line to line, then copied to
+ * the arena once they are complete.
+ */
+struct parser
+{
+	struct reader in;
+	struct arena arena;
+	char *word;
+	size_t word_len;
+	size_t word_cap;
+	const char **args;
+	int args_count;
+	size_t args_cap;
+	struct cmd *cmds;
+	int cmds_count;
+	size_t cmds_cap;
+	struct pipeline *pipes;
+	int pipes_count;
+	size_t pipes_cap;
+	/* Lines stay in the arena, a whole script is parsed at once */
+	bool keep_lines;
+};
+
+static void
+parser_create(struct parser *p, int fd)
+{
+	memset(p, 0, sizeof(*p));
+	p->in.fd = fd;
+	p->in.buf = (char *)malloc(READ_SIZE);
+	if(p->in.buf == NULL)
+		handle_error("malloc");
+}
+
+static void
+parser_destroy(struct parser *p)
+{
+	if(p->in.mapped != 0)
+		munmap(p->in.buf, p->in.mapped);
+	else
+		free(p->in.buf);
+	free(p->word);
+	free(p->args);
+	free(p->cmds);
+	free(p->pipes);
+	arena_destroy(&p->arena);
+}
+
+/* Grow a buffer of @a cap items of @a size bytes to fit @a need */
+static void *
+buffer_reserve(void *buf, size_t size, size_t need, size_t *cap)
+{
+	if(need <= *cap)
+		return buf;
+	size_t new_cap = *cap == 0 ? 64 : *cap;
+	while(new_cap < need)
+		new_cap *= 2;
+	buf = realloc(buf, new_cap * size);
+	if(buf == NULL)
+		handle_error("realloc");
+	*cap = new_cap;
+	return buf;
+}
+
+static inline void
+word_append(struct parser *p, const char *data, size_t len)
+{
+	if(p->word_len + len > p->word_cap)
+		p->word = (char *)buffer_reserve(p->word, 1, p->word_len + len, &p->word_cap);
+	memcpy(p->word + p->word_len, data, len);
+	p->word_len += len;
+}
+
+/* Copy the gathered word to the arena */
+static const char *
+word_finish(struct parser *p)
+{
+	char *word = (char *)arena_alloc(&p->arena, p->word_len + 1);
+	memcpy(word, p->word, p->word_len);
+	word[p->word_len] = 0;
+	p->word_len = 0;
+	return word;
+}
+
+/* Append the plain bytes up to the end of the block */
+static void
+read_run(struct parser *p)
+{
+	struct reader *in = &p->in;
+	size_t start = in->pos;
+	while(in->pos < in->end && char_class[(unsigned char)in->buf[in->pos]] == CH_PLAIN)
+		in->pos++;
+	word_append(p, in->buf + start, in->pos - start);
+}
+
+/*
+ * Read a quoted part of a word up to the closing quote, which can
+ * be on another line. In double quotes a backslash escapes only
+ * '"', '\' and a newline, in single quotes nothing.
+ * @retval false The input ended first.
+ */
+static bool
+read_quoted(struct parser *p, char quote)
+{
+	struct reader *in = &p->in;
+	for(;;) {
+		int c = reader_peek(in);
+		if(c < 0)
+			return false;
+		if(c == quote) {
+			in->pos++;
+			return true;
+		}
+		if(c == '\\' && quote == '"') {
+			in->pos++;
+			c = reader_peek(in);
+			if(c < 0)
+				return false;
+			if(c == '"' || c == '\\')
+				word_append(p, in->buf + in->pos, 1);
+			else if(c != '\n')
+				word_append(p, "\\", 1);
+			if(c == '"' || c == '\\' || c == '\n')
+				in->pos++;
+			continue;
+		}
+		/* Up to the quote or, in double quotes, a backslash */
+		size_t start = in->pos++;
+		while(in->pos < in->end && in->buf[in->pos] != quote &&
+		      (in->buf[in->pos] != '\\' || quote != '"'))
+			in->pos++;
+		word_append(p, in->buf + start, in->pos - start);
+	}
+}
+
+/*
+ * The next token. A word is stored in the arena and returned in
+ * *@a word. Words are split by spaces and operators, quotes and
+ * backslashes keep them together, '#' at the start of a word
+ * comments out the rest of the line.
+ */
+static enum token
+next_token(struct parser *p, const char **word)
+{
+	struct reader *in = &p->in;
+	bool in_word = false;
+	for(;;) {
+		int c = reader_peek(in);
+		unsigned char cls = c < 0 ? CH_NEWLINE : char_class[c];
+		if(in_word && (c < 0 || (cls >= CH_SPACE && cls <= CH_GT))) {
+			*word = word_finish(p);
+			return TOKEN_WORD;
+		}
+		if(c < 0)
+			return TOKEN_EOF;
+		switch(cls) {
+		case CH_SPACE:
+			in->pos++;
+			break;
+		case CH_NEWLINE:
+			in->pos++;
+			return TOKEN_END;
+		case CH_PIPE:
+			in->pos++;
+			if(reader_peek(in) != '|')
+				return TOKEN_PIPE;
+			in->pos++;
+			return TOKEN_OR;
+		case CH_AMP:
+			in->pos++;
+			if(reader_peek(in) != '&') {
+				fprintf(stderr, "syntax error: background jobs are not supported\n");
+				return TOKEN_ERROR;
 			}
-			else if(ch == ' ') {}
-			else if(ch == '\n')
+			in->pos++;
+			return TOKEN_AND;
+		case CH_LT:
+			in->pos++;
+			return TOKEN_IN;
+		case CH_GT:
+			in->pos++;
+			if(reader_peek(in) != '>')
+				return TOKEN_OUT;
+			in->pos++;
+			return TOKEN_APPEND;
+		case CH_COMMENT:
+			if(in_word) {
+				word_append(p, "#", 1);
+				in->pos++;
 				break;
+			}
+			while((c = reader_peek(in)) >= 0 && c != '\n') {
+				char *nl = (char *)memchr(in->buf + in->pos, '\n', in->end - in->pos);
+				in->pos = nl != NULL ? (size_t)(nl - in->buf) : in->end;
+			}
+			break;
+		case CH_DQUOTE:
+		case CH_SQUOTE:
+			in->pos++;
+			in_word = true;
+			if(!read_quoted(p, (char)c)) {
+				fprintf(stderr, "syntax error: unterminated quote\n");
+				p->word_len = 0;
+				return TOKEN_ERROR;
+			}
+			break;
+		case CH_ESCAPE:
+			in->pos++;
+			c = reader_peek(in);
+			/* A backslash before a newline joins the lines */
+			if(c == '\n') {
+				in->pos++;
+				break;
+			}
+			in_word = true;
+			if(c < 0)
+				word_append(p, "\\", 1);
+			else
+				word_append(p, in->buf + in->pos++, 1);
+			break;
+		default:
+			in_word = true;
+			read_run(p);
+			break;
+		}
+	}
+}
+
+/* Copy the gathered arguments to the arena as a command */
+static void
+command_finish(struct parser *p, struct cmd *cmd)
+{
+	p->cmds = (struct cmd *)buffer_reserve(p->cmds, sizeof(*p->cmds),
+					       p->cmds_count + 1, &p->cmds_cap);
+	cmd->argv = (const char **)arena_alloc(&p->arena, (p->args_count + 1) * sizeof(char *));
+	memcpy(cmd->argv, p->args, p->args_count * sizeof(char *));
+	cmd->argv[p->args_count] = NULL;
+	cmd->argc = p->args_count;
+	cmd->name = cmd->argv[0];
+	p->cmds[p->cmds_count++] = *cmd;
+	p->args_count = 0;
+	memset(cmd, 0, sizeof(*cmd));
+}
+
+/* Copy the gathered commands to the arena as a pipeline */
+static void
+pipeline_finish(struct parser *p, enum pipeline_next next)
+{
+	p->pipes = (struct pipeline *)buffer_reserve(p->pipes, sizeof(*p->pipes),
+						     p->pipes_count + 1, &p->pipes_cap);
+	struct pipeline *pipeline = &p->pipes[p->pipes_count++];
+	pipeline->cmds = (struct cmd *)arena_alloc(&p->arena, p->cmds_count * sizeof(struct cmd));
+	memcpy(pipeline->cmds, p->cmds, p->cmds_count * sizeof(struct cmd));
+	pipeline->count = p->cmds_count;
+	pipeline->next = next;
+	p->cmds_count = 0;
+}
+
+/*
+ * Parse one line into pipelines stored in the arena, which is
+ * reset first unless keep_lines is set. Redirections can stand
+ * anywhere among the words of a command.
+ * @retval 1 A line is parsed, it can be empty.
+ * @retval 0 The input ended.
+ * @retval -1 Syntax error, the rest of the line is skipped.
+ */
+static int
+parse_line(struct parser *p, struct cmd_line *line)
+{
+	if(!p->keep_lines)
+		arena_reset(&p->arena);
+	p->args_count = 0;
+	p->cmds_count = 0;
+	p->pipes_count = 0;
+	line->pipes = NULL;
+	line->count = 0;
+	struct cmd cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	/* An operator was the last, a command must follow */
+	bool need_cmd = false;
+	enum token token;
+	for(;;) {
+		const char *word;
+		token = next_token(p, &word);
+		if(token == TOKEN_WORD) {
+			p->args = (const char **)buffer_reserve(p->args, sizeof(*p->args),
+								p->args_count + 1, &p->args_cap);
+			p->args[p->args_count++] = word;
+			continue;
+		}
+		if(token == TOKEN_IN || token == TOKEN_OUT || token == TOKEN_APPEND) {
+			enum token redirect = token;
+			if((token = next_token(p, &word)) != TOKEN_WORD) {
+				if(token != TOKEN_ERROR)
+					fprintf(stderr, "syntax error: no file to redirect to\n");
+				goto skip_line;
+			}
+			if(redirect == TOKEN_IN) {
+				cmd.in_file = word;
+			}
 			else {
-				if(scanf("%[^ \n]", buf))
-					sprintf(words[count_words], "%c%s", ch, buf);
-				else
-					sprintf(words[count_words], "%c", ch);
-				count_words ++;
-			} 
-		}
-		for(int i=0; i<count_words; i++)
-			printf("%s|", words[i]);
-		//command.name = buf;
-		//command.argv = (const char **)(&buf);
-		//command.argc = 1;
-		//print_cmd(command);
+				cmd.out_file = word;
+				cmd.append = redirect == TOKEN_APPEND;
+			}
+			continue;
+		}
+		if(token == TOKEN_ERROR)
+			goto skip_line;
+		/* An operator or the end of the line ends a command */
+		if(p->args_count > 0) {
+			command_finish(p, &cmd);
+		}
+		else if(need_cmd || cmd.in_file != NULL || cmd.out_file != NULL ||
+			(token != TOKEN_END && token != TOKEN_EOF)) {
+			fprintf(stderr, "syntax error: empty command\n");
+			goto skip_line;
+		}
+		need_cmd = token != TOKEN_END && token != TOKEN_EOF;
+		if(token == TOKEN_PIPE)
+			continue;
+		if(p->cmds_count > 0)
+			pipeline_finish(p, token == TOKEN_AND ? NEXT_AND : token == TOKEN_OR ? NEXT_OR : NEXT_NONE);
+		if(need_cmd)
+			continue;
+		if(token == TOKEN_EOF && p->pipes_count == 0)
+			return 0;
+		break;
+	}
+	line->pipes = (struct pipeline *)arena_alloc(&p->arena, p->pipes_count * sizeof(struct pipeline));
+	memcpy(line->pipes, p->pipes, p->pipes_count * sizeof(struct pipeline));
+	line->count = p->pipes_count;
+	return 1;
+
+skip_line:
+	if(token == TOKEN_END || token == TOKEN_EOF)
+		return -1;
+	for(int c; (c = reader_peek(&p->in)) >= 0 && c != '\n';)
+		p->in.pos++;
+	if(reader_peek(&p->in) == '\n')
+		p->in.pos++;
+	return -1;
+}
+
+/* Exit status of a child as the shell reports it */
+static int
+wait_status(pid_t pid)
+{
+	int status;
+	while(waitpid(pid, &status, 0) < 0) {
+		if(errno != EINTR) {
+			perror("waitpid");
+			return 127;
+		}
+	}
+	if(WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
+
+/*
+ * Start a command with posix_spawnp(). glibc starts it like
+ * vfork(): the child shares the memory of the shell until exec,
+ * so page tables are never copied and the start costs the same
+ * for a shell of any size. Only the descriptors which differ from
+ * the shell's are set up: the pipe ends @a in and @a out, -1 when
+ * there are none, and redirections opened right into 0 and 1.
+ * Pipes and line outputs are close-on-exec, so nothing else
+ * needs closing.
+ * @retval -1 The command can not be started.
+ */
+static pid_t
+spawn_cmd(const struct cmd *cmd, int in, int out)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	if(cmd->in_file != NULL)
+		posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, cmd->in_file, O_RDONLY, 0);
+	else if(in >= 0)
+		posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+	if(cmd->out_file != NULL)
+		posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, cmd->out_file,
+						 O_WRONLY | O_CREAT | (cmd->append ? O_APPEND : O_TRUNC), 0644);
+	else if(out >= 0)
+		posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+	pid_t pid;
+	int rc = posix_spawnp(&pid, cmd->name, &actions, NULL, (char *const *)cmd->argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if(rc != 0) {
+		fprintf(stderr, "%s: %s\n", cmd->name, strerror(rc));
+		return -1;
+	}
+	return pid;
+}
+
+/* Whether a command changes the shell itself, see run_builtin() */
+static bool
+is_builtin(const struct cmd *cmd)
+{
+	return strcmp(cmd->name, "cd") == 0 || strcmp(cmd->name, "exit") == 0;
+}
+
+/*
+ * Commands which change the shell itself. They run in the shell
+ * when they are alone in a pipeline. 'exit' only sets @a quit,
+ * the caller stops after the lines before it are done.
+ * @retval -1 Not a builtin.
+ */
+static int
+run_builtin(const struct cmd *cmd, bool *quit)
+{
+	if(strcmp(cmd->name, "cd") == 0) {
+		const char *dir = cmd->argc > 1 ? cmd->argv[1] : getenv("HOME");
+		if(dir == NULL || chdir(dir) != 0) {
+			fprintf(stderr, "cd: %s\n", dir == NULL ? "HOME is not set" : strerror(errno));
+			return 1;
+		}
+		return 0;
+	}
+	if(strcmp(cmd->name, "exit") == 0) {
+		*quit = true;
+		return cmd->argc > 1 ? atoi(cmd->argv[1]) & 0xff : 0;
+	}
+	return -1;
+}
+
+/*
+ * Run a pipeline: start all its commands connected with pipes,
+ * then wait for them. The output of the last command goes to
+ * @a out, or to the shell's stdout when it is -1.
+ * @retval Exit status of the last command.
+ */
+static int
+run_pipeline(const struct pipeline *pipeline, int out, bool *quit)
+{
+	int status;
+	if(pipeline->count == 1 && (status = run_builtin(&pipeline->cmds[0], quit)) >= 0)
+		return status;
+	pid_t short_pids[PIPELINE_SHORT];
+	pid_t *pids = short_pids;
+	if(pipeline->count > PIPELINE_SHORT &&
+	   (pids = (pid_t *)malloc(pipeline->count * sizeof(pid_t))) == NULL)
+		handle_error("malloc");
+	int in = -1;
+	int started = 0;
+	for(; started < pipeline->count; started++) {
+		int fds[2] = {-1, -1};
+		if(started + 1 < pipeline->count && pipe2(fds, O_CLOEXEC) != 0) {
+			perror("pipe");
+			break;
+		}
+		pids[started] = spawn_cmd(&pipeline->cmds[started], in,
+					  started + 1 < pipeline->count ? fds[1] : out);
+		if(in >= 0)
+			close(in);
+		if(fds[1] >= 0)
+			close(fds[1]);
+		in = fds[0];
+	}
+	if(in >= 0)
+		close(in);
+	status = started < pipeline->count ? 1 : 127;
+	for(int i = 0; i < started; i++) {
+		if(pids[i] < 0)
+			continue;
+		int rc = wait_status(pids[i]);
+		if(i == pipeline->count - 1)
+			status = rc;
+	}
+	if(pids != short_pids)
+		free(pids);
+	return status;
+}
+
+/*
+ * Run the pipelines of a line: each one after '&&' runs if the
+ * status so far is success, after '||' if it is a failure. An
+ * 'exit' sets @a quit and ends the line.
+ * @retval Status of the last pipeline run, @a status if none.
+ */
+static int
+run_line(const struct cmd_line *line, int status, int out, bool *quit)
+{
+	for(int i = 0; i < line->count && !*quit; i++) {
+		if(i == 0 || (line->pipes[i - 1].next == NEXT_AND && status == 0) ||
+		   (line->pipes[i - 1].next == NEXT_OR && status != 0))
+			status = run_pipeline(&line->pipes[i], out, quit);
+	}
+	return status;
+}
+
+/* Whether a line can run a builtin, which changes the shell */
+static bool
+line_has_builtin(const struct cmd_line *line)
+{
+	for(int i = 0; i < line->count; i++) {
+		if(line->pipes[i].count == 1 && is_builtin(&line->pipes[i].cmds[0]))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Lines of a script run by several workers. Each worker gathers
+ * the output of its line in a memory file, and the outputs are
+ * printed in the order of the lines, so they never interleave.
+ */
+struct batch
+{
+	const struct cmd_line *lines;
+	int count;
+	/* The next line to run */
+	int next;
+	/* The next line to print the output of */
+	int printed;
+	/* A line with a builtin waits or runs, nothing else starts */
+	bool barrier;
+	/* Status of the last line */
+	int status;
+	pthread_mutex_t lock;
+	pthread_cond_t printed_cond;
+};
+
+/* Print the output gathered in @a fd and empty it */
+static void
+output_flush(int fd)
+{
+	char buf[READ_SIZE];
+	off_t offset = 0;
+	ssize_t rc;
+	while((rc = pread(fd, buf, sizeof(buf), offset)) > 0) {
+		for(ssize_t done = 0; done < rc;) {
+			ssize_t written = write(STDOUT_FILENO, buf + done, rc - done);
+			if(written < 0 && errno == EINTR)
+				continue;
+			if(written < 0)
+				handle_error("write");
+			done += written;
+		}
+		offset += rc;
+	}
+	if(ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0)
+		handle_error("ftruncate");
+}
+
+static void *
+batch_worker(void *arg)
+{
+	struct batch *batch = (struct batch *)arg;
+	int out = memfd_create("parser_output", MFD_CLOEXEC);
+	if(out < 0)
+		handle_error("memfd_create");
+	pthread_mutex_lock(&batch->lock);
+	while(batch->next < batch->count) {
+		if(batch->barrier) {
+			pthread_cond_wait(&batch->printed_cond, &batch->lock);
+			continue;
+		}
+		int i = batch->next++;
+		bool barrier = line_has_builtin(&batch->lines[i]);
+		if(barrier) {
+			/* It runs alone, after the lines before it are done */
+			batch->barrier = true;
+			while(batch->printed != i)
+				pthread_cond_wait(&batch->printed_cond, &batch->lock);
+		}
+		pthread_mutex_unlock(&batch->lock);
+		bool quit = false;
+		int status = run_line(&batch->lines[i], 0, out, &quit);
+		pthread_mutex_lock(&batch->lock);
+		while(batch->printed != i)
+			pthread_cond_wait(&batch->printed_cond, &batch->lock);
+		pthread_mutex_unlock(&batch->lock);
+		output_flush(out);
+		pthread_mutex_lock(&batch->lock);
+		/* Nothing runs after an exit, it gives the status */
+		if(quit)
+			batch->count = i + 1;
+		if(i == batch->count - 1)
+			batch->status = status;
+		if(barrier)
+			batch->barrier = false;
+		batch->printed++;
+		pthread_cond_broadcast(&batch->printed_cond);
+	}
+	pthread_mutex_unlock(&batch->lock);
+	close(out);
+	return NULL;
+}
+
+/*
+ * Run a script without prompts. All of it is parsed first, so a
+ * syntax error anywhere stops it before anything runs. With
+ * @a jobs > 1 up to that many lines run at once, which is only
+ * right when they do not depend on each other. A line which can
+ * run 'cd' or 'exit' is a barrier: it starts after all lines
+ * before it are done and printed, and the lines after it start
+ * when it is done, so a 'cd' never moves a running line and
+ * nothing runs after an 'exit'.
+ * @retval Status of the last line run.
+ */
+static int
+run_batch(struct parser *p, int jobs)
+{
+	reader_map(&p->in);
+	p->keep_lines = true;
+	struct cmd_line *lines = NULL;
+	size_t cap = 0;
+	int count = 0, rc;
+	bool failed = false;
+	struct cmd_line line;
+	while((rc = parse_line(p, &line)) != 0) {
+		if(rc < 0) {
+			failed = true;
+			continue;
+		}
+		if(line.count == 0)
+			continue;
+		lines = (struct cmd_line *)buffer_reserve(lines, sizeof(*lines), count + 1, &cap);
+		lines[count++] = line;
+	}
+	if(failed) {
+		free(lines);
+		return 2;
+	}
+	int status = 0;
+	if(jobs <= 1) {
+		bool quit = false;
+		for(int i = 0; i < count && !quit; i++)
+			status = run_line(&lines[i], status, -1, &quit);
+		free(lines);
+		return status;
+	}
+	struct batch batch = {lines, count, 0, 0, false, 0, PTHREAD_MUTEX_INITIALIZER,
+			      PTHREAD_COND_INITIALIZER};
+	if(jobs > count)
+		jobs = count;
+	pthread_t workers[BATCH_MAX_JOBS];
+	int started = 0;
+	for(; started < jobs; started++) {
+		if(pthread_create(&workers[started], NULL, batch_worker, &batch) != 0)
+			break;
+	}
+	/* Without any worker the lines run here */
+	if(started == 0)
+		batch_worker(&batch);
+	for(int i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	free(lines);
+	return batch.status;
+}
+
+/*
+ * Usage: parser [-j jobs] [script]
+ * Commands are read from the script or stdin. A script, or stdin
+ * which is not a terminal, runs in batch mode, see run_batch().
+ */
+int main (int argc, char* argv[])
+{
+	int jobs = 1;
+	int opt;
+	while((opt = getopt(argc, argv, "j:")) != -1) {
+		if(opt == 'j' && (jobs = atoi(optarg)) >= 1 && jobs <= BATCH_MAX_JOBS)
+			continue;
+		fprintf(stderr, "usage: %s [-j 1..%d] [script]\n", argv[0], BATCH_MAX_JOBS);
+		return 2;
+	}
+	int fd = STDIN_FILENO;
+	if(optind < argc && (fd = open(argv[optind], O_RDONLY | O_CLOEXEC)) < 0)
+		handle_error(argv[optind]);
+	struct parser parser;
+	parser_create(&parser, fd);
+	int status = 0;
+	if(fd != STDIN_FILENO || !isatty(fd)) {
+		status = run_batch(&parser, jobs);
+		parser_destroy(&parser);
+		if(fd != STDIN_FILENO)
+			close(fd);
+		return status;
+	}
+	struct cmd_line line;
+	int rc;
+	bool quit = false;
+	while(!quit) {
+		printf("\n> ");
+		fflush(stdout);
+		if((rc = parse_line(&parser, &line)) == 0)
+			break;
+		status = rc < 0 ? 2 : run_line(&line, status, -1, &quit);
 	}
+	parser_destroy(&parser);
+	return status;
 }
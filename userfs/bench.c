@@ -0,0 +1,674 @@
+#include "userfs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Benchmark of userfs. Each workload is run on userfs and, as a
+ * baseline, on files of a real directory through the POSIX API -
+ * tmpfs by default, so both keep the data in memory. For each run
+ * it prints rates of calls and bytes, latency percentiles of single
+ * calls and the process RSS at the end of the run, before its files
+ * are deleted. Note that tmpfs data is not in the RSS.
+ *
+ *     bench [-b ufs|posix] [-d dir] [-t threads] [-s scale] [workload...]
+ *
+ * -b runs only one backend, -d is a directory for the baseline,
+ * -t is a thread count of the multi-threaded workloads, -s scales
+ * call counts and file sizes. Workload arguments are prefixes of
+ * names of the workloads to run, by default all are run.
+ */
+
+enum {
+	KB = 1024,
+	MB = 1024 * 1024,
+	/** The biggest I/O size of the workloads. */
+	IO_MAX = MB,
+	/** Files of open_close workloads. */
+	OPEN_FILES = 1000,
+	/** Files kept by each thread of churn workloads. */
+	CHURN_FILES = 256,
+	NAME_SIZE = 64,
+};
+
+/** Calls of a filesystem, the same for userfs and POSIX. */
+struct backend {
+	const char *name;
+	int (*open)(const char *name, bool create);
+	int (*close)(int fd);
+	ssize_t (*pread)(int fd, char *buf, size_t size, size_t offset);
+	ssize_t (*pwrite)(int fd, const char *buf, size_t size, size_t offset);
+	int (*resize)(int fd, size_t size);
+	int (*remove)(const char *name);
+	/** Description of the last error of the calling thread. */
+	const char *(*error)(void);
+};
+
+static int
+ufs_backend_open(const char *name, bool create)
+{
+	return ufs_open(name, create ? UFS_CREATE : 0);
+}
+
+static int
+ufs_backend_resize(int fd, size_t size)
+{
+	return ufs_resize(fd, size);
+}
+
+static const char *
+ufs_backend_error(void)
+{
+	static __thread char buf[32];
+	snprintf(buf, sizeof(buf), "userfs error %d", (int)ufs_errno());
+	return buf;
+}
+
+static const struct backend ufs_backend = {
+	"ufs",
+	ufs_backend_open,
+	ufs_close,
+	ufs_pread,
+	ufs_pwrite,
+	ufs_backend_resize,
+	ufs_delete,
+	ufs_backend_error,
+};
+
+/** Directory of the POSIX backend files, with room for names. */
+static char posix_dir[PATH_MAX - NAME_SIZE];
+
+static void
+posix_path(char *path, const char *name)
+{
+	snprintf(path, PATH_MAX, "%s/%s", posix_dir, name);
+}
+
+static int
+posix_open(const char *name, bool create)
+{
+	char path[PATH_MAX];
+	posix_path(path, name);
+	return open(path, O_RDWR | (create ? O_CREAT : 0), 0644);
+}
+
+static ssize_t
+posix_pread(int fd, char *buf, size_t size, size_t offset)
+{
+	return pread(fd, buf, size, offset);
+}
+
+static ssize_t
+posix_pwrite(int fd, const char *buf, size_t size, size_t offset)
+{
+	return pwrite(fd, buf, size, offset);
+}
+
+static int
+posix_resize(int fd, size_t size)
+{
+	return ftruncate(fd, size);
+}
+
+static int
+posix_remove(const char *name)
+{
+	char path[PATH_MAX];
+	posix_path(path, name);
+	return unlink(path);
+}
+
+static const char *
+posix_error(void)
+{
+	return strerror(errno);
+}
+
+static const struct backend posix_backend = {
+	"posix",
+	posix_open,
+	close,
+	posix_pread,
+	posix_pwrite,
+	posix_resize,
+	posix_remove,
+	posix_error,
+};
+
+/** Backend of the current run. */
+static const struct backend *be;
+static double scale = 1;
+static int thread_count = 4;
+
+static void
+check(bool ok, const char *what)
+{
+	if(!ok) {
+		fprintf(stderr, "%s: %s failed: %s\n", be->name, what, be->error());
+		exit(1);
+	}
+}
+
+static inline uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t
+rng_next(uint64_t *state)
+{
+	/* xorshift64* */
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static size_t
+scaled_count(size_t count)
+{
+	size_t result = count * scale;
+	return result > 0 ? result : 1;
+}
+
+/** A file size multiplied by the scale, in whole megabytes. */
+static size_t
+scaled_size(size_t size)
+{
+	size_t result = (size_t)(size * scale) / MB * MB;
+	return result > 0 ? result : MB;
+}
+
+struct workload;
+
+/** State of one thread of a run. */
+struct worker {
+	const struct workload *wl;
+	int id;
+	uint64_t rng;
+	/** Buffer of IO_MAX bytes. */
+	char *buf;
+	/** Latencies of the calls, nanoseconds. */
+	uint64_t *lat;
+	size_t lat_count;
+	/** Calls to do. */
+	size_t ops;
+	uint64_t bytes;
+	/** Bounds of the timed part. */
+	uint64_t start;
+	uint64_t end;
+	/** RSS at the end of the timed part. */
+	size_t rss;
+};
+
+struct workload {
+	const char *name;
+	/** Done by each thread, calls worker_start() and worker_stop(). */
+	void (*run)(struct worker *w);
+	/** Done once before and after the threads, can be NULL. */
+	void (*prepare)(const struct workload *wl);
+	void (*cleanup)(const struct workload *wl);
+	/** Calls per thread, 0 means file_size / io_size. */
+	size_t count;
+	size_t io_size;
+	size_t file_size;
+	/** Percent of reads in a read/write mix. */
+	int read_percent;
+	/** The file is one for all threads. */
+	bool shared;
+	bool threaded;
+};
+
+static pthread_barrier_t start_barrier;
+
+/** Begin the timed part, when all threads are ready. */
+static void
+worker_start(struct worker *w)
+{
+	pthread_barrier_wait(&start_barrier);
+	w->start = now_ns();
+}
+
+static size_t
+rss_bytes(void)
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	if(f == NULL)
+		return 0;
+	size_t size, resident = 0;
+	if(fscanf(f, "%zu %zu", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void
+worker_stop(struct worker *w)
+{
+	w->end = now_ns();
+	w->rss = rss_bytes();
+}
+
+/** Account a call begun at @a start. */
+static inline void
+worker_done(struct worker *w, uint64_t start, size_t bytes)
+{
+	w->lat[w->lat_count++] = now_ns() - start;
+	w->bytes += bytes;
+}
+
+static void
+file_name(char *name, const char *prefix, int id, size_t n)
+{
+	snprintf(name, NAME_SIZE, "bench_%s_%d_%zu", prefix, id, n);
+}
+
+/** Create a file of @a size bytes, not timed. */
+static void
+fill_file(const char *name, size_t size, char *buf)
+{
+	int fd = be->open(name, true);
+	check(fd >= 0, "open");
+	for(size_t off = 0; off < size; off += IO_MAX) {
+		size_t len = size - off < IO_MAX ? size - off : IO_MAX;
+		check(be->pwrite(fd, buf, len, off) == (ssize_t)len, "pwrite");
+	}
+	check(be->close(fd) == 0, "close");
+}
+
+static void
+open_prepare(const struct workload *wl)
+{
+	(void)wl;
+	char name[NAME_SIZE];
+	for(size_t i = 0; i < OPEN_FILES; i++) {
+		file_name(name, "open", 0, i);
+		int fd = be->open(name, true);
+		check(fd >= 0, "open");
+		check(be->close(fd) == 0, "close");
+	}
+}
+
+static void
+open_cleanup(const struct workload *wl)
+{
+	(void)wl;
+	char name[NAME_SIZE];
+	for(size_t i = 0; i < OPEN_FILES; i++) {
+		file_name(name, "open", 0, i);
+		check(be->remove(name) == 0, "remove");
+	}
+}
+
+/** Open and close random existing files. */
+static void
+open_close_run(struct worker *w)
+{
+	char name[NAME_SIZE];
+	worker_start(w);
+	for(size_t i = 0; i < w->ops; i++) {
+		file_name(name, "open", 0, rng_next(&w->rng) % OPEN_FILES);
+		uint64_t start = now_ns();
+		int fd = be->open(name, false);
+		check(fd >= 0, "open");
+		check(be->close(fd) == 0, "close");
+		worker_done(w, start, 0);
+	}
+	worker_stop(w);
+}
+
+/**
+ * Many small files: create, write, close, each replaces the
+ * oldest of the last CHURN_FILES files of the thread.
+ */
+static void
+churn_run(struct worker *w)
+{
+	size_t io_size = w->wl->io_size;
+	char name[NAME_SIZE];
+	worker_start(w);
+	for(size_t i = 0; i < w->ops; i++) {
+		file_name(name, "churn", w->id, i % CHURN_FILES);
+		uint64_t start = now_ns();
+		if(i >= CHURN_FILES)
+			check(be->remove(name) == 0, "remove");
+		int fd = be->open(name, true);
+		check(fd >= 0, "open");
+		check(be->pwrite(fd, w->buf, io_size, 0) == (ssize_t)io_size, "pwrite");
+		check(be->close(fd) == 0, "close");
+		worker_done(w, start, io_size);
+	}
+	worker_stop(w);
+	size_t left = w->ops < CHURN_FILES ? w->ops : CHURN_FILES;
+	for(size_t i = 0; i < left; i++) {
+		file_name(name, "churn", w->id, i);
+		check(be->remove(name) == 0, "remove");
+	}
+}
+
+static void
+seq_write_run(struct worker *w)
+{
+	const struct workload *wl = w->wl;
+	char name[NAME_SIZE];
+	file_name(name, "seq", w->id, 0);
+	int fd = be->open(name, true);
+	check(fd >= 0, "open");
+	worker_start(w);
+	size_t off = 0;
+	for(size_t i = 0; i < w->ops; i++, off += wl->io_size) {
+		uint64_t start = now_ns();
+		check(be->pwrite(fd, w->buf, wl->io_size, off) == (ssize_t)wl->io_size,
+		      "pwrite");
+		worker_done(w, start, wl->io_size);
+	}
+	worker_stop(w);
+	check(be->close(fd) == 0, "close");
+	check(be->remove(name) == 0, "remove");
+}
+
+static void
+seq_read_run(struct worker *w)
+{
+	const struct workload *wl = w->wl;
+	char name[NAME_SIZE];
+	file_name(name, "seq", w->id, 0);
+	fill_file(name, w->ops * wl->io_size, w->buf);
+	int fd = be->open(name, false);
+	check(fd >= 0, "open");
+	worker_start(w);
+	size_t off = 0;
+	for(size_t i = 0; i < w->ops; i++, off += wl->io_size) {
+		uint64_t start = now_ns();
+		check(be->pread(fd, w->buf, wl->io_size, off) == (ssize_t)wl->io_size,
+		      "pread");
+		worker_done(w, start, wl->io_size);
+	}
+	worker_stop(w);
+	check(be->close(fd) == 0, "close");
+	check(be->remove(name) == 0, "remove");
+}
+
+static void
+shared_prepare(const struct workload *wl)
+{
+	char *buf = (char *)malloc(IO_MAX);
+	check(buf != NULL, "malloc");
+	memset(buf, 'x', IO_MAX);
+	char name[NAME_SIZE];
+	file_name(name, "shared", 0, 0);
+	fill_file(name, scaled_size(wl->file_size), buf);
+	free(buf);
+}
+
+static void
+shared_cleanup(const struct workload *wl)
+{
+	(void)wl;
+	char name[NAME_SIZE];
+	file_name(name, "shared", 0, 0);
+	check(be->remove(name) == 0, "remove");
+}
+
+/** Reads and writes at random aligned offsets of a file. */
+static void
+random_run(struct worker *w)
+{
+	const struct workload *wl = w->wl;
+	size_t file_size = scaled_size(wl->file_size);
+	size_t slots = file_size / wl->io_size;
+	char name[NAME_SIZE];
+	if(wl->shared) {
+		file_name(name, "shared", 0, 0);
+	} else {
+		file_name(name, "random", w->id, 0);
+		fill_file(name, file_size, w->buf);
+	}
+	int fd = be->open(name, false);
+	check(fd >= 0, "open");
+	worker_start(w);
+	for(size_t i = 0; i < w->ops; i++) {
+		uint64_t r = rng_next(&w->rng);
+		size_t off = (r >> 8) % slots * wl->io_size;
+		bool is_read = (int)(r % 100) < wl->read_percent;
+		uint64_t start = now_ns();
+		ssize_t rc = is_read ? be->pread(fd, w->buf, wl->io_size, off) :
+			     be->pwrite(fd, w->buf, wl->io_size, off);
+		check(rc == (ssize_t)wl->io_size, is_read ? "pread" : "pwrite");
+		worker_done(w, start, wl->io_size);
+	}
+	worker_stop(w);
+	check(be->close(fd) == 0, "close");
+	if(!wl->shared)
+		check(be->remove(name) == 0, "remove");
+}
+
+/**
+ * Resize a file to a random size up to file_size and write a block
+ * at its new end, so it keeps allocating and freeing its tail.
+ */
+static void
+resize_run(struct worker *w)
+{
+	const struct workload *wl = w->wl;
+	size_t file_size = scaled_size(wl->file_size);
+	char name[NAME_SIZE];
+	file_name(name, "resize", w->id, 0);
+	int fd = be->open(name, true);
+	check(fd >= 0, "open");
+	worker_start(w);
+	for(size_t i = 0; i < w->ops; i++) {
+		size_t size = rng_next(&w->rng) % (file_size - wl->io_size) + wl->io_size;
+		uint64_t start = now_ns();
+		check(be->resize(fd, size) == 0, "resize");
+		check(be->pwrite(fd, w->buf, wl->io_size, size - wl->io_size) ==
+		      (ssize_t)wl->io_size, "pwrite");
+		worker_done(w, start, wl->io_size);
+	}
+	worker_stop(w);
+	check(be->close(fd) == 0, "close");
+	check(be->remove(name) == 0, "remove");
+}
+
+#define SEQ(op, size) \
+	{#op "_" #size, op##_run, NULL, NULL, 0, size, 64 * MB, 0, false, false}
+#define RANDOM(name, size, read_percent) \
+	{name, random_run, NULL, NULL, 20000, size, 64 * MB, read_percent, false, false}
+
+static const struct workload workloads[] = {
+	{"open_close", open_close_run, open_prepare, open_cleanup,
+	 100000, 0, 0, 0, false, false},
+	{"churn_4k", churn_run, NULL, NULL, 50000, 4 * KB, 0, 0, false, false},
+	SEQ(seq_write, 512),
+	SEQ(seq_write, 4096),
+	SEQ(seq_write, 65536),
+	SEQ(seq_write, 1048576),
+	SEQ(seq_read, 512),
+	SEQ(seq_read, 4096),
+	SEQ(seq_read, 65536),
+	SEQ(seq_read, 1048576),
+	RANDOM("rand_read_4096", 4 * KB, 100),
+	RANDOM("rand_read_65536", 64 * KB, 100),
+	RANDOM("rand_write_4096", 4 * KB, 0),
+	RANDOM("rand_write_65536", 64 * KB, 0),
+	{"resize", resize_run, NULL, NULL, 50000, 4 * KB, 4 * MB, 0, false, false},
+	{"mt_open_close", open_close_run, open_prepare, open_cleanup,
+	 100000, 0, 0, 0, false, true},
+	{"mt_churn_4k", churn_run, NULL, NULL, 50000, 4 * KB, 0, 0, false, true},
+	{"mt_own_mix_4096", random_run, NULL, NULL, 100000, 4 * KB, 16 * MB,
+	 70, false, true},
+	{"mt_shared_mix_4096", random_run, shared_prepare, shared_cleanup,
+	 100000, 4 * KB, 64 * MB, 70, true, true},
+	{"mt_resize", resize_run, NULL, NULL, 50000, 4 * KB, 4 * MB, 0, false, true},
+};
+
+#undef SEQ
+#undef RANDOM
+
+static int
+u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/** Latency at quantile @a q of sorted @a lat, microseconds. */
+static double
+percentile(const uint64_t *lat, size_t count, double q)
+{
+	size_t i = count * q;
+	return lat[i < count ? i : count - 1] / 1000.0;
+}
+
+static void *
+worker_f(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	w->wl->run(w);
+	return NULL;
+}
+
+static void
+run_workload(const struct workload *wl)
+{
+	int threads = wl->threaded ? thread_count : 1;
+	size_t ops = wl->count != 0 ? scaled_count(wl->count) :
+		     scaled_size(wl->file_size) / wl->io_size;
+	struct worker *workers = (struct worker *)calloc(threads, sizeof(*workers));
+	uint64_t *lat = (uint64_t *)malloc(threads * ops * sizeof(*lat));
+	check(workers != NULL && lat != NULL, "malloc");
+	if(wl->prepare != NULL)
+		wl->prepare(wl);
+	pthread_barrier_init(&start_barrier, NULL, threads);
+	pthread_t *tids = (pthread_t *)calloc(threads, sizeof(*tids));
+	check(tids != NULL, "malloc");
+	for(int i = 0; i < threads; i++) {
+		struct worker *w = &workers[i];
+		w->wl = wl;
+		w->id = i;
+		w->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+		w->buf = (char *)malloc(IO_MAX);
+		check(w->buf != NULL, "malloc");
+		memset(w->buf, 'a' + i % 26, IO_MAX);
+		w->lat = lat + i * ops;
+		w->ops = ops;
+		check(pthread_create(&tids[i], NULL, worker_f, w) == 0, "pthread_create");
+	}
+	uint64_t start = UINT64_MAX, end = 0, bytes = 0;
+	size_t count = 0, rss = 0;
+	for(int i = 0; i < threads; i++) {
+		struct worker *w = &workers[i];
+		pthread_join(tids[i], NULL);
+		if(w->start < start)
+			start = w->start;
+		if(w->end > end)
+			end = w->end;
+		if(w->rss > rss)
+			rss = w->rss;
+		bytes += w->bytes;
+		/* Latencies of all the threads are put together */
+		memmove(lat + count, w->lat, w->lat_count * sizeof(*lat));
+		count += w->lat_count;
+		free(w->buf);
+	}
+	if(wl->cleanup != NULL)
+		wl->cleanup(wl);
+	pthread_barrier_destroy(&start_barrier);
+
+	qsort(lat, count, sizeof(*lat), u64_cmp);
+	double sec = (end - start) / 1e9;
+	printf("%-6s %-20s %3d %12.0f %10.1f %9.2f %9.2f %9.2f %9.2f %8.1f\n",
+	       be->name, wl->name, threads, count / sec, bytes / sec / MB,
+	       percentile(lat, count, 0.5), percentile(lat, count, 0.99),
+	       percentile(lat, count, 0.999), lat[count - 1] / 1000.0,
+	       (double)rss / MB);
+	fflush(stdout);
+	free(tids);
+	free(lat);
+	free(workers);
+}
+
+static bool
+is_selected(const char *name, char **prefixes, int count)
+{
+	if(count == 0)
+		return true;
+	for(int i = 0; i < count; i++)
+		if(strncmp(name, prefixes[i], strlen(prefixes[i])) == 0)
+			return true;
+	return false;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *dir = "/dev/shm";
+	const char *only = NULL;
+	int opt;
+	while((opt = getopt(argc, argv, "b:d:t:s:")) != -1) {
+		switch(opt) {
+		case 'b':
+			only = optarg;
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 't':
+			thread_count = atoi(optarg);
+			break;
+		case 's':
+			scale = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-b ufs|posix] [-d dir] [-t threads] "
+				"[-s scale] [workload...]\n", argv[0]);
+			return 1;
+		}
+	}
+	if(thread_count < 1 || scale <= 0 ||
+	   (only != NULL && strcmp(only, "ufs") != 0 && strcmp(only, "posix") != 0)) {
+		fprintf(stderr, "%s: invalid arguments\n", argv[0]);
+		return 1;
+	}
+	const struct backend *backends[2];
+	int backend_count = 0;
+	if(only == NULL || strcmp(only, "ufs") == 0)
+		backends[backend_count++] = &ufs_backend;
+	if(only == NULL || strcmp(only, "posix") == 0) {
+		snprintf(posix_dir, sizeof(posix_dir), "%s/ufs_bench_XXXXXX", dir);
+		if(mkdtemp(posix_dir) == NULL) {
+			perror(dir);
+			return 1;
+		}
+		backends[backend_count++] = &posix_backend;
+	}
+
+	printf("%-6s %-20s %3s %12s %10s %9s %9s %9s %9s %8s\n", "fs", "workload",
+	       "thr", "ops/s", "MB/s", "p50 us", "p99 us", "p99.9 us", "max us",
+	       "RSS MB");
+	int workload_count = sizeof(workloads) / sizeof(workloads[0]);
+	for(int i = 0; i < workload_count; i++) {
+		if(!is_selected(workloads[i].name, argv + optind, argc - optind))
+			continue;
+		for(int j = 0; j < backend_count; j++) {
+			be = backends[j];
+			run_workload(&workloads[i]);
+		}
+	}
+	if(posix_dir[0] != 0)
+		rmdir(posix_dir);
+	return 0;
+}
@@ -1,7 +1,10 @@
 #include "userfs.h"
 #include "unit.h"
 #include <limits.h>
+#include <stdbool.h>
 #include <string.h>
+#include <stdio.h>
+#include <sys/stat.h>
 
 static void
 test_open(void)
@@ -69,6 +72,75 @@ test_stress_open(void)
 	unit_test_finish();
 }
 
+static void
+test_many_files(void)
+{
+	unit_test_start();
+
+	const int count = 100000;
+	char name[32];
+	unit_msg("create %d files", count);
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "many_files_%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	unit_msg("delete every odd file");
+	for (int i = 1; i < count; i += 2) {
+		sprintf(name, "many_files_%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "many_files_%d", i);
+		int fd = ufs_open(name, 0);
+		unit_fail_if((fd == -1) != (i % 2 == 1));
+		if (fd != -1)
+			unit_fail_if(ufs_close(fd) != 0);
+	}
+	unit_msg("only even files are left");
+	for (int i = 0; i < count; i += 2) {
+		sprintf(name, "many_files_%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	unit_check(ufs_open("many_files_0", 0) == -1, "all are deleted");
+
+	unit_test_finish();
+}
+
+static void
+test_many_descriptors(void)
+{
+	unit_test_start();
+
+	const int count = 100000;
+	int *fds = (int *) malloc(count * sizeof(int));
+	unit_msg("open %d descriptors on one file", count);
+	for (int i = 0; i < count; ++i) {
+		fds[i] = ufs_open("file", UFS_CREATE);
+		unit_fail_if(fds[i] == -1);
+	}
+	unit_check(ufs_write(fds[count - 1], "a", 1) == 1,
+		   "the last descriptor works");
+	char c;
+	unit_check(ufs_read(fds[0], &c, 1) == 1 && c == 'a',
+		   "the first one sees its data");
+	for (int i = 0; i < count; i += 2)
+		unit_fail_if(ufs_close(fds[i]) != 0);
+	for (int i = 0; i < count; i += 2) {
+		fds[i] = ufs_open("file", 0);
+		unit_fail_if(fds[i] == -1);
+	}
+	unit_msg("closed descriptors are reused");
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(ufs_close(fds[i]) != 0);
+	unit_check(ufs_close(fds[0]) == -1, "all are closed");
+	unit_fail_if(ufs_delete("file") != 0);
+	free(fds);
+
+	unit_test_finish();
+}
+
 static void
 test_close(void)
 {
@@ -316,6 +388,1030 @@ test_resize(void)
 #endif
 }
 
+static void
+test_positional_io(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buf[4096], buf2[4096];
+	for (int i = 0; i < (int) sizeof(buf); ++i)
+		buf[i] = 'a' + i % 26;
+	unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+
+	unit_check(ufs_pread(fd, buf2, 100, 1000) == 100, "pread");
+	unit_check(memcmp(buf2, buf + 1000, 100) == 0, "pread data");
+	unit_check(ufs_read(fd, buf2, 1) == 0, "position is not moved");
+
+	unit_check(ufs_pwrite(fd, "xyz", 3, 511) == 3,
+		   "pwrite over a block border");
+	unit_fail_if(ufs_pread(fd, buf2, 5, 510) != 5);
+	unit_check(memcmp(buf2, "qxyzu", 5) == 0, "pwrite data");
+
+	size_t far = 1024 * 1024;
+	unit_check(ufs_pwrite(fd, "end", 3, far) == 3, "pwrite far away");
+	unit_fail_if(ufs_pread(fd, buf2, sizeof(buf2), far - 100) != 103);
+	int zeros = 1;
+	for (int i = 0; i < 100; ++i)
+		zeros = zeros && buf2[i] == 0;
+	unit_check(zeros && memcmp(buf2 + 100, "end", 3) == 0,
+		   "the gap reads as zeros");
+
+	unit_check(ufs_lseek(fd, 0, UFS_SEEK_END) == (ssize_t) far + 3,
+		   "seek to the end");
+	unit_check(ufs_lseek(fd, -3, UFS_SEEK_CUR) == (ssize_t) far,
+		   "seek back");
+	unit_fail_if(ufs_read(fd, buf2, 3) != 3);
+	unit_check(memcmp(buf2, "end", 3) == 0, "read after seek");
+	unit_check(ufs_lseek(fd, -1, UFS_SEEK_SET) == -1,
+		   "can not seek before the start");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_lseek(fd, 0, 100) == -1, "bad whence");
+
+	unit_check(ufs_lseek(fd, 10, UFS_SEEK_SET) == 10, "seek to start");
+	unit_fail_if(ufs_write(fd, "!", 1) != 1);
+	unit_fail_if(ufs_pread(fd, buf2, 3, 9) != 3);
+	unit_check(memcmp(buf2, "j!l", 3) == 0, "write after seek");
+
+#ifdef NEED_RESIZE
+	unit_fail_if(ufs_resize(fd, 600) != 0);
+	unit_fail_if(ufs_resize(fd, 2000) != 0);
+	unit_fail_if(ufs_pread(fd, buf2, 10, 595) != 10);
+	unit_check(memcmp(buf2, buf + 595, 5) == 0 && buf2[5] == 0 &&
+		   buf2[9] == 0, "truncated tail reads as zeros after growth");
+#endif
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_vectored_io(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char a[300], b[700], c[100];
+	memset(a, 'a', sizeof(a));
+	memset(b, 'b', sizeof(b));
+	memset(c, 'c', sizeof(c));
+	struct iovec iov[3] = {
+		{a, sizeof(a)}, {b, sizeof(b)}, {c, sizeof(c)},
+	};
+	unit_check(ufs_writev(fd, iov, 3) == 1100, "writev");
+
+	char r1[500], r2[1000];
+	struct iovec riov[2] = {{r1, sizeof(r1)}, {r2, sizeof(r2)}};
+	unit_fail_if(ufs_lseek(fd, 0, UFS_SEEK_SET) != 0);
+	unit_check(ufs_readv(fd, riov, 2) == 1100, "readv");
+	unit_check(memcmp(r1, a, 300) == 0 && memcmp(r1 + 300, b, 200) == 0 &&
+		   memcmp(r2, b, 500) == 0 && memcmp(r2 + 500, c, 100) == 0,
+		   "readv data");
+
+	unit_fail_if(ufs_lseek(fd, 200, UFS_SEEK_SET) != 200);
+	struct ufs_view view;
+	unit_check(ufs_read_view(fd, 2000, &view) == 900, "view till EOF");
+	size_t total = 0;
+	int ok = 1;
+	for (int i = 0; i < view.iovcnt; ++i) {
+		const char *p = (const char *) view.iov[i].iov_base;
+		for (size_t j = 0; j < view.iov[i].iov_len; ++j, ++total) {
+			size_t pos = 200 + total;
+			char want = pos < 300 ? 'a' : pos < 1000 ? 'b' : 'c';
+			ok = ok && p[j] == want;
+		}
+	}
+	unit_check(ok && total == view.size, "view spans have the data");
+	unit_check(ufs_read(fd, r1, 1) == 0, "view moved the position");
+
+	unit_fail_if(ufs_pwrite(fd, "xxxx", 4, 200) != 4);
+	unit_fail_if(ufs_resize(fd, 0) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	const struct iovec *last = &view.iov[view.iovcnt - 1];
+	unit_check(((const char *) view.iov[0].iov_base)[0] == 'a' &&
+		   ((const char *) last->iov_base)[last->iov_len - 1] == 'c',
+		   "pinned data survives writes, truncation and delete");
+	ufs_view_release(&view);
+
+	unit_test_finish();
+}
+
+static void
+test_append(void)
+{
+#ifdef NEED_OPEN_FLAGS
+	unit_test_start();
+
+	int fd1 = ufs_open("log", UFS_CREATE | UFS_APPEND);
+	int fd2 = ufs_open("log", UFS_APPEND);
+	int fd = ufs_open("log", 0);
+	unit_fail_if(fd1 == -1 || fd2 == -1 || fd == -1);
+	unit_check(ufs_write(fd1, "aaa", 3) == 3 && ufs_write(fd2, "bbb", 3) == 3 &&
+		   ufs_write(fd1, "cc", 2) == 2, "append from two descriptors");
+	char buf[16];
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 8 &&
+		   memcmp(buf, "aaabbbcc", 8) == 0, "each write goes to the end");
+	unit_check(ufs_read(fd1, buf, sizeof(buf)) == 0,
+		   "the position is at the end of the written data");
+	unit_check(ufs_lseek(fd2, 0, UFS_SEEK_SET) == 0 &&
+		   ufs_write(fd2, "d", 1) == 1 &&
+		   ufs_lseek(fd2, 0, UFS_SEEK_CUR) == 9,
+		   "a seek does not move the writes");
+	unit_check(ufs_pwrite(fd1, "x", 1, 0) == 1 &&
+		   ufs_pread(fd, buf, 9, 0) == 9 && memcmp(buf, "xaabbbccd", 9) == 0,
+		   "pwrite writes at its offset");
+
+	struct ufs_snapshot *snap = ufs_snapshot();
+	unit_fail_if(snap == NULL);
+	struct iovec iov[2] = {{(void *) "ee", 2}, {(void *) "f", 1}};
+	unit_check(ufs_writev(fd2, iov, 2) == 3, "writev appends");
+	int snap_fd = ufs_snapshot_open(snap, "log");
+	unit_fail_if(snap_fd == -1);
+	unit_check(ufs_read(snap_fd, buf, sizeof(buf)) == 9,
+		   "appends do not change a snapshot");
+	unit_fail_if(ufs_close(snap_fd) != 0);
+	ufs_snapshot_delete(snap);
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == 12 &&
+		   memcmp(buf, "xaabbbccdeef", 12) == 0, "but are in the file");
+
+	/* Cross extent borders, the first appends grow the extents */
+	char rec[100], back[100];
+	int ok = 1;
+	for (int i = 0; i < 1000; ++i) {
+		memset(rec, 'a' + i % 26, sizeof(rec));
+		ok = ok && ufs_write(i % 2 == 0 ? fd1 : fd2, rec, sizeof(rec)) ==
+			   (ssize_t) sizeof(rec);
+	}
+	for (int i = 0; i < 1000; ++i) {
+		ok = ok && ufs_pread(fd, back, sizeof(back), 12 + i * 100) ==
+			   (ssize_t) sizeof(back);
+		for (size_t j = 0; j < sizeof(back); ++j)
+			ok = ok && back[j] == 'a' + i % 26;
+	}
+	unit_check(ok, "many appends");
+
+	int ro = ufs_open("log", UFS_APPEND | UFS_READ_ONLY);
+	unit_check(ro != -1 && ufs_write(ro, "z", 1) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_PERMISSION,
+		   "appends need the write right");
+	unit_fail_if(ufs_close(ro) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("log") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_sparse(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	size_t size = 512 * 1024 * 1024;
+#ifdef NEED_RESIZE
+	unit_check(ufs_resize(fd, size) == 0, "grow to 512MB at once");
+#else
+	unit_fail_if(ufs_pwrite(fd, "", 1, size - 1) != 1);
+#endif
+	unit_check(ufs_lseek(fd, 0, UFS_SEEK_END) == (ssize_t) size,
+		   "size is set");
+	char buf[2048];
+	memset(buf, 'x', sizeof(buf));
+	unit_fail_if(ufs_pwrite(fd, buf, sizeof(buf), 1000) != sizeof(buf));
+	unit_fail_if(ufs_pwrite(fd, "end", 3, size - 3) != 3);
+
+	char buf2[4096];
+	unit_fail_if(ufs_pread(fd, buf2, sizeof(buf2), 0) != sizeof(buf2));
+	int ok = 1;
+	for (int i = 0; i < (int) sizeof(buf2); ++i)
+		ok = ok && buf2[i] == (i >= 1000 && i < 3048 ? 'x' : 0);
+	unit_check(ok, "data is in place, holes read as zeros");
+	unit_fail_if(ufs_pread(fd, buf2, 10, size - 10) != 10);
+	unit_check(memcmp(buf2, "\0\0\0\0\0\0\0end", 10) == 0,
+		   "the last extent is written");
+
+	unit_check(ufs_punch_hole(fd, 1500, 1000) == 0, "punch a hole");
+	unit_fail_if(ufs_pread(fd, buf2, sizeof(buf2), 0) != sizeof(buf2));
+	ok = 1;
+	for (int i = 0; i < (int) sizeof(buf2); ++i) {
+		int in_data = i >= 1000 && i < 3048 && (i < 1500 || i >= 2500);
+		ok = ok && buf2[i] == (in_data ? 'x' : 0);
+	}
+	unit_check(ok, "the hole reads as zeros, its edges are kept");
+	unit_check(ufs_punch_hole(fd, 0, size * 2) == 0,
+		   "punch the whole file");
+	unit_check(ufs_lseek(fd, 0, UFS_SEEK_END) == (ssize_t) size,
+		   "size is not changed");
+	unit_fail_if(ufs_pread(fd, buf2, 10, size - 10) != 10);
+	unit_check(buf2[7] == 0 && buf2[9] == 0, "everything is zero");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_clone(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_clone("no_file", "copy") == -1, "clone of no file");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buf[3000], buf2[3000];
+	memset(buf, 'a', sizeof(buf));
+	unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	unit_check(ufs_clone("file", "copy") == 0, "clone");
+
+	int fd2 = ufs_open("copy", 0);
+	unit_fail_if(fd2 == -1);
+	unit_check(ufs_read(fd2, buf2, sizeof(buf2)) == sizeof(buf),
+		   "the copy has the same size");
+	unit_check(memcmp(buf, buf2, sizeof(buf)) == 0, "and the same data");
+
+	unit_fail_if(ufs_pwrite(fd, "bb", 2, 1000) != 2);
+	unit_fail_if(ufs_pwrite(fd2, "cc", 2, 2000) != 2);
+	unit_fail_if(ufs_pread(fd, buf2, sizeof(buf2), 0) != sizeof(buf));
+	unit_check(memcmp(buf2 + 1000, "bb", 2) == 0 && buf2[2000] == 'a',
+		   "the original sees only its own writes");
+	unit_fail_if(ufs_pread(fd2, buf2, sizeof(buf2), 0) != sizeof(buf));
+	unit_check(memcmp(buf2 + 2000, "cc", 2) == 0 && buf2[1000] == 'a',
+		   "the copy sees only its own writes");
+
+	unit_check(ufs_clone("file", "copy") == 0, "clone into existing file");
+	unit_fail_if(ufs_pread(fd2, buf2, sizeof(buf2), 0) != sizeof(buf));
+	unit_check(memcmp(buf2 + 1000, "bb", 2) == 0 && buf2[2000] == 'a',
+		   "its content is replaced");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_copy_range(void)
+{
+	unit_test_start();
+
+	enum { MB = 1024 * 1024, SIZE = 12 * MB };
+	static char data[SIZE], buf[SIZE];
+	for(size_t i = 0; i < sizeof(data); i++)
+		data[i] = 'a' + (i + i / 4096) % 26;
+	int src = ufs_open("src", UFS_CREATE);
+	int dst = ufs_open("dst", UFS_CREATE);
+	unit_fail_if(src == -1 || dst == -1);
+	unit_fail_if(ufs_write(src, data, SIZE) != SIZE);
+	unit_check(ufs_copy_range(src, 0, dst + 100, 0, 1) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "a bad descriptor");
+
+	/* Equal offsets, all extents are shared */
+	struct ufs_memory_stats before, after;
+	ufs_memory_stats(&before);
+	unit_check(ufs_copy_range(src, 0, dst, 0, SIZE) == SIZE, "copy a file");
+	ufs_memory_stats(&after);
+	unit_check(after.used - before.used < MB, "the data is shared");
+	unit_fail_if(ufs_pread(dst, buf, SIZE, 0) != SIZE);
+	unit_check(memcmp(buf, data, SIZE) == 0, "the copy is equal");
+	unit_fail_if(ufs_pwrite(dst, "XY", 2, 5 * MB) != 2);
+	unit_fail_if(ufs_pread(src, buf, 2, 5 * MB) != 2);
+	unit_check(memcmp(buf, data + 5 * MB, 2) == 0, "writes to it are its own");
+
+	/* 4MB apart the big extents line up, the rest is copied */
+	ufs_memory_stats(&before);
+	unit_check(ufs_copy_range(src, 100, dst, 4 * MB + 100, SIZE) == SIZE - 100,
+		   "a copy stops at the end of the source");
+	ufs_memory_stats(&after);
+	unit_check(after.used - before.used < 5 * MB, "big extents are shared");
+	unit_fail_if(ufs_pread(dst, buf, SIZE, 4 * MB + 100) != SIZE - 100);
+	unit_check(memcmp(buf, data + 100, SIZE - 100) == 0, "the copy is equal");
+	unit_fail_if(ufs_pread(dst, buf, 4 * MB, 0) != 4 * MB);
+	unit_check(memcmp(buf, data, 4 * MB) == 0, "the bytes before it stay");
+
+	/* Misaligned ranges, a hole and a gap */
+	unit_fail_if(ufs_resize(dst, 0) != 0);
+	unit_fail_if(ufs_pwrite(dst, data, 3 * MB, 0) != 3 * MB);
+	unit_fail_if(ufs_punch_hole(src, MB, MB) != 0);
+	unit_check(ufs_copy_range(src, 12345, dst, 777, 3 * MB) == 3 * MB,
+		   "copy misaligned");
+	unit_fail_if(ufs_pread(dst, buf, 3 * MB, 777) != 3 * MB);
+	bool ok = memcmp(buf, data + 12345, MB - 12345) == 0 &&
+		  memcmp(buf + 2 * MB - 12345, data + 2 * MB, MB + 12345) == 0;
+	for(int i = 0; i < MB; i++)
+		ok = ok && buf[MB - 12345 + i] == 0;
+	unit_check(ok, "holes are copied too");
+	unit_check(ufs_copy_range(src, 0, dst, 8 * MB, 10) == 10, "copy past the end");
+	unit_check(ufs_pread(dst, buf, SIZE, 3 * MB) == 5 * MB + 10 &&
+		   buf[777] == 0 && buf[5 * MB - 1] == 0 &&
+		   memcmp(buf + 5 * MB, data, 10) == 0, "the gap is zero");
+	unit_check(ufs_copy_range(src, SIZE, dst, 0, 10) == 0, "copy nothing");
+
+	unit_check(ufs_copy_range(src, 0, src, 100, 200) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "overlapping ranges");
+	unit_check(ufs_copy_range(src, 0, src, SIZE, SIZE) == SIZE,
+		   "copy within a file");
+	unit_fail_if(ufs_pread(src, buf, MB, SIZE + 2 * MB) != MB);
+	unit_check(memcmp(buf, data + 2 * MB, MB) == 0, "it is equal");
+	int fd = ufs_open("small", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, data, 100) != 100);
+	unit_check(ufs_copy_range(fd, 0, fd, 200, 100) == 100,
+		   "copy within an extent which grows");
+	unit_fail_if(ufs_pread(fd, buf, 300, 0) != 300);
+	ok = memcmp(buf, data, 100) == 0 && memcmp(buf + 200, data, 100) == 0;
+	for(int i = 100; i < 200; i++)
+		ok = ok && buf[i] == 0;
+	unit_check(ok, "it is equal");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("small") != 0);
+
+	unit_fail_if(ufs_close(src) != 0);
+	unit_fail_if(ufs_close(dst) != 0);
+	unit_fail_if(ufs_delete("src") != 0);
+	unit_fail_if(ufs_delete("dst") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_snapshot(void)
+{
+	unit_test_start();
+
+	int fd1 = ufs_open("file1", UFS_CREATE);
+	int fd2 = ufs_open("file2", UFS_CREATE);
+	unit_fail_if(fd1 == -1 || fd2 == -1);
+	unit_fail_if(ufs_write(fd1, "old1", 4) != 4);
+	unit_fail_if(ufs_write(fd2, "old2", 4) != 4);
+
+	struct ufs_snapshot *snap = ufs_snapshot();
+	unit_check(snap != NULL, "take a snapshot");
+
+	unit_fail_if(ufs_pwrite(fd1, "new1", 4, 0) != 4);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("file2") != 0);
+	int fd3 = ufs_open("file3", UFS_CREATE);
+	unit_fail_if(fd3 == -1);
+	unit_fail_if(ufs_close(fd3) != 0);
+
+	char buf[16];
+	int sfd = ufs_snapshot_open(snap, "file1");
+	unit_check(sfd != -1, "open a file of the snapshot");
+	unit_check(ufs_read(sfd, buf, sizeof(buf)) == 4 &&
+		   memcmp(buf, "old1", 4) == 0, "it has the old data");
+	unit_check(ufs_write(sfd, "x", 1) == -1, "it can not be written");
+	unit_fail_if(ufs_close(sfd) != 0);
+	unit_check(ufs_snapshot_open(snap, "file3") == -1,
+		   "files created later are not in it");
+
+	unit_check(ufs_snapshot_restore(snap) == 0, "restore the snapshot");
+	unit_check(ufs_open("file3", 0) == -1, "the new file is gone");
+	fd2 = ufs_open("file2", 0);
+	unit_check(fd2 != -1, "the deleted file is back");
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == 4 &&
+		   memcmp(buf, "old2", 4) == 0, "with its data");
+	unit_fail_if(ufs_pread(fd1, buf, sizeof(buf), 0) != 4);
+	unit_check(memcmp(buf, "new1", 4) == 0,
+		   "a descriptor opened before stays on the old file");
+	unit_fail_if(ufs_close(fd1) != 0);
+	fd1 = ufs_open("file1", 0);
+	unit_fail_if(ufs_read(fd1, buf, sizeof(buf)) != 4);
+	unit_check(memcmp(buf, "old1", 4) == 0, "reopened file has old data");
+
+	ufs_snapshot_delete(snap);
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("file1") != 0);
+	unit_fail_if(ufs_delete("file2") != 0);
+
+	unit_test_finish();
+}
+
+static long
+file_size(const char *path)
+{
+	struct stat st;
+	return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+static void
+test_image(void)
+{
+	unit_test_start();
+
+	const char *path = "test_image.ufs";
+	remove(path);
+	unit_check(ufs_image_load(path) == -1, "no image file");
+	unit_check(ufs_errno() == UFS_ERR_IO, "errno is set");
+
+	/* 1MB file, a sparse one and a clone */
+	static char big[1024 * 1024];
+	for(size_t i = 0; i < sizeof(big); i++)
+		big[i] = 'a' + i % 26;
+	int fd = ufs_open("big", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, big, sizeof(big)) != sizeof(big));
+	int fd2 = ufs_open("sparse", UFS_CREATE);
+	unit_fail_if(fd2 == -1);
+	unit_fail_if(ufs_pwrite(fd2, "end", 3, 100000) != 3);
+	unit_fail_if(ufs_clone("big", "big_copy") != 0);
+	int fd3 = ufs_open("empty", UFS_CREATE);
+	unit_fail_if(fd3 == -1);
+	unit_fail_if(ufs_close(fd3) != 0);
+
+	unit_check(ufs_image_checkpoint(path) == 0, "checkpoint");
+	long full_size = file_size(path);
+	unit_check(full_size > (long)sizeof(big) &&
+		   full_size < (long)sizeof(big) * 3 / 2,
+		   "shared extents and holes are not stored");
+
+	unit_fail_if(ufs_pwrite(fd, "XYZ", 3, 5000) != 3);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("sparse") != 0);
+	unit_check(ufs_image_checkpoint(path) == 0, "second checkpoint");
+	unit_check(file_size(path) - full_size < 16 * 1024,
+		   "it appends only the changed extent and the file table");
+
+	/* Not saved */
+	unit_fail_if(ufs_pwrite(fd, "zzz", 3, 0) != 3);
+	fd2 = ufs_open("new", UFS_CREATE);
+	unit_fail_if(fd2 == -1);
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	unit_check(ufs_image_load(path) == 0, "load");
+	unit_check(ufs_open("new", 0) == -1, "unsaved file is gone");
+	unit_check(ufs_open("sparse", 0) == -1, "deleted file is gone");
+	fd3 = ufs_open("empty", 0);
+	unit_check(fd3 != -1, "empty file is there");
+	unit_fail_if(ufs_close(fd3) != 0);
+	static char buf[sizeof(big)];
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("big", 0);
+	unit_fail_if(fd == -1);
+	memcpy(big + 5000, "XYZ", 3);
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == sizeof(big) &&
+		   memcmp(buf, big, sizeof(big)) == 0,
+		   "the data is of the last checkpoint");
+	fd2 = ufs_open("big_copy", 0);
+	unit_fail_if(fd2 == -1);
+	unit_fail_if(ufs_pread(fd2, buf, 10, 5000) != 10);
+	unit_check(buf[0] == 'a' + 5000 % 26, "the clone has its own data");
+
+	unit_fail_if(ufs_pwrite(fd2, "123", 3, 0) != 3);
+	unit_fail_if(ufs_pread(fd2, buf, 4, 0) != 4);
+	unit_check(memcmp(buf, "123d", 4) == 0, "loaded files can be written");
+	unit_fail_if(ufs_pread(fd, buf, 4, 0) != 4);
+	unit_check(memcmp(buf, "abcd", 4) == 0, "without touching others");
+	unit_check(ufs_image_checkpoint(path) == 0, "checkpoint after load");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	unit_check(ufs_image_load(path) == 0, "load again");
+	fd2 = ufs_open("big_copy", 0);
+	unit_fail_if(fd2 == -1);
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == sizeof(big) &&
+		   memcmp(buf, "123d", 4) == 0, "the write is saved");
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	FILE *f = fopen(path, "r+");
+	unit_fail_if(f == NULL);
+	fputs("garbage", f);
+	fclose(f);
+	unit_check(ufs_image_load(path) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "broken image");
+	fd = ufs_open("big", 0);
+	unit_check(fd != -1, "nothing is changed");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	unit_fail_if(ufs_delete("big") != 0);
+	unit_fail_if(ufs_delete("big_copy") != 0);
+	unit_fail_if(ufs_delete("empty") != 0);
+	remove(path);
+
+	unit_test_finish();
+}
+
+/** Whether a listing has an entry @a name of the given kind. */
+static bool
+dirlist_has(const struct ufs_dirlist *list, const char *name, int is_dir)
+{
+	for(int i = 0; i < list->count; i++) {
+		if(strcmp(list->entries[i].name, name) == 0)
+			return list->entries[i].is_dir == is_dir;
+	}
+	return false;
+}
+
+static void
+test_directories(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_mkdir("a") == 0, "mkdir");
+	unit_check(ufs_mkdir("a") == -1 && ufs_errno() == UFS_ERR_EXISTS,
+		   "it exists");
+	unit_check(ufs_mkdir("x/y") == -1 && ufs_errno() == UFS_ERR_NO_FILE,
+		   "the parent must exist");
+	unit_fail_if(ufs_mkdir("/a/b/") != 0);
+	int fd = ufs_open("a/b/file", UFS_CREATE);
+	unit_check(fd != -1, "create a file in a nested directory");
+	unit_fail_if(ufs_write(fd, "data", 4) != 4);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("//a/b//file", 0);
+	unit_check(fd != -1, "extra slashes mean nothing");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("a/b/file/c", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_NOT_DIR, "a file is not a directory");
+	unit_check(ufs_open("a/b", 0) == -1 && ufs_errno() == UFS_ERR_IS_DIR,
+		   "a directory can not be opened");
+	unit_check(ufs_open("a/../a/b/file", 0) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "there is no ..");
+	unit_check(ufs_delete("a/b") == -1 && ufs_errno() == UFS_ERR_IS_DIR,
+		   "a directory is not deleted as a file");
+	unit_check(ufs_open("b/file", 0) == -1, "names are per directory");
+
+	fd = ufs_open("a/file2", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_close(fd) != 0);
+	struct ufs_dirlist list;
+	unit_check(ufs_readdir("a", &list) == 0, "readdir");
+	unit_check(list.count == 2 && dirlist_has(&list, "b", 1) &&
+		   dirlist_has(&list, "file2", 0), "it lists only own entries");
+	ufs_dirlist_release(&list);
+	unit_check(ufs_readdir("/", &list) == 0 && dirlist_has(&list, "a", 1),
+		   "readdir of the root");
+	ufs_dirlist_release(&list);
+	unit_check(ufs_readdir("a/file2", &list) == -1 &&
+		   ufs_errno() == UFS_ERR_NOT_DIR, "readdir of a file");
+
+	fd = ufs_open("a/b/file", 0);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_rename("a/b", "c") == 0, "rename a directory");
+	unit_check(ufs_open("a/b/file", 0) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "the old path is gone");
+	int fd2 = ufs_open("c/file", 0);
+	unit_check(fd2 != -1, "the new path works");
+	char buf[16];
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == 4 &&
+		   memcmp(buf, "data", 4) == 0, "it is the same file");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_mkdir("c/d") != 0);
+	unit_check(ufs_rename("c", "c/d/e") == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG,
+		   "a directory can not be moved into itself");
+	unit_check(ufs_rename("c/file", "a/file2") == 0, "rename a file over another");
+	unit_check(ufs_open("c/file", 0) == -1, "the old name is gone");
+	unit_fail_if(ufs_pwrite(fd, "new", 3, 0) != 3);
+	fd2 = ufs_open("a/file2", 0);
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == 4 &&
+		   memcmp(buf, "newa", 4) == 0, "opened descriptors stay valid");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_rename("a/file2", "c/d") == -1 &&
+		   ufs_errno() == UFS_ERR_EXISTS, "a directory is not replaced");
+
+	struct ufs_snapshot *snap = ufs_snapshot();
+	unit_fail_if(snap == NULL);
+	unit_check(ufs_rmdir("c", 0) == -1 && ufs_errno() == UFS_ERR_NOT_EMPTY,
+		   "rmdir of a not empty directory");
+	unit_check(ufs_rmdir("c/d", 0) == 0, "rmdir of an empty one");
+	fd = ufs_open("a/file2", 0);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_rmdir("a", 1) == 0, "recursive rmdir");
+	unit_check(ufs_open("a/file2", UFS_CREATE) == -1, "the tree is gone");
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 4,
+		   "opened files live until closed");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	fd = ufs_snapshot_open(snap, "a/file2");
+	unit_check(fd != -1, "the snapshot has the tree");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_snapshot_restore(snap) == 0, "restore it");
+	ufs_snapshot_delete(snap);
+	unit_check(ufs_readdir("c/d", &list) == 0 && list.count == 0,
+		   "directories are restored");
+	ufs_dirlist_release(&list);
+
+	const char *path = "test_dirs.ufs";
+	unit_check(ufs_image_checkpoint(path) == 0, "checkpoint with directories");
+	unit_fail_if(ufs_rmdir("a", 1) != 0);
+	unit_fail_if(ufs_rmdir("c", 1) != 0);
+	unit_check(ufs_image_load(path) == 0, "load it");
+	fd = ufs_open("a/file2", 0);
+	unit_check(fd != -1 && ufs_read(fd, buf, sizeof(buf)) == 4 &&
+		   memcmp(buf, "newa", 4) == 0, "files in directories are loaded");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_mkdir("c/d") == -1 && ufs_errno() == UFS_ERR_EXISTS,
+		   "empty directories are loaded");
+
+	unit_fail_if(ufs_rmdir("a", 1) != 0);
+	unit_fail_if(ufs_rmdir("c", 1) != 0);
+	unit_check(ufs_rmdir("/", 1) == -1, "the root can not be deleted");
+	remove(path);
+
+	unit_test_finish();
+}
+
+static void
+test_compression(void)
+{
+	unit_test_start();
+
+	/* Text-like data packs well, random one does not */
+	static char text[1024 * 1024];
+	static char noise[64 * 1024];
+	static char buf[1024 * 1024];
+	for(size_t i = 0; i < sizeof(text); i++)
+		text[i] = "the quick brown fox jumps over the lazy dog "[i % 44] + (i / 4096) % 3;
+	unsigned seed = 1;
+	for(size_t i = 0; i < sizeof(noise); i++) {
+		seed = seed * 1103515245 + 12345;
+		noise[i] = seed >> 16;
+	}
+	int fd = ufs_open("text", UFS_CREATE);
+	int fd2 = ufs_open("noise", UFS_CREATE);
+	int fd3 = ufs_open("hot", UFS_CREATE);
+	unit_fail_if(fd == -1 || fd2 == -1 || fd3 == -1);
+	unit_fail_if(ufs_write(fd, text, sizeof(text)) != sizeof(text));
+	unit_fail_if(ufs_write(fd2, noise, sizeof(noise)) != sizeof(noise));
+	unit_fail_if(ufs_write(fd3, text, 100000) != 100000);
+
+	struct ufs_compress_stats before, after;
+	ufs_compress_stats(&before);
+	unit_check(ufs_compress_cold() == 0, "fresh data is not compressed");
+	unit_fail_if(ufs_pread(fd3, buf, 10, 50000) != 10);
+	ssize_t saved = ufs_compress_cold();
+	unit_check(saved > (ssize_t)sizeof(text) / 2, "cold data is compressed");
+	ufs_compress_stats(&after);
+	unit_check(after.extents > before.extents &&
+		   after.raw_bytes - before.raw_bytes >= sizeof(text) &&
+		   after.raw_bytes - after.compressed_bytes >= (size_t)saved,
+		   "stats show it");
+	unit_check(after.rejects > before.rejects, "random data is left as is");
+
+	/* The extent of the hot file read between the calls is not packed */
+	size_t extents = after.extents;
+	unit_fail_if(ufs_pread(fd3, buf, 10, 50000) != 10);
+	unit_fail_if(ufs_pread(fd, buf, 10, 300000) != 10);
+	ufs_compress_stats(&after);
+	unit_check(after.hits == before.hits + 1 && after.extents == extents - 1,
+		   "a read unpacks only its extent");
+	unit_fail_if(ufs_pread(fd3, buf, 100000, 0) != 100000);
+	unit_check(memcmp(buf, text, 100000) == 0, "hot data is intact");
+	unit_fail_if(ufs_pread(fd, buf, sizeof(buf), 0) != sizeof(text));
+	unit_check(memcmp(buf, text, sizeof(text)) == 0, "cold data is intact");
+	unit_fail_if(ufs_pread(fd2, buf, sizeof(noise), 0) != sizeof(noise));
+	unit_check(memcmp(buf, noise, sizeof(noise)) == 0, "and so is random");
+
+	/* Compressed again, now changed */
+	unit_fail_if(ufs_compress_cold() < 0);
+	unit_fail_if(ufs_compress_cold() <= 0);
+	unit_check(ufs_pwrite(fd, "XYZ", 3, 500000) == 3, "write compressed data");
+	memcpy(text + 500000, "XYZ", 3);
+	unit_fail_if(ufs_resize(fd, 700000) != 0);
+	unit_fail_if(ufs_pread(fd, buf, sizeof(buf), 0) != 700000);
+	unit_check(memcmp(buf, text, 700000) == 0, "write and truncate");
+
+	/* Checkpoint of compressed extents */
+	const char *path = "test_compression.ufs";
+	remove(path);
+	unit_fail_if(ufs_compress_cold() < 0);
+	unit_fail_if(ufs_compress_cold() <= 0);
+	unit_check(ufs_image_checkpoint(path) == 0, "checkpoint");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd3) != 0);
+	unit_check(ufs_image_load(path) == 0, "load");
+	fd = ufs_open("text", 0);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_pread(fd, buf, sizeof(buf), 0) != 700000);
+	unit_check(memcmp(buf, text, 700000) == 0, "the image has the data");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("text") != 0);
+	unit_fail_if(ufs_delete("noise") != 0);
+	unit_fail_if(ufs_delete("hot") != 0);
+	remove(path);
+
+	unit_test_finish();
+}
+
+static void
+test_dedup(void)
+{
+	unit_test_start();
+
+	/* Extents differ from each other, the files are equal */
+	enum { SIZE = 1024 * 1024, BIG = 4 * 1024 * 1024 };
+	static char data[SIZE], zeros[SIZE], buf[BIG];
+	for(size_t i = 0; i < sizeof(data); i++)
+		data[i] = 'a' + (i * 7 + i / 4096) % 26;
+	const char *names[] = {"dup_0", "dup_1", "dup_2", "zeros", "big"};
+	int fds[5];
+	for(int i = 0; i < 5; i++) {
+		fds[i] = ufs_open(names[i], UFS_CREATE);
+		unit_fail_if(fds[i] == -1);
+	}
+	for(int i = 0; i < 3; i++)
+		unit_fail_if(ufs_write(fds[i], data, SIZE) != SIZE);
+	unit_fail_if(ufs_write(fds[3], zeros, SIZE) != SIZE);
+	/* Extents after the first 4MB are all 4MB, equal ones in a file merge too */
+	for(size_t i = 0; i < sizeof(buf); i++)
+		buf[i] = 'A' + i % 23;
+	unit_fail_if(ufs_pwrite(fds[4], buf, BIG, BIG) != BIG);
+	unit_fail_if(ufs_pwrite(fds[4], buf, BIG, 2 * BIG) != BIG);
+
+	struct ufs_memory_stats mem_before, mem_after;
+	struct ufs_dedup_stats before, after;
+	ufs_memory_stats(&mem_before);
+	ufs_dedup_stats(&before);
+	ssize_t saved = ufs_dedup();
+	unit_check(saved >= 3 * SIZE + BIG, "equal and zero data is freed");
+	ufs_memory_stats(&mem_after);
+	unit_check(mem_before.used - mem_after.used == (size_t)saved,
+		   "memory is accounted");
+	ufs_dedup_stats(&after);
+	unit_check(after.merges - before.merges >= 2 * 9 + 1 &&
+		   after.holes - before.holes >= 9 &&
+		   after.saved_bytes - before.saved_bytes == (size_t)saved,
+		   "stats show it");
+	unit_check(ufs_dedup() == 0, "shared data is not merged again");
+
+	for(int i = 0; i < 3; i++) {
+		unit_fail_if(ufs_pread(fds[i], buf, SIZE, 0) != SIZE);
+		unit_check(memcmp(buf, data, SIZE) == 0, "merged data is intact");
+	}
+	unit_fail_if(ufs_pread(fds[3], buf, SIZE, 0) != SIZE);
+	unit_check(memcmp(buf, zeros, SIZE) == 0, "holes read as zeros");
+	unit_check(ufs_pwrite(fds[1], "XYZ", 3, 70000) == 3, "write merged data");
+	unit_fail_if(ufs_pread(fds[0], buf, SIZE, 0) != SIZE);
+	unit_check(memcmp(buf, data, SIZE) == 0, "the others do not change");
+	unit_fail_if(ufs_pread(fds[1], buf, 3, 70000) != 3);
+	unit_check(memcmp(buf, "XYZ", 3) == 0, "the written one does");
+	unit_fail_if(ufs_pread(fds[4], buf, BIG, 2 * BIG) != BIG);
+	bool ok = true;
+	for(size_t i = 0; i < BIG; i++)
+		ok = ok && buf[i] == (char)('A' + i % 23);
+	unit_check(ok, "and so are extents merged in a file");
+
+	for(int i = 0; i < 5; i++) {
+		unit_fail_if(ufs_close(fds[i]) != 0);
+		unit_fail_if(ufs_delete(names[i]) != 0);
+	}
+
+	unit_test_finish();
+}
+
+static void
+test_mmap(void)
+{
+	unit_test_start();
+
+	/* The range starts inside the first extent and ends in the third */
+	enum { SIZE = 64 * 1024, OFFSET = 1000, LEN = 20000 };
+	static char data[SIZE], buf[SIZE];
+	for(size_t i = 0; i < sizeof(data); i++)
+		data[i] = 'a' + i % 26;
+	int fd = ufs_open("mapped", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, data, SIZE) != SIZE);
+	struct ufs_mapping map;
+	unit_check(ufs_mmap(fd, 0, 0, &map) == -1 && ufs_errno() == UFS_ERR_INVALID_ARG,
+		   "an empty range");
+	unit_check(ufs_mmap(fd, SIZE - 10, 11, &map) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "a range beyond the end");
+	unit_check(ufs_mmap(fd + 100, 0, 1, &map) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "a bad descriptor");
+
+	struct ufs_snapshot *snap = ufs_snapshot();
+	unit_fail_if(snap == NULL);
+	unit_check(ufs_mmap(fd, OFFSET, LEN, &map) == 0 && map.size == LEN, "map");
+	char *mem = (char *)map.addr;
+	unit_check(memcmp(mem, data + OFFSET, LEN) == 0, "the data is contiguous");
+	memset(mem, 'X', LEN);
+	unit_fail_if(ufs_pread(fd, buf, SIZE, 0) != SIZE);
+	bool ok = memcmp(buf, data, OFFSET) == 0 &&
+		  memcmp(buf + OFFSET + LEN, data + OFFSET + LEN, SIZE - OFFSET - LEN) == 0;
+	for(int i = 0; i < LEN; i++)
+		ok = ok && buf[OFFSET + i] == 'X';
+	unit_check(ok, "writes through the mapping go to the file");
+	unit_fail_if(ufs_pwrite(fd, "hello", 5, OFFSET + 5000) != 5);
+	unit_check(memcmp(mem + 5000, "hello", 5) == 0, "writes to the file are seen");
+
+	int sfd = ufs_snapshot_open(snap, "mapped");
+	unit_fail_if(sfd == -1);
+	unit_fail_if(ufs_pread(sfd, buf, SIZE, 0) != SIZE);
+	unit_check(memcmp(buf, data, SIZE) == 0, "an older snapshot does not change");
+	unit_fail_if(ufs_close(sfd) != 0);
+	ufs_snapshot_delete(snap);
+	snap = ufs_snapshot();
+	unit_fail_if(snap == NULL);
+	mem[0] = 'Y';
+	sfd = ufs_snapshot_open(snap, "mapped");
+	unit_fail_if(sfd == -1);
+	unit_check(ufs_pread(sfd, buf, 1, OFFSET) == 1 && buf[0] == 'X',
+		   "nor does a snapshot of mapped data");
+	unit_fail_if(ufs_close(sfd) != 0);
+	ufs_snapshot_delete(snap);
+
+	struct ufs_mapping again;
+	unit_check(ufs_mmap(fd, 0, SIZE, &again) == 0 &&
+		   ((char *)again.addr)[OFFSET] == 'Y', "map it twice");
+	((char *)again.addr)[OFFSET + 1] = 'Z';
+	unit_check(mem[1] == 'Z', "both mappings share the data");
+	ufs_munmap(&again);
+	ufs_munmap(&map);
+	unit_check(ufs_pread(fd, buf, 2, OFFSET) == 2 && memcmp(buf, "YZ", 2) == 0,
+		   "the data stays after unmap");
+	unit_fail_if(ufs_close(fd) != 0);
+
+#ifdef NEED_OPEN_FLAGS
+	fd = ufs_open("mapped", UFS_READ_ONLY);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_mmap(fd, 0, SIZE, &map) == 0 && ((char *)map.addr)[OFFSET] == 'Y',
+		   "map a read-only descriptor");
+	ufs_munmap(&map);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("mapped", UFS_WRITE_ONLY);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_mmap(fd, 0, SIZE, &map) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_PERMISSION, "a write-only one can't be");
+	unit_fail_if(ufs_close(fd) != 0);
+#endif
+	unit_fail_if(ufs_delete("mapped") != 0);
+
+	/* With the storage on data is mapped where it is */
+	unit_check(ufs_set_mmap_storage(1) == 0, "turn the storage on");
+	fd = ufs_open("stored", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, data, SIZE) != SIZE);
+	unit_check(ufs_mmap(fd, 0, SIZE, &map) == 0 &&
+		   memcmp(map.addr, data, SIZE) == 0, "map stored data");
+	ufs_munmap(&map);
+	unit_fail_if(ufs_set_mmap_storage(0) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("stored") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_memory_limit(void)
+{
+	unit_test_start();
+
+	enum { FILE_COUNT = 16, FILE_SIZE = 1024 * 1024 };
+	static char data[FILE_SIZE];
+	static char buf[FILE_SIZE];
+	struct ufs_memory_stats stats;
+	ufs_memory_stats(&stats);
+	size_t limit = stats.used + 4 * FILE_SIZE;
+	unit_check(ufs_set_memory_limit(limit, "/nonexistent") == -1 &&
+		   ufs_errno() == UFS_ERR_IO, "bad spill directory");
+	unit_check(ufs_set_memory_limit(limit, ".") == 0, "set a limit");
+
+	int fds[FILE_COUNT];
+	char name[32];
+	bool ok = true;
+	for(int i = 0; i < FILE_COUNT; i++) {
+		sprintf(name, "limited_%d", i);
+		fds[i] = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fds[i] == -1);
+		memset(data, 'a' + i, sizeof(data));
+		ok = ok && ufs_write(fds[i], data, sizeof(data)) == sizeof(data);
+	}
+	ufs_memory_stats(&stats);
+	unit_check(ok, "write 4 times more than the limit");
+	unit_check(stats.used <= limit && stats.spilled_extents > 0,
+		   "the rest is spilled");
+
+	ok = true;
+	for(int i = 0; i < FILE_COUNT; i++) {
+		memset(data, 'a' + i, sizeof(data));
+		ok = ok && ufs_pread(fds[i], buf, sizeof(buf), 0) == sizeof(buf) &&
+		     memcmp(buf, data, sizeof(buf)) == 0;
+	}
+	ufs_memory_stats(&stats);
+	unit_check(ok && stats.faults > 0, "spilled data is read back");
+	unit_check(stats.used <= limit, "within the limit");
+
+	unit_check(ufs_pin(fds[0], 1) == 0, "pin a file");
+	uint64_t faults = stats.faults;
+	for(int i = 1; i < FILE_COUNT; i++)
+		unit_fail_if(ufs_pread(fds[i], buf, sizeof(buf), 0) != sizeof(buf));
+	ufs_memory_stats(&stats);
+	unit_fail_if(stats.faults == faults);
+	faults = stats.faults;
+	memset(data, 'a', sizeof(data));
+	unit_fail_if(ufs_pread(fds[0], buf, sizeof(buf), 0) != sizeof(buf));
+	ufs_memory_stats(&stats);
+	unit_check(stats.faults == faults && memcmp(buf, data, sizeof(buf)) == 0,
+		   "it stays in memory");
+
+	/* Nothing to evict: the pinned files fill the limit */
+	for(int i = 1; i < 4; i++)
+		unit_fail_if(ufs_pin(fds[i], 1) != 0);
+	unit_check(ufs_pwrite(fds[4], data, sizeof(data), sizeof(data) * 2) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_MEM, "a write beyond the limit fails");
+	unit_check(ufs_lseek(fds[4], 0, UFS_SEEK_END) == sizeof(data),
+		   "the file does not grow");
+	for(int i = 0; i < 4; i++)
+		unit_fail_if(ufs_pin(fds[i], 0) != 0);
+	unit_check(ufs_pwrite(fds[4], data, sizeof(data), sizeof(data) * 2) ==
+		   sizeof(data), "unpinned files are evicted again");
+
+	unit_check(ufs_set_memory_limit(0, NULL) == 0, "remove the limit");
+	for(int i = 0; i < FILE_COUNT; i++) {
+		sprintf(name, "limited_%d", i);
+		unit_fail_if(ufs_close(fds[i]) != 0);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	ufs_memory_stats(&stats);
+	unit_check(stats.spilled_extents == 0, "spilled data is freed with files");
+
+	unit_test_finish();
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct ufs_stats before, after;
+	ufs_stats(&before);
+	unit_check(before.files == 0 && before.dirs >= 1, "only the root exists");
+	unit_check(ufs_open("missing", 0) == -1, "failed open");
+	int fd = ufs_open("stats_file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buf[1000];
+	memset(buf, 'x', sizeof(buf));
+	bool ok = true;
+	for(int i = 0; i < 32; i++)
+		ok = ok && ufs_pwrite(fd, buf, sizeof(buf), i * sizeof(buf)) == sizeof(buf);
+	unit_fail_if(!ok);
+	unit_fail_if(ufs_pread(fd, buf, sizeof(buf), 31500) != 500);
+	ufs_stats(&after);
+	const struct ufs_op_stats *open = &after.ops[UFS_OP_OPEN];
+	const struct ufs_op_stats *pwrite = &after.ops[UFS_OP_PWRITE];
+	unit_check(open->calls - before.ops[UFS_OP_OPEN].calls == 2 &&
+		   open->errors - before.ops[UFS_OP_OPEN].errors == 1,
+		   "calls and errors are counted");
+	unit_check(pwrite->calls - before.ops[UFS_OP_PWRITE].calls == 32 &&
+		   pwrite->bytes - before.ops[UFS_OP_PWRITE].bytes == 32000 &&
+		   after.ops[UFS_OP_PREAD].bytes - before.ops[UFS_OP_PREAD].bytes == 500,
+		   "bytes are counted");
+	uint64_t timed = 0;
+	for(int i = 0; i < UFS_LATENCY_BUCKETS; i++)
+		timed += pwrite->latency[i] - before.ops[UFS_OP_PWRITE].latency[i];
+	unit_check(timed == 2, "a sample of calls is timed");
+	uint64_t p50 = ufs_latency_percentile(pwrite, 0.5);
+	unit_check(p50 > 0 && p50 <= ufs_latency_percentile(pwrite, 0.99),
+		   "latency percentiles");
+	unit_check(after.files == before.files + 1 && after.extents > before.extents &&
+		   after.meta_bytes > before.meta_bytes &&
+		   after.meta_slab_bytes >= after.meta_bytes / 2 &&
+		   after.memory.used >= 32000, "memory is accounted");
+
+	char text[4096];
+	size_t len = ufs_stats_dump(&after, UFS_STATS_TEXT, text, sizeof(text));
+	int called = 0, lines = 0;
+	for(int i = 0; i < UFS_OP_COUNT; i++)
+		called += after.ops[i].calls != 0;
+	for(const char *pos = text; (pos = strstr(pos, "\nop ")) != NULL; pos++)
+		lines++;
+	unit_check(len < sizeof(text) && strlen(text) == len &&
+		   strstr(text, "op pwrite calls") != NULL && lines == called,
+		   "text dump");
+	static char json[16384];
+	len = ufs_stats_dump(&after, UFS_STATS_JSON, json, sizeof(json));
+	unit_check(len < sizeof(json) && json[0] == '{' &&
+		   strcmp(json + len - 3, "}}\n") == 0 &&
+		   strstr(json, "\"clone\":{\"calls\":") != NULL, "JSON dump");
+	unit_check(ufs_stats_dump(&after, UFS_STATS_JSON, text, 10) == len &&
+		   strlen(text) == 9, "a dump is cut to the buffer");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("stats_file") != 0);
+	ufs_stats(&after);
+	unit_check(after.files == before.files && after.extents == before.extents,
+		   "deleted files are not counted");
+
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -326,9 +1422,25 @@ main(void)
 	test_io();
 	test_delete();
 	test_stress_open();
+	test_many_files();
+	test_many_descriptors();
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_positional_io();
+	test_vectored_io();
+	test_append();
+	test_sparse();
+	test_clone();
+	test_copy_range();
+	test_snapshot();
+	test_image();
+	test_directories();
+	test_compression();
+	test_dedup();
+	test_mmap();
+	test_memory_limit();
+	test_stats();
 
 	unit_test_finish();
 	return 0;
@@ -0,0 +1,290 @@
+#define _GNU_SOURCE
+#include "ufs_client.h"
+#include "ufs_proto.h"
+#include "ufs_server.h"
+#include "unit.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * Test of the userfs server and its client library. The server
+ * runs in a child process, the checks are done through clients.
+ */
+
+static const char *socket_path = "test_client.sock";
+
+static struct ufs_client *
+connect_retry(void)
+{
+	/* The server can be still starting */
+	for (int i = 0; i < 1000; ++i) {
+		struct ufs_client *client = ufs_client_connect(socket_path);
+		if (client != NULL)
+			return client;
+		usleep(1000);
+	}
+	return NULL;
+}
+
+static void
+test_calls(void)
+{
+	unit_test_start();
+
+	struct ufs_client *client = connect_retry();
+	unit_check(client != NULL, "connect");
+	unit_check(ufs_client_open(client, "missing", 0) == -1 &&
+		   ufs_client_errno(client) == UFS_ERR_NO_FILE,
+		   "errors are passed back");
+	int fd = ufs_client_open(client, "file", UFS_CREATE);
+	unit_check(fd != -1, "open");
+	unit_check(ufs_client_write(client, fd, "123456", 6) == 6, "write");
+	char buf[16];
+	unit_check(ufs_client_pread(client, fd, buf, sizeof(buf), 2) == 4 &&
+		   memcmp(buf, "3456", 4) == 0, "pread");
+	unit_check(ufs_client_pwrite(client, fd, "ab", 2, 0) == 2, "pwrite");
+	unit_check(ufs_client_read(client, fd, buf, sizeof(buf)) == 0,
+		   "the descriptor position is on the server");
+
+	/* Bigger than the shared memory, goes by parts */
+	size_t big_size = 20 * 1024 * 1024 + 3;
+	char *big = (char *) malloc(big_size);
+	char *big_copy = (char *) malloc(big_size);
+	unit_fail_if(big == NULL || big_copy == NULL);
+	for (size_t i = 0; i < big_size; ++i)
+		big[i] = 'a' + i % 23;
+	unit_check(ufs_client_pwrite(client, fd, big, big_size, 1) ==
+		   (ssize_t) big_size, "big write");
+	unit_check(ufs_client_pread(client, fd, big_copy, big_size, 1) ==
+		   (ssize_t) big_size &&
+		   memcmp(big, big_copy, big_size) == 0, "big read");
+	free(big);
+	free(big_copy);
+	unit_check(ufs_client_close(client, fd) == 0, "close");
+	unit_check(ufs_client_close(client, fd) == -1 &&
+		   ufs_client_errno(client) == UFS_ERR_NO_FILE,
+		   "closed descriptor is invalid");
+	unit_check(ufs_client_delete(client, "file") == 0, "delete");
+	ufs_client_disconnect(client);
+
+	unit_test_finish();
+}
+
+enum {
+	BATCH_FILES = 300,
+};
+
+static void
+test_batch(void)
+{
+	unit_test_start();
+
+	struct ufs_client *client = connect_retry();
+	unit_fail_if(client == NULL);
+	static struct ufs_request reqs[BATCH_FILES + 1];
+	static char names[BATCH_FILES][32];
+	memset(reqs, 0, sizeof(reqs));
+	reqs[0].op = UFS_REQ_MKDIR;
+	reqs[0].path = "batch";
+	for (int i = 0; i < BATCH_FILES; ++i) {
+		sprintf(names[i], "batch/file_%d", i);
+		reqs[i + 1].op = UFS_REQ_OPEN;
+		reqs[i + 1].path = names[i];
+		reqs[i + 1].flags = UFS_CREATE;
+	}
+	unit_check(ufs_client_submit(client, reqs, BATCH_FILES + 1) == 0,
+		   "submit a batch of opens");
+	bool ok = reqs[0].result == 0;
+	int fds[BATCH_FILES];
+	for (int i = 0; i < BATCH_FILES; ++i) {
+		fds[i] = reqs[i + 1].result;
+		ok = ok && fds[i] >= 0;
+	}
+	unit_check(ok, "all are done");
+
+	static char data[BATCH_FILES][32];
+	memset(reqs, 0, sizeof(reqs));
+	for (int i = 0; i < BATCH_FILES; ++i) {
+		sprintf(data[i], "data of %d", i);
+		reqs[i].op = UFS_REQ_PWRITE;
+		reqs[i].fd = fds[i];
+		reqs[i].buf = data[i];
+		reqs[i].size = strlen(data[i]);
+	}
+	unit_fail_if(ufs_client_submit(client, reqs, BATCH_FILES) != 0);
+	static char back[BATCH_FILES][32];
+	memset(reqs, 0, sizeof(reqs));
+	for (int i = 0; i < BATCH_FILES; ++i) {
+		reqs[i].op = UFS_REQ_PREAD;
+		reqs[i].fd = fds[i];
+		reqs[i].buf = back[i];
+		reqs[i].size = sizeof(back[i]);
+	}
+	unit_fail_if(ufs_client_submit(client, reqs, BATCH_FILES) != 0);
+	ok = true;
+	for (int i = 0; i < BATCH_FILES; ++i) {
+		ok = ok && reqs[i].result == (ssize_t) strlen(data[i]) &&
+		     memcmp(back[i], data[i], reqs[i].result) == 0;
+	}
+	unit_check(ok, "batched writes and reads");
+
+	memset(reqs, 0, sizeof(reqs));
+	for (int i = 0; i < BATCH_FILES; ++i) {
+		reqs[i].op = UFS_REQ_CLOSE;
+		reqs[i].fd = fds[i];
+	}
+	reqs[BATCH_FILES].op = UFS_REQ_RMDIR;
+	reqs[BATCH_FILES].path = "batch";
+	reqs[BATCH_FILES].flags = 1;
+	unit_fail_if(ufs_client_submit(client, reqs, BATCH_FILES + 1) != 0);
+	unit_check(reqs[BATCH_FILES].result == 0, "a batch of different calls");
+	ufs_client_disconnect(client);
+
+	unit_test_finish();
+}
+
+static void
+test_sharing(void)
+{
+	unit_test_start();
+
+	/* Not to print the buffered output twice */
+	fflush(stdout);
+	pid_t pid = fork();
+	unit_fail_if(pid < 0);
+	if (pid == 0) {
+		struct ufs_client *client = connect_retry();
+		unit_fail_if(client == NULL);
+		int fd = ufs_client_open(client, "shared", UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_client_write(client, fd, "hello", 5) != 5);
+		/* Disconnect closes the descriptor */
+		ufs_client_disconnect(client);
+		exit(0);
+	}
+	int status;
+	unit_fail_if(waitpid(pid, &status, 0) != pid || status != 0);
+	struct ufs_client *client = connect_retry();
+	unit_fail_if(client == NULL);
+	unit_check(ufs_client_close(client, 0) == -1,
+		   "descriptors of other clients are not visible");
+	int fd = ufs_client_open(client, "shared", 0);
+	char buf[16];
+	unit_check(fd != -1 && ufs_client_read(client, fd, buf, sizeof(buf)) == 5 &&
+		   memcmp(buf, "hello", 5) == 0,
+		   "a file written by another process");
+	unit_fail_if(ufs_client_close(client, fd) != 0);
+	unit_fail_if(ufs_client_delete(client, "shared") != 0);
+	ufs_client_disconnect(client);
+
+	unit_test_finish();
+}
+
+/**
+ * Send a hello claiming @a shm_size bytes in @a shm_fd, and
+ * @a extra_fd too if it is not -1.
+ * @retval Error code of the response, UFS_ERR_NO_ERR on success.
+ */
+static enum ufs_error_code
+raw_hello(int shm_fd, int extra_fd, uint64_t shm_size)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	unit_fail_if(sock < 0);
+	unit_fail_if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0);
+	struct ufs_proto_hello hello = {UFS_PROTO_MAGIC, UFS_PROTO_VERSION, shm_size};
+	struct iovec iov = {&hello, sizeof(hello)};
+	int fds[2] = {shm_fd, extra_fd};
+	int fd_count = extra_fd == -1 ? 1 : 2;
+	char control[CMSG_SPACE(sizeof(fds))];
+	memset(control, 0, sizeof(control));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+	unit_fail_if(sendmsg(sock, &msg, 0) != sizeof(hello));
+	struct ufs_proto_response res;
+	unit_fail_if(read(sock, &res, sizeof(res)) != sizeof(res));
+	close(sock);
+	return res.result == 0 ? UFS_ERR_NO_ERR : (enum ufs_error_code) res.error;
+}
+
+/** A memfd of @a size bytes, sealed against shrinking if asked. */
+static int
+make_shm(size_t size, bool sealed)
+{
+	int fd = memfd_create("shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	unit_fail_if(fd < 0 || ftruncate(fd, size) != 0);
+	unit_fail_if(sealed && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) != 0);
+	return fd;
+}
+
+static void
+test_bad_shm(void)
+{
+	unit_test_start();
+
+	int good = make_shm(1 << 20, true);
+	unit_check(raw_hello(good, -1, 1 << 20) == UFS_ERR_NO_ERR,
+		   "a sealed memfd is taken");
+	int fd = make_shm(4096, true);
+	unit_check(raw_hello(fd, -1, 1 << 20) == UFS_ERR_INVALID_ARG,
+		   "a memfd shorter than the hello says is rejected");
+	close(fd);
+	/* The client could shrink it later and crash the server */
+	fd = make_shm(1 << 20, false);
+	unit_check(raw_hello(fd, -1, 1 << 20) == UFS_ERR_INVALID_ARG,
+		   "a memfd which can shrink is rejected");
+	close(fd);
+	fd = make_shm(4096, false);
+	unit_check(raw_hello(good, fd, 1 << 20) == UFS_ERR_INVALID_ARG,
+		   "extra descriptors are rejected");
+	close(fd);
+	close(good);
+	struct ufs_client *client = connect_retry();
+	unit_check(client != NULL, "the server is alive");
+	ufs_client_disconnect(client);
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	unit_test_start();
+
+	fflush(stdout);
+	pid_t server = fork();
+	unit_fail_if(server < 0);
+	if (server == 0) {
+		ufs_server_run(socket_path);
+		exit(1);
+	}
+	test_calls();
+	test_batch();
+	test_sharing();
+	test_bad_shm();
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	unlink(socket_path);
+
+	unit_test_finish();
+	return 0;
+}
@@ -0,0 +1,201 @@
+#include "ufs_ring.h"
+#include "unit.h"
+#include <stdbool.h>
+#include <string.h>
+
+/**
+ * Test of the submission and completion rings. Each test runs
+ * with calls inline and on workers.
+ */
+
+static struct ufs_sqe *
+sqe_new(struct ufs_ring *ring, enum ufs_sqe_op op, int flags, uint64_t user_data)
+{
+	struct ufs_sqe *sqe = ufs_ring_get_sqe(ring);
+	unit_fail_if(sqe == NULL);
+	sqe->op = op;
+	sqe->flags = flags;
+	sqe->user_data = user_data;
+	return sqe;
+}
+
+/** Wait for @a count completions, store them by user_data. */
+static void
+wait_all(struct ufs_ring *ring, struct ufs_cqe *by_data, int count)
+{
+	struct ufs_cqe cqes[16];
+	while (count > 0) {
+		int rc = ufs_ring_wait(ring, cqes, 16, 1);
+		unit_fail_if(rc <= 0);
+		for (int i = 0; i < rc; ++i)
+			by_data[cqes[i].user_data] = cqes[i];
+		count -= rc;
+	}
+}
+
+static void
+test_chain(int workers)
+{
+	unit_test_start();
+	unit_msg("workers: %d", workers);
+
+	struct ufs_ring *ring = ufs_ring_new(8, workers);
+	unit_fail_if(ring == NULL);
+	char data[] = "hello, ring", back[32];
+	struct ufs_sqe *sqe = sqe_new(ring, UFS_SQE_OPEN, UFS_SQE_LINK, 0);
+	sqe->path = "ring_file";
+	sqe->open_flags = UFS_CREATE;
+	sqe = sqe_new(ring, UFS_SQE_WRITE, UFS_SQE_LINK | UFS_SQE_FD_OPENED, 1);
+	sqe->buf = data;
+	sqe->size = sizeof(data);
+	unit_check(ufs_ring_submit(ring) == 2, "submit open and write");
+	struct ufs_cqe cqes[8];
+	unit_check(ufs_ring_wait(ring, cqes, 8, 2) == 2, "wait for them");
+	unit_check(cqes[0].user_data == 0 && cqes[0].result >= 0 &&
+		   cqes[1].user_data == 1 &&
+		   cqes[1].result == (ssize_t) sizeof(data),
+		   "a chain runs in order with the opened descriptor");
+	int fd = cqes[0].result;
+
+	sqe = sqe_new(ring, UFS_SQE_PREAD, 0, 0);
+	sqe->fd = fd;
+	sqe->buf = back;
+	sqe->size = sizeof(back);
+	unit_fail_if(ufs_ring_submit(ring) != 1);
+	unit_check(ufs_ring_wait(ring, cqes, 8, 1) == 1 &&
+		   cqes[0].result == (ssize_t) sizeof(data) &&
+		   memcmp(back, data, sizeof(data)) == 0, "read it back");
+
+	sqe = sqe_new(ring, UFS_SQE_OPEN, UFS_SQE_LINK, 0);
+	sqe->path = "missing";
+	sqe = sqe_new(ring, UFS_SQE_READ, UFS_SQE_LINK | UFS_SQE_FD_OPENED, 1);
+	sqe->buf = back;
+	sqe->size = sizeof(back);
+	sqe_new(ring, UFS_SQE_CLOSE, UFS_SQE_FD_OPENED, 2);
+	sqe = sqe_new(ring, UFS_SQE_RESIZE, 0, 3);
+	sqe->fd = fd;
+	sqe->size = 3;
+	sqe_new(ring, (enum ufs_sqe_op) 100, 0, 4);
+	unit_fail_if(ufs_ring_submit(ring) != 5);
+	wait_all(ring, cqes, 5);
+	unit_check(cqes[0].result == -1 && cqes[0].error == UFS_ERR_NO_FILE,
+		   "a call of a chain fails");
+	unit_check(cqes[1].result == -1 && cqes[1].error == UFS_ERR_CANCELED &&
+		   cqes[2].result == -1 && cqes[2].error == UFS_ERR_CANCELED,
+		   "the rest of the chain is canceled");
+	unit_check(cqes[3].result == 0 && ufs_pread(fd, back, sizeof(back), 0) == 3,
+		   "other calls run");
+	unit_check(cqes[4].result == -1 && cqes[4].error == UFS_ERR_INVALID_ARG,
+		   "a bad call");
+
+	ufs_ring_delete(ring);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("ring_file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_full(int workers)
+{
+	unit_test_start();
+	unit_msg("workers: %d", workers);
+
+	unit_check(ufs_ring_new(0, workers) == NULL, "a ring can't be empty");
+	struct ufs_ring *ring = ufs_ring_new(3, workers);
+	unit_fail_if(ring == NULL);
+	for (int i = 0; i < 4; ++i)
+		sqe_new(ring, UFS_SQE_NOP, 0, i);
+	unit_check(ufs_ring_get_sqe(ring) == NULL,
+		   "the size is rounded up to a power of two");
+	unit_fail_if(ufs_ring_submit(ring) != 4);
+	unit_check(ufs_ring_get_sqe(ring) == NULL,
+		   "completions not taken keep the ring full");
+	struct ufs_cqe cqes[4];
+	unit_fail_if(ufs_ring_wait(ring, cqes, 2, 2) != 2);
+	unit_check(ufs_ring_get_sqe(ring) != NULL, "taken ones free it");
+	unit_check(ufs_ring_wait(ring, cqes, 4, 4) == 2,
+		   "a wait does not wait for more than is submitted");
+	unit_fail_if(ufs_ring_submit(ring) != 1);
+	unit_check(ufs_ring_wait(ring, cqes, 4, 1) == 1 && cqes[0].result == 0,
+		   "a nop");
+	ufs_ring_delete(ring);
+
+	unit_test_finish();
+}
+
+enum {
+	MANY_FILES = 100,
+	MANY_ENTRIES = 64,
+};
+
+static void
+test_many(int workers)
+{
+	unit_test_start();
+	unit_msg("workers: %d", workers);
+
+	/* Chains of open, write and close, the ring wraps many times */
+	struct ufs_ring *ring = ufs_ring_new(MANY_ENTRIES, workers);
+	unit_fail_if(ring == NULL);
+	static char names[MANY_FILES][32];
+	static struct ufs_cqe cqes[MANY_FILES * 3];
+	for (int i = 0; i < MANY_FILES; ++i)
+		sprintf(names[i], "many_%d", i);
+	int submitted = 0;
+	for (int i = 0; i < MANY_FILES; ++i) {
+		if (submitted + 3 > MANY_ENTRIES) {
+			wait_all(ring, cqes, submitted);
+			submitted = 0;
+		}
+		struct ufs_sqe *sqe = sqe_new(ring, UFS_SQE_OPEN, UFS_SQE_LINK,
+					      i * 3);
+		sqe->path = names[i];
+		sqe->open_flags = UFS_CREATE;
+		sqe = sqe_new(ring, UFS_SQE_PWRITE,
+			      UFS_SQE_LINK | UFS_SQE_FD_OPENED, i * 3 + 1);
+		sqe->buf = names[i];
+		sqe->size = strlen(names[i]);
+		sqe->offset = i;
+		sqe_new(ring, UFS_SQE_CLOSE, UFS_SQE_FD_OPENED, i * 3 + 2);
+		unit_fail_if(ufs_ring_submit(ring) != 3);
+		submitted += 3;
+	}
+	wait_all(ring, cqes, submitted);
+	bool ok = true;
+	for (int i = 0; i < MANY_FILES; ++i) {
+		ok = ok && cqes[i * 3].result >= 0 &&
+		     cqes[i * 3 + 1].result == (ssize_t) strlen(names[i]) &&
+		     cqes[i * 3 + 2].result == 0;
+	}
+	unit_check(ok, "all calls succeed");
+	for (int i = 0; i < MANY_FILES; ++i) {
+		char buf[32];
+		int fd = ufs_open(names[i], 0);
+		ok = ok && fd != -1 &&
+		     ufs_pread(fd, buf, sizeof(buf), i) ==
+		     (ssize_t) strlen(names[i]) &&
+		     memcmp(buf, names[i], strlen(names[i])) == 0;
+		unit_fail_if(ufs_close(fd) != 0);
+		unit_fail_if(ufs_delete(names[i]) != 0);
+	}
+	unit_check(ok, "the data is written");
+	ufs_ring_delete(ring);
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	unit_test_start();
+
+	for (int workers = 0; workers <= 4; workers += 4) {
+		test_chain(workers);
+		test_full(workers);
+		test_many(workers);
+	}
+
+	unit_test_finish();
+	return 0;
+}
@@ -0,0 +1,896 @@
+#include "userfs.h"
+#include "unit.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+
+/**
+ * Multi-threaded stress test of userfs. Each test starts several
+ * threads hammering the same filesystem and checks that the data
+ * stays consistent.
+ */
+
+enum {
+	THREAD_COUNT = 8,
+	CHUNK_SIZE = 1000,
+	CHUNK_COUNT = 500,
+};
+
+static void
+run_threads(void *(*func)(void *))
+{
+	pthread_t threads[THREAD_COUNT];
+	for (long i = 0; i < THREAD_COUNT; ++i)
+		unit_fail_if(pthread_create(&threads[i], NULL, func,
+					    (void *) i) != 0);
+	for (int i = 0; i < THREAD_COUNT; ++i)
+		unit_fail_if(pthread_join(threads[i], NULL) != 0);
+}
+
+static void *
+own_file_worker(void *arg)
+{
+	long id = (long) arg;
+	char name[32], buf[CHUNK_SIZE], buf2[CHUNK_SIZE];
+	sprintf(name, "own_file_%ld", id);
+	memset(buf, 'a' + id, sizeof(buf));
+	for (int round = 0; round < 20; ++round) {
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		for (int i = 0; i < 50; ++i)
+			unit_fail_if(ufs_write(fd, buf, sizeof(buf)) !=
+				     sizeof(buf));
+		for (int i = 0; i < 50; ++i) {
+			unit_fail_if(ufs_pread(fd, buf2, sizeof(buf2),
+					       i * sizeof(buf2)) !=
+				     sizeof(buf2));
+			unit_fail_if(memcmp(buf, buf2, sizeof(buf)) != 0);
+		}
+		unit_fail_if(ufs_close(fd) != 0);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	return NULL;
+}
+
+static void
+test_own_files(void)
+{
+	unit_test_start();
+
+	run_threads(own_file_worker);
+	unit_check(ufs_open("own_file_0", 0) == -1, "all files are deleted");
+
+	unit_test_finish();
+}
+
+static void *
+shared_reader_worker(void *arg)
+{
+	(void) arg;
+	int fd = ufs_open("shared", 0);
+	unit_fail_if(fd == -1);
+	char buf[CHUNK_SIZE];
+	size_t seen = 0;
+	/* Poll the growing file, every chunk is written at once */
+	while (seen < CHUNK_COUNT) {
+		ssize_t rc = ufs_pread(fd, buf, sizeof(buf),
+				       seen * CHUNK_SIZE);
+		unit_fail_if(rc == -1);
+		if (rc == 0) {
+			sched_yield();
+			continue;
+		}
+		unit_fail_if(rc != CHUNK_SIZE);
+		for (int i = 0; i < CHUNK_SIZE; ++i)
+			unit_fail_if(buf[i] != (char) ('A' + seen % 26));
+		seen++;
+	}
+	unit_fail_if(ufs_close(fd) != 0);
+	return NULL;
+}
+
+static void *
+shared_writer(void *arg)
+{
+	(void) arg;
+	int fd = ufs_open("shared", 0);
+	unit_fail_if(fd == -1);
+	char buf[CHUNK_SIZE];
+	for (int i = 0; i < CHUNK_COUNT; ++i) {
+		memset(buf, 'A' + i % 26, sizeof(buf));
+		unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	}
+	unit_fail_if(ufs_close(fd) != 0);
+	return NULL;
+}
+
+static void
+test_shared_file(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("shared", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	pthread_t writer;
+	unit_fail_if(pthread_create(&writer, NULL, shared_writer, NULL) != 0);
+	run_threads(shared_reader_worker);
+	unit_fail_if(pthread_join(writer, NULL) != 0);
+	unit_check(ufs_lseek(fd, 0, UFS_SEEK_END) ==
+		   CHUNK_SIZE * CHUNK_COUNT,
+		   "readers saw whole chunks while the file grew");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("shared") != 0);
+
+	unit_test_finish();
+}
+
+static int shared_fd;
+static long shared_fd_read[THREAD_COUNT];
+
+static void *
+shared_fd_worker(void *arg)
+{
+	long id = (long) arg;
+	char buf[CHUNK_SIZE];
+	ssize_t rc;
+	while ((rc = ufs_read(shared_fd, buf, sizeof(buf))) > 0) {
+		unit_fail_if(rc != CHUNK_SIZE);
+		for (int i = 1; i < CHUNK_SIZE; ++i)
+			unit_fail_if(buf[i] != buf[0]);
+		shared_fd_read[id] += rc;
+	}
+	unit_fail_if(rc != 0);
+	return NULL;
+}
+
+static void
+test_shared_descriptor(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("shared", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buf[CHUNK_SIZE];
+	for (int i = 0; i < CHUNK_COUNT; ++i) {
+		memset(buf, 'A' + i % 26, sizeof(buf));
+		unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	}
+	unit_fail_if(ufs_lseek(fd, 0, UFS_SEEK_SET) != 0);
+	shared_fd = fd;
+	run_threads(shared_fd_worker);
+	long total = 0;
+	for (int i = 0; i < THREAD_COUNT; ++i)
+		total += shared_fd_read[i];
+	unit_check(total == CHUNK_SIZE * CHUNK_COUNT,
+		   "threads reading one descriptor got each chunk once");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("shared") != 0);
+
+	unit_test_finish();
+}
+
+static atomic_int closing_fd = -1;
+static atomic_bool closing_done = false;
+static bool closing_ok[THREAD_COUNT];
+
+static void *
+closing_worker(void *arg)
+{
+	long id = (long) arg;
+	char buf[CHUNK_SIZE];
+	bool ok = true;
+	while (!atomic_load(&closing_done)) {
+		int fd = atomic_load(&closing_fd);
+		ssize_t rc;
+		if (id % 2 == 0) {
+			rc = ufs_pread(fd, buf, sizeof(buf), 0);
+			for (ssize_t i = 0; i < rc; ++i)
+				ok = ok && buf[i] == 'a';
+		} else {
+			memset(buf, 'a', sizeof(buf));
+			rc = ufs_pwrite(fd, buf, sizeof(buf), 0);
+			ok = ok && (rc == -1 || rc == CHUNK_SIZE);
+		}
+		ok = ok && (rc >= 0 || ufs_errno() == UFS_ERR_NO_FILE);
+	}
+	closing_ok[id] = ok;
+	return NULL;
+}
+
+static void
+test_close_while_used(void)
+{
+	unit_test_start();
+
+	pthread_t threads[THREAD_COUNT];
+	for (long i = 0; i < THREAD_COUNT; ++i)
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    closing_worker, (void *) i) != 0);
+	char buf[CHUNK_SIZE];
+	memset(buf, 'a', sizeof(buf));
+	for (int round = 0; round < 2000; ++round) {
+		int fd = ufs_open("closing", UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_pwrite(fd, buf, sizeof(buf), 0) !=
+			     sizeof(buf));
+		atomic_store(&closing_fd, fd);
+		sched_yield();
+		/* The descriptor goes away under the calls using it */
+		unit_fail_if(ufs_close(fd) != 0);
+		if (round % 10 == 0)
+			unit_fail_if(ufs_delete("closing") != 0);
+	}
+	atomic_store(&closing_done, true);
+	bool ok = true;
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		unit_fail_if(pthread_join(threads[i], NULL) != 0);
+		ok = ok && closing_ok[i];
+	}
+	unit_check(ok, "calls on a closed descriptor fail or see the data");
+	unit_fail_if(ufs_delete("closing") != 0);
+
+	unit_test_finish();
+}
+
+static void *
+churn_worker(void *arg)
+{
+	long id = (long) arg;
+	char name[32];
+	for (int i = 0; i < 20000; ++i) {
+		sprintf(name, "churn_%d", i % 16);
+		if ((i + id) % 3 == 0) {
+			if (ufs_delete(name) == -1)
+				unit_fail_if(ufs_errno() != UFS_ERR_NO_FILE);
+			continue;
+		}
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, name, 4) != 4);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	return NULL;
+}
+
+static void
+test_name_churn(void)
+{
+	unit_test_start();
+
+	run_threads(churn_worker);
+	char name[32];
+	for (int i = 0; i < 16; ++i) {
+		sprintf(name, "churn_%d", i);
+		ufs_delete(name);
+	}
+	unit_msg("concurrent create and delete of the same names");
+
+	unit_test_finish();
+}
+
+static void *
+errno_worker(void *arg)
+{
+	(void) arg;
+	int fd = ufs_open("errno_file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char c;
+	for (int i = 0; i < 10000; ++i) {
+		unit_fail_if(ufs_read(fd, &c, 1) != 0);
+		unit_fail_if(ufs_errno() != UFS_ERR_NO_ERR);
+	}
+	unit_fail_if(ufs_close(fd) != 0);
+	return NULL;
+}
+
+static void
+test_thread_errno(void)
+{
+	unit_test_start();
+
+	pthread_t thread;
+	unit_fail_if(pthread_create(&thread, NULL, errno_worker, NULL) != 0);
+	for (int i = 0; i < 10000; ++i)
+		unit_fail_if(ufs_close(-1) != -1);
+	unit_fail_if(pthread_join(thread, NULL) != 0);
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE,
+		   "errors of one thread are not seen by another");
+	unit_fail_if(ufs_delete("errno_file") != 0);
+
+	unit_test_finish();
+}
+
+static void *
+snapshot_writer(void *arg)
+{
+	long id = (long) arg;
+	char name[32], buf[CHUNK_SIZE];
+	sprintf(name, "snap_file_%ld", id);
+	int fd = ufs_open(name, 0);
+	unit_fail_if(fd == -1);
+	for (int i = 0; i < CHUNK_COUNT; ++i) {
+		memset(buf, 'A' + i % 26, sizeof(buf));
+		unit_fail_if(ufs_pwrite(fd, buf, sizeof(buf), 0) !=
+			     sizeof(buf));
+	}
+	unit_fail_if(ufs_close(fd) != 0);
+	return NULL;
+}
+
+static void
+test_concurrent_snapshot(void)
+{
+	unit_test_start();
+
+	char name[32], buf[CHUNK_SIZE];
+	memset(buf, 'A', sizeof(buf));
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		sprintf(name, "snap_file_%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	pthread_t threads[THREAD_COUNT];
+	for (long i = 0; i < THREAD_COUNT; ++i)
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    snapshot_writer, (void *) i) != 0);
+	bool ok = true;
+	for (int round = 0; round < 50; ++round) {
+		struct ufs_snapshot *snap = ufs_snapshot();
+		unit_fail_if(snap == NULL);
+		for (int i = 0; i < THREAD_COUNT; ++i) {
+			sprintf(name, "snap_file_%d", i);
+			int fd = ufs_snapshot_open(snap, name);
+			unit_fail_if(fd == -1);
+			unit_fail_if(ufs_read(fd, buf, sizeof(buf)) !=
+				     sizeof(buf));
+			/* Each write is atomic, a snapshot can't split it */
+			for (int j = 1; j < CHUNK_SIZE; ++j)
+				ok = ok && buf[j] == buf[0];
+			unit_fail_if(ufs_close(fd) != 0);
+		}
+		ufs_snapshot_delete(snap);
+	}
+	for (int i = 0; i < THREAD_COUNT; ++i)
+		unit_fail_if(pthread_join(threads[i], NULL) != 0);
+	unit_check(ok, "snapshots taken under writes see whole writes");
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		sprintf(name, "snap_file_%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+
+	unit_test_finish();
+}
+
+enum {
+	APPEND_COUNT = 2000,
+};
+
+struct append_record {
+	int id;
+	int seq;
+	char fill[56];
+};
+
+static void
+append_record_fill(struct append_record *rec, int id, int seq)
+{
+	rec->id = id;
+	rec->seq = seq;
+	memset(rec->fill, 'a' + (id + seq) % 26, sizeof(rec->fill));
+}
+
+static void *
+append_writer(void *arg)
+{
+	long id = (long) arg;
+	int fd = ufs_open("append_file", UFS_APPEND);
+	unit_fail_if(fd == -1);
+	struct append_record rec;
+	for (int i = 0; i < APPEND_COUNT; ++i) {
+		append_record_fill(&rec, id, i);
+		unit_fail_if(ufs_write(fd, (const char *) &rec, sizeof(rec)) !=
+			     sizeof(rec));
+	}
+	unit_fail_if(ufs_close(fd) != 0);
+	return NULL;
+}
+
+static void
+test_concurrent_append(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("append_file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	pthread_t threads[THREAD_COUNT];
+	for (long i = 0; i < THREAD_COUNT; ++i)
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    append_writer, (void *) i) != 0);
+	/* Tail the file while it grows */
+	int next[THREAD_COUNT] = {0};
+	int total = THREAD_COUNT * APPEND_COUNT;
+	bool ok = true, snap_ok = true;
+	struct append_record rec, want;
+	for (int count = 0; count < total;) {
+		ssize_t rc = ufs_pread(fd, (char *) &rec, sizeof(rec),
+				       count * sizeof(rec));
+		if (rc == 0) {
+			sched_yield();
+			continue;
+		}
+		if (rc != sizeof(rec) || rec.id < 0 || rec.id >= THREAD_COUNT) {
+			ok = false;
+			break;
+		}
+		append_record_fill(&want, rec.id, next[rec.id]++);
+		ok = ok && memcmp(&rec, &want, sizeof(rec)) == 0;
+		if (++count % 1000 != 0)
+			continue;
+		/* Appends go on while a snapshot shares the extents */
+		struct ufs_snapshot *snap = ufs_snapshot();
+		unit_fail_if(snap == NULL);
+		int snap_fd = ufs_snapshot_open(snap, "append_file");
+		unit_fail_if(snap_fd == -1);
+		ssize_t size = ufs_lseek(snap_fd, 0, UFS_SEEK_END);
+		snap_ok = snap_ok && size >= (ssize_t) (count * sizeof(rec)) &&
+			  size % sizeof(rec) == 0;
+		unit_fail_if(ufs_close(snap_fd) != 0);
+		ufs_snapshot_delete(snap);
+	}
+	for (int i = 0; i < THREAD_COUNT; ++i)
+		unit_fail_if(pthread_join(threads[i], NULL) != 0);
+	for (int i = 0; i < THREAD_COUNT; ++i)
+		ok = ok && next[i] == APPEND_COUNT;
+	unit_check(ok, "a tail reader sees whole records in order");
+	unit_check(snap_ok, "snapshots see whole records");
+	unit_check(ufs_lseek(fd, 0, UFS_SEEK_END) ==
+		   (ssize_t) (total * sizeof(rec)), "nothing is lost");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("append_file") != 0);
+
+	unit_test_finish();
+}
+
+static void *
+append_resize_writer(void *arg)
+{
+	(void) arg;
+	int fd = ufs_open("append_resize", UFS_APPEND);
+	unit_fail_if(fd == -1);
+	struct append_record rec;
+	for (int i = 0; i < APPEND_COUNT; ++i) {
+		append_record_fill(&rec, 0, i);
+		unit_fail_if(ufs_write(fd, (const char *) &rec, sizeof(rec)) !=
+			     sizeof(rec));
+	}
+	unit_fail_if(ufs_close(fd) != 0);
+	return NULL;
+}
+
+static void
+test_append_resize(void)
+{
+	unit_test_start();
+
+	/* Truncates move the positions of the appending descriptors */
+	int fd = ufs_open("append_resize", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	pthread_t threads[THREAD_COUNT];
+	for (long i = 0; i < THREAD_COUNT; ++i)
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    append_resize_writer,
+					    (void *) i) != 0);
+	for (int i = 0; i < 200; ++i) {
+		unit_fail_if(ufs_resize(fd, 0) != 0);
+		sched_yield();
+	}
+	for (int i = 0; i < THREAD_COUNT; ++i)
+		unit_fail_if(pthread_join(threads[i], NULL) != 0);
+	ssize_t size = ufs_lseek(fd, 0, UFS_SEEK_END);
+	unit_check(size >= 0 && size % sizeof(struct append_record) == 0,
+		   "appends and truncates do not tear records");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("append_resize") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_concurrent_checkpoint(void)
+{
+	unit_test_start();
+
+	const char *path = "test_threads_image.ufs";
+	char name[32], buf[CHUNK_SIZE];
+	memset(buf, 'A', sizeof(buf));
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		sprintf(name, "snap_file_%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	pthread_t threads[THREAD_COUNT];
+	for (long i = 0; i < THREAD_COUNT; ++i)
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    snapshot_writer, (void *) i) != 0);
+	for (int round = 0; round < 20; ++round)
+		unit_fail_if(ufs_image_checkpoint(path) != 0);
+	for (int i = 0; i < THREAD_COUNT; ++i)
+		unit_fail_if(pthread_join(threads[i], NULL) != 0);
+	unit_fail_if(ufs_image_load(path) != 0);
+	bool ok = true;
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		sprintf(name, "snap_file_%d", i);
+		int fd = ufs_open(name, 0);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_read(fd, buf, sizeof(buf)) != sizeof(buf));
+		for (int j = 1; j < CHUNK_SIZE; ++j)
+			ok = ok && buf[j] == buf[0];
+		unit_fail_if(ufs_close(fd) != 0);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	unit_check(ok, "checkpoints taken under writes save whole writes");
+	remove(path);
+
+	unit_test_finish();
+}
+
+static void *
+dir_worker(void *arg)
+{
+	long id = (long) arg;
+	char name[64];
+	bool ok = true;
+	for (int i = 0; i < CHUNK_COUNT; ++i) {
+		/* The tree is moved back and forth meanwhile */
+		sprintf(name, "%s/dir_%ld/file_%d", i % 2 == 0 ? "tree" : "tree2",
+			id, i % 4);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd == -1) {
+			ok = ok && ufs_errno() == UFS_ERR_NO_FILE;
+			continue;
+		}
+		ok = ok && ufs_write(fd, name, 8) == 8;
+		unit_fail_if(ufs_close(fd) != 0);
+		ok = ok && (ufs_delete(name) == 0 ||
+			    ufs_errno() == UFS_ERR_NO_FILE);
+	}
+	unit_fail_if(!ok);
+	return NULL;
+}
+
+static void *
+dir_renamer(void *arg)
+{
+	(void) arg;
+	for (int i = 0; i < CHUNK_COUNT; ++i) {
+		unit_fail_if(ufs_rename("tree", "tree2") != 0);
+		struct ufs_snapshot *snap = ufs_snapshot();
+		unit_fail_if(snap == NULL);
+		ufs_snapshot_delete(snap);
+		unit_fail_if(ufs_rename("tree2", "tree") != 0);
+	}
+	return NULL;
+}
+
+static void
+test_concurrent_directories(void)
+{
+	unit_test_start();
+
+	char name[64];
+	unit_fail_if(ufs_mkdir("tree") != 0);
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		sprintf(name, "tree/dir_%d", i);
+		unit_fail_if(ufs_mkdir(name) != 0);
+	}
+	pthread_t renamer;
+	unit_fail_if(pthread_create(&renamer, NULL, dir_renamer, NULL) != 0);
+	run_threads(dir_worker);
+	unit_fail_if(pthread_join(renamer, NULL) != 0);
+	struct ufs_dirlist list;
+	unit_fail_if(ufs_readdir("tree", &list) != 0);
+	unit_check(list.count == THREAD_COUNT,
+		   "paths stay consistent under renames of directories");
+	ufs_dirlist_release(&list);
+	unit_check(ufs_rmdir("tree", 1) == 0, "delete the tree");
+
+	unit_test_finish();
+}
+
+static void *
+pack_worker(void *arg)
+{
+	long id = (long) arg;
+	char name[32], buf[CHUNK_SIZE];
+	sprintf(name, "pack_file_%ld", id);
+	int fd = ufs_open(name, 0);
+	unit_fail_if(fd == -1);
+	bool ok = true;
+	for (int i = 0; i < CHUNK_COUNT; ++i) {
+		/* Chunk j is filled with its letter, rewriting keeps it */
+		int chunk = (i * 7) % 64;
+		if (i % 4 == 0) {
+			memset(buf, 'a' + chunk % 26, sizeof(buf));
+			ok = ok && ufs_pwrite(fd, buf, sizeof(buf),
+					      chunk * CHUNK_SIZE) == sizeof(buf);
+			continue;
+		}
+		ok = ok && ufs_pread(fd, buf, sizeof(buf),
+				     chunk * CHUNK_SIZE) == sizeof(buf);
+		for (int j = 0; j < CHUNK_SIZE; ++j)
+			ok = ok && buf[j] == 'a' + chunk % 26;
+		/* Let the other extents get cold */
+		if (i % 16 == 0)
+			sched_yield();
+	}
+	unit_fail_if(!ok);
+	unit_fail_if(ufs_close(fd) != 0);
+	return NULL;
+}
+
+/** Files of pack_worker(), all with the same data. */
+static void
+pack_files_create(void)
+{
+	char name[32], buf[CHUNK_SIZE];
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		sprintf(name, "pack_file_%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		for (int j = 0; j < 64; ++j) {
+			memset(buf, 'a' + j % 26, sizeof(buf));
+			unit_fail_if(ufs_write(fd, buf, sizeof(buf)) !=
+				     sizeof(buf));
+		}
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+}
+
+static void
+pack_files_delete(void)
+{
+	char name[32];
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		sprintf(name, "pack_file_%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+}
+
+static void
+test_concurrent_compression(void)
+{
+	unit_test_start();
+
+	pack_files_create();
+	pthread_t threads[THREAD_COUNT];
+	for (long i = 0; i < THREAD_COUNT; ++i)
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    pack_worker, (void *) i) != 0);
+	for (int round = 0; round < 100; ++round)
+		unit_fail_if(ufs_compress_cold() < 0);
+	for (int i = 0; i < THREAD_COUNT; ++i)
+		unit_fail_if(pthread_join(threads[i], NULL) != 0);
+	struct ufs_compress_stats stats;
+	ufs_compress_stats(&stats);
+	unit_check(stats.compressions > 0,
+		   "data stays consistent under compression");
+	pack_files_delete();
+
+	unit_test_finish();
+}
+
+static void
+test_concurrent_dedup(void)
+{
+	unit_test_start();
+
+	/* Writers copy the extents merged under them */
+	pack_files_create();
+	pthread_t threads[THREAD_COUNT];
+	for (long i = 0; i < THREAD_COUNT; ++i)
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    pack_worker, (void *) i) != 0);
+	for (int round = 0; round < 100; ++round)
+		unit_fail_if(ufs_dedup() < 0);
+	for (int i = 0; i < THREAD_COUNT; ++i)
+		unit_fail_if(pthread_join(threads[i], NULL) != 0);
+	struct ufs_dedup_stats stats;
+	ufs_dedup_stats(&stats);
+	unit_check(stats.merges > 0, "data stays consistent under dedup");
+	pack_files_delete();
+
+	unit_test_finish();
+}
+
+static void
+test_concurrent_copy_range(void)
+{
+	unit_test_start();
+
+	/* The files are equal, so copies between them keep the data */
+	pack_files_create();
+	pthread_t threads[THREAD_COUNT];
+	for (long i = 0; i < THREAD_COUNT; ++i)
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    pack_worker, (void *) i) != 0);
+	char name[32];
+	int fds[THREAD_COUNT];
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		sprintf(name, "pack_file_%d", i);
+		fds[i] = ufs_open(name, 0);
+		unit_fail_if(fds[i] == -1);
+	}
+	for (int round = 0; round < 200; ++round) {
+		int src = fds[round % THREAD_COUNT];
+		int dst = fds[(round + 1) % THREAD_COUNT];
+		size_t offset = round % 2 == 0 ? 0 : CHUNK_SIZE * 3 + 100;
+		size_t len = round % 2 == 0 ? CHUNK_SIZE * 64 : 5000;
+		unit_fail_if(ufs_copy_range(src, offset, dst, offset, len) !=
+			     (ssize_t) len);
+	}
+	bool ok = true;
+	char buf[CHUNK_SIZE];
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		unit_fail_if(pthread_join(threads[i], NULL) != 0);
+		for (int j = 0; j < 64; ++j) {
+			ok = ok && ufs_pread(fds[i], buf, sizeof(buf),
+					     j * CHUNK_SIZE) == sizeof(buf);
+			for (int k = 0; k < CHUNK_SIZE; ++k)
+				ok = ok && buf[k] == 'a' + j % 26;
+		}
+		unit_fail_if(ufs_close(fds[i]) != 0);
+	}
+	unit_check(ok, "data stays consistent under copies");
+	pack_files_delete();
+
+	unit_test_finish();
+}
+
+static void
+test_concurrent_mmap(void)
+{
+	unit_test_start();
+
+	/* Mapped data moves and is copied by snapshots under the writers */
+	pack_files_create();
+	pthread_t threads[THREAD_COUNT];
+	for (long i = 0; i < THREAD_COUNT; ++i)
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    pack_worker, (void *) i) != 0);
+	char name[32];
+	int mapped = 0;
+	for (int round = 0; round < 100; ++round) {
+		sprintf(name, "pack_file_%d", round % THREAD_COUNT);
+		int fd = ufs_open(name, 0);
+		unit_fail_if(fd == -1);
+		struct ufs_mapping map;
+		if (ufs_mmap(fd, 0, CHUNK_SIZE * 64, &map) == 0)
+			++mapped;
+		struct ufs_snapshot *snap = ufs_snapshot();
+		unit_fail_if(snap == NULL);
+		unit_fail_if(ufs_dedup() < 0);
+		ufs_snapshot_delete(snap);
+		if (map.addr != NULL)
+			ufs_munmap(&map);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	for (int i = 0; i < THREAD_COUNT; ++i)
+		unit_fail_if(pthread_join(threads[i], NULL) != 0);
+	unit_check(mapped > 0, "data stays consistent while mapped");
+	pack_files_delete();
+
+	unit_test_finish();
+}
+
+static void
+test_concurrent_memory_limit(void)
+{
+	unit_test_start();
+
+	char name[32], buf[CHUNK_SIZE];
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		sprintf(name, "pack_file_%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		for (int j = 0; j < 64; ++j) {
+			memset(buf, 'a' + j % 26, sizeof(buf));
+			unit_fail_if(ufs_write(fd, buf, sizeof(buf)) !=
+				     sizeof(buf));
+		}
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	/*
+	 * Not all files fit, but all threads can unpack the extents
+	 * of a read at once
+	 */
+	struct ufs_memory_stats stats;
+	ufs_memory_stats(&stats);
+	unit_fail_if(ufs_set_memory_limit(stats.used * 3 / 4, ".") != 0);
+	run_threads(pack_worker);
+	ufs_memory_stats(&stats);
+	unit_check(stats.evictions > 0 && stats.faults > 0,
+		   "data stays consistent under eviction");
+	unit_fail_if(ufs_set_memory_limit(0, NULL) != 0);
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		sprintf(name, "pack_file_%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+
+	unit_test_finish();
+}
+
+static void *
+stats_worker(void *arg)
+{
+	long id = (long) arg;
+	char name[32], buf[100];
+	sprintf(name, "stats_file_%ld", id);
+	memset(buf, 'a' + id, sizeof(buf));
+	int fd = ufs_open(name, UFS_CREATE);
+	unit_fail_if(fd == -1);
+	struct ufs_stats stats;
+	for (int i = 0; i < 1000; ++i) {
+		unit_fail_if(ufs_pwrite(fd, buf, sizeof(buf), i * sizeof(buf)) !=
+			     sizeof(buf));
+		/* Sum the counters while other threads change them */
+		if (i % 100 == 0)
+			ufs_stats(&stats);
+	}
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete(name) != 0);
+	return NULL;
+}
+
+static void
+test_thread_stats(void)
+{
+	unit_test_start();
+
+	struct ufs_stats before, after;
+	ufs_stats(&before);
+	run_threads(stats_worker);
+	ufs_stats(&after);
+	const struct ufs_op_stats *b = &before.ops[UFS_OP_PWRITE];
+	const struct ufs_op_stats *a = &after.ops[UFS_OP_PWRITE];
+	unit_check(a->calls - b->calls == THREAD_COUNT * 1000 &&
+		   a->bytes - b->bytes == THREAD_COUNT * 1000 * 100,
+		   "counters of exited threads are kept");
+	unit_check(after.files == before.files &&
+		   after.extents == before.extents,
+		   "objects freed by other threads are not counted");
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	unit_test_start();
+
+	test_own_files();
+	test_shared_file();
+	test_shared_descriptor();
+	test_close_while_used();
+	test_name_churn();
+	test_thread_errno();
+	test_concurrent_snapshot();
+	test_concurrent_append();
+	test_append_resize();
+	test_concurrent_checkpoint();
+	test_concurrent_directories();
+	test_concurrent_compression();
+	test_concurrent_dedup();
+	test_concurrent_copy_range();
+	test_concurrent_mmap();
+	test_concurrent_memory_limit();
+	test_thread_stats();
+
+	unit_test_finish();
+	return 0;
+}
@@ -0,0 +1,389 @@
+#define _GNU_SOURCE
+#include "ufs_client.h"
+#include "ufs_proto.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+enum {
+	/** Size of the memory shared with the server. */
+	CLIENT_SHM_SIZE = 8 * 1024 * 1024,
+	/** Data of calls is aligned in it by this. */
+	CLIENT_SHM_ALIGN = 64,
+	/** Max number of calls in one round trip. */
+	CLIENT_BATCH = 256,
+};
+
+struct ufs_client {
+	int sock;
+	/** Memory shared with the server. */
+	char *shm;
+	size_t shm_size;
+	enum ufs_error_code error;
+	/** Requests of a round trip being built. */
+	char *out;
+	size_t out_size;
+	size_t out_capacity;
+	/**
+	 * Where data of each call of the round trip is in the
+	 * shared memory, SIZE_MAX for calls not sent.
+	 */
+	size_t shm_offsets[CLIENT_BATCH];
+	struct ufs_proto_response in[CLIENT_BATCH];
+};
+
+/** Write a whole buffer, retrying short writes. */
+static int
+write_all(int sock, const void *buf, size_t size)
+{
+	const char *pos = (const char *)buf;
+	while(size > 0) {
+		ssize_t rc = send(sock, pos, size, MSG_NOSIGNAL);
+		if(rc < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		pos += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+/** Read exactly @a size bytes. */
+static int
+read_all(int sock, void *buf, size_t size)
+{
+	char *pos = (char *)buf;
+	while(size > 0) {
+		ssize_t rc = recv(sock, pos, size, 0);
+		if(rc < 0 && errno == EINTR)
+			continue;
+		if(rc <= 0)
+			return -1;
+		pos += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+static inline bool
+request_has_data(enum ufs_request_op op)
+{
+	return op == UFS_REQ_READ || op == UFS_REQ_WRITE || op == UFS_REQ_PREAD ||
+	       op == UFS_REQ_PWRITE;
+}
+
+/** How much of the shared memory a call takes. */
+static inline size_t
+request_data_size(const struct ufs_request *req)
+{
+	if(!request_has_data(req->op))
+		return 0;
+	if(req->size > SIZE_MAX - CLIENT_SHM_ALIGN)
+		return SIZE_MAX;
+	return (req->size + CLIENT_SHM_ALIGN - 1) & ~(size_t)(CLIENT_SHM_ALIGN - 1);
+}
+
+/** Append bytes to the requests being built. */
+static int
+client_out_append(struct ufs_client *client, const void *data, size_t size)
+{
+	if(size == 0)
+		return 0;
+	if(client->out_size + size > client->out_capacity) {
+		size_t capacity = client->out_capacity == 0 ? 4096 : client->out_capacity;
+		while(capacity < client->out_size + size)
+			capacity *= 2;
+		char *out = (char *)realloc(client->out, capacity);
+		if(out == NULL)
+			return -1;
+		client->out = out;
+		client->out_capacity = capacity;
+	}
+	memcpy(client->out + client->out_size, data, size);
+	client->out_size += size;
+	return 0;
+}
+
+/**
+ * Execute calls in one round trip. There are at most CLIENT_BATCH
+ * of them and their data fits the shared memory.
+ * @retval 0 Success.
+ * @retval -1 Broken connection.
+ */
+static int
+client_round(struct ufs_client *client, struct ufs_request *reqs, int count)
+{
+	client->out_size = 0;
+	size_t shm_used = 0;
+	int sent = 0;
+	for(int i = 0; i < count; i++) {
+		struct ufs_request *r = &reqs[i];
+		size_t path_len = r->path != NULL ? strlen(r->path) : 0;
+		size_t new_path_len = r->new_path != NULL ? strlen(r->new_path) : 0;
+		client->shm_offsets[i] = SIZE_MAX;
+		/* The server would drop the connection */
+		if(path_len > UFS_PROTO_PATH_MAX || new_path_len > UFS_PROTO_PATH_MAX) {
+			r->result = -1;
+			r->error = UFS_ERR_INVALID_ARG;
+			continue;
+		}
+		struct ufs_proto_request req;
+		memset(&req, 0, sizeof(req));
+		/* Values of the ops are the same */
+		req.op = r->op;
+		req.fd = r->fd;
+		req.flags = r->flags;
+		req.path_len = path_len;
+		req.new_path_len = new_path_len;
+		req.size = r->size;
+		req.offset = r->offset;
+		req.shm_offset = shm_used;
+		if(r->op == UFS_REQ_WRITE || r->op == UFS_REQ_PWRITE)
+			memcpy(client->shm + shm_used, r->buf, r->size);
+		size_t out_size = client->out_size;
+		if(client_out_append(client, &req, sizeof(req)) != 0 ||
+		   client_out_append(client, r->path, path_len) != 0 ||
+		   client_out_append(client, r->new_path, new_path_len) != 0) {
+			/* Drop the partially appended request */
+			client->out_size = out_size;
+			r->result = -1;
+			r->error = UFS_ERR_NO_MEM;
+			continue;
+		}
+		client->shm_offsets[i] = shm_used;
+		shm_used += request_data_size(r);
+		sent++;
+	}
+	if(write_all(client->sock, client->out, client->out_size) != 0 ||
+	   read_all(client->sock, client->in, sent * sizeof(client->in[0])) != 0)
+		return -1;
+	const struct ufs_proto_response *res = client->in;
+	for(int i = 0; i < count; i++) {
+		struct ufs_request *r = &reqs[i];
+		if(client->shm_offsets[i] == SIZE_MAX)
+			continue;
+		r->result = res->result;
+		r->error = (enum ufs_error_code)res->error;
+		res++;
+		if((r->op == UFS_REQ_READ || r->op == UFS_REQ_PREAD) && r->result > 0 &&
+		   (size_t)r->result <= r->size)
+			memcpy(r->buf, client->shm + client->shm_offsets[i], r->result);
+	}
+	return 0;
+}
+
+/**
+ * Execute a read or a write bigger than the shared memory by
+ * parts, one round trip each.
+ */
+static int
+client_submit_big(struct ufs_client *client, struct ufs_request *req)
+{
+	struct ufs_request part = *req;
+	size_t done = 0;
+	req->result = 0;
+	req->error = UFS_ERR_NO_ERR;
+	while(done < req->size) {
+		part.buf = (char *)req->buf + done;
+		part.size = req->size - done < client->shm_size ? req->size - done : client->shm_size;
+		part.offset = req->offset + done;
+		if(client_round(client, &part, 1) != 0)
+			return -1;
+		if(part.result < 0) {
+			/* Like a short write when a part is done */
+			if(done == 0) {
+				req->result = -1;
+				req->error = part.error;
+			}
+			return 0;
+		}
+		done += part.result;
+		req->result = done;
+		if((size_t)part.result < part.size)
+			break;
+	}
+	return 0;
+}
+
+int
+ufs_client_submit(struct ufs_client *client, struct ufs_request *reqs, int count)
+{
+	int i = 0;
+	while(i < count) {
+		if(request_data_size(&reqs[i]) > client->shm_size) {
+			if(client_submit_big(client, &reqs[i]) != 0)
+				goto broken;
+			i++;
+			continue;
+		}
+		/* As many calls as fit, they go in one round trip */
+		int n = 0;
+		size_t shm_used = 0;
+		while(i + n < count && n < CLIENT_BATCH) {
+			size_t size = request_data_size(&reqs[i + n]);
+			if(size > client->shm_size - shm_used)
+				break;
+			shm_used += size;
+			n++;
+		}
+		if(client_round(client, &reqs[i], n) != 0)
+			goto broken;
+		i += n;
+	}
+	return 0;
+broken:
+	for(; i < count; i++) {
+		reqs[i].result = -1;
+		reqs[i].error = UFS_ERR_IO;
+	}
+	client->error = UFS_ERR_IO;
+	return -1;
+}
+
+struct ufs_client *
+ufs_client_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	if(strlen(path) >= sizeof(addr.sun_path))
+		return NULL;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	struct ufs_client *client = (struct ufs_client *)calloc(1, sizeof(*client));
+	if(client == NULL)
+		return NULL;
+	client->shm = (char *)MAP_FAILED;
+	client->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	/* The server maps the memory only if it can not shrink */
+	int shm_fd = memfd_create("ufs_client", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(client->sock < 0 || shm_fd < 0 ||
+	   connect(client->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	   ftruncate(shm_fd, CLIENT_SHM_SIZE) != 0 ||
+	   fcntl(shm_fd, F_ADD_SEALS, F_SEAL_SHRINK) != 0)
+		goto error;
+	client->shm = (char *)mmap(NULL, CLIENT_SHM_SIZE, PROT_READ | PROT_WRITE,
+				   MAP_SHARED, shm_fd, 0);
+	if(client->shm == MAP_FAILED)
+		goto error;
+	client->shm_size = CLIENT_SHM_SIZE;
+	/* The shared memory goes to the server with the hello */
+	struct ufs_proto_hello hello = {UFS_PROTO_MAGIC, UFS_PROTO_VERSION, CLIENT_SHM_SIZE};
+	struct iovec iov = {&hello, sizeof(hello)};
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &shm_fd, sizeof(int));
+	struct ufs_proto_response res;
+	if(sendmsg(client->sock, &msg, MSG_NOSIGNAL) != sizeof(hello) ||
+	   read_all(client->sock, &res, sizeof(res)) != 0 || res.result != 0)
+		goto error;
+	close(shm_fd);
+	return client;
+error:
+	if(client->shm != MAP_FAILED)
+		munmap(client->shm, CLIENT_SHM_SIZE);
+	if(shm_fd >= 0)
+		close(shm_fd);
+	if(client->sock >= 0)
+		close(client->sock);
+	free(client);
+	return NULL;
+}
+
+void
+ufs_client_disconnect(struct ufs_client *client)
+{
+	close(client->sock);
+	munmap(client->shm, client->shm_size);
+	free(client->out);
+	free(client);
+}
+
+enum ufs_error_code
+ufs_client_errno(struct ufs_client *client)
+{
+	return client->error;
+}
+
+/** Execute one call, remembering its error. */
+static ssize_t
+client_call(struct ufs_client *client, struct ufs_request *req)
+{
+	if(ufs_client_submit(client, req, 1) != 0)
+		return -1;
+	if(req->result < 0)
+		client->error = req->error;
+	return req->result;
+}
+
+int
+ufs_client_open(struct ufs_client *client, const char *path, int flags)
+{
+	struct ufs_request req = {.op = UFS_REQ_OPEN, .path = path, .flags = flags};
+	return client_call(client, &req);
+}
+
+int
+ufs_client_close(struct ufs_client *client, int fd)
+{
+	struct ufs_request req = {.op = UFS_REQ_CLOSE, .fd = fd};
+	return client_call(client, &req);
+}
+
+ssize_t
+ufs_client_read(struct ufs_client *client, int fd, char *buf, size_t size)
+{
+	struct ufs_request req = {.op = UFS_REQ_READ, .fd = fd, .buf = buf, .size = size};
+	return client_call(client, &req);
+}
+
+ssize_t
+ufs_client_write(struct ufs_client *client, int fd, const char *buf, size_t size)
+{
+	struct ufs_request req = {.op = UFS_REQ_WRITE, .fd = fd, .buf = (char *)buf,
+				  .size = size};
+	return client_call(client, &req);
+}
+
+ssize_t
+ufs_client_pread(struct ufs_client *client, int fd, char *buf, size_t size,
+		 size_t offset)
+{
+	struct ufs_request req = {.op = UFS_REQ_PREAD, .fd = fd, .buf = buf, .size = size,
+				  .offset = offset};
+	return client_call(client, &req);
+}
+
+ssize_t
+ufs_client_pwrite(struct ufs_client *client, int fd, const char *buf,
+		  size_t size, size_t offset)
+{
+	struct ufs_request req = {.op = UFS_REQ_PWRITE, .fd = fd, .buf = (char *)buf,
+				  .size = size, .offset = offset};
+	return client_call(client, &req);
+}
+
+int
+ufs_client_delete(struct ufs_client *client, const char *path)
+{
+	struct ufs_request req = {.op = UFS_REQ_DELETE, .path = path};
+	return client_call(client, &req);
+}
@@ -0,0 +1,122 @@
+#ifndef UFS_CLIENT_H
+#define UFS_CLIENT_H
+
+#include "userfs.h"
+
+/**
+ * Client of a userfs server, see ufs_server.h: the filesystem of
+ * another process, used like the local one. Calls can be batched:
+ * a batch goes to the server in one write and its results come
+ * back in one read, so the cost of a round trip is paid once for
+ * many calls. Data of reads and writes is passed through memory
+ * shared with the server, not through the socket.
+ *
+ * A client is a connection with its own descriptors. It must not
+ * be used by several threads at once, each thread can have its
+ * own client.
+ */
+struct ufs_client;
+
+/** Operations of ufs_request, each is like the ufs_ call. */
+enum ufs_request_op {
+	UFS_REQ_OPEN = 1,
+	UFS_REQ_CLOSE,
+	UFS_REQ_READ,
+	UFS_REQ_WRITE,
+	UFS_REQ_PREAD,
+	UFS_REQ_PWRITE,
+	UFS_REQ_RESIZE,
+	UFS_REQ_DELETE,
+	UFS_REQ_MKDIR,
+	UFS_REQ_RMDIR,
+	UFS_REQ_RENAME,
+};
+
+/** A call to the server, see ufs_client_submit(). */
+struct ufs_request {
+	enum ufs_request_op op;
+	/** Descriptor of the client. */
+	int fd;
+	/** Path of open, delete, mkdir, rmdir and rename. */
+	const char *path;
+	/** New path of rename. */
+	const char *new_path;
+	/** Open flags, or recursive flag of rmdir. */
+	int flags;
+	/** Buffer of a read or a write. */
+	void *buf;
+	/** Size of the buffer, or new size of resize. */
+	size_t size;
+	/** File offset of pread and pwrite. */
+	size_t offset;
+	/** Result of the call, -1 on error. */
+	ssize_t result;
+	/** Error of the call when the result is -1. */
+	enum ufs_error_code error;
+};
+
+/**
+ * Connect to a server listening on a Unix socket at @a path.
+ * @retval not NULL Client, close it with ufs_client_disconnect().
+ * @retval NULL The server is unreachable or not enough memory.
+ */
+struct ufs_client *
+ufs_client_connect(const char *path);
+
+/**
+ * Close the connection. Descriptors opened through it are closed
+ * by the server.
+ */
+void
+ufs_client_disconnect(struct ufs_client *client);
+
+/** Get code of the last error of a client call. */
+enum ufs_error_code
+ufs_client_errno(struct ufs_client *client);
+
+/**
+ * Execute calls on the server. They are sent without waiting for
+ * results and executed in order, so a batch costs about one round
+ * trip. A descriptor opened in a batch can be used only in the
+ * next one. Reads and writes bigger than the shared memory are
+ * split into several calls.
+ * @param reqs Calls, their result and error are filled.
+ * @param count Number of calls.
+ * @retval 0 All calls are executed, each has its own result.
+ * @retval -1 The connection is broken, calls without result have
+ *         UFS_ERR_IO.
+ */
+int
+ufs_client_submit(struct ufs_client *client, struct ufs_request *reqs, int count);
+
+/** Same as ufs_open() on the server. */
+int
+ufs_client_open(struct ufs_client *client, const char *path, int flags);
+
+/** Same as ufs_close() on the server. */
+int
+ufs_client_close(struct ufs_client *client, int fd);
+
+/** Same as ufs_read() on the server. */
+ssize_t
+ufs_client_read(struct ufs_client *client, int fd, char *buf, size_t size);
+
+/** Same as ufs_write() on the server. */
+ssize_t
+ufs_client_write(struct ufs_client *client, int fd, const char *buf, size_t size);
+
+/** Same as ufs_pread() on the server. */
+ssize_t
+ufs_client_pread(struct ufs_client *client, int fd, char *buf, size_t size,
+		 size_t offset);
+
+/** Same as ufs_pwrite() on the server. */
+ssize_t
+ufs_client_pwrite(struct ufs_client *client, int fd, const char *buf,
+		  size_t size, size_t offset);
+
+/** Same as ufs_delete() on the server. */
+int
+ufs_client_delete(struct ufs_client *client, const char *path);
+
+#endif /* UFS_CLIENT_H */
@@ -0,0 +1,79 @@
+#ifndef UFS_PROTO_H
+#define UFS_PROTO_H
+
+#include <stdint.h>
+
+/**
+ * Protocol of the userfs server, see ufs_server.h. It is spoken
+ * over a Unix stream socket between processes of one machine, so
+ * everything is in the native byte order.
+ *
+ * A client starts with ufs_proto_hello carrying a memfd in
+ * SCM_RIGHTS: the shared region. The memfd must be sealed with
+ * F_SEAL_SHRINK and hold at least shm_size bytes. The server maps
+ * it and answers with one ufs_proto_response. Then the client sends requests,
+ * each is ufs_proto_request followed by its paths, without
+ * waiting for the responses: the server answers them in order.
+ * Data of reads and writes never goes through the socket, it is
+ * in the shared region at the offset given in the request.
+ */
+
+enum {
+	UFS_PROTO_MAGIC = 0x55465331,
+	UFS_PROTO_VERSION = 1,
+	/** Max length of a path in a request. */
+	UFS_PROTO_PATH_MAX = 4096,
+	/** Max size of the shared region. */
+	UFS_PROTO_SHM_MAX = 1 << 30,
+};
+
+enum ufs_proto_op {
+	UFS_PROTO_OPEN = 1,
+	UFS_PROTO_CLOSE,
+	UFS_PROTO_READ,
+	UFS_PROTO_WRITE,
+	UFS_PROTO_PREAD,
+	UFS_PROTO_PWRITE,
+	UFS_PROTO_RESIZE,
+	UFS_PROTO_DELETE,
+	UFS_PROTO_MKDIR,
+	UFS_PROTO_RMDIR,
+	UFS_PROTO_RENAME,
+	UFS_PROTO_OP_MAX,
+};
+
+struct ufs_proto_hello {
+	uint32_t magic;
+	uint32_t version;
+	/** Size of the shared region. */
+	uint64_t shm_size;
+};
+
+struct ufs_proto_request {
+	/** One of ufs_proto_op. */
+	uint32_t op;
+	/** Descriptor number of the connection, not of the server. */
+	int32_t fd;
+	/** Open flags, or recursive flag of rmdir. */
+	uint32_t flags;
+	/** Lengths of the paths following the request, no zeros. */
+	uint32_t path_len;
+	uint32_t new_path_len;
+	uint32_t unused;
+	/** Size of the data, or new size of resize. */
+	uint64_t size;
+	/** File offset of pread and pwrite. */
+	uint64_t offset;
+	/** Where the data is in the shared region. */
+	uint64_t shm_offset;
+};
+
+struct ufs_proto_response {
+	/** Result of the call, -1 on error. */
+	int64_t result;
+	/** ufs_error_code when the result is -1. */
+	uint32_t error;
+	uint32_t unused;
+};
+
+#endif /* UFS_PROTO_H */
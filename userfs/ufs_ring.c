@@ -0,0 +1,297 @@
+#include "ufs_ring.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	/** Max number of entries of a ring. */
+	RING_MAX_ENTRIES = 1 << 24,
+	/** A worker adds completions to the ring by that many. */
+	RING_WORKER_BATCH = 32,
+};
+
+/** Entries of a chain: the first one and their number. */
+struct ring_chain {
+	unsigned first;
+	unsigned count;
+};
+
+/**
+ * Positions in the rings are counters which wrap around, an entry
+ * of a position is at the position & mask. The owner queues
+ * entries at sq_tail and submits them by moving sq_head. Each
+ * submitted entry gives one completion, added at cq_tail and taken
+ * at cq_head, and no more than mask + 1 entries are queued,
+ * submitted or completed but not taken. So neither ring overflows
+ * and an entry is not reused until its completion is taken.
+ */
+struct ufs_ring {
+	unsigned mask;
+	struct ufs_sqe *sqes;
+	unsigned sq_head;
+	unsigned sq_tail;
+	struct ufs_cqe *cqes;
+	unsigned cq_head;
+	unsigned cq_tail;
+	/** Submitted chains not taken by workers yet. */
+	struct ring_chain *chains;
+	unsigned chain_head;
+	unsigned chain_tail;
+	/** 0 when calls run inline, then nothing below is used. */
+	int worker_count;
+	pthread_t *workers;
+	bool stop;
+	/** Protects chains, completions and stop. */
+	pthread_mutex_t lock;
+	/** Workers wait for chains here. */
+	pthread_cond_t work_cond;
+	/** The owner waits for completions here. */
+	pthread_cond_t done_cond;
+};
+
+/** Execute one call, @a fd is its descriptor. */
+static void
+ring_execute(const struct ufs_sqe *sqe, int fd, struct ufs_cqe *cqe)
+{
+	ssize_t result;
+	switch(sqe->op) {
+	case UFS_SQE_NOP:
+		result = 0;
+		break;
+	case UFS_SQE_OPEN:
+		result = ufs_open(sqe->path, sqe->open_flags);
+		break;
+	case UFS_SQE_CLOSE:
+		result = ufs_close(fd);
+		break;
+	case UFS_SQE_READ:
+		result = ufs_read(fd, (char *)sqe->buf, sqe->size);
+		break;
+	case UFS_SQE_WRITE:
+		result = ufs_write(fd, (const char *)sqe->buf, sqe->size);
+		break;
+	case UFS_SQE_PREAD:
+		result = ufs_pread(fd, (char *)sqe->buf, sqe->size, sqe->offset);
+		break;
+	case UFS_SQE_PWRITE:
+		result = ufs_pwrite(fd, (const char *)sqe->buf, sqe->size, sqe->offset);
+		break;
+	case UFS_SQE_RESIZE:
+		result = ufs_resize(fd, sqe->size);
+		break;
+	default:
+		cqe->result = -1;
+		cqe->error = UFS_ERR_INVALID_ARG;
+		return;
+	}
+	cqe->result = result;
+	cqe->error = result < 0 ? ufs_errno() : UFS_ERR_NO_ERR;
+}
+
+/** Add completions to the ring. */
+static void
+ring_complete(struct ufs_ring *ring, const struct ufs_cqe *cqes, unsigned count)
+{
+	if(ring->worker_count > 0)
+		pthread_mutex_lock(&ring->lock);
+	for(unsigned i = 0; i < count; i++)
+		ring->cqes[ring->cq_tail++ & ring->mask] = cqes[i];
+	if(ring->worker_count > 0) {
+		pthread_cond_signal(&ring->done_cond);
+		pthread_mutex_unlock(&ring->lock);
+	}
+}
+
+/** Run a chain of calls in order, see UFS_SQE_LINK. */
+static void
+ring_run_chain(struct ufs_ring *ring, struct ring_chain chain)
+{
+	struct ufs_cqe done[RING_WORKER_BATCH];
+	unsigned done_count = 0;
+	bool failed = false;
+	int opened = -1;
+	for(unsigned i = 0; i < chain.count; i++) {
+		const struct ufs_sqe *sqe = &ring->sqes[(chain.first + i) & ring->mask];
+		struct ufs_cqe *cqe = &done[done_count++];
+		cqe->user_data = sqe->user_data;
+		/* A call failed, the rest of the chain is not run */
+		if(failed) {
+			cqe->result = -1;
+			cqe->error = UFS_ERR_CANCELED;
+		}
+		else {
+			ring_execute(sqe, (sqe->flags & UFS_SQE_FD_OPENED) ? opened : sqe->fd, cqe);
+			failed = cqe->result < 0;
+			if(sqe->op == UFS_SQE_OPEN && !failed)
+				opened = cqe->result;
+		}
+		if(done_count == RING_WORKER_BATCH) {
+			ring_complete(ring, done, done_count);
+			done_count = 0;
+		}
+	}
+	if(done_count > 0)
+		ring_complete(ring, done, done_count);
+}
+
+static void *
+ring_worker(void *arg)
+{
+	struct ufs_ring *ring = (struct ufs_ring *)arg;
+	pthread_mutex_lock(&ring->lock);
+	for(;;) {
+		while(ring->chain_head == ring->chain_tail && !ring->stop)
+			pthread_cond_wait(&ring->work_cond, &ring->lock);
+		if(ring->chain_head == ring->chain_tail)
+			break;
+		struct ring_chain chain = ring->chains[ring->chain_head++ & ring->mask];
+		pthread_mutex_unlock(&ring->lock);
+		ring_run_chain(ring, chain);
+		pthread_mutex_lock(&ring->lock);
+	}
+	pthread_mutex_unlock(&ring->lock);
+	return NULL;
+}
+
+/** Stop and join the first @a count workers. */
+static void
+ring_stop_workers(struct ufs_ring *ring, int count)
+{
+	pthread_mutex_lock(&ring->lock);
+	ring->stop = true;
+	pthread_cond_broadcast(&ring->work_cond);
+	pthread_mutex_unlock(&ring->lock);
+	for(int i = 0; i < count; i++)
+		pthread_join(ring->workers[i], NULL);
+}
+
+static void
+ring_free(struct ufs_ring *ring)
+{
+	if(ring->worker_count > 0) {
+		pthread_cond_destroy(&ring->done_cond);
+		pthread_cond_destroy(&ring->work_cond);
+		pthread_mutex_destroy(&ring->lock);
+	}
+	free(ring->workers);
+	free(ring->chains);
+	free(ring->cqes);
+	free(ring->sqes);
+	free(ring);
+}
+
+struct ufs_ring *
+ufs_ring_new(unsigned entries, int workers)
+{
+	if(entries == 0 || entries > RING_MAX_ENTRIES || workers < 0)
+		return NULL;
+	unsigned size = 1;
+	while(size < entries)
+		size *= 2;
+	struct ufs_ring *ring = (struct ufs_ring *)calloc(1, sizeof(*ring));
+	if(ring == NULL)
+		return NULL;
+	ring->mask = size - 1;
+	ring->sqes = (struct ufs_sqe *)calloc(size, sizeof(ring->sqes[0]));
+	ring->cqes = (struct ufs_cqe *)calloc(size, sizeof(ring->cqes[0]));
+	if(ring->sqes == NULL || ring->cqes == NULL) {
+		ring_free(ring);
+		return NULL;
+	}
+	if(workers == 0)
+		return ring;
+	ring->chains = (struct ring_chain *)calloc(size, sizeof(ring->chains[0]));
+	ring->workers = (pthread_t *)calloc(workers, sizeof(ring->workers[0]));
+	if(ring->chains == NULL || ring->workers == NULL) {
+		ring_free(ring);
+		return NULL;
+	}
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->work_cond, NULL);
+	pthread_cond_init(&ring->done_cond, NULL);
+	ring->worker_count = workers;
+	for(int i = 0; i < workers; i++) {
+		if(pthread_create(&ring->workers[i], NULL, ring_worker, ring) != 0) {
+			ring_stop_workers(ring, i);
+			ring_free(ring);
+			return NULL;
+		}
+	}
+	return ring;
+}
+
+void
+ufs_ring_delete(struct ufs_ring *ring)
+{
+	if(ring->worker_count > 0) {
+		pthread_mutex_lock(&ring->lock);
+		while(ring->cq_tail != ring->sq_head)
+			pthread_cond_wait(&ring->done_cond, &ring->lock);
+		pthread_mutex_unlock(&ring->lock);
+		ring_stop_workers(ring, ring->worker_count);
+	}
+	ring_free(ring);
+}
+
+struct ufs_sqe *
+ufs_ring_get_sqe(struct ufs_ring *ring)
+{
+	if(ring->sq_tail - ring->cq_head > ring->mask)
+		return NULL;
+	struct ufs_sqe *sqe = &ring->sqes[ring->sq_tail++ & ring->mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int
+ufs_ring_submit(struct ufs_ring *ring)
+{
+	unsigned count = ring->sq_tail - ring->sq_head;
+	if(count == 0)
+		return 0;
+	if(ring->worker_count > 0)
+		pthread_mutex_lock(&ring->lock);
+	struct ring_chain chain = {ring->sq_head, 0};
+	for(unsigned pos = ring->sq_head; pos != ring->sq_tail; pos++) {
+		chain.count++;
+		if((ring->sqes[pos & ring->mask].flags & UFS_SQE_LINK) &&
+		   pos + 1 != ring->sq_tail)
+			continue;
+		if(ring->worker_count == 0)
+			ring_run_chain(ring, chain);
+		else
+			ring->chains[ring->chain_tail++ & ring->mask] = chain;
+		chain.first = pos + 1;
+		chain.count = 0;
+	}
+	ring->sq_head = ring->sq_tail;
+	if(ring->worker_count > 0) {
+		pthread_cond_broadcast(&ring->work_cond);
+		pthread_mutex_unlock(&ring->lock);
+	}
+	return count;
+}
+
+int
+ufs_ring_wait(struct ufs_ring *ring, struct ufs_cqe *cqes, int count, int min)
+{
+	if(count <= 0)
+		return 0;
+	if(ring->worker_count > 0)
+		pthread_mutex_lock(&ring->lock);
+	/* Not more than the submitted calls can give */
+	unsigned need = min < count ? (min > 0 ? min : 0) : count;
+	if(need > ring->sq_head - ring->cq_head)
+		need = ring->sq_head - ring->cq_head;
+	while(ring->cq_tail - ring->cq_head < need)
+		pthread_cond_wait(&ring->done_cond, &ring->lock);
+	unsigned ready = ring->cq_tail - ring->cq_head;
+	if(ready > (unsigned)count)
+		ready = count;
+	for(unsigned i = 0; i < ready; i++)
+		cqes[i] = ring->cqes[ring->cq_head++ & ring->mask];
+	if(ring->worker_count > 0)
+		pthread_mutex_unlock(&ring->lock);
+	return ready;
+}
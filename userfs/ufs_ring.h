@@ -0,0 +1,128 @@
+#ifndef UFS_RING_H
+#define UFS_RING_H
+
+#include "userfs.h"
+#include <stdint.h>
+
+/**
+ * Submission and completion rings for userfs calls. The caller
+ * fills entries of the submission ring and submits them with one
+ * call. Each entry then gives one entry of the completion ring,
+ * and completions are taken in bulk. The calls run inline, in
+ * ufs_ring_submit(), or on a pool of worker threads of the ring.
+ *
+ * Entries can be linked into a chain, which runs in order. When
+ * a call of a chain fails, the rest is not run and completes with
+ * UFS_ERR_CANCELED. Calls of a chain can take the descriptor
+ * opened earlier in it, so a chain can open a file, use it and
+ * close it in one submission.
+ *
+ * A ring must not be used by several threads at once, each thread
+ * can have its own ring. Descriptors are the usual ones of the
+ * filesystem.
+ */
+struct ufs_ring;
+
+/** Calls of ufs_sqe, each is like the ufs_ call. */
+enum ufs_sqe_op {
+	UFS_SQE_NOP = 0,
+	UFS_SQE_OPEN,
+	UFS_SQE_CLOSE,
+	UFS_SQE_READ,
+	UFS_SQE_WRITE,
+	UFS_SQE_PREAD,
+	UFS_SQE_PWRITE,
+	UFS_SQE_RESIZE,
+};
+
+/** Flags of ufs_sqe. */
+enum ufs_sqe_flags {
+	/**
+	 * The next entry runs after this one and only if this one
+	 * succeeds. A short read or write is a success.
+	 */
+	UFS_SQE_LINK = 1,
+	/**
+	 * The descriptor is the one opened by the last open before
+	 * this entry in its chain. The fd member is ignored.
+	 */
+	UFS_SQE_FD_OPENED = 2,
+};
+
+/** An entry of the submission ring, see ufs_ring_get_sqe(). */
+struct ufs_sqe {
+	enum ufs_sqe_op op;
+	/** A combination of ufs_sqe_flags. */
+	int flags;
+	int fd;
+	/** Path of open. */
+	const char *path;
+	/** Flags of open. */
+	int open_flags;
+	/** Buffer of a read or a write. */
+	void *buf;
+	/** Size of the buffer, or new size of resize. */
+	size_t size;
+	/** File offset of pread and pwrite. */
+	size_t offset;
+	/** Passed to the completion as is. */
+	uint64_t user_data;
+};
+
+/** An entry of the completion ring. */
+struct ufs_cqe {
+	/** user_data of the submitted entry. */
+	uint64_t user_data;
+	/** Result of the call, -1 on error. */
+	ssize_t result;
+	/** Error of the call when the result is -1. */
+	enum ufs_error_code error;
+};
+
+/**
+ * Create a ring.
+ * @param entries Max number of calls submitted or queued and not
+ *        yet taken from the completion ring. Rounded up to a power
+ *        of two.
+ * @param workers Number of worker threads. 0 means the calls run
+ *        inline, in ufs_ring_submit().
+ * @retval not NULL Ring, delete it with ufs_ring_delete().
+ * @retval NULL Not enough memory or threads, or a bad argument.
+ */
+struct ufs_ring *
+ufs_ring_new(unsigned entries, int workers);
+
+/**
+ * Wait for the submitted calls, stop the workers and free the
+ * ring. Descriptors opened through it stay open.
+ */
+void
+ufs_ring_delete(struct ufs_ring *ring);
+
+/**
+ * Get a zeroed entry of the submission ring to fill. It is queued
+ * until ufs_ring_submit().
+ * @retval NULL The ring is full: take completions first.
+ */
+struct ufs_sqe *
+ufs_ring_get_sqe(struct ufs_ring *ring);
+
+/**
+ * Submit the queued entries. The ring owns them from now on and
+ * reuses them after their completions are taken. A chain not
+ * ended by the last queued entry ends there.
+ * @retval Number of submitted entries.
+ */
+int
+ufs_ring_submit(struct ufs_ring *ring);
+
+/**
+ * Take up to @a count completions, waiting until there are at
+ * least @a min of them or all submitted calls are completed.
+ * Chains complete in order, unlinked calls in any order.
+ * @retval Number of taken completions.
+ */
+int
+ufs_ring_wait(struct ufs_ring *ring, struct ufs_cqe *cqes, int count, int min);
+
+#endif /* UFS_RING_H */
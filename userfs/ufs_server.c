@@ -0,0 +1,370 @@
+#define _GNU_SOURCE
+#include "ufs_server.h"
+#include "ufs_proto.h"
+#include "userfs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+enum {
+	/**
+	 * Size of the input buffer of a connection. It fits any
+	 * request with its paths.
+	 */
+	CONN_BUF_SIZE = 64 * 1024,
+	/** Responses are sent when that many are ready. */
+	CONN_BATCH = 256,
+	/**
+	 * Descriptors a hello can bring. It needs one, the room for
+	 * more is to receive and close the extra ones.
+	 */
+	CONN_HELLO_FDS = 8,
+};
+
+/** State of one client. */
+struct conn {
+	int sock;
+	/** Shared region of the client. */
+	char *shm;
+	size_t shm_size;
+	/**
+	 * Descriptors of the client: its descriptor number is an
+	 * index here, -1 marks a free one.
+	 */
+	int *fds;
+	int fd_count;
+	/** Received bytes, the first one is at in_pos. */
+	char in[CONN_BUF_SIZE];
+	size_t in_pos;
+	size_t in_size;
+	/** Responses not sent yet. */
+	struct ufs_proto_response out[CONN_BATCH];
+	int out_count;
+	/** Paths of the current request, terminated. */
+	char path[UFS_PROTO_PATH_MAX + 1];
+	char new_path[UFS_PROTO_PATH_MAX + 1];
+};
+
+/** Write a whole buffer, retrying short writes. */
+static int
+write_all(int sock, const void *buf, size_t size)
+{
+	const char *pos = (const char *)buf;
+	while(size > 0) {
+		ssize_t rc = send(sock, pos, size, MSG_NOSIGNAL);
+		if(rc < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		pos += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+/**
+ * Receive the hello of a client and map its shared region.
+ * @retval 0 Success.
+ * @retval -1 Broken connection or not a client.
+ */
+static int
+conn_handshake(struct conn *conn)
+{
+	struct ufs_proto_hello hello;
+	struct iovec iov = {&hello, sizeof(hello)};
+	char control[CMSG_SPACE(CONN_HELLO_FDS * sizeof(int))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t rc;
+	while((rc = recvmsg(conn->sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+		;
+	/* Keep the first descriptor, close whatever else came */
+	int shm_fd = -1;
+	int fd_count = 0;
+	for(struct cmsghdr *cmsg = rc > 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for(int i = 0; i < count; i++) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+			if(fd_count++ == 0)
+				shm_fd = fd;
+			else
+				close(fd);
+		}
+	}
+	if(shm_fd < 0)
+		return -1;
+	struct ufs_proto_response res = {0, UFS_ERR_NO_ERR, 0};
+	/*
+	 * Memory beyond the end of the memfd would raise SIGBUS, so it
+	 * must be long enough and sealed against shrinking
+	 */
+	struct stat st;
+	int seals = fcntl(shm_fd, F_GET_SEALS);
+	if(rc != sizeof(hello) || hello.magic != UFS_PROTO_MAGIC ||
+	   hello.version != UFS_PROTO_VERSION || hello.shm_size == 0 ||
+	   hello.shm_size > UFS_PROTO_SHM_MAX || fd_count != 1 ||
+	   (msg.msg_flags & MSG_CTRUNC) != 0 || seals < 0 || (seals & F_SEAL_SHRINK) == 0 ||
+	   fstat(shm_fd, &st) != 0 || (uint64_t)st.st_size < hello.shm_size) {
+		res.result = -1;
+		res.error = UFS_ERR_INVALID_ARG;
+	}
+	else {
+		void *shm = mmap(NULL, hello.shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+		if(shm == MAP_FAILED) {
+			res.result = -1;
+			res.error = UFS_ERR_IO;
+		}
+		else {
+			conn->shm = (char *)shm;
+			conn->shm_size = hello.shm_size;
+		}
+	}
+	close(shm_fd);
+	if(write_all(conn->sock, &res, sizeof(res)) != 0)
+		return -1;
+	return res.result;
+}
+
+/** Store a server descriptor, return its number for the client. */
+static int
+conn_fd_add(struct conn *conn, int fd)
+{
+	for(int i = 0; i < conn->fd_count; i++) {
+		if(conn->fds[i] < 0) {
+			conn->fds[i] = fd;
+			return i;
+		}
+	}
+	int new_count = conn->fd_count == 0 ? 16 : conn->fd_count * 2;
+	int *fds = (int *)realloc(conn->fds, new_count * sizeof(int));
+	if(fds == NULL)
+		return -1;
+	for(int i = conn->fd_count; i < new_count; i++)
+		fds[i] = -1;
+	conn->fds = fds;
+	int result = conn->fd_count;
+	conn->fd_count = new_count;
+	conn->fds[result] = fd;
+	return result;
+}
+
+/** Server descriptor of a client descriptor, -1 if there is none. */
+static inline int
+conn_fd(const struct conn *conn, int32_t fd)
+{
+	return fd >= 0 && fd < conn->fd_count ? conn->fds[fd] : -1;
+}
+
+/** Data of a request in the shared region, NULL if it is outside. */
+static char *
+conn_data(const struct conn *conn, const struct ufs_proto_request *req)
+{
+	if(req->shm_offset > conn->shm_size || req->size > conn->shm_size - req->shm_offset)
+		return NULL;
+	return conn->shm + req->shm_offset;
+}
+
+/** Execute a request, @a path and @a new_path are terminated. */
+static void
+conn_execute(struct conn *conn, const struct ufs_proto_request *req,
+	     const char *path, const char *new_path,
+	     struct ufs_proto_response *res)
+{
+	int fd = conn_fd(conn, req->fd);
+	char *data = NULL;
+	int64_t result = -1;
+	switch(req->op) {
+	case UFS_PROTO_READ:
+	case UFS_PROTO_WRITE:
+	case UFS_PROTO_PREAD:
+	case UFS_PROTO_PWRITE:
+		if((data = conn_data(conn, req)) == NULL) {
+			res->result = -1;
+			res->error = UFS_ERR_INVALID_ARG;
+			return;
+		}
+		break;
+	}
+	switch(req->op) {
+	case UFS_PROTO_OPEN:
+		if((fd = ufs_open(path, req->flags)) < 0)
+			break;
+		if((result = conn_fd_add(conn, fd)) < 0) {
+			ufs_close(fd);
+			res->result = -1;
+			res->error = UFS_ERR_NO_MEM;
+			return;
+		}
+		break;
+	case UFS_PROTO_CLOSE:
+		if((result = ufs_close(fd)) == 0)
+			conn->fds[req->fd] = -1;
+		break;
+	case UFS_PROTO_READ:
+		result = ufs_read(fd, data, req->size);
+		break;
+	case UFS_PROTO_WRITE:
+		result = ufs_write(fd, data, req->size);
+		break;
+	case UFS_PROTO_PREAD:
+		result = ufs_pread(fd, data, req->size, req->offset);
+		break;
+	case UFS_PROTO_PWRITE:
+		result = ufs_pwrite(fd, data, req->size, req->offset);
+		break;
+	case UFS_PROTO_RESIZE:
+		result = ufs_resize(fd, req->size);
+		break;
+	case UFS_PROTO_DELETE:
+		result = ufs_delete(path);
+		break;
+	case UFS_PROTO_MKDIR:
+		result = ufs_mkdir(path);
+		break;
+	case UFS_PROTO_RMDIR:
+		result = ufs_rmdir(path, req->flags);
+		break;
+	case UFS_PROTO_RENAME:
+		result = ufs_rename(path, new_path);
+		break;
+	default:
+		res->result = -1;
+		res->error = UFS_ERR_INVALID_ARG;
+		return;
+	}
+	res->result = result;
+	res->error = result < 0 ? ufs_errno() : UFS_ERR_NO_ERR;
+}
+
+static int
+conn_flush(struct conn *conn)
+{
+	int rc = write_all(conn->sock, conn->out, conn->out_count * sizeof(conn->out[0]));
+	conn->out_count = 0;
+	return rc;
+}
+
+/**
+ * Execute all complete requests in the input buffer.
+ * @retval 0 Success.
+ * @retval -1 Broken connection or protocol.
+ */
+static int
+conn_process(struct conn *conn)
+{
+	while(conn->in_size - conn->in_pos >= sizeof(struct ufs_proto_request)) {
+		struct ufs_proto_request req;
+		memcpy(&req, conn->in + conn->in_pos, sizeof(req));
+		if(req.path_len > UFS_PROTO_PATH_MAX || req.new_path_len > UFS_PROTO_PATH_MAX)
+			return -1;
+		size_t size = sizeof(req) + req.path_len + req.new_path_len;
+		if(conn->in_size - conn->in_pos < size)
+			break;
+		const char *pos = conn->in + conn->in_pos + sizeof(req);
+		memcpy(conn->path, pos, req.path_len);
+		conn->path[req.path_len] = 0;
+		memcpy(conn->new_path, pos + req.path_len, req.new_path_len);
+		conn->new_path[req.new_path_len] = 0;
+		conn->in_pos += size;
+		conn_execute(conn, &req, conn->path, conn->new_path,
+			     &conn->out[conn->out_count++]);
+		if(conn->out_count == CONN_BATCH && conn_flush(conn) != 0)
+			return -1;
+	}
+	/* A pipelined batch is answered by one write */
+	if(conn->out_count > 0 && conn_flush(conn) != 0)
+		return -1;
+	memmove(conn->in, conn->in + conn->in_pos, conn->in_size - conn->in_pos);
+	conn->in_size -= conn->in_pos;
+	conn->in_pos = 0;
+	return 0;
+}
+
+static void *
+conn_worker(void *arg)
+{
+	struct conn *conn = (struct conn *)arg;
+	if(conn_handshake(conn) == 0) {
+		for(;;) {
+			ssize_t rc = recv(conn->sock, conn->in + conn->in_size,
+					  sizeof(conn->in) - conn->in_size, 0);
+			if(rc < 0 && errno == EINTR)
+				continue;
+			if(rc <= 0)
+				break;
+			conn->in_size += rc;
+			if(conn_process(conn) != 0)
+				break;
+		}
+	}
+	for(int i = 0; i < conn->fd_count; i++)
+		if(conn->fds[i] >= 0)
+			ufs_close(conn->fds[i]);
+	free(conn->fds);
+	if(conn->shm != NULL)
+		munmap(conn->shm, conn->shm_size);
+	close(conn->sock);
+	free(conn);
+	return NULL;
+}
+
+int
+ufs_server_run(const char *path)
+{
+	struct sockaddr_un addr;
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(sock < 0)
+		return -1;
+	unlink(path);
+	if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 128) != 0) {
+		int err = errno;
+		close(sock);
+		errno = err;
+		return -1;
+	}
+	for(;;) {
+		int client = accept(sock, NULL, NULL);
+		if(client < 0)
+			continue;
+		struct conn *conn = (struct conn *)calloc(1, sizeof(*conn));
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if(conn != NULL) {
+			conn->sock = client;
+			if(pthread_create(&thread, &attr, conn_worker, conn) != 0) {
+				free(conn);
+				conn = NULL;
+			}
+		}
+		pthread_attr_destroy(&attr);
+		if(conn == NULL)
+			close(client);
+	}
+}
@@ -0,0 +1,22 @@
+#ifndef UFS_SERVER_H
+#define UFS_SERVER_H
+
+/**
+ * Server sharing the filesystem of its process with other local
+ * processes, which use it through the client library, see
+ * ufs_client.h. Each connection gets its own thread and its own
+ * descriptor table: descriptors of a client are not visible to
+ * others and are closed when it disconnects. Files, directories
+ * and their data are shared by all.
+ */
+
+/**
+ * Listen on a Unix socket at @a path and serve clients. An old
+ * socket file at the path is replaced.
+ * @retval -1 The socket can not be created, see errno. Otherwise
+ *         it does not return.
+ */
+int
+ufs_server_run(const char *path);
+
+#endif /* UFS_SERVER_H */
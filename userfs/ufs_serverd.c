@@ -0,0 +1,20 @@
+#include "ufs_server.h"
+#include <stdio.h>
+
+/**
+ * userfs daemon: an in-memory filesystem shared by local
+ * processes.
+ *
+ *     ufs_serverd <socket path>
+ */
+int
+main(int argc, char **argv)
+{
+	if(argc != 2) {
+		fprintf(stderr, "Usage: %s <socket path>\n", argv[0]);
+		return 1;
+	}
+	ufs_server_run(argv[1]);
+	perror("ufs_serverd");
+	return 1;
+}
@@ -1,459 +1,5799 @@
+#define _GNU_SOURCE
 #include "userfs.h"
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <time.h>
 
 enum {
-	BLOCK_SIZE = 512,
+	/**
+	 * Files are stored in extents which double in size from
+	 * EXTENT_MIN up to EXTENT_MAX and stay EXTENT_MAX after
+	 * that, see extent_number().
+	 */
+	EXTENT_MIN_SHIFT = 12,
+	EXTENT_MAX_SHIFT = 22,
+	EXTENT_MIN = 1 << EXTENT_MIN_SHIFT,
+	EXTENT_MAX = 1 << EXTENT_MAX_SHIFT,
+	/** How many extents the doubling part of a file has. */
+	EXTENT_GROWING = EXTENT_MAX_SHIFT - EXTENT_MIN_SHIFT + 1,
+	/** The least memory given to an extent, see extent.capacity. */
+	EXTENT_MIN_CAPACITY = 64,
+	/** Extents of this size and more are backed by huge pages. */
+	EXTENT_HUGE = 2 * 1024 * 1024,
 	MAX_FILE_SIZE = 1024 * 1024 * 1024,
 };
 
-/** Global error code. Set from any function on any error. */
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+/**
+ * Error code of the last failed call. Set from any function on
+ * any error. Each thread has its own, like errno.
+ */
+static __thread enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
 
-struct block {
-	/** Block memory. */
-	char *memory;
-	/** How many bytes are occupied. */
-	int occupied;
-	/** Next block in the file. */
-	struct block *next;
-	/** Previous block in the file. */
-	struct block *prev;
+enum {
+	/** Latency of one of each STATS_SAMPLE calls is measured. */
+	STATS_SAMPLE = 16,
+};
 
-	/* PUT HERE OTHER MEMBERS */
+struct stats_op {
+	atomic_uint_least64_t calls;
+	atomic_uint_least64_t errors;
+	atomic_uint_least64_t bytes;
+	atomic_uint_least64_t latency[UFS_LATENCY_BUCKETS];
 };
 
-struct file {
-	/** Double-linked list of file blocks. */
-	struct block *block_list;
+/**
+ * Counters of one thread, see ufs_stats(). Only the owner thread
+ * changes them, so an update is a plain load and store, and
+ * readers sum the counters of all threads. Object counters are
+ * changes made by the thread: it can free more than it created,
+ * then they wrap around, and the sum is still right.
+ */
+struct stats_thread {
+	struct stats_op ops[UFS_OP_COUNT];
+	atomic_uint_least64_t files;
+	atomic_uint_least64_t dirs;
+	atomic_uint_least64_t extents;
+	atomic_uint_least64_t meta_bytes;
+	struct stats_thread *prev;
+	struct stats_thread *next;
+};
+
+static struct {
+	/** Protects the list and retired. */
+	pthread_mutex_t lock;
+	/** Its destructor retires counters of an exiting thread. */
+	pthread_key_t key;
+	struct stats_thread *threads;
+	/** Sums of the exited threads. */
+	struct stats_thread retired;
 	/**
-	 * Last block in the list above for fast access to the end
-	 * of file.
+	 * Counters of threads which failed to allocate their own.
+	 * Updates of such threads can be lost, but nothing else.
 	 */
-	struct block *last_block;
-	/** How many file descriptors are opened on the file. */
-	int refs;
-	/** File name. */
-	const char *name;
-	/** Files are stored in a double-linked list. */
-	struct file *next;
-	struct file *prev;
-	/** How many bytes are occupied. */
-	int occupied;
-	/* A flag indicating that this file should be deleted */
-	int deleted;
-	
+	struct stats_thread shared;
+} stats = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static __thread struct stats_thread *stats_self;
+
+static inline void
+stats_add(atomic_uint_least64_t *counter, uint64_t value)
+{
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static inline uint64_t
+stats_get(const atomic_uint_least64_t *counter)
+{
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/** Add all counters of @a src to @a dst. */
+static void
+stats_fold(struct stats_thread *dst, const struct stats_thread *src)
+{
+	for(int i = 0; i < UFS_OP_COUNT; i++) {
+		stats_add(&dst->ops[i].calls, stats_get(&src->ops[i].calls));
+		stats_add(&dst->ops[i].errors, stats_get(&src->ops[i].errors));
+		stats_add(&dst->ops[i].bytes, stats_get(&src->ops[i].bytes));
+		for(int j = 0; j < UFS_LATENCY_BUCKETS; j++)
+			stats_add(&dst->ops[i].latency[j], stats_get(&src->ops[i].latency[j]));
+	}
+	stats_add(&dst->files, stats_get(&src->files));
+	stats_add(&dst->dirs, stats_get(&src->dirs));
+	stats_add(&dst->extents, stats_get(&src->extents));
+	stats_add(&dst->meta_bytes, stats_get(&src->meta_bytes));
+}
+
+static void
+stats_thread_exit(void *arg)
+{
+	struct stats_thread *self = (struct stats_thread *)arg;
+	pthread_mutex_lock(&stats.lock);
+	stats_fold(&stats.retired, self);
+	if(self->prev != NULL)
+		self->prev->next = self->next;
+	else
+		stats.threads = self->next;
+	if(self->next != NULL)
+		self->next->prev = self->prev;
+	pthread_mutex_unlock(&stats.lock);
+	free(self);
+	stats_self = NULL;
+}
+
+static void
+stats_init(void)
+{
+	pthread_key_create(&stats.key, stats_thread_exit);
+}
+
+/** Counters of the current thread, created on its first call. */
+static inline struct stats_thread *
+stats_thread(void)
+{
+	struct stats_thread *self = stats_self;
+	if(self != NULL)
+		return self;
+	pthread_once(&stats_once, stats_init);
+	/* Not meta_alloc(), it counts into the counters */
+	self = (struct stats_thread *)calloc(1, sizeof(*self));
+	if(self == NULL)
+		return &stats.shared;
+	pthread_mutex_lock(&stats.lock);
+	self->next = stats.threads;
+	if(stats.threads != NULL)
+		stats.threads->prev = self;
+	stats.threads = self;
+	pthread_mutex_unlock(&stats.lock);
+	pthread_setspecific(stats.key, self);
+	stats_self = self;
+	return self;
+}
+
+static inline uint64_t
+stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Begin a call of @a op.
+ * @return Start time to pass to stats_finish(), 0 if the call is
+ *         not in the latency sample.
+ */
+static inline uint64_t
+stats_start(enum ufs_op op)
+{
+	struct stats_thread *self = stats_thread();
+	if(stats_get(&self->ops[op].calls) % STATS_SAMPLE != 0)
+		return 0;
+	return stats_now();
+}
+
+/**
+ * Account a finished call of @a op.
+ * @param rc Result of the call, an error if it is negative.
+ * @param data The result is a count of moved bytes.
+ */
+static inline void
+stats_finish(enum ufs_op op, uint64_t start, ssize_t rc, bool data)
+{
+	struct stats_op *counters = &stats_thread()->ops[op];
+	stats_add(&counters->calls, 1);
+	if(rc < 0)
+		stats_add(&counters->errors, 1);
+	else if(data)
+		stats_add(&counters->bytes, rc);
+	if(start != 0) {
+		uint64_t ns = stats_now() - start;
+		int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+		if(bucket >= UFS_LATENCY_BUCKETS)
+			bucket = UFS_LATENCY_BUCKETS - 1;
+		stats_add(&counters->latency[bucket], 1);
+	}
+}
+
+/**
+ * Slab allocator for extent pages and metadata. Objects of one size
+ * are carved from SLAB_SIZE chunks aligned by their size, so the
+ * chunk header is found from an object pointer by masking. Each
+ * chunk keeps its own free list and a count of used objects; a
+ * cache keeps the chunks which have free objects. A chunk which
+ * becomes empty goes back to the system unless it is the only
+ * spare one, so deleting a file releases its memory instead of
+ * leaving it fragmented over the heap.
+ */
+enum {
+	SLAB_SIZE = 64 * 1024,
+	/** Metadata size classes are powers of two from 32 to 2048. */
+	SLAB_MIN_CLASS = 5,
+	SLAB_MAX_CLASS = 11,
+	SLAB_ALIGN = 16,
+};
+
+struct slab_cache;
+
+struct slab {
+	struct slab_cache *cache;
+	/** Neighbours in the cache list of slabs with free objects. */
+	struct slab *next;
+	struct slab *prev;
+	/** Freed objects of this slab. */
+	void *free_list;
+	/** Start of never used space. */
+	char *unused;
+	/** How many objects are allocated. */
+	uint32_t used;
+	/** How many objects fit into the slab. */
+	uint32_t capacity;
+};
+
+struct slab_cache {
+	/** Protects everything below and the slabs of the cache. */
+	pthread_mutex_t lock;
+	/** Size of one object. */
+	size_t object_size;
+	/** Where objects start in a slab, aligned like objects. */
+	size_t header_size;
+	/** Slabs having free objects. */
+	struct slab *partial;
+	/** Number of completely free slabs in the list above. */
+	int empty_count;
+	/** How many slabs are allocated, for memory accounting. */
+	size_t slab_count;
+};
+
+/** Create a cache of objects aligned by @a align, a power of two. */
+static void
+slab_cache_create(struct slab_cache *cache, size_t object_size, size_t align)
+{
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->object_size = (object_size + align - 1) & ~(align - 1);
+	cache->header_size = (sizeof(struct slab) + align - 1) & ~(align - 1);
+	cache->partial = NULL;
+	cache->empty_count = 0;
+	cache->slab_count = 0;
+}
+
+static void
+slab_list_remove(struct slab_cache *cache, struct slab *slab)
+{
+	if(slab->prev != NULL)
+		slab->prev->next = slab->next;
+	else
+		cache->partial = slab->next;
+	if(slab->next != NULL)
+		slab->next->prev = slab->prev;
+	slab->next = slab->prev = NULL;
+}
+
+static void
+slab_list_add(struct slab_cache *cache, struct slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = cache->partial;
+	if(cache->partial != NULL)
+		cache->partial->prev = slab;
+	cache->partial = slab;
+}
+
+/**
+ * Map memory for a new slab. Slabs bypass malloc(): aligned
+ * allocations leave holes in its heap, and a freed slab should
+ * return to the system right away.
+ */
+static void *
+slab_map(void)
+{
+	/* Map twice as much and trim the ends to get the alignment */
+	char *mem = (char *)mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mem == MAP_FAILED)
+		return NULL;
+	char *aligned = (char *)(((uintptr_t)mem + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+	if(aligned > mem)
+		munmap(mem, aligned - mem);
+	munmap(aligned + SLAB_SIZE, mem + SLAB_SIZE - aligned);
+	return aligned;
+}
+
+/** Allocate an object from the cache, NULL if out of memory. */
+static void *
+slab_alloc(struct slab_cache *cache)
+{
+	pthread_mutex_lock(&cache->lock);
+	struct slab *slab = cache->partial;
+	if(slab == NULL) {
+		void *mem = slab_map();
+		if(mem == NULL) {
+			pthread_mutex_unlock(&cache->lock);
+			return NULL;
+		}
+		slab = (struct slab *)mem;
+		slab->cache = cache;
+		slab->free_list = NULL;
+		slab->unused = (char *)mem + cache->header_size;
+		slab->used = 0;
+		slab->capacity = (SLAB_SIZE - cache->header_size) / cache->object_size;
+		slab_list_add(cache, slab);
+		cache->slab_count ++;
+	}
+	else if(slab->used == 0) {
+		cache->empty_count --;
+	}
+	void *object;
+	if(slab->free_list != NULL) {
+		object = slab->free_list;
+		slab->free_list = *(void **)object;
+	}
+	else {
+		object = slab->unused;
+		slab->unused += cache->object_size;
+	}
+	if(++slab->used == slab->capacity)
+		slab_list_remove(cache, slab);
+	pthread_mutex_unlock(&cache->lock);
+	return object;
+}
+
+/** Return an object to its slab. */
+static void
+slab_free(void *object)
+{
+	struct slab *slab = (struct slab *)((uintptr_t)object & ~(uintptr_t)(SLAB_SIZE - 1));
+	struct slab_cache *cache = slab->cache;
+	pthread_mutex_lock(&cache->lock);
+	*(void **)object = slab->free_list;
+	slab->free_list = object;
+	if(slab->used-- == slab->capacity)
+		slab_list_add(cache, slab);
+	if(slab->used == 0) {
+		/* Keep one spare slab to avoid ping-pong with the system */
+		if(cache->empty_count > 0) {
+			slab_list_remove(cache, slab);
+			cache->slab_count --;
+			munmap(slab, SLAB_SIZE);
+		}
+		else {
+			cache->empty_count ++;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Caches for metadata of variable size, one per power of two.
+ * Created in ufs_init().
+ */
+static struct slab_cache size_classes[SLAB_MAX_CLASS - SLAB_MIN_CLASS + 1];
+
+static struct slab_cache *
+size_class(size_t size)
+{
+	if(size > ((size_t)1 << SLAB_MAX_CLASS))
+		return NULL;
+	int cls = SLAB_MIN_CLASS;
+	while(((size_t)1 << cls) < size)
+		cls ++;
+	return &size_classes[cls - SLAB_MIN_CLASS];
+}
+
+/**
+ * Allocate metadata of the given size. Sizes above the largest
+ * class go to malloc(), so the same size has to be passed to
+ * meta_free().
+ */
+static void *
+meta_alloc(size_t size)
+{
+	struct slab_cache *cache = size_class(size);
+	void *ptr = cache == NULL ? malloc(size) : slab_alloc(cache);
+	if(ptr != NULL)
+		stats_add(&stats_thread()->meta_bytes, cache == NULL ? size : cache->object_size);
+	return ptr;
+}
+
+static void
+meta_free(void *ptr, size_t size)
+{
+	struct slab_cache *cache = size_class(size);
+	stats_add(&stats_thread()->meta_bytes, -(cache == NULL ? size : cache->object_size));
+	if(cache == NULL)
+		free(ptr);
+	else
+		slab_free(ptr);
+}
+
+struct image_map;
+
+/**
+ * A part of a file. Extent n covers bytes from extent_start(n)
+ * to extent_start(n) + extent_span(n) of its file. Memory of
+ * extents bigger than a page is mapped for the whole span at
+ * once: pages take no memory until touched. Memory of smaller
+ * ones starts shorter and grows by doubling, so small files stay
+ * small. As everywhere in a file, bytes after its end are zeros.
+ */
+struct extent {
+	/**
+	 * The extent index holds one reference, views of the data
+	 * hold more. An extent referenced more than once is never
+	 * changed in place, a writer replaces it with a copy.
+	 */
+	atomic_int refs;
+	/**
+	 * Image the extent is saved in, 0 if it is not saved or
+	 * was changed after that. See image_off.
+	 */
+	uint32_t image_id;
+	/** Offset of the saved copy in the image file. */
+	uint64_t image_off;
+	/** Size of the saved copy, the rest of the extent is zeros. */
+	uint32_t image_size;
+	/**
+	 * Mapping of the image file the data lies in, NULL when
+	 * the data is owned. Mapped extents are never written, a
+	 * writer replaces them with a copy.
+	 */
+	struct image_map *map;
+	/**
+	 * Extent data, bytes from capacity to the span are zeros.
+	 * NULL when the extent is packed.
+	 */
+	char *data;
+	/** Size of data, at most the extent span. */
+	uint32_t capacity;
+	/**
+	 * Compressed data of a cold extent, see ufs_compress_cold(),
+	 * or NULL if the packed data is spilled. A packed extent is
+	 * never changed, a reader or a writer replaces it with an
+	 * unpacked copy.
+	 */
+	char *packed;
+	/**
+	 * Size of the packed data. Spilled data can be not
+	 * compressed, then it equals packed_used.
+	 */
+	uint32_t packed_size;
+	/** How many first bytes were packed, the rest are zeros. */
+	uint32_t packed_used;
+	/**
+	 * The packed data was evicted to the spill file at
+	 * spill_off, see memory_make_room().
+	 */
+	bool spilled;
+	uint64_t spill_off;
+	/** Accessed since the last compression pass. */
+	atomic_bool touched;
+	/** The last pass found the data not worth packing. */
+	bool incompressible;
+	/**
+	 * Mappings of the data, see ufs_mmap(). Their memory is the
+	 * data, so a mapped extent is changed in place even when it
+	 * is shared, and is never moved or replaced while mapped.
+	 */
+	atomic_int mmaps;
+
 	/* PUT HERE OTHER MEMBERS */
 };
 
-/** List of all files. */
-static struct file *file_list = NULL;
+/** Counters of packed extents, see struct ufs_compress_stats. */
+static struct {
+	atomic_size_t extents;
+	atomic_size_t raw_bytes;
+	atomic_size_t packed_bytes;
+	atomic_uint_least64_t compressions;
+	atomic_uint_least64_t hits;
+	atomic_uint_least64_t rejects;
+} pack_stats;
+
+/**
+ * Memory of file data, packed data included, and its limit set
+ * by ufs_set_memory_limit().
+ */
+static struct {
+	/** Serializes evictions. */
+	pthread_mutex_t reclaim_lock;
+	atomic_size_t used;
+	/** 0 if there is no limit. */
+	atomic_size_t limit;
+	atomic_size_t spilled_extents;
+	atomic_size_t spilled_bytes;
+	atomic_uint_least64_t evictions;
+	atomic_uint_least64_t faults;
+} memory = {PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0, 0};
+
+/** Whether @a size more bytes fit into the limit. */
+static inline bool
+memory_fits(size_t size)
+{
+	size_t limit = atomic_load_explicit(&memory.limit, memory_order_relaxed);
+	return limit == 0 || atomic_load_explicit(&memory.used, memory_order_relaxed) + size <= limit;
+}
+
+/**
+ * Account @a size bytes of new data memory.
+ * @retval false The limit does not allow it.
+ */
+static bool
+memory_charge(size_t size)
+{
+	size_t limit = atomic_load_explicit(&memory.limit, memory_order_relaxed);
+	size_t used = atomic_fetch_add_explicit(&memory.used, size, memory_order_relaxed) + size;
+	if(limit != 0 && used > limit) {
+		atomic_fetch_sub_explicit(&memory.used, size, memory_order_relaxed);
+		return false;
+	}
+	return true;
+}
+
+static inline void
+memory_uncharge(size_t size)
+{
+	atomic_fetch_sub_explicit(&memory.used, size, memory_order_relaxed);
+}
+
+enum {
+	/** Spill file slots are powers of two from 512 bytes to EXTENT_MAX. */
+	SPILL_MIN_SHIFT = 9,
+	SPILL_CLASSES = EXTENT_MAX_SHIFT - SPILL_MIN_SHIFT + 1,
+};
+
+/**
+ * The file evicted data goes to. It is unlinked right after
+ * creation, so it disappears with the process. Space is given in
+ * power of two slots, freed slots are kept in lists by size and
+ * reused.
+ */
+static struct {
+	/** Protects the slots. */
+	pthread_mutex_t lock;
+	/** -1 while there is no spill file. */
+	atomic_int fd;
+	/** Where the next new slot goes. */
+	uint64_t end;
+	struct {
+		uint64_t *offsets;
+		size_t count;
+		size_t capacity;
+	} free[SPILL_CLASSES];
+} spill = {PTHREAD_MUTEX_INITIALIZER, -1, 0, {{NULL, 0, 0}}};
+
+static int
+spill_class(size_t size)
+{
+	int cls = 0;
+	while(((size_t)1 << (SPILL_MIN_SHIFT + cls)) < size)
+		cls++;
+	return cls;
+}
+
+/**
+ * Get a slot for @a size bytes.
+ * @retval UINT64_MAX There is no spill file.
+ */
+static uint64_t
+spill_alloc(size_t size)
+{
+	int cls = spill_class(size);
+	uint64_t offset = UINT64_MAX;
+	pthread_mutex_lock(&spill.lock);
+	if(spill.free[cls].count > 0) {
+		offset = spill.free[cls].offsets[--spill.free[cls].count];
+	}
+	else if(atomic_load(&spill.fd) >= 0) {
+		offset = spill.end;
+		spill.end += (size_t)1 << (SPILL_MIN_SHIFT + cls);
+	}
+	pthread_mutex_unlock(&spill.lock);
+	return offset;
+}
+
+static void
+spill_free(uint64_t offset, size_t size)
+{
+	int cls = spill_class(size);
+	pthread_mutex_lock(&spill.lock);
+	if(spill.free[cls].count == spill.free[cls].capacity) {
+		size_t capacity = spill.free[cls].capacity == 0 ? 64 : spill.free[cls].capacity * 2;
+		uint64_t *offsets = (uint64_t *)realloc(spill.free[cls].offsets, capacity * sizeof(uint64_t));
+		/* Without memory the slot is lost, only disk space is wasted */
+		if(offsets != NULL) {
+			spill.free[cls].offsets = offsets;
+			spill.free[cls].capacity = capacity;
+		}
+	}
+	if(spill.free[cls].count < spill.free[cls].capacity)
+		spill.free[cls].offsets[spill.free[cls].count++] = offset;
+	pthread_mutex_unlock(&spill.lock);
+}
+
+/**
+ * Read or write @a size bytes of the spill file at @a offset,
+ * retrying short transfers.
+ * @retval 0 Success.
+ * @retval -1 IO error.
+ */
+static int
+spill_io(char *buf, size_t size, uint64_t offset, bool write)
+{
+	int fd = atomic_load(&spill.fd);
+	while(size > 0) {
+		ssize_t rc = write ? pwrite(fd, buf, size, offset) : pread(fd, buf, size, offset);
+		if(rc < 0 && errno == EINTR)
+			continue;
+		if(rc <= 0)
+			return -1;
+		buf += rc;
+		size -= rc;
+		offset += rc;
+	}
+	return 0;
+}
+
+/** Page-sized extent memory, smaller sizes use metadata classes. */
+static struct slab_cache page_cache;
+
+/**
+ * Zeros to read from missing extents and beyond the memory of
+ * existing ones. Mapped at init, it takes no memory.
+ */
+static const char *zero_data;
+
+/**
+ * Number of the extent holding the byte at @a offset. Extents
+ * 0 and 1 have EXTENT_MIN bytes, each next one is twice bigger
+ * up to EXTENT_MAX, so extent n > 0 starts at its own size.
+ * Then all extents have EXTENT_MAX bytes. A 1GB file has 266
+ * extents.
+ */
+static inline size_t
+extent_number(size_t offset)
+{
+	if(offset < EXTENT_MIN)
+		return 0;
+	if(offset < EXTENT_MAX)
+		return (63 - __builtin_clzll(offset)) - EXTENT_MIN_SHIFT + 1;
+	return EXTENT_GROWING - 1 + offset / EXTENT_MAX;
+}
+
+/** Offset of the first byte of extent @a n. */
+static inline size_t
+extent_start(size_t n)
+{
+	if(n == 0)
+		return 0;
+	if(n < EXTENT_GROWING)
+		return (size_t)1 << (EXTENT_MIN_SHIFT + n - 1);
+	return (n - (EXTENT_GROWING - 1)) * EXTENT_MAX;
+}
+
+/** Number of bytes extent @a n covers. */
+static inline size_t
+extent_span(size_t n)
+{
+	if(n == 0)
+		return EXTENT_MIN;
+	if(n < EXTENT_GROWING)
+		return extent_start(n);
+	return EXTENT_MAX;
+}
+
+enum {
+	/** The shortest match the codec looks for. */
+	LZ_MIN_MATCH = 4,
+	/** Matches are searched this far back. */
+	LZ_MAX_OFFSET = 65535,
+	LZ_HASH_BITS = 12,
+};
+
+static inline uint32_t
+lz_load32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/**
+ * Append a length which did not fit into a token nibble: bytes
+ * of 255 and the remainder.
+ * @retval NULL The output is full.
+ */
+static inline uint8_t *
+lz_put_length(uint8_t *out, const uint8_t *out_end, size_t len)
+{
+	for(; len >= 255; len -= 255) {
+		if(out == out_end)
+			return NULL;
+		*out++ = 255;
+	}
+	if(out == out_end)
+		return NULL;
+	*out++ = (uint8_t)len;
+	return out;
+}
+
+/**
+ * Append a sequence: literals copied as is, then a match of
+ * @a match_len bytes found @a offset bytes back. The last
+ * sequence has only literals.
+ * @retval NULL The output is full.
+ */
+static uint8_t *
+lz_put_sequence(uint8_t *out, const uint8_t *out_end, const uint8_t *lit,
+		size_t lit_len, size_t offset, size_t match_len)
+{
+	if(out == out_end)
+		return NULL;
+	uint8_t *token = out++;
+	size_t match_code = match_len == 0 ? 0 : match_len - LZ_MIN_MATCH;
+	*token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4 |
+			   (match_code < 15 ? match_code : 15));
+	if(lit_len >= 15 && (out = lz_put_length(out, out_end, lit_len - 15)) == NULL)
+		return NULL;
+	if((size_t)(out_end - out) < lit_len)
+		return NULL;
+	memcpy(out, lit, lit_len);
+	out += lit_len;
+	if(match_len == 0)
+		return out;
+	if(out_end - out < 2)
+		return NULL;
+	*out++ = (uint8_t)offset;
+	*out++ = (uint8_t)(offset >> 8);
+	if(match_code >= 15)
+		out = lz_put_length(out, out_end, match_code - 15);
+	return out;
+}
+
+/**
+ * Compress @a size bytes with a fast LZ77 codec in the LZ4
+ * style: a hash table of recent positions finds 4-byte matches,
+ * which are extended as far as they go. Data without matches is
+ * skipped faster and faster, so incompressible data costs little.
+ * @retval > 0 Size of the compressed data.
+ * @retval 0 It does not fit into @a capacity bytes.
+ */
+static size_t
+lz_compress(const char *src, size_t size, char *dst, size_t capacity)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+	const uint8_t *in = (const uint8_t *)src;
+	const uint8_t *end = in + size;
+	const uint8_t *anchor = in;
+	const uint8_t *p = in;
+	uint8_t *out = (uint8_t *)dst;
+	const uint8_t *out_end = out + capacity;
+	while(end - p >= LZ_MIN_MATCH) {
+		uint32_t seq = lz_load32(p);
+		uint32_t hash = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+		const uint8_t *ref = in + table[hash];
+		table[hash] = p - in;
+		if(ref >= p || p - ref > LZ_MAX_OFFSET || lz_load32(ref) != seq) {
+			p += 1 + ((p - anchor) >> 6);
+			continue;
+		}
+		const uint8_t *m = p + LZ_MIN_MATCH;
+		const uint8_t *r = ref + LZ_MIN_MATCH;
+		while(end - m >= 8) {
+			uint64_t a, b;
+			memcpy(&a, m, 8);
+			memcpy(&b, r, 8);
+			if(a != b) {
+				m += __builtin_ctzll(a ^ b) / 8;
+				break;
+			}
+			m += 8;
+			r += 8;
+		}
+		if(end - m < 8) {
+			while(m < end && *m == *r) {
+				m++;
+				r++;
+			}
+		}
+		out = lz_put_sequence(out, out_end, anchor, p - anchor, p - ref, m - p);
+		if(out == NULL)
+			return 0;
+		p = anchor = m;
+	}
+	out = lz_put_sequence(out, out_end, anchor, end - anchor, 0, 0);
+	return out == NULL ? 0 : out - (uint8_t *)dst;
+}
+
+/** Read a length continued after a token nibble. */
+static inline const uint8_t *
+lz_get_length(const uint8_t *in, const uint8_t *in_end, size_t *len)
+{
+	uint8_t b;
+	do {
+		if(in == in_end)
+			return NULL;
+		b = *in++;
+		*len += b;
+	} while(b == 255);
+	return in;
+}
+
+/**
+ * Decompress data of lz_compress() which must unpack into
+ * exactly @a size bytes.
+ * @retval 0 Success.
+ * @retval -1 The data is corrupted.
+ */
+static int
+lz_decompress(const char *src, size_t src_size, char *dst, size_t size)
+{
+	const uint8_t *in = (const uint8_t *)src;
+	const uint8_t *in_end = in + src_size;
+	uint8_t *out = (uint8_t *)dst;
+	uint8_t *out_end = out + size;
+	while(in < in_end) {
+		uint8_t token = *in++;
+		size_t lit_len = token >> 4;
+		if(lit_len == 15 && (in = lz_get_length(in, in_end, &lit_len)) == NULL)
+			return -1;
+		if((size_t)(in_end - in) < lit_len || (size_t)(out_end - out) < lit_len)
+			return -1;
+		memcpy(out, in, lit_len);
+		in += lit_len;
+		out += lit_len;
+		if(in == in_end)
+			break;
+		if(in_end - in < 2)
+			return -1;
+		size_t offset = in[0] | (size_t)in[1] << 8;
+		in += 2;
+		size_t match_len = token & 15;
+		if(match_len == 15 && (in = lz_get_length(in, in_end, &match_len)) == NULL)
+			return -1;
+		match_len += LZ_MIN_MATCH;
+		if(offset == 0 || offset > (size_t)(out - (uint8_t *)dst) ||
+		   (size_t)(out_end - out) < match_len)
+			return -1;
+		const uint8_t *ref = out - offset;
+		if(offset >= match_len) {
+			memcpy(out, ref, match_len);
+		}
+		else if(offset == 1) {
+			memset(out, *ref, match_len);
+		}
+		else {
+			for(size_t i = 0; i < match_len; i++)
+				out[i] = ref[i];
+		}
+		out += match_len;
+	}
+	return out == out_end ? 0 : -1;
+}
+
+enum {
+	RADIX_SHIFT = 6,
+	RADIX_FANOUT = 1 << RADIX_SHIFT,
+	RADIX_MASK = RADIX_FANOUT - 1,
+};
+
+/**
+ * A node of a file extent index. The index is a radix tree
+ * keyed by extent number: a tree of height h covers
+ * RADIX_FANOUT^h extents, inner nodes point to nodes of the next
+ * level and the nodes of level 1 point to extents. So any extent
+ * of a 1GB file is found in at most 2 steps.
+ */
+struct radix_node {
+	void *slots[RADIX_FANOUT];
+};
+
+/**
+ * Locking. A file is protected by its rwlock: reads take it
+ * shared, anything changing data or size takes it exclusively.
+ * Names are protected by the locks of name index shards, the
+ * descriptor table is read without locks. Lock order is: a
+ * descriptor pos_lock, then a file lock, then a file desc_lock.
+ */
+struct file {
+	/** Protects extents and size. */
+	pthread_rwlock_t lock;
+	/** Root of the extent index. */
+	struct radix_node *root;
+	/** Height of the extent index, 0 for an empty file. */
+	int height;
+	/**
+	 * File size in bytes. Changed under the exclusive lock, or
+	 * under the shared one by appends, see file_append_shared().
+	 */
+	atomic_size_t size;
+	/**
+	 * End of the space reserved by appends in progress, equals
+	 * size when there are none.
+	 */
+	atomic_size_t append_end;
+	/** Appends in progress under the shared lock. */
+	atomic_int appenders;
+	/**
+	 * Holders of the shared lock which share the extents, so
+	 * appends must not write them in place meanwhile. New
+	 * appends take the exclusive lock while there are any.
+	 */
+	atomic_int append_blockers;
+	/**
+	 * How many file descriptors are opened on the file, plus
+	 * one while the file has a name. The file is freed when
+	 * it drops to zero, so a deleted file lives until its
+	 * last descriptor is closed.
+	 */
+	atomic_int refs;
+	/** Protects desc_list. */
+	pthread_mutex_t desc_lock;
+	/** Descriptors opened on the file. */
+	struct filedesc *desc_list;
+	/** Cached hash of the name, see name_index. */
+	uint32_t hash;
+	/** Entries of a directory, NULL for a regular file. */
+	struct dir *dir;
+	/**
+	 * Name in the parent directory. Changed only by rename,
+	 * under the lock of the index holding the file.
+	 */
+	char *name;
+	/**
+	 * The file can have packed extents, so readers look for
+	 * them in their range first. Set under the exclusive lock.
+	 */
+	bool has_packed;
+	/** Data of a pinned file is never packed or spilled. */
+	bool pinned;
+	/** Neighbours in the eviction clock, see clock_ring. */
+	struct file *clock_prev;
+	struct file *clock_next;
+	
+	/* PUT HERE OTHER MEMBERS */
+};
+
+struct filedesc {
+	struct file *file;
+	/**
+	 * Serializes calls using the position, so that two threads
+	 * reading one descriptor get different data.
+	 */
+	pthread_mutex_t pos_lock;
+	/*
+	 * The position of the filedescriptor in the file. Changed
+	 * under pos_lock and a shared file lock, or under an
+	 * exclusive file lock.
+	 */
+	size_t pos;
+	/* A regime of the work */
+	int regime;
+	/**
+	 * The table slot holds one reference, each call using the
+	 * descriptor holds one more, so a close does not free it
+	 * under a running call. The memory of a closed descriptor is
+	 * kept for reuse and never freed, a late fd_get() can still
+	 * look at the counter.
+	 */
+	atomic_int refs;
+	/** Other descriptors of the same file, or free ones. */
+	struct filedesc *next;
+	struct filedesc *prev;
+	/* PUT HERE OTHER MEMBERS */
+};
+
+/**
+ * Open-addressing hash table of directory entries keyed by name. Linear
+ * probing over a power-of-two array; deletion shifts the
+ * following entries back, so there are no tombstones and a
+ * lookup stops at the first empty slot. Each slot caches the
+ * name hash, so strcmp() is called only for real candidates.
+ */
+struct name_slot {
+	/** Hash of the entry name. */
+	uint32_t hash;
+	/** The file, or NULL if the slot is empty. */
+	struct file *file;
+};
+
+struct name_index {
+	struct name_slot *slots;
+	/** Number of slots, always a power of two. */
+	uint32_t capacity;
+	/** Number of occupied slots. */
+	uint32_t count;
+};
+
+enum {
+	NAME_INDEX_MIN_CAPACITY = 64,
+	/** Must be a power of two. */
+	NAME_SHARD_COUNT = 16,
+};
+
+/**
+ * A part of a directory index. The entries of a directory are
+ * split into shards by the high bits of the name hash, each shard
+ * has its own index and lock, so lookups of different names
+ * rarely meet on one lock and lookups of the same name do not
+ * block each other. Only the root, where flat workloads put all
+ * their files, has many shards, other directories have one.
+ */
+struct name_shard {
+	pthread_rwlock_t lock;
+	struct name_index index;
+	/** Shards of the root do not share cache lines. */
+	char padding[128 - sizeof(pthread_rwlock_t) - sizeof(struct name_index)];
+};
+
+/** Shards of the root directory. */
+static struct name_shard name_shards[NAME_SHARD_COUNT] __attribute__((aligned(64)));
+
+struct dir {
+	/** Index of the entries. */
+	struct name_shard *shards;
+	/** Number of shards minus one. */
+	uint32_t shard_mask;
+	/**
+	 * Set when the directory is deleted, before its entries
+	 * are taken out of the shards. Nothing can be created in
+	 * it then.
+	 */
+	atomic_bool dead;
+	/**
+	 * The top of a tree: of the filesystem, of a snapshot or of
+	 * one being built. A root is owned by its tree, path lookups
+	 * return it without a reference, see lookup_unref().
+	 */
+	bool is_root;
+	/**
+	 * The directory holding this one, NULL for a root. It does
+	 * not hold a reference and is changed only under
+	 * namespace_lock.
+	 */
+	struct file *parent;
+};
+
+/** The root directory, its shards are name_shards. */
+static struct file *root_dir;
+
+/**
+ * Serializes changes touching more than one directory: renames,
+ * removal of directory trees and replacement of the whole
+ * namespace, as well as snapshots, which lock all directories at
+ * once. It is taken before any directory lock.
+ */
+static pthread_mutex_t namespace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Bumped after every change which can make a path lead to another
+ * directory or nowhere: a rename or removal of a directory, or
+ * replacement of the namespace. Validates the path cache.
+ */
+static _Atomic uint64_t namespace_gen = 1;
+
+enum {
+	/** Number of path cache entries, a power of two. */
+	PATH_CACHE_SIZE = 1024,
+};
+
+/**
+ * Directories found by path, so that repeated opens of files deep
+ * in the tree do not walk and lock every directory on the way. It
+ * is a direct-mapped table keyed by the path of a directory. An
+ * entry is valid only if no directory was renamed or removed
+ * since it was made.
+ */
+struct path_cache_entry {
+	pthread_mutex_t lock;
+	/** namespace_gen read before the path was walked. */
+	uint64_t gen;
+	uint32_t hash;
+	/** The path, not terminated. */
+	char *path;
+	size_t len;
+	/** The directory, referenced. */
+	struct file *dir;
+};
+
+static struct path_cache_entry path_cache[PATH_CACHE_SIZE];
+
+static inline struct name_shard *
+dir_shard(const struct dir *dir, uint32_t hash)
+{
+	return &dir->shards[hash >> 28 & dir->shard_mask];
+}
+
+/** FNV-1a hash of a name of @a len bytes. */
+static uint32_t
+name_hash(const char *name, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for(size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+ * Find a slot holding an entry with the given name of @a len
+ * bytes.
+ * @retval >= 0 Slot number.
+ * @retval -1 No such entry.
+ */
+static int64_t
+name_index_find(const struct name_index *index, const char *name, size_t len, uint32_t hash)
+{
+	if(index->count == 0)
+		return -1;
+	uint32_t mask = index->capacity - 1;
+	for(uint32_t i = hash & mask; index->slots[i].file != NULL; i = (i + 1) & mask) {
+		const char *other = index->slots[i].file->name;
+		if(index->slots[i].hash == hash && strncmp(other, name, len) == 0 && other[len] == 0)
+			return i;
+	}
+	return -1;
+}
+
+/** Put a file into the table without checking for duplicates. */
+static void
+name_index_place(struct name_slot *slots, uint32_t capacity, struct file *file)
+{
+	uint32_t mask = capacity - 1;
+	uint32_t i = file->hash & mask;
+	while(slots[i].file != NULL)
+		i = (i + 1) & mask;
+	slots[i].hash = file->hash;
+	slots[i].file = file;
+}
+
+/**
+ * Grow the index if needed, so that one more entry can be
+ * inserted keeping the load factor below 3/4.
+ * @retval 0 Success.
+ * @retval -1 Not enough memory.
+ */
+static int
+name_index_reserve(struct name_index *index)
+{
+	if((index->count + 1) * 4 > index->capacity * 3) {
+		uint32_t new_capacity = index->capacity == 0 ? NAME_INDEX_MIN_CAPACITY : index->capacity * 2;
+		struct name_slot *new_slots = (struct name_slot *)calloc(new_capacity, sizeof(struct name_slot));
+		if(new_slots == NULL)
+			return -1;
+		for(uint32_t i = 0; i < index->capacity; i++)
+			if(index->slots[i].file != NULL)
+				name_index_place(new_slots, new_capacity, index->slots[i].file);
+		free(index->slots);
+		index->slots = new_slots;
+		index->capacity = new_capacity;
+	}
+	return 0;
+}
+
+/**
+ * Insert a file into the index.
+ * @retval 0 Success.
+ * @retval -1 Not enough memory.
+ */
+static int
+name_index_insert(struct name_index *index, struct file *file)
+{
+	if(name_index_reserve(index) != 0)
+		return -1;
+	name_index_place(index->slots, index->capacity, file);
+	index->count ++;
+	return 0;
+}
+
+/** Remove the file in the slot @a pos and close the probe gap. */
+static void
+name_index_remove(struct name_index *index, uint32_t pos)
+{
+	uint32_t mask = index->capacity - 1;
+	uint32_t hole = pos;
+	uint32_t i = pos;
+	while(1) {
+		i = (i + 1) & mask;
+		if(index->slots[i].file == NULL)
+			break;
+		/* An entry can fill the hole if its home slot is not in (hole, i] */
+		uint32_t home = index->slots[i].hash & mask;
+		if(((i - home) & mask) >= ((i - hole) & mask)) {
+			index->slots[hole] = index->slots[i];
+			hole = i;
+		}
+	}
+	index->slots[hole].file = NULL;
+	index->count --;
+}
+
+enum {
+	/** Address space of the arena, see arena_alloc(). */
+	ARENA_SHIFT = 38,
+};
+
+/**
+ * Arena of extent data which can be mapped again as a part of a
+ * contiguous range, see ufs_mmap(). It is a memfd mapped once, so
+ * its address space is reserved at once and only used pages take
+ * memory. Blocks are powers of two from EXTENT_MIN to EXTENT_MAX
+ * aligned by their size. Freed blocks return their pages to the
+ * system and are kept for reuse in a stack per size.
+ */
+static struct {
+	pthread_mutex_t lock;
+	int fd;
+	_Atomic(char *) base;
+	/** End of the used address space. */
+	size_t top;
+	struct {
+		size_t *offsets;
+		size_t count;
+		size_t capacity;
+	} free[EXTENT_GROWING];
+	/** All extent data of a page and more goes here. */
+	atomic_bool all_data;
+} arena = {.lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1};
+
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+/** Extent data of this thread goes to the arena, see ufs_mmap(). */
+static __thread bool arena_force;
+
+static void
+arena_init(void)
+{
+	size_t size = (size_t)1 << ARENA_SHIFT;
+	int fd = memfd_create("userfs", MFD_CLOEXEC);
+	if(fd < 0)
+		return;
+	void *base = MAP_FAILED;
+	if(ftruncate(fd, size) == 0)
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+	if(base == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	/* Used where shared memory can have huge pages */
+	madvise(base, size, MADV_HUGEPAGE);
+	arena.fd = fd;
+	atomic_store(&arena.base, (char *)base);
+}
+
+/** Whether @a data lies in the arena. */
+static inline bool
+arena_owns(const char *data)
+{
+	const char *base = atomic_load_explicit(&arena.base, memory_order_acquire);
+	return base != NULL && data >= base && data < base + ((size_t)1 << ARENA_SHIFT);
+}
+
+/**
+ * Allocate zero-filled memory of the arena.
+ * @retval NULL The arena can not be created or is exhausted.
+ */
+static char *
+arena_alloc(size_t size)
+{
+	pthread_once(&arena_once, arena_init);
+	char *base = atomic_load(&arena.base);
+	if(base == NULL)
+		return NULL;
+	int cls = 63 - __builtin_clzll(size) - EXTENT_MIN_SHIFT;
+	size_t offset;
+	pthread_mutex_lock(&arena.lock);
+	if(arena.free[cls].count > 0) {
+		offset = arena.free[cls].offsets[--arena.free[cls].count];
+	}
+	else {
+		offset = (arena.top + size - 1) & ~(size - 1);
+		if(offset + size > ((size_t)1 << ARENA_SHIFT)) {
+			pthread_mutex_unlock(&arena.lock);
+			return NULL;
+		}
+		arena.top = offset + size;
+	}
+	pthread_mutex_unlock(&arena.lock);
+	return base + offset;
+}
+
+static void
+arena_free(char *data, size_t size)
+{
+	/* The pages are dropped, so the block comes zero-filled again */
+	madvise(data, size, MADV_REMOVE);
+	int cls = 63 - __builtin_clzll(size) - EXTENT_MIN_SHIFT;
+	pthread_mutex_lock(&arena.lock);
+	if(arena.free[cls].count == arena.free[cls].capacity) {
+		size_t capacity = arena.free[cls].capacity == 0 ? 64 : arena.free[cls].capacity * 2;
+		size_t *offsets = (size_t *)realloc(arena.free[cls].offsets, capacity * sizeof(size_t));
+		/* Without memory the block is lost, only its address space */
+		if(offsets == NULL) {
+			pthread_mutex_unlock(&arena.lock);
+			return;
+		}
+		arena.free[cls].offsets = offsets;
+		arena.free[cls].capacity = capacity;
+	}
+	arena.free[cls].offsets[arena.free[cls].count++] = data - atomic_load(&arena.base);
+	pthread_mutex_unlock(&arena.lock);
+}
+
+/**
+ * Memory for extent data. Sizes are powers of two: small ones are
+ * metadata classes, a page comes from page_cache, bigger ones are
+ * mapped and so come zero-filled and are returned to the system
+ * right away. Pages and more can come from the arena instead.
+ */
+static char *
+extent_data_map(size_t size)
+{
+	if(size >= EXTENT_MIN && (arena_force || atomic_load_explicit(&arena.all_data, memory_order_relaxed))) {
+		char *data = arena_alloc(size);
+		if(data != NULL || arena_force)
+			return data;
+	}
+	if(size < EXTENT_MIN)
+		return (char *)meta_alloc(size);
+	if(size == EXTENT_MIN)
+		return (char *)slab_alloc(&page_cache);
+	if(size < EXTENT_HUGE) {
+		void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return mem == MAP_FAILED ? NULL : (char *)mem;
+	}
+	/*
+	 * Faults of small pages make filling big extents several
+	 * times slower than copying. Huge pages need the alignment,
+	 * so map more and trim the ends like in slab_map().
+	 */
+	char *mem = (char *)mmap(NULL, size + EXTENT_HUGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mem == MAP_FAILED)
+		return NULL;
+	char *aligned = (char *)(((uintptr_t)mem + EXTENT_HUGE - 1) & ~(uintptr_t)(EXTENT_HUGE - 1));
+	if(aligned > mem)
+		munmap(mem, aligned - mem);
+	munmap(aligned + size, mem + EXTENT_HUGE - aligned);
+	madvise(aligned, size, MADV_HUGEPAGE);
+	return aligned;
+}
+
+static void
+memory_make_room(size_t size);
+
+/**
+ * Extent memory within the memory limit. Over the limit data is
+ * evicted, the caller can hold a file lock meanwhile.
+ */
+static char *
+extent_data_alloc(size_t size)
+{
+	if(!memory_charge(size)) {
+		memory_make_room(size);
+		if(!memory_charge(size))
+			return NULL;
+	}
+	char *data = extent_data_map(size);
+	if(data == NULL)
+		memory_uncharge(size);
+	return data;
+}
+
+static void
+extent_data_free(char *data, size_t size)
+{
+	memory_uncharge(size);
+	if(arena_owns(data))
+		arena_free(data, size);
+	else if(size < EXTENT_MIN)
+		meta_free(data, size);
+	else if(size == EXTENT_MIN)
+		slab_free(data);
+	else
+		munmap(data, size);
+}
+
+/** Allocate an extent with @a capacity bytes of uninitialized memory. */
+static struct extent *
+extent_alloc(size_t capacity)
+{
+	struct extent *ext = (struct extent *)meta_alloc(sizeof(struct extent));
+	if(ext == NULL)
+		return NULL;
+	ext->data = extent_data_alloc(capacity);
+	if(ext->data == NULL) {
+		meta_free(ext, sizeof(*ext));
+		return NULL;
+	}
+	stats_add(&stats_thread()->extents, 1);
+	atomic_init(&ext->refs, 1);
+	ext->image_id = 0;
+	ext->image_off = 0;
+	ext->image_size = 0;
+	ext->map = NULL;
+	ext->capacity = capacity;
+	ext->packed = NULL;
+	ext->spilled = false;
+	atomic_init(&ext->touched, true);
+	ext->incompressible = false;
+	atomic_init(&ext->mmaps, 0);
+	return ext;
+}
+
+/** Allocate a zero-filled extent. */
+static struct extent *
+extent_new(size_t capacity)
+{
+	struct extent *ext = extent_alloc(capacity);
+	if(ext != NULL && capacity <= EXTENT_MIN)
+		memset(ext->data, 0, capacity);
+	return ext;
+}
+
+static void
+image_map_unref(struct image_map *map);
+
+/** Free the packed data kept in memory. */
+static void
+extent_packed_free(struct extent *ext)
+{
+	meta_free(ext->packed, ext->packed_size);
+	memory_uncharge(ext->packed_size);
+	ext->packed = NULL;
+	atomic_fetch_sub(&pack_stats.extents, 1);
+	atomic_fetch_sub(&pack_stats.raw_bytes, ext->packed_used);
+	atomic_fetch_sub(&pack_stats.packed_bytes, ext->packed_size);
+}
+
+/** Drop a reference, the last one frees the extent. */
+static void
+extent_unref(struct extent *ext)
+{
+	if(atomic_fetch_sub(&ext->refs, 1) != 1)
+		return;
+	if(ext->packed != NULL) {
+		extent_packed_free(ext);
+	}
+	else if(ext->spilled) {
+		spill_free(ext->spill_off, ext->packed_size);
+		atomic_fetch_sub(&memory.spilled_extents, 1);
+		atomic_fetch_sub(&memory.spilled_bytes, ext->packed_size);
+	}
+	else if(ext->map == NULL)
+		extent_data_free(ext->data, ext->capacity);
+	else
+		image_map_unref(ext->map);
+	stats_add(&stats_thread()->extents, -1);
+	meta_free(ext, sizeof(*ext));
+}
+
+/** Mark an extent accessed, see ufs_compress_cold(). */
+static inline void
+extent_touch(struct extent *ext)
+{
+	/* Hot extents are marked already, a load does not dirty the line */
+	if(!atomic_load_explicit(&ext->touched, memory_order_relaxed))
+		atomic_store_explicit(&ext->touched, true, memory_order_relaxed);
+}
+
+/**
+ * Unpack a packed extent into the first @a size bytes of @a buf,
+ * at least its packed_used. Bytes after the packed ones are zeros.
+ * @retval 0 Success.
+ * @retval -1 Spilled data can not be read or does not unpack into
+ *         packed_used bytes.
+ */
+static int
+extent_unpack_to(const struct extent *ext, char *buf, size_t size)
+{
+	int rc = 0;
+	if(ext->packed != NULL) {
+		rc = lz_decompress(ext->packed, ext->packed_size, buf, ext->packed_used);
+	}
+	else if(ext->packed_size == ext->packed_used) {
+		rc = spill_io(buf, ext->packed_size, ext->spill_off, false);
+	}
+	else {
+		char *packed = (char *)malloc(ext->packed_size);
+		rc = packed == NULL ? -1 : spill_io(packed, ext->packed_size, ext->spill_off, false);
+		if(rc == 0)
+			rc = lz_decompress(packed, ext->packed_size, buf, ext->packed_used);
+		free(packed);
+	}
+	memset(buf + ext->packed_used, 0, size - ext->packed_used);
+	return rc;
+}
+
+/**
+ * Memory an extent of @a span bytes needs to hold its first
+ * @a size bytes: the whole span if it is mapped, otherwise a
+ * power of two.
+ */
+static size_t
+extent_capacity(size_t size, size_t span)
+{
+	if(span > EXTENT_MIN)
+		return span;
+	size_t capacity = EXTENT_MIN_CAPACITY;
+	while(capacity < size)
+		capacity *= 2;
+	return capacity < span ? capacity : span;
+}
+
+/**
+ * Copy a packed extent unpacked, with memory for at least
+ * @a capacity bytes. The data is the same, so the copy stays
+ * saved in the image.
+ * @retval NULL Error, ufs_error_code is set.
+ */
+static struct extent *
+extent_unpacked_copy(const struct extent *ext, size_t capacity)
+{
+	struct extent *copy = extent_new(capacity > ext->capacity ? capacity : ext->capacity);
+	if(copy == NULL) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return NULL;
+	}
+	if(extent_unpack_to(ext, copy->data, ext->packed_used) != 0) {
+		extent_unref(copy);
+		ufs_error_code = UFS_ERR_IO;
+		return NULL;
+	}
+	copy->image_id = ext->image_id;
+	copy->image_off = ext->image_off;
+	copy->image_size = ext->image_size;
+	if(ext->spilled)
+		atomic_fetch_add(&memory.faults, 1);
+	if(ext->packed_size != ext->packed_used)
+		atomic_fetch_add(&pack_stats.hits, 1);
+	return copy;
+}
+
+static struct radix_node *
+radix_node_new(void)
+{
+	struct radix_node *node = (struct radix_node *)meta_alloc(sizeof(struct radix_node));
+	if(node != NULL)
+		memset(node, 0, sizeof(*node));
+	return node;
+}
+
+static void
+radix_node_delete(struct radix_node *node)
+{
+	meta_free(node, sizeof(*node));
+}
+
+/** Number of extents covered by one slot of a node of @a level. */
+static inline size_t
+radix_span(int level)
+{
+	return (size_t)1 << (RADIX_SHIFT * (level - 1));
+}
+
+/** Find an extent by its number. NULL if there is no such extent. */
+static struct extent *
+extent_find(const struct file *file, size_t idx)
+{
+	if(file->height == 0 || idx >= radix_span(file->height + 1))
+		return NULL;
+	struct radix_node *node = file->root;
+	for(int level = file->height; level > 1; level--) {
+		node = (struct radix_node *)node->slots[(idx / radix_span(level)) & RADIX_MASK];
+		if(node == NULL)
+			return NULL;
+	}
+	return (struct extent *)node->slots[idx & RADIX_MASK];
+}
+
+/**
+ * Get the index slot for an extent number, growing the tree and
+ * creating the missing nodes on the way.
+ * @retval NULL Not enough memory.
+ */
+static struct extent **
+extent_slot(struct file *file, size_t idx)
+{
+	while(file->height == 0 || idx >= radix_span(file->height + 1)) {
+		struct radix_node *root = radix_node_new();
+		if(root == NULL)
+			return NULL;
+		root->slots[0] = file->root;
+		file->root = root;
+		file->height ++;
+	}
+	struct radix_node *node = file->root;
+	for(int level = file->height; level > 1; level--) {
+		void **slot = &node->slots[(idx / radix_span(level)) & RADIX_MASK];
+		if(*slot == NULL) {
+			*slot = radix_node_new();
+			if(*slot == NULL)
+				return NULL;
+		}
+		node = (struct radix_node *)*slot;
+	}
+	return (struct extent **)&node->slots[idx & RADIX_MASK];
+}
+
+/** Free a subtree of the extent index with all its extents. */
+static void
+radix_free(struct radix_node *node, int level)
+{
+	for(int i = 0; i < RADIX_FANOUT; i++) {
+		if(node->slots[i] == NULL)
+			continue;
+		if(level == 1)
+			extent_unref((struct extent *)node->slots[i]);
+		else
+			radix_free((struct radix_node *)node->slots[i], level - 1);
+	}
+	radix_node_delete(node);
+}
+
+/**
+ * Copy a subtree of the extent index. Extents are not copied, they
+ * get one more reference and are copied by the first writer.
+ * @retval NULL Not enough memory.
+ */
+static struct radix_node *
+radix_clone(const struct radix_node *node, int level)
+{
+	struct radix_node *copy = radix_node_new();
+	if(copy == NULL)
+		return NULL;
+	for(int i = 0; i < RADIX_FANOUT; i++) {
+		if(node->slots[i] == NULL)
+			continue;
+		if(level == 1) {
+			struct extent *ext = (struct extent *)node->slots[i];
+			/* Mapped data changes in place, the copy needs its own */
+			if(atomic_load(&ext->mmaps) > 0) {
+				struct extent *own = extent_alloc(ext->capacity);
+				if(own == NULL) {
+					radix_free(copy, level);
+					return NULL;
+				}
+				memcpy(own->data, ext->data, ext->capacity);
+				copy->slots[i] = own;
+				continue;
+			}
+			atomic_fetch_add(&ext->refs, 1);
+			copy->slots[i] = ext;
+			continue;
+		}
+		copy->slots[i] = radix_clone((const struct radix_node *)node->slots[i], level - 1);
+		if(copy->slots[i] == NULL) {
+			radix_free(copy, level);
+			return NULL;
+		}
+	}
+	return copy;
+}
+
+/**
+ * Drop all extents with numbers in [@a first, @a end) from a
+ * subtree whose first extent number is @a base.
+ * @retval 1 The subtree became empty and was freed.
+ */
+static int
+radix_drop(struct radix_node *node, int level, size_t base, size_t first, size_t end)
+{
+	int empty = 1;
+	for(int i = 0; i < RADIX_FANOUT; i++) {
+		if(node->slots[i] == NULL)
+			continue;
+		size_t child_base = base + i * radix_span(level);
+		size_t child_end = child_base + radix_span(level);
+		if(child_base >= first && child_end <= end) {
+			if(level == 1)
+				extent_unref((struct extent *)node->slots[i]);
+			else
+				radix_free((struct radix_node *)node->slots[i], level - 1);
+			node->slots[i] = NULL;
+		}
+		else if(level > 1 && child_base < end && child_end > first &&
+			radix_drop((struct radix_node *)node->slots[i], level - 1, child_base, first, end))
+			node->slots[i] = NULL;
+		else
+			empty = 0;
+	}
+	if(empty)
+		radix_node_delete(node);
+	return empty;
+}
+
+/**
+ * Drop extents with numbers in [@a first, @a end), they become a
+ * hole. Nodes left empty are freed and the tree is lowered while
+ * only its first branch is used.
+ */
+static void
+file_drop_extents(struct file *file, size_t first, size_t end)
+{
+	if(file->height == 0 || first >= end)
+		return;
+	if(radix_drop(file->root, file->height, 0, first, end)) {
+		file->root = NULL;
+		file->height = 0;
+		return;
+	}
+	while(file->height > 1) {
+		for(int i = 1; i < RADIX_FANOUT; i++)
+			if(file->root->slots[i] != NULL)
+				return;
+		struct radix_node *old_root = file->root;
+		file->root = (struct radix_node *)old_root->slots[0];
+		file->height --;
+		radix_node_delete(old_root);
+	}
+}
+
+static void
+dir_delete(struct dir *dir);
+
+enum {
+	/** Must be a power of two. */
+	CLOCK_RING_COUNT = 16,
+};
+
+/**
+ * The eviction clock: rings of all files, split like name shards
+ * so that creating files in parallel does not meet on one lock.
+ * The hand goes round the rings in turn and evicts extents not
+ * touched since its previous pass, the touched ones get a second
+ * chance. It approximates LRU while readers only set
+ * extent.touched. See memory_make_room().
+ */
+struct clock_ring {
+	pthread_mutex_t lock;
+	struct file *hand;
+	size_t count;
+	char padding[128 - sizeof(pthread_mutex_t) - sizeof(struct file *) - sizeof(size_t)];
+};
+
+static struct clock_ring clock_rings[CLOCK_RING_COUNT] __attribute__((aligned(64)));
+
+/** Number of the ring the hand visits next. */
+static atomic_uint clock_next_ring;
+
+static inline struct clock_ring *
+file_clock_ring(const struct file *file)
+{
+	return &clock_rings[((uintptr_t)file / sizeof(struct file)) & (CLOCK_RING_COUNT - 1)];
+}
+
+static void
+clock_ring_add(struct file *file)
+{
+	struct clock_ring *ring = file_clock_ring(file);
+	pthread_mutex_lock(&ring->lock);
+	if(ring->hand == NULL) {
+		file->clock_prev = file->clock_next = file;
+		ring->hand = file;
+	}
+	else {
+		/* Behind the hand, the file is visited last */
+		file->clock_next = ring->hand;
+		file->clock_prev = ring->hand->clock_prev;
+		file->clock_prev->clock_next = file;
+		ring->hand->clock_prev = file;
+	}
+	ring->count++;
+	pthread_mutex_unlock(&ring->lock);
+}
+
+static void
+clock_ring_remove(struct file *file)
+{
+	struct clock_ring *ring = file_clock_ring(file);
+	pthread_mutex_lock(&ring->lock);
+	if(file->clock_next == file) {
+		ring->hand = NULL;
+	}
+	else {
+		if(ring->hand == file)
+			ring->hand = file->clock_next;
+		file->clock_prev->clock_next = file->clock_next;
+		file->clock_next->clock_prev = file->clock_prev;
+	}
+	ring->count--;
+	pthread_mutex_unlock(&ring->lock);
+}
+
+/** Free a file together with its extents, or a directory with its entries. */
+static void
+file_free(struct file *file)
+{
+	clock_ring_remove(file);
+	stats_add(&stats_thread()->files, -1);
+	if(file->root != NULL)
+		radix_free(file->root, file->height);
+	if(file->dir != NULL)
+		dir_delete(file->dir);
+	pthread_rwlock_destroy(&file->lock);
+	pthread_mutex_destroy(&file->desc_lock);
+	meta_free(file->name, strlen(file->name) + 1);
+	meta_free(file, sizeof(struct file));
+}
+
+/** Drop a reference, the last one frees the file. */
+static void
+file_unref(struct file *file)
+{
+	if(atomic_fetch_sub(&file->refs, 1) == 1)
+		file_free(file);
+}
+
+/**
+ * Set the size under the exclusive lock, when there are no appends
+ * in progress.
+ */
+static inline void
+file_set_size(struct file *file, size_t size)
+{
+	atomic_store_explicit(&file->size, size, memory_order_relaxed);
+	atomic_store_explicit(&file->append_end, size, memory_order_relaxed);
+}
+
+/**
+ * Keep appends from writing extents in place while the caller,
+ * holding the shared lock, makes them shared: wait for the appends
+ * in progress, new ones take the exclusive lock meanwhile.
+ */
+static void
+file_block_appends(struct file *file)
+{
+	atomic_fetch_add(&file->append_blockers, 1);
+	while(atomic_load(&file->appenders) != 0)
+		sched_yield();
+}
+
+static inline void
+file_unblock_appends(struct file *file)
+{
+	atomic_fetch_sub(&file->append_blockers, 1);
+}
+
+/**
+ * Replace the content of @a dst with the content of @a src. The
+ * extents become shared, see radix_clone(). The caller holds the
+ * locks of both files. Descriptors of @a dst behind its new end
+ * proceed from it.
+ * @retval 0 Success.
+ * @retval -1 Not enough memory, @a dst is not changed.
+ */
+static int
+file_clone_data(struct file *dst, struct file *src)
+{
+	struct radix_node *root = NULL;
+	file_block_appends(src);
+	if(src->root != NULL && (root = radix_clone(src->root, src->height)) == NULL) {
+		file_unblock_appends(src);
+		return -1;
+	}
+	file_unblock_appends(src);
+	if(dst->root != NULL)
+		radix_free(dst->root, dst->height);
+	dst->root = root;
+	dst->height = src->height;
+	file_set_size(dst, src->size);
+	dst->has_packed = src->has_packed;
+	pthread_mutex_lock(&dst->desc_lock);
+	for(struct filedesc *desc = dst->desc_list; desc != NULL; desc = desc->next)
+		if(desc->pos > dst->size)
+			desc->pos = dst->size;
+	pthread_mutex_unlock(&dst->desc_lock);
+	return 0;
+}
+
+/** Unreference all files of an index and free it. */
+static void
+name_index_destroy(struct name_index *index)
+{
+	for(uint32_t i = 0; i < index->capacity; i++)
+		if(index->slots[i].file != NULL)
+			file_unref(index->slots[i].file);
+	free(index->slots);
+	*index = (struct name_index){NULL, 0, 0};
+}
+
+/**
+ * How many first bytes of extent @a idx of the file can be not
+ * zero: its memory up to the end of file.
+ */
+static inline size_t
+extent_used(const struct file *file, size_t idx, const struct extent *ext)
+{
+	size_t start = extent_start(idx);
+	/* Appends can move the end meanwhile */
+	size_t size = file->size;
+	if(size <= start)
+		return 0;
+	return size - start < ext->capacity ? size - start : ext->capacity;
+}
+
+/**
+ * Get an extent which can be changed in place and has memory for
+ * at least its first @a size bytes. A missing extent is created,
+ * a shared or mapped one is copied, a short one grows.
+ * @retval NULL Error, ufs_error_code is set.
+ */
+static struct extent *
+extent_get_writable(struct file *file, size_t idx, size_t size)
+{
+	struct extent **slot = extent_slot(file, idx);
+	if(slot == NULL) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return NULL;
+	}
+	struct extent *ext = *slot;
+	size_t capacity = extent_capacity(size, extent_span(idx));
+	if(ext == NULL) {
+		if((ext = extent_new(capacity)) == NULL)
+			ufs_error_code = UFS_ERR_NO_MEM;
+		return *slot = ext;
+	}
+	if(capacity < ext->capacity)
+		capacity = ext->capacity;
+	if(ext->data == NULL) {
+		struct extent *copy = extent_unpacked_copy(ext, capacity);
+		if(copy == NULL)
+			return NULL;
+		extent_unref(ext);
+		*slot = ext = copy;
+	}
+	else if((atomic_load(&ext->refs) > 1 && atomic_load(&ext->mmaps) == 0) ||
+		ext->map != NULL || ext->capacity < capacity || (arena_force && !arena_owns(ext->data))) {
+		/* Only the bytes before the end of file can be not zero */
+		size_t used = extent_used(file, idx, ext);
+		struct extent *copy = extent_new(capacity);
+		if(copy == NULL) {
+			ufs_error_code = UFS_ERR_NO_MEM;
+			return NULL;
+		}
+		memcpy(copy->data, ext->data, used);
+		extent_unref(ext);
+		*slot = ext = copy;
+	}
+	/* The caller changes it, the saved copy becomes stale */
+	ext->image_id = 0;
+	ext->incompressible = false;
+	extent_touch(ext);
+	return ext;
+}
+
+/**
+ * Zero bytes [@a from, @a to) of one extent, if the extent
+ * exists. A missing extent is a hole and is zero anyway, so are
+ * the bytes beyond its memory or the end of file.
+ * @retval 0 Success.
+ * @retval -1 Error, ufs_error_code is set.
+ */
+static int
+extent_zero_range(struct file *file, size_t idx, size_t from, size_t to)
+{
+	struct extent *ext = extent_find(file, idx);
+	if(ext == NULL)
+		return 0;
+	if(to > extent_used(file, idx, ext))
+		to = extent_used(file, idx, ext);
+	if(from >= to)
+		return 0;
+	ext = extent_get_writable(file, idx, to);
+	if(ext == NULL)
+		return -1;
+	memset(ext->data + from, 0, to - from);
+	return 0;
+}
+
+/**
+ * Release the memory of the range [@a offset, @a offset + @a len)
+ * of the file. Whole extents in it become holes, the edges are
+ * zeroed. The file size does not change.
+ * @retval 0 Success.
+ * @retval -1 Error, ufs_error_code is set.
+ */
+static int
+file_punch_hole(struct file *file, size_t offset, size_t len)
+{
+	if(offset >= file->size || len == 0)
+		return 0;
+	size_t end = len > file->size - offset ? file->size : offset + len;
+	size_t first = extent_number(offset);
+	size_t last = extent_number(end - 1);
+	size_t head = offset - extent_start(first);
+	size_t tail = end - extent_start(last);
+	/* Bytes after the end of file are zero, the last extent can go whole */
+	if(end == file->size)
+		tail = extent_span(last);
+	if(first == last && (head != 0 || tail != extent_span(last)))
+		return extent_zero_range(file, first, head, tail);
+	/* Zero the partial edges first, nothing is lost if it fails */
+	if((head != 0 && extent_zero_range(file, first, head, extent_span(first)) != 0) ||
+	   (tail != extent_span(last) && extent_zero_range(file, last, 0, tail) != 0))
+		return -1;
+	file_drop_extents(file, head != 0 ? first + 1 : first,
+			  tail != extent_span(last) ? last : last + 1);
+	return 0;
+}
+
+/**
+ * Write data to the file at the given offset. The file grows if
+ * needed, a gap between its end and @a offset is zero-filled.
+ * @retval >= 0 How many bytes were written. It is less than
+ *         @a size only if memory ran out in the middle.
+ * @retval -1 Error, ufs_error_code is set.
+ */
+static ssize_t
+file_write(struct file *file, const char *buf, size_t size, size_t offset)
+{
+	/* Check whether the file is short enought to write 'buf' */
+	if(offset > MAX_FILE_SIZE || MAX_FILE_SIZE - offset < size) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	/* A gap after the old end stays a hole, the size grows after the data is in */
+	size_t done = 0;
+	while(done < size) {
+		size_t pos = offset + done;
+		size_t idx = extent_number(pos);
+		size_t in_ext = pos - extent_start(idx);
+		size_t len = extent_span(idx) - in_ext;
+		if(len > size - done)
+			len = size - done;
+		struct extent *ext = extent_get_writable(file, idx, in_ext + len);
+		if(ext == NULL)
+			break;
+		memcpy(ext->data + in_ext, buf + done, len);
+		done += len;
+	}
+	if(done > 0 && offset + done > file->size)
+		file_set_size(file, offset + done);
+	if(done == 0 && size != 0)
+		return -1;
+	return done;
+}
+
+/**
+ * Find where @a len bytes from offset @a in_ext of extent @a ext
+ * are. The first *@a filled of them are in *@a data, the rest
+ * are zeros.
+ */
+static inline void
+extent_locate(const struct extent *ext, size_t in_ext, size_t len,
+	      const char **data, size_t *filled)
+{
+	*filled = 0;
+	*data = zero_data;
+	if(ext != NULL && in_ext < ext->capacity) {
+		*data = ext->data + in_ext;
+		*filled = ext->capacity - in_ext < len ? ext->capacity - in_ext : len;
+	}
+}
+
+/**
+ * Read data from the file at the given offset.
+ * @retval How many bytes were read, 0 at or beyond the end.
+ */
+static ssize_t
+file_read(const struct file *file, char *buf, size_t size, size_t offset)
+{
+	/* Appends can move the end meanwhile */
+	size_t file_size = file->size;
+	if(offset >= file_size)
+		return 0;
+	if(size > file_size - offset)
+		size = file_size - offset;
+	size_t done = 0;
+	while(done < size) {
+		size_t pos = offset + done;
+		size_t idx = extent_number(pos);
+		size_t in_ext = pos - extent_start(idx);
+		size_t len = extent_span(idx) - in_ext;
+		if(len > size - done)
+			len = size - done;
+		struct extent *ext = extent_find(file, idx);
+		if(ext != NULL)
+			extent_touch(ext);
+		const char *data;
+		size_t filled;
+		extent_locate(ext, in_ext, len, &data, &filled);
+		memcpy(buf + done, data, filled);
+		memset(buf + done + filled, 0, len - filled);
+		done += len;
+	}
+	return done;
+}
+
+/**
+ * Memory needed to unpack the packed extents of the range
+ * [@a offset, @a offset + @a size), 0 if there are none.
+ */
+static size_t
+file_packed_size(const struct file *file, size_t offset, size_t size)
+{
+	/* Appends can move the end meanwhile */
+	size_t file_size = file->size;
+	if(offset >= file_size || size == 0)
+		return 0;
+	size_t end = size > file_size - offset ? file_size : offset + size;
+	size_t last = extent_number(end - 1);
+	size_t total = 0;
+	for(size_t idx = extent_number(offset); idx <= last; idx++) {
+		const struct extent *ext = extent_find(file, idx);
+		if(ext != NULL && ext->data == NULL)
+			total += ext->capacity;
+	}
+	return total;
+}
+
+/**
+ * Unpack the packed extents of the range [@a offset, @a offset +
+ * @a size). The caller holds the file lock exclusively.
+ * @retval 0 Success.
+ * @retval -1 Error, ufs_error_code is set.
+ */
+static int
+file_unpack_range(struct file *file, size_t offset, size_t size)
+{
+	if(offset >= file->size || size == 0)
+		return 0;
+	size_t end = size > file->size - offset ? file->size : offset + size;
+	size_t last = extent_number(end - 1);
+	for(size_t idx = extent_number(offset); idx <= last; idx++) {
+		struct extent *ext = extent_find(file, idx);
+		if(ext == NULL || ext->data != NULL)
+			continue;
+		/* Shared extents are not changed, the slot gets a copy */
+		struct extent *copy = extent_unpacked_copy(ext, 0);
+		if(copy == NULL)
+			return -1;
+		*extent_slot(file, idx) = copy;
+		extent_unref(ext);
+	}
+	return 0;
+}
+
+/**
+ * Take the file lock shared to read @a size bytes at *@a offset,
+ * which is read anew after each wait. Packed extents of the range
+ * are unpacked first under the exclusive lock, after making room
+ * for them within the memory limit. Files which were never packed
+ * cost one check.
+ * @retval 0 Success.
+ * @retval -1 Error, ufs_error_code is set, the lock is not taken.
+ */
+static int
+file_rdlock_data(struct file *file, const size_t *offset, size_t size)
+{
+	pthread_rwlock_rdlock(&file->lock);
+	size_t need;
+	while(file->has_packed && (need = file_packed_size(file, *offset, size)) != 0) {
+		pthread_rwlock_unlock(&file->lock);
+		memory_make_room(need);
+		pthread_rwlock_wrlock(&file->lock);
+		int rc = file_unpack_range(file, *offset, size);
+		pthread_rwlock_unlock(&file->lock);
+		if(rc != 0)
+			return -1;
+		pthread_rwlock_rdlock(&file->lock);
+	}
+	return 0;
+}
+
+/**
+ * The most new memory a write of @a size bytes at @a offset can
+ * take: new extents, copies of shared and packed ones and growth
+ * of short ones.
+ */
+static size_t
+file_write_need(const struct file *file, size_t offset, size_t size)
+{
+	if(size == 0 || offset > MAX_FILE_SIZE || MAX_FILE_SIZE - offset < size)
+		return 0;
+	size_t end = offset + size;
+	size_t last = extent_number(end - 1);
+	size_t total = 0;
+	for(size_t idx = extent_number(offset); idx <= last; idx++) {
+		size_t in_end = end - extent_start(idx);
+		size_t capacity = extent_capacity(in_end < extent_span(idx) ? in_end : extent_span(idx),
+						  extent_span(idx));
+		const struct extent *ext = extent_find(file, idx);
+		if(ext == NULL)
+			total += capacity;
+		else if(ext->data == NULL || ext->map != NULL ||
+			(atomic_load(&ext->refs) > 1 && atomic_load(&ext->mmaps) == 0))
+			total += capacity > ext->capacity ? capacity : ext->capacity;
+		else if(ext->capacity < capacity)
+			total += capacity;
+	}
+	return total;
+}
+
+/**
+ * Take the file lock exclusively to write @a size bytes at
+ * *@a offset. Under a memory limit room for the write is made
+ * first, see memory_make_room(). If there is not enough of it
+ * anyway, the write fails with UFS_ERR_NO_MEM.
+ */
+static void
+file_wrlock_data(struct file *file, const size_t *offset, size_t size)
+{
+	pthread_rwlock_wrlock(&file->lock);
+	if(atomic_load_explicit(&memory.limit, memory_order_relaxed) == 0)
+		return;
+	size_t need = file_write_need(file, *offset, size);
+	if(memory_fits(need))
+		return;
+	pthread_rwlock_unlock(&file->lock);
+	memory_make_room(need);
+	pthread_rwlock_wrlock(&file->lock);
+}
+
+enum {
+	/** Spins of an append waiting for the ones before it. */
+	APPEND_SPINS = 64,
+};
+
+/**
+ * Whether bytes [@a offset, @a end) can be written in place under
+ * the shared lock: their extents exist, have memory for them and
+ * are not packed, shared, mapped or saved in an image.
+ */
+static bool
+file_append_ready(const struct file *file, size_t offset, size_t end)
+{
+	if(offset == end)
+		return true;
+	size_t last = extent_number(end - 1);
+	for(size_t idx = extent_number(offset); idx <= last; idx++) {
+		size_t in_end = end - extent_start(idx);
+		if(in_end > extent_span(idx))
+			in_end = extent_span(idx);
+		const struct extent *ext = extent_find(file, idx);
+		/* References go first, image_id of a shared extent can change */
+		if(ext == NULL || atomic_load_explicit(&ext->refs, memory_order_acquire) > 1 ||
+		   ext->data == NULL || ext->map != NULL || ext->image_id != 0 ||
+		   ext->incompressible || ext->capacity < in_end)
+			return false;
+	}
+	return true;
+}
+
+/** Copy data into extents checked by file_append_ready(). */
+static void
+file_append_copy(struct file *file, const char *buf, size_t size, size_t offset)
+{
+	size_t done = 0;
+	while(done < size) {
+		size_t pos = offset + done;
+		size_t idx = extent_number(pos);
+		size_t in_ext = pos - extent_start(idx);
+		size_t len = extent_span(idx) - in_ext;
+		if(len > size - done)
+			len = size - done;
+		struct extent *ext = extent_find(file, idx);
+		extent_touch(ext);
+		memcpy(ext->data + in_ext, buf + done, len);
+		done += len;
+	}
+}
+
+/**
+ * Append @a size bytes of @a iov under the shared lock. The range
+ * is reserved by moving append_end, the data is copied in parallel
+ * with other appends and published by moving the size after the
+ * ranges reserved before it, so readers never see a torn record.
+ * @param[out] end End of the written data.
+ * @retval true Success.
+ * @retval false The end is not ready for writes in place or
+ *         appends are blocked, see file_block_appends().
+ */
+static bool
+file_append_shared(struct file *file, const struct iovec *iov, int iovcnt,
+		   size_t size, size_t *end)
+{
+	atomic_fetch_add(&file->appenders, 1);
+	size_t start = atomic_load_explicit(&file->append_end, memory_order_relaxed);
+	/* The range is checked before it is taken, so it is a CAS, not an add */
+	do {
+		if(atomic_load(&file->append_blockers) != 0 || start > MAX_FILE_SIZE ||
+		   MAX_FILE_SIZE - start < size || !file_append_ready(file, start, start + size)) {
+			atomic_fetch_sub(&file->appenders, 1);
+			return false;
+		}
+	} while(!atomic_compare_exchange_weak_explicit(&file->append_end, &start, start + size,
+						       memory_order_relaxed, memory_order_relaxed));
+	size_t done = 0;
+	for(int i = 0; i < iovcnt; i++) {
+		file_append_copy(file, (const char *)iov[i].iov_base, iov[i].iov_len, start + done);
+		done += iov[i].iov_len;
+	}
+	for(int spin = 0; atomic_load_explicit(&file->size, memory_order_acquire) != start; spin++) {
+		if(spin >= APPEND_SPINS)
+			sched_yield();
+	}
+	atomic_store_explicit(&file->size, start + size, memory_order_release);
+	atomic_fetch_sub(&file->appenders, 1);
+	*end = start + size;
+	return true;
+}
+
+/**
+ * Append under the exclusive lock when the shared one does not
+ * do. The extents at the end get memory for the appends after it.
+ * @param[out] end End of the written data, stored under the lock
+ *             unless nothing is written.
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error, ufs_error_code is set.
+ */
+static ssize_t
+file_append_locked(struct file *file, const struct iovec *iov, int iovcnt,
+		   size_t size, size_t *end)
+{
+	/* Only a guess of the end for the memory limit */
+	size_t offset = file->size;
+	file_wrlock_data(file, &offset, size);
+	offset = file->size;
+	ssize_t total = 0;
+	for(int i = 0; i < iovcnt; i++) {
+		ssize_t rc = file_write(file, (const char *)iov[i].iov_base, iov[i].iov_len,
+					offset + total);
+		if(rc < 0) {
+			if(total == 0)
+				total = -1;
+			break;
+		}
+		total += rc;
+		if((size_t)rc < iov[i].iov_len)
+			break;
+	}
+	if(total >= 0)
+		*end = offset + total;
+	pthread_rwlock_unlock(&file->lock);
+	return total;
+}
+
+enum {
+	FD_CHUNK_SIZE = 1024,
+	FD_MAX_CHUNKS = 1 << 16,
+	/** Must be a power of two. */
+	FD_SHARD_COUNT = 8,
+};
+
+/**
+ * A table of file descriptors. When a file descriptor is
+ * created, its pointer drops here. When a file descriptor is
+ * closed, its place in this table is set to NULL and its number
+ * is pushed to a free stack, so the next ufs_open() call takes
+ * it in O(1).
+ *
+ * The table is split into chunks of FD_CHUNK_SIZE slots which
+ * are allocated on demand and never move, so growing does not
+ * copy the table and lookups need no locks. The chunk directory
+ * costs only a pointer per chunk and covers 64M descriptors.
+ *
+ * Free numbers are kept in several shards, each thread takes
+ * numbers from its own shard and a number returns to the shard
+ * of its chunk. So threads opening and closing descriptors do
+ * not contend on one lock.
+ */
+static _Atomic(struct filedesc *) *_Atomic fd_chunks[FD_MAX_CHUNKS];
+/** Shard owning each chunk. */
+static uint8_t fd_chunk_shard[FD_MAX_CHUNKS];
+static atomic_int fd_chunk_count = 0;
+static pthread_mutex_t fd_grow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct fd_shard {
+	pthread_mutex_t lock;
+	/**
+	 * Stack of free descriptor numbers. A fresh chunk is pushed
+	 * lowest on top, a closed descriptor is reused first.
+	 */
+	int *free;
+	int free_count;
+	int free_capacity;
+	/** Closed descriptors to reuse, linked by next. */
+	struct filedesc *free_descs;
+} __attribute__((aligned(64)));
+
+static struct fd_shard fd_shards[FD_SHARD_COUNT];
+static atomic_uint fd_next_shard = 0;
+/** Shard of the current thread, -1 until the first open. */
+static __thread int fd_my_shard = -1;
+
+static void
+filedesc_put(struct filedesc *desc);
+
+/**
+ * Get a descriptor by its number and take a reference to it, or
+ * NULL if it is not opened. The caller drops the reference with
+ * filedesc_put().
+ */
+static struct filedesc *
+fd_get(int fd)
+{
+	if(fd < 0 || fd / FD_CHUNK_SIZE >= atomic_load_explicit(&fd_chunk_count, memory_order_acquire))
+		return NULL;
+	_Atomic(struct filedesc *) *chunk = atomic_load_explicit(&fd_chunks[fd / FD_CHUNK_SIZE], memory_order_acquire);
+	_Atomic(struct filedesc *) *slot = &chunk[fd % FD_CHUNK_SIZE];
+	struct filedesc *desc;
+	while((desc = atomic_load_explicit(slot, memory_order_acquire)) != NULL) {
+		/* A descriptor closed meanwhile has no references left */
+		int refs = atomic_load_explicit(&desc->refs, memory_order_relaxed);
+		while(refs > 0 && !atomic_compare_exchange_weak(&desc->refs, &refs, refs + 1))
+			;
+		if(refs == 0)
+			continue;
+		/* It could be closed and reused for another number */
+		if(atomic_load_explicit(slot, memory_order_acquire) == desc)
+			return desc;
+		filedesc_put(desc);
+	}
+	return NULL;
+}
+
+/** Shard of the current thread, chosen on its first use. */
+static struct fd_shard *
+fd_shard_mine(void)
+{
+	if(fd_my_shard < 0)
+		fd_my_shard = atomic_fetch_add(&fd_next_shard, 1) & (FD_SHARD_COUNT - 1);
+	return &fd_shards[fd_my_shard];
+}
+
+/**
+ * Add a new chunk and give its numbers to the shard, which is
+ * locked by the caller.
+ * @retval 0 Success.
+ * @retval -1 Not enough memory.
+ */
+static int
+fd_grow(struct fd_shard *shard, int shard_no)
+{
+	/* The stack must fit all numbers of the shard at once */
+	int new_capacity = shard->free_capacity + FD_CHUNK_SIZE;
+	int *new_free = (int *)realloc(shard->free, sizeof(int) * new_capacity);
+	if(new_free == NULL)
+		return -1;
+	shard->free = new_free;
+	pthread_mutex_lock(&fd_grow_lock);
+	int chunk_no = atomic_load(&fd_chunk_count);
+	_Atomic(struct filedesc *) *chunk = NULL;
+	if(chunk_no < FD_MAX_CHUNKS)
+		chunk = (_Atomic(struct filedesc *) *)calloc(FD_CHUNK_SIZE, sizeof(*chunk));
+	if(chunk == NULL) {
+		pthread_mutex_unlock(&fd_grow_lock);
+		return -1;
+	}
+	shard->free_capacity = new_capacity;
+	fd_chunk_shard[chunk_no] = shard_no;
+	atomic_store_explicit(&fd_chunks[chunk_no], chunk, memory_order_release);
+	atomic_store_explicit(&fd_chunk_count, chunk_no + 1, memory_order_release);
+	pthread_mutex_unlock(&fd_grow_lock);
+	/* Push in reverse order to hand out lower numbers first */
+	int base = chunk_no * FD_CHUNK_SIZE;
+	for(int i = FD_CHUNK_SIZE - 1; i >= 0; i--)
+		shard->free[shard->free_count++] = base + i;
+	return 0;
+}
+
+/**
+ * Allocate a number for the descriptor.
+ * @retval >= 0 Descriptor number.
+ * @retval -1 Not enough memory.
+ */
+static int
+fd_alloc(struct filedesc *desc)
+{
+	struct fd_shard *shard = fd_shard_mine();
+	pthread_mutex_lock(&shard->lock);
+	if(shard->free_count == 0 && fd_grow(shard, fd_my_shard) != 0) {
+		pthread_mutex_unlock(&shard->lock);
+		return -1;
+	}
+	int fd = shard->free[--shard->free_count];
+	pthread_mutex_unlock(&shard->lock);
+	_Atomic(struct filedesc *) *chunk = atomic_load(&fd_chunks[fd / FD_CHUNK_SIZE]);
+	atomic_store_explicit(&chunk[fd % FD_CHUNK_SIZE], desc, memory_order_release);
+	return fd;
+}
+
+/**
+ * Take the descriptor out of the table and return its number to
+ * the free stack.
+ * @retval NULL The descriptor is not opened.
+ */
+static struct filedesc *
+fd_release(int fd)
+{
+	if(fd < 0 || fd / FD_CHUNK_SIZE >= atomic_load_explicit(&fd_chunk_count, memory_order_acquire))
+		return NULL;
+	_Atomic(struct filedesc *) *chunk = atomic_load(&fd_chunks[fd / FD_CHUNK_SIZE]);
+	/* Exchange, so only one of concurrent closes succeeds */
+	struct filedesc *desc = atomic_exchange(&chunk[fd % FD_CHUNK_SIZE], NULL);
+	if(desc == NULL)
+		return NULL;
+	struct fd_shard *shard = &fd_shards[fd_chunk_shard[fd / FD_CHUNK_SIZE]];
+	pthread_mutex_lock(&shard->lock);
+	/* The stack has room for every number of the shard chunks */
+	shard->free[shard->free_count++] = fd;
+	pthread_mutex_unlock(&shard->lock);
+	return desc;
+}
+
+/**
+ * Unlink a descriptor from its file and keep its memory for
+ * reuse, see filedesc.refs.
+ */
+static void
+filedesc_delete(struct filedesc *desc)
+{
+	struct file *file = desc->file;
+	pthread_mutex_lock(&file->desc_lock);
+	if(desc->prev != NULL)
+		desc->prev->next = desc->next;
+	else
+		file->desc_list = desc->next;
+	if(desc->next != NULL)
+		desc->next->prev = desc->prev;
+	pthread_mutex_unlock(&file->desc_lock);
+	pthread_mutex_destroy(&desc->pos_lock);
+	file_unref(file);
+	struct fd_shard *shard = fd_shard_mine();
+	pthread_mutex_lock(&shard->lock);
+	desc->next = shard->free_descs;
+	shard->free_descs = desc;
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/** Drop a reference to the descriptor, NULL is ignored. */
+static void
+filedesc_put(struct filedesc *desc)
+{
+	if(desc != NULL && atomic_fetch_sub(&desc->refs, 1) == 1)
+		filedesc_delete(desc);
+}
+
+/**
+ * Allocate a file which is not linked anywhere yet.
+ * @param name Name of @a name_len bytes, not terminated.
+ * @param refs Initial reference count.
+ */
+static struct file *
+file_new(const char *name, size_t name_len, uint32_t hash, int refs)
+{
+	struct file *file = (struct file *)meta_alloc(sizeof(struct file));
+	char *name_copy = (char *)meta_alloc(name_len + 1);
+	if(file == NULL || name_copy == NULL) {
+		if(file != NULL)
+			meta_free(file, sizeof(struct file));
+		if(name_copy != NULL)
+			meta_free(name_copy, name_len + 1);
+		return NULL;
+	}
+	pthread_rwlock_init(&file->lock, NULL);
+	pthread_mutex_init(&file->desc_lock, NULL);
+	file->root = NULL;
+	file->height = 0;
+	atomic_init(&file->size, 0);
+	atomic_init(&file->append_end, 0);
+	atomic_init(&file->appenders, 0);
+	atomic_init(&file->append_blockers, 0);
+	atomic_init(&file->refs, refs);
+	file->desc_list = NULL;
+	file->hash = hash;
+	file->dir = NULL;
+	file->has_packed = false;
+	file->pinned = false;
+	clock_ring_add(file);
+	stats_add(&stats_thread()->files, 1);
+	memcpy(name_copy, name, name_len);
+	name_copy[name_len] = 0;
+	file->name = name_copy;
+	return file;
+}
+
+static pthread_once_t ufs_init_once = PTHREAD_ONCE_INIT;
+
+/** Create the global objects. */
+static void
+ufs_init(void)
+{
+	for(int i = SLAB_MIN_CLASS; i <= SLAB_MAX_CLASS; i++)
+		slab_cache_create(&size_classes[i - SLAB_MIN_CLASS], (size_t)1 << i, SLAB_ALIGN);
+	slab_cache_create(&page_cache, EXTENT_MIN, EXTENT_MIN);
+	/* Untouched anonymous pages all map the same zero page */
+	void *zeros = mmap(NULL, EXTENT_MAX, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(zeros == MAP_FAILED)
+		abort();
+	zero_data = (const char *)zeros;
+	for(int i = 0; i < NAME_SHARD_COUNT; i++) {
+		pthread_rwlock_init(&name_shards[i].lock, NULL);
+		name_shards[i].index = (struct name_index){NULL, 0, 0};
+	}
+	for(int i = 0; i < CLOCK_RING_COUNT; i++) {
+		pthread_mutex_init(&clock_rings[i].lock, NULL);
+		clock_rings[i].hand = NULL;
+		clock_rings[i].count = 0;
+	}
+	struct dir *root = (struct dir *)meta_alloc(sizeof(struct dir));
+	root_dir = file_new("", 0, 0, 1);
+	if(root == NULL || root_dir == NULL)
+		abort();
+	stats_add(&stats_thread()->dirs, 1);
+	root->shards = name_shards;
+	root->shard_mask = NAME_SHARD_COUNT - 1;
+	atomic_init(&root->dead, false);
+	root->is_root = true;
+	root->parent = NULL;
+	root_dir->dir = root;
+	for(int i = 0; i < PATH_CACHE_SIZE; i++) {
+		pthread_mutex_init(&path_cache[i].lock, NULL);
+		path_cache[i].path = NULL;
+		path_cache[i].dir = NULL;
+	}
+	for(int i = 0; i < FD_SHARD_COUNT; i++) {
+		pthread_mutex_init(&fd_shards[i].lock, NULL);
+		fd_shards[i].free = NULL;
+		fd_shards[i].free_count = 0;
+		fd_shards[i].free_capacity = 0;
+		fd_shards[i].free_descs = NULL;
+	}
+}
+
+enum ufs_error_code
+ufs_errno()
+{
+	return ufs_error_code;
+}
+
+/**
+ * Allocate an empty directory index of @a shard_count shards, a
+ * power of two up to NAME_SHARD_COUNT.
+ * @retval NULL Not enough memory.
+ */
+static struct dir *
+dir_new(uint32_t shard_count)
+{
+	struct dir *dir = (struct dir *)meta_alloc(sizeof(struct dir));
+	if(dir == NULL)
+		return NULL;
+	dir->shards = (struct name_shard *)meta_alloc(shard_count * sizeof(struct name_shard));
+	if(dir->shards == NULL) {
+		meta_free(dir, sizeof(struct dir));
+		return NULL;
+	}
+	stats_add(&stats_thread()->dirs, 1);
+	dir->shard_mask = shard_count - 1;
+	atomic_init(&dir->dead, false);
+	dir->is_root = false;
+	dir->parent = NULL;
+	for(uint32_t i = 0; i < shard_count; i++) {
+		pthread_rwlock_init(&dir->shards[i].lock, NULL);
+		dir->shards[i].index = (struct name_index){NULL, 0, 0};
+	}
+	return dir;
+}
+
+/** Unreference all entries of a directory and free it. */
+static void
+dir_delete(struct dir *dir)
+{
+	for(uint32_t i = 0; i <= dir->shard_mask; i++) {
+		name_index_destroy(&dir->shards[i].index);
+		pthread_rwlock_destroy(&dir->shards[i].lock);
+	}
+	if(dir->shards != name_shards)
+		meta_free(dir->shards, (dir->shard_mask + 1) * sizeof(struct name_shard));
+	stats_add(&stats_thread()->dirs, -1);
+	meta_free(dir, sizeof(struct dir));
+}
+
+/**
+ * Allocate a directory which is not linked anywhere yet.
+ * @param refs Initial reference count.
+ */
+static struct file *
+dir_file_new(const char *name, size_t name_len, uint32_t hash, int refs,
+	     uint32_t shard_count)
+{
+	struct file *file = file_new(name, name_len, hash, refs);
+	if(file == NULL)
+		return NULL;
+	if((file->dir = dir_new(shard_count)) == NULL) {
+		file_free(file);
+		return NULL;
+	}
+	return file;
+}
+
+/** Drop a reference returned by a path lookup. */
+static inline void
+lookup_unref(struct file *file)
+{
+	if(file->dir == NULL || !file->dir->is_root)
+		file_unref(file);
+}
+
+/**
+ * Find an entry of a directory.
+ * @retval NULL No such entry.
+ * @retval not NULL The entry, the caller owns a reference to it.
+ */
+static struct file *
+dir_find(struct file *dir, const char *name, size_t len, uint32_t hash)
+{
+	struct name_shard *shard = dir_shard(dir->dir, hash);
+	struct file *file = NULL;
+	pthread_rwlock_rdlock(&shard->lock);
+	int64_t slot = name_index_find(&shard->index, name, len, hash);
+	if(slot >= 0) {
+		file = shard->index.slots[slot].file;
+		/* The name reference keeps it alive until this one is taken */
+		atomic_fetch_add(&file->refs, 1);
+	}
+	pthread_rwlock_unlock(&shard->lock);
+	return file;
+}
+
+/**
+ * Find an entry of a directory, creating it if there is none.
+ * @param is_dir Create a directory rather than a file.
+ * @param[out] created Whether the entry is a new one.
+ * @retval NULL Error, ufs_error_code is set.
+ * @retval not NULL The entry, the caller owns a reference to it.
+ */
+static struct file *
+dir_find_or_create(struct file *dir, const char *name, size_t len,
+		   bool is_dir, bool *created)
+{
+	uint32_t hash = name_hash(name, len);
+	*created = false;
+	struct file *file = dir_find(dir, name, len, hash);
+	if(file != NULL)
+		return file;
+	/* One for the name and one for the caller */
+	struct file *new_file = is_dir ? dir_file_new(name, len, hash, 2, 1) :
+				file_new(name, len, hash, 2);
+	if(new_file == NULL) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return NULL;
+	}
+	if(is_dir)
+		new_file->dir->parent = dir;
+	struct name_shard *shard = dir_shard(dir->dir, hash);
+	pthread_rwlock_wrlock(&shard->lock);
+	/* Somebody could create it or delete the directory while the lock was released */
+	int64_t slot = name_index_find(&shard->index, name, len, hash);
+	if(slot >= 0) {
+		file = shard->index.slots[slot].file;
+		atomic_fetch_add(&file->refs, 1);
+	}
+	else if(atomic_load(&dir->dir->dead)) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+	}
+	else if(name_index_insert(&shard->index, new_file) == 0) {
+		file = new_file;
+		new_file = NULL;
+		*created = true;
+	}
+	else {
+		ufs_error_code = UFS_ERR_NO_MEM;
+	}
+	pthread_rwlock_unlock(&shard->lock);
+	if(new_file != NULL)
+		file_free(new_file);
+	return file;
+}
+
+/**
+ * Find a directory in the path cache.
+ * @retval NULL Not cached.
+ * @retval not NULL The directory, the caller owns a reference.
+ */
+static struct file *
+path_cache_get(const char *path, size_t len, uint32_t hash)
+{
+	struct path_cache_entry *entry = &path_cache[hash & (PATH_CACHE_SIZE - 1)];
+	struct file *dir = NULL;
+	pthread_mutex_lock(&entry->lock);
+	if(entry->dir != NULL && entry->gen == atomic_load(&namespace_gen) &&
+	   entry->hash == hash && entry->len == len &&
+	   memcmp(entry->path, path, len) == 0) {
+		dir = entry->dir;
+		atomic_fetch_add(&dir->refs, 1);
+	}
+	pthread_mutex_unlock(&entry->lock);
+	return dir;
+}
+
+/** Remember a directory found by path when namespace_gen was @a gen. */
+static void
+path_cache_put(const char *path, size_t len, uint32_t hash, uint64_t gen,
+	       struct file *dir)
+{
+	char *path_copy = (char *)malloc(len);
+	if(path_copy == NULL)
+		return;
+	memcpy(path_copy, path, len);
+	atomic_fetch_add(&dir->refs, 1);
+	struct path_cache_entry *entry = &path_cache[hash & (PATH_CACHE_SIZE - 1)];
+	pthread_mutex_lock(&entry->lock);
+	char *old_path = entry->path;
+	struct file *old_dir = entry->dir;
+	entry->gen = gen;
+	entry->hash = hash;
+	entry->path = path_copy;
+	entry->len = len;
+	entry->dir = dir;
+	pthread_mutex_unlock(&entry->lock);
+	free(old_path);
+	if(old_dir != NULL)
+		file_unref(old_dir);
+}
+
+/** "." and ".." can not be names, there are no such links. */
+static inline bool
+name_is_dots(const char *name, size_t len)
+{
+	return (len == 1 || len == 2) && name[0] == '.' && name[len - 1] == '.';
+}
+
+/**
+ * Walk all components of a path but the last one. Components are
+ * separated by slashes, leading, trailing and repeated slashes are
+ * ignored.
+ * @param root Directory the path starts from.
+ * @param cached Whether the path cache can be used, only for the
+ *        live namespace.
+ * @param[out] name The last component, not terminated.
+ * @param[out] name_len Its length, 0 when the path names the root.
+ * @retval NULL Error, ufs_error_code is set.
+ * @retval not NULL The directory holding the last component, to
+ *         be released with lookup_unref().
+ */
+static struct file *
+path_parent(struct file *root, const char *path, bool cached,
+	    const char **name, size_t *name_len)
+{
+	const char *end = path + strlen(path);
+	while(end > path && end[-1] == '/')
+		end--;
+	const char *last = end;
+	while(last > path && last[-1] != '/')
+		last--;
+	*name = last;
+	*name_len = end - last;
+	if(name_is_dots(last, end - last)) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return NULL;
+	}
+	const char *dir_end = last;
+	while(dir_end > path && dir_end[-1] == '/')
+		dir_end--;
+	size_t dir_len = dir_end - path;
+	uint32_t hash = 0;
+	uint64_t gen = 0;
+	if(cached && dir_len != 0) {
+		hash = name_hash(path, dir_len);
+		struct file *dir = path_cache_get(path, dir_len, hash);
+		if(dir != NULL)
+			return dir;
+		/* Read before the walk, a change during it fails the entry */
+		gen = atomic_load(&namespace_gen);
+	}
+	struct file *dir = root;
+	const char *pos = path;
+	while(pos < dir_end) {
+		while(*pos == '/')
+			pos++;
+		size_t len = strcspn(pos, "/");
+		struct file *next = NULL;
+		if(name_is_dots(pos, len))
+			ufs_error_code = UFS_ERR_INVALID_ARG;
+		else if((next = dir_find(dir, pos, len, name_hash(pos, len))) == NULL)
+			ufs_error_code = UFS_ERR_NO_FILE;
+		else if(next->dir == NULL)
+			ufs_error_code = UFS_ERR_NOT_DIR;
+		lookup_unref(dir);
+		if(next == NULL || next->dir == NULL) {
+			if(next != NULL)
+				file_unref(next);
+			return NULL;
+		}
+		dir = next;
+		pos += len;
+	}
+	if(cached && dir_len != 0)
+		path_cache_put(path, dir_len, hash, gen, dir);
+	return dir;
+}
+
+/**
+ * Find a file or a directory by path.
+ * @retval NULL Error, ufs_error_code is set.
+ * @retval not NULL The entry, to be released with lookup_unref().
+ */
+static struct file *
+path_lookup(struct file *root, const char *path, bool cached)
+{
+	const char *name;
+	size_t len;
+	struct file *dir = path_parent(root, path, cached, &name, &len);
+	if(dir == NULL || len == 0)
+		return dir;
+	struct file *file = dir_find(dir, name, len, name_hash(name, len));
+	lookup_unref(dir);
+	if(file == NULL)
+		ufs_error_code = UFS_ERR_NO_FILE;
+	return file;
+}
+
+/**
+ * Find a regular file by path, creating it if asked.
+ * @retval NULL Error, ufs_error_code is set.
+ * @retval not NULL The file, the caller owns a reference to it.
+ */
+static struct file *
+file_lookup(const char *path, int create)
+{
+	pthread_once(&ufs_init_once, ufs_init);
+	struct file *file;
+	if(!create) {
+		file = path_lookup(root_dir, path, true);
+	}
+	else {
+		const char *name;
+		size_t len;
+		struct file *dir = path_parent(root_dir, path, true, &name, &len);
+		if(dir == NULL || len == 0) {
+			file = dir;
+		}
+		else {
+			bool created;
+			file = dir_find_or_create(dir, name, len, false, &created);
+			lookup_unref(dir);
+		}
+	}
+	if(file != NULL && file->dir != NULL) {
+		lookup_unref(file);
+		ufs_error_code = UFS_ERR_IS_DIR;
+		return NULL;
+	}
+	return file;
+}
+
+/**
+ * Open a descriptor on the file. Takes the caller's reference
+ * to the file, also on failure.
+ * @retval >= 0 Descriptor number.
+ * @retval -1 Not enough memory.
+ */
+static int
+filedesc_open(struct file *file, int flags)
+{
+	struct fd_shard *shard = fd_shard_mine();
+	pthread_mutex_lock(&shard->lock);
+	struct filedesc *new_filedesc = shard->free_descs;
+	if(new_filedesc != NULL)
+		shard->free_descs = new_filedesc->next;
+	pthread_mutex_unlock(&shard->lock);
+	if(new_filedesc == NULL)
+		new_filedesc = (struct filedesc *)meta_alloc(sizeof(struct filedesc));
+	if(new_filedesc == NULL) {
+		file_unref(file);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	pthread_mutex_init(&new_filedesc->pos_lock, NULL);
+	new_filedesc->file = file;
+	new_filedesc->pos = 0;
+	new_filedesc->regime = flags;
+	atomic_store(&new_filedesc->refs, 1);
+	pthread_mutex_lock(&file->desc_lock);
+	new_filedesc->prev = NULL;
+	new_filedesc->next = file->desc_list;
+	if(file->desc_list != NULL)
+		file->desc_list->prev = new_filedesc;
+	file->desc_list = new_filedesc;
+	pthread_mutex_unlock(&file->desc_lock);
+	/* Add a new file descriptor to the table */
+	int fd = fd_alloc(new_filedesc);
+	if(fd < 0) {
+		filedesc_put(new_filedesc);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	return fd;
+}
+
+int
+ufs_open(const char *filename, int flags)
+{
+	uint64_t start = stats_start(UFS_OP_OPEN);
+	/* Try to find the file by name and create file descriptor if it is success */
+	struct file *file = file_lookup(filename, flags & UFS_CREATE);
+	int rc = file == NULL ? -1 : filedesc_open(file, flags);
+	stats_finish(UFS_OP_OPEN, start, rc, false);
+	return rc;
+}
+
+/**
+ * Get a descriptor allowed to write and take a reference to it,
+ * or NULL with an error set.
+ */
+static struct filedesc *
+fd_get_for_write(int fd)
+{
+	/* Check whether a file descriptor #fd exists */
+	struct filedesc *desc = fd_get(fd);
+	if(desc == NULL) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return NULL;
+	}
+	/* Check permissions of the work */
+	if(desc->regime & UFS_READ_ONLY) {
+		filedesc_put(desc);
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return NULL;
+	}
+	return desc;
+}
+
+/**
+ * Get a descriptor allowed to read and take a reference to it,
+ * or NULL with an error set.
+ */
+static struct filedesc *
+fd_get_for_read(int fd)
+{
+	struct filedesc *desc = fd_get(fd);
+	if(desc == NULL) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return NULL;
+	}
+	if(desc->regime & UFS_WRITE_ONLY) {
+		filedesc_put(desc);
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return NULL;
+	}
+	return desc;
+}
+
+/**
+ * Write at the end of the file for a descriptor opened with
+ * UFS_APPEND. The position moves to the end of the written data.
+ */
+static ssize_t
+filedesc_append(struct filedesc *desc, const struct iovec *iov, int iovcnt, size_t size)
+{
+	struct file *file = desc->file;
+	size_t end;
+	ssize_t rc = size;
+	/* The position is stored under the file lock, see filedesc.pos */
+	pthread_mutex_lock(&desc->pos_lock);
+	pthread_rwlock_rdlock(&file->lock);
+	bool done = file_append_shared(file, iov, iovcnt, size, &end);
+	if(done)
+		desc->pos = end;
+	pthread_rwlock_unlock(&file->lock);
+	if(!done)
+		rc = file_append_locked(file, iov, iovcnt, size, &desc->pos);
+	pthread_mutex_unlock(&desc->pos_lock);
+	return rc;
+}
+
+static ssize_t
+filedesc_write(struct filedesc *desc, const char *buf, size_t size)
+{
+	if(desc->regime & UFS_APPEND) {
+		struct iovec iov = {(void *)buf, size};
+		return filedesc_append(desc, &iov, 1, size);
+	}
+	struct file *file = desc->file;
+	pthread_mutex_lock(&desc->pos_lock);
+	file_wrlock_data(file, &desc->pos, size);
+	ssize_t rc = file_write(file, buf, size, desc->pos);
+	if(rc > 0)
+		desc->pos += rc;
+	pthread_rwlock_unlock(&file->lock);
+	pthread_mutex_unlock(&desc->pos_lock);
+	return rc;
+}
+
+ssize_t
+ufs_write(int fd, const char *buf, size_t size)
+{
+	uint64_t start = stats_start(UFS_OP_WRITE);
+	struct filedesc *desc = fd_get_for_write(fd);
+	ssize_t rc = desc == NULL ? -1 : filedesc_write(desc, buf, size);
+	filedesc_put(desc);
+	stats_finish(UFS_OP_WRITE, start, rc, true);
+	return rc;
+}
+
+static ssize_t
+filedesc_read(struct filedesc *desc, char *buf, size_t size)
+{
+	struct file *file = desc->file;
+	pthread_mutex_lock(&desc->pos_lock);
+	if(file_rdlock_data(file, &desc->pos, size) != 0) {
+		pthread_mutex_unlock(&desc->pos_lock);
+		return -1;
+	}
+	ssize_t rc = file_read(file, buf, size, desc->pos);
+	desc->pos += rc;
+	pthread_rwlock_unlock(&file->lock);
+	pthread_mutex_unlock(&desc->pos_lock);
+	return rc;
+}
+
+ssize_t
+ufs_read(int fd, char *buf, size_t size)
+{
+	uint64_t start = stats_start(UFS_OP_READ);
+	struct filedesc *desc = fd_get_for_read(fd);
+	ssize_t rc = desc == NULL ? -1 : filedesc_read(desc, buf, size);
+	filedesc_put(desc);
+	stats_finish(UFS_OP_READ, start, rc, true);
+	return rc;
+}
+
+static ssize_t
+filedesc_pwrite(struct filedesc *desc, const char *buf, size_t size, size_t offset)
+{
+	struct file *file = desc->file;
+	file_wrlock_data(file, &offset, size);
+	ssize_t rc = file_write(file, buf, size, offset);
+	pthread_rwlock_unlock(&file->lock);
+	return rc;
+}
+
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset)
+{
+	uint64_t start = stats_start(UFS_OP_PWRITE);
+	struct filedesc *desc = fd_get_for_write(fd);
+	ssize_t rc = desc == NULL ? -1 : filedesc_pwrite(desc, buf, size, offset);
+	filedesc_put(desc);
+	stats_finish(UFS_OP_PWRITE, start, rc, true);
+	return rc;
+}
+
+static ssize_t
+filedesc_pread(struct filedesc *desc, char *buf, size_t size, size_t offset)
+{
+	struct file *file = desc->file;
+	if(file_rdlock_data(file, &offset, size) != 0)
+		return -1;
+	ssize_t rc = file_read(file, buf, size, offset);
+	pthread_rwlock_unlock(&file->lock);
+	return rc;
+}
+
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset)
+{
+	uint64_t start = stats_start(UFS_OP_PREAD);
+	struct filedesc *desc = fd_get_for_read(fd);
+	ssize_t rc = desc == NULL ? -1 : filedesc_pread(desc, buf, size, offset);
+	filedesc_put(desc);
+	stats_finish(UFS_OP_PREAD, start, rc, true);
+	return rc;
+}
+
+static ssize_t
+filedesc_writev(struct filedesc *desc, const struct iovec *iov, int iovcnt)
+{
+	if(iovcnt < 0) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	struct file *file = desc->file;
+	size_t size = 0;
+	for(int i = 0; i < iovcnt; i++)
+		size = iov[i].iov_len > SIZE_MAX - size ? SIZE_MAX : size + iov[i].iov_len;
+	if(desc->regime & UFS_APPEND)
+		return filedesc_append(desc, iov, iovcnt, size);
+	pthread_mutex_lock(&desc->pos_lock);
+	file_wrlock_data(file, &desc->pos, size);
+	ssize_t total = 0;
+	for(int i = 0; i < iovcnt; i++) {
+		ssize_t rc = file_write(file, (const char *)iov[i].iov_base, iov[i].iov_len, desc->pos);
+		if(rc < 0) {
+			if(total == 0)
+				total = -1;
+			break;
+		}
+		desc->pos += rc;
+		total += rc;
+		if((size_t)rc < iov[i].iov_len)
+			break;
+	}
+	pthread_rwlock_unlock(&file->lock);
+	pthread_mutex_unlock(&desc->pos_lock);
+	return total;
+}
+
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	uint64_t start = stats_start(UFS_OP_WRITEV);
+	struct filedesc *desc = fd_get_for_write(fd);
+	ssize_t rc = desc == NULL ? -1 : filedesc_writev(desc, iov, iovcnt);
+	filedesc_put(desc);
+	stats_finish(UFS_OP_WRITEV, start, rc, true);
+	return rc;
+}
+
+static ssize_t
+filedesc_readv(struct filedesc *desc, const struct iovec *iov, int iovcnt)
+{
+	if(iovcnt < 0) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	struct file *file = desc->file;
+	size_t size = 0;
+	for(int i = 0; i < iovcnt; i++)
+		size = iov[i].iov_len > SIZE_MAX - size ? SIZE_MAX : size + iov[i].iov_len;
+	pthread_mutex_lock(&desc->pos_lock);
+	if(file_rdlock_data(file, &desc->pos, size) != 0) {
+		pthread_mutex_unlock(&desc->pos_lock);
+		return -1;
+	}
+	ssize_t total = 0;
+	for(int i = 0; i < iovcnt; i++) {
+		ssize_t rc = file_read(file, (char *)iov[i].iov_base, iov[i].iov_len, desc->pos);
+		desc->pos += rc;
+		total += rc;
+		if((size_t)rc < iov[i].iov_len)
+			break;
+	}
+	pthread_rwlock_unlock(&file->lock);
+	pthread_mutex_unlock(&desc->pos_lock);
+	return total;
+}
+
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	uint64_t start = stats_start(UFS_OP_READV);
+	struct filedesc *desc = fd_get_for_read(fd);
+	ssize_t rc = desc == NULL ? -1 : filedesc_readv(desc, iov, iovcnt);
+	filedesc_put(desc);
+	stats_finish(UFS_OP_READV, start, rc, true);
+	return rc;
+}
+
+static ssize_t
+filedesc_read_view(struct filedesc *desc, size_t size, struct ufs_view *view)
+{
+	struct file *file = desc->file;
+	pthread_mutex_lock(&desc->pos_lock);
+	if(file_rdlock_data(file, &desc->pos, size) != 0) {
+		pthread_mutex_unlock(&desc->pos_lock);
+		return -1;
+	}
+	size_t offset = desc->pos;
+	size_t file_size = file->size;
+	if(offset >= file_size)
+		size = 0;
+	else if(size > file_size - offset)
+		size = file_size - offset;
+	/* Each extent gives a span of data and a span of zeros at most */
+	size_t count = size == 0 ? 0 : 2 * (extent_number(offset + size - 1) - extent_number(offset) + 1);
+	view->iov = NULL;
+	view->pins = NULL;
+	if(count != 0) {
+		view->iov = (struct iovec *)malloc(count * sizeof(struct iovec));
+		view->pins = (void **)malloc(count * sizeof(void *));
+		if(view->iov == NULL || view->pins == NULL) {
+			pthread_rwlock_unlock(&file->lock);
+			pthread_mutex_unlock(&desc->pos_lock);
+			free(view->iov);
+			free(view->pins);
+			ufs_error_code = UFS_ERR_NO_MEM;
+			return -1;
+		}
+	}
+	size_t done = 0;
+	int iovcnt = 0;
+	while(done < size) {
+		size_t pos = offset + done;
+		size_t idx = extent_number(pos);
+		size_t in_ext = pos - extent_start(idx);
+		size_t len = extent_span(idx) - in_ext;
+		if(len > size - done)
+			len = size - done;
+		struct extent *ext = extent_find(file, idx);
+		if(ext != NULL)
+			extent_touch(ext);
+		const char *data;
+		size_t filled;
+		extent_locate(ext, in_ext, len, &data, &filled);
+		if(filled != 0) {
+			/* The reference keeps the data unchanged until release */
+			atomic_fetch_add(&ext->refs, 1);
+			view->pins[iovcnt] = ext;
+			view->iov[iovcnt].iov_base = (void *)data;
+			view->iov[iovcnt].iov_len = filled;
+			iovcnt++;
+		}
+		if(filled != len) {
+			view->pins[iovcnt] = NULL;
+			view->iov[iovcnt].iov_base = (void *)zero_data;
+			view->iov[iovcnt].iov_len = len - filled;
+			iovcnt++;
+		}
+		done += len;
+	}
+	view->iovcnt = iovcnt;
+	view->size = size;
+	desc->pos += size;
+	pthread_rwlock_unlock(&file->lock);
+	pthread_mutex_unlock(&desc->pos_lock);
+	return size;
+}
+
+ssize_t
+ufs_read_view(int fd, size_t size, struct ufs_view *view)
+{
+	uint64_t start = stats_start(UFS_OP_READ_VIEW);
+	struct filedesc *desc = fd_get_for_read(fd);
+	ssize_t rc = desc == NULL ? -1 : filedesc_read_view(desc, size, view);
+	filedesc_put(desc);
+	stats_finish(UFS_OP_READ_VIEW, start, rc, true);
+	return rc;
+}
+
+void
+ufs_view_release(struct ufs_view *view)
+{
+	for(int i = 0; i < view->iovcnt; i++)
+		if(view->pins[i] != NULL)
+			extent_unref((struct extent *)view->pins[i]);
+	free(view->iov);
+	free(view->pins);
+	view->iov = NULL;
+	view->pins = NULL;
+	view->iovcnt = 0;
+	view->size = 0;
+}
+
+/** Unmap the window of a mapping and unpin its extents. */
+static void
+mapping_destroy(struct ufs_mapping *map)
+{
+	if(map->window != NULL)
+		munmap(map->window, map->window_size);
+	for(int i = 0; i < map->pin_count; i++) {
+		struct extent *ext = (struct extent *)map->pins[i];
+		atomic_fetch_sub(&ext->mmaps, 1);
+		extent_unref(ext);
+	}
+	free(map->pins);
+	memset(map, 0, sizeof(*map));
+}
+
+/**
+ * Move the extents of the pages of [@a offset, @a offset + @a len)
+ * to the arena and map them one after another into a window.
+ */
+static int
+filedesc_mmap(struct filedesc *desc, size_t offset, size_t len, struct ufs_mapping *map)
+{
+	struct file *file = desc->file;
+	int prot = PROT_READ | ((desc->regime & UFS_READ_ONLY) ? 0 : PROT_WRITE);
+	memset(map, 0, sizeof(*map));
+	if(len == 0 || offset > MAX_FILE_SIZE || len > MAX_FILE_SIZE) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	/* Extents begin at page boundaries, so pages never span two */
+	size_t start = offset & ~(size_t)(EXTENT_MIN - 1);
+	size_t end = (offset + len + EXTENT_MIN - 1) & ~(size_t)(EXTENT_MIN - 1);
+	size_t first = extent_number(start);
+	size_t count = extent_number(end - 1) - first + 1;
+	pthread_once(&arena_once, arena_init);
+	char *base = atomic_load(&arena.base);
+	if(base == NULL) {
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	map->pins = (void **)malloc(count * sizeof(void *));
+	void *window = mmap(NULL, end - start, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(map->pins == NULL || window == MAP_FAILED) {
+		free(map->pins);
+		map->pins = NULL;
+		if(window != MAP_FAILED)
+			munmap(window, end - start);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	map->window = window;
+	map->window_size = end - start;
+	file_wrlock_data(file, &start, end - start);
+	if(offset > file->size || len > file->size - offset) {
+		pthread_rwlock_unlock(&file->lock);
+		mapping_destroy(map);
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	arena_force = true;
+	for(size_t idx = first; idx < first + count; idx++) {
+		size_t ext_start = extent_start(idx);
+		size_t from = start > ext_start ? start : ext_start;
+		size_t to = end < ext_start + extent_span(idx) ? end : ext_start + extent_span(idx);
+		struct extent *ext = extent_get_writable(file, idx, to - ext_start);
+		if(ext == NULL ||
+		   mmap((char *)window + (from - start), to - from, prot, MAP_SHARED | MAP_FIXED, arena.fd,
+			ext->data - base + (from - ext_start)) == MAP_FAILED) {
+			if(ext != NULL)
+				ufs_error_code = UFS_ERR_NO_MEM;
+			arena_force = false;
+			pthread_rwlock_unlock(&file->lock);
+			mapping_destroy(map);
+			return -1;
+		}
+		/* Written in place from now on and kept alive by the pin */
+		atomic_fetch_add(&ext->mmaps, 1);
+		atomic_fetch_add(&ext->refs, 1);
+		map->pins[map->pin_count++] = ext;
+	}
+	arena_force = false;
+	pthread_rwlock_unlock(&file->lock);
+	map->addr = (char *)window + (offset - start);
+	map->size = len;
+	return 0;
+}
+
+int
+ufs_mmap(int fd, size_t offset, size_t len, struct ufs_mapping *map)
+{
+	uint64_t start = stats_start(UFS_OP_MMAP);
+	struct filedesc *desc = fd_get_for_read(fd);
+	int rc = desc == NULL ? -1 : filedesc_mmap(desc, offset, len, map);
+	filedesc_put(desc);
+	stats_finish(UFS_OP_MMAP, start, rc == 0 ? (ssize_t)len : -1, true);
+	return rc;
+}
+
+void
+ufs_munmap(struct ufs_mapping *map)
+{
+	mapping_destroy(map);
+}
+
+int
+ufs_set_mmap_storage(int on)
+{
+	if(on) {
+		pthread_once(&arena_once, arena_init);
+		if(atomic_load(&arena.base) == NULL) {
+			ufs_error_code = UFS_ERR_IO;
+			return -1;
+		}
+	}
+	atomic_store(&arena.all_data, on != 0);
+	return 0;
+}
+
+static int
+filedesc_punch_hole(struct filedesc *desc, size_t offset, size_t len)
+{
+	struct file *file = desc->file;
+	pthread_rwlock_wrlock(&file->lock);
+	int rc = file_punch_hole(file, offset, len);
+	pthread_rwlock_unlock(&file->lock);
+	return rc;
+}
+
+int
+ufs_punch_hole(int fd, size_t offset, size_t len)
+{
+	uint64_t start = stats_start(UFS_OP_PUNCH_HOLE);
+	struct filedesc *desc = fd_get_for_write(fd);
+	int rc = desc == NULL ? -1 : filedesc_punch_hole(desc, offset, len);
+	filedesc_put(desc);
+	stats_finish(UFS_OP_PUNCH_HOLE, start, rc, false);
+	return rc;
+}
+
+static ssize_t
+filedesc_lseek(struct filedesc *desc, ssize_t offset, int whence)
+{
+	struct file *file = desc->file;
+	pthread_mutex_lock(&desc->pos_lock);
+	pthread_rwlock_rdlock(&file->lock);
+	ssize_t base;
+	switch(whence) {
+	case UFS_SEEK_SET:
+		base = 0;
+		break;
+	case UFS_SEEK_CUR:
+		base = desc->pos;
+		break;
+	case UFS_SEEK_END:
+		base = file->size;
+		break;
+	default:
+		base = -1;
+		break;
+	}
+	ssize_t rc = -1;
+	if(base < 0 || (offset < 0 && base + offset < 0) || (offset > 0 && offset > MAX_FILE_SIZE - base))
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+	else
+		rc = desc->pos = base + offset;
+	pthread_rwlock_unlock(&file->lock);
+	pthread_mutex_unlock(&desc->pos_lock);
+	return rc;
+}
+
+ssize_t
+ufs_lseek(int fd, ssize_t offset, int whence)
+{
+	uint64_t start = stats_start(UFS_OP_LSEEK);
+	struct filedesc *desc = fd_get(fd);
+	ssize_t rc = -1;
+	if(desc == NULL)
+		ufs_error_code = UFS_ERR_NO_FILE;
+	else
+		rc = filedesc_lseek(desc, offset, whence);
+	filedesc_put(desc);
+	stats_finish(UFS_OP_LSEEK, start, rc, false);
+	return rc;
+}
+
+static int
+filedesc_close(int fd)
+{
+	/* Check whether a file descriptor #fd exists */
+	struct filedesc *desc = fd_release(fd);
+	if(desc == NULL) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+	/*
+	 * Delete the descriptor after the calls still using it, and
+	 * the file if it was the last one of a deleted file
+	 */
+	filedesc_put(desc);
+	return 0;
+}
+
+int
+ufs_close(int fd)
+{
+	uint64_t start = stats_start(UFS_OP_CLOSE);
+	int rc = filedesc_close(fd);
+	stats_finish(UFS_OP_CLOSE, start, rc, false);
+	return rc;
+}
+
+static int
+path_delete(const char *filename)
+{
+	pthread_once(&ufs_init_once, ufs_init);
+	const char *name;
+	size_t len;
+	struct file *dir = path_parent(root_dir, filename, true, &name, &len);
+	if(dir == NULL)
+		return -1;
+	if(len == 0) {
+		ufs_error_code = UFS_ERR_IS_DIR;
+		return -1;
+	}
+	uint32_t hash = name_hash(name, len);
+	struct name_shard *shard = dir_shard(dir->dir, hash);
+	struct file *file = NULL;
+	pthread_rwlock_wrlock(&shard->lock);
+	int64_t slot = name_index_find(&shard->index, name, len, hash);
+	if(slot < 0) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+	}
+	else if(shard->index.slots[slot].file->dir != NULL) {
+		ufs_error_code = UFS_ERR_IS_DIR;
+	}
+	else {
+		file = shard->index.slots[slot].file;
+		name_index_remove(&shard->index, slot);
+	}
+	pthread_rwlock_unlock(&shard->lock);
+	lookup_unref(dir);
+	if(file == NULL)
+		return -1;
+	/* Opened descriptors keep the file until they are closed */
+	file_unref(file);
+	return 0;
+}
+
+int
+ufs_delete(const char *filename)
+{
+	uint64_t start = stats_start(UFS_OP_DELETE);
+	int rc = path_delete(filename);
+	stats_finish(UFS_OP_DELETE, start, rc, false);
+	return rc;
+}
+
+static int
+path_mkdir(const char *path)
+{
+	pthread_once(&ufs_init_once, ufs_init);
+	const char *name;
+	size_t len;
+	struct file *parent = path_parent(root_dir, path, true, &name, &len);
+	if(parent == NULL)
+		return -1;
+	if(len == 0) {
+		ufs_error_code = UFS_ERR_EXISTS;
+		return -1;
+	}
+	bool created;
+	struct file *dir = dir_find_or_create(parent, name, len, true, &created);
+	lookup_unref(parent);
+	if(dir == NULL)
+		return -1;
+	file_unref(dir);
+	if(!created) {
+		ufs_error_code = UFS_ERR_EXISTS;
+		return -1;
+	}
+	return 0;
+}
+
+int
+ufs_mkdir(const char *path)
+{
+	uint64_t start = stats_start(UFS_OP_MKDIR);
+	int rc = path_mkdir(path);
+	stats_finish(UFS_OP_MKDIR, start, rc, false);
+	return rc;
+}
+
+/**
+ * Delete all entries of a directory tree, and forbid creation of
+ * new ones in it: lookups which found the directory before it was
+ * unlinked can still try. Opened descriptors keep their files.
+ * The caller holds namespace_lock and owns a reference to the
+ * directory.
+ */
+static void
+dir_kill(struct file *node)
+{
+	struct dir *dir = node->dir;
+	for(uint32_t i = 0; i <= dir->shard_mask; i++) {
+		struct name_shard *shard = &dir->shards[i];
+		pthread_rwlock_wrlock(&shard->lock);
+		atomic_store(&dir->dead, true);
+		struct name_index index = shard->index;
+		shard->index = (struct name_index){NULL, 0, 0};
+		pthread_rwlock_unlock(&shard->lock);
+		for(uint32_t j = 0; j < index.capacity; j++) {
+			struct file *file = index.slots[j].file;
+			if(file != NULL && file->dir != NULL)
+				dir_kill(file);
+		}
+		name_index_destroy(&index);
+	}
+}
+
+static int
+path_rmdir(const char *path, int recursive)
+{
+	pthread_once(&ufs_init_once, ufs_init);
+	const char *name;
+	size_t len;
+	struct file *parent = path_parent(root_dir, path, true, &name, &len);
+	if(parent == NULL)
+		return -1;
+	if(len == 0) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	uint32_t hash = name_hash(name, len);
+	struct name_shard *shard = dir_shard(parent->dir, hash);
+	struct file *dir = NULL;
+	pthread_mutex_lock(&namespace_lock);
+	pthread_rwlock_wrlock(&shard->lock);
+	int64_t slot = name_index_find(&shard->index, name, len, hash);
+	if(slot < 0) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+	}
+	else if(shard->index.slots[slot].file->dir == NULL) {
+		ufs_error_code = UFS_ERR_NOT_DIR;
+	}
+	else {
+		dir = shard->index.slots[slot].file;
+		if(!recursive) {
+			/* Empty and dead at once, so nothing is created in it meanwhile */
+			struct name_shard *own = &dir->dir->shards[0];
+			pthread_rwlock_wrlock(&own->lock);
+			if(own->index.count == 0)
+				atomic_store(&dir->dir->dead, true);
+			else
+				dir = NULL;
+			pthread_rwlock_unlock(&own->lock);
+			if(dir == NULL)
+				ufs_error_code = UFS_ERR_NOT_EMPTY;
+		}
+		if(dir != NULL)
+			name_index_remove(&shard->index, slot);
+	}
+	pthread_rwlock_unlock(&shard->lock);
+	if(dir != NULL) {
+		dir_kill(dir);
+		atomic_fetch_add(&namespace_gen, 1);
+	}
+	pthread_mutex_unlock(&namespace_lock);
+	lookup_unref(parent);
+	if(dir == NULL)
+		return -1;
+	file_unref(dir);
+	return 0;
+}
+
+int
+ufs_rmdir(const char *path, int recursive)
+{
+	uint64_t start = stats_start(UFS_OP_RMDIR);
+	int rc = path_rmdir(path, recursive);
+	stats_finish(UFS_OP_RMDIR, start, rc, false);
+	return rc;
+}
+
+/** Check if a directory is @a ancestor or lies inside it. */
+static bool
+dir_is_inside(const struct file *dir, const struct file *ancestor)
+{
+	for(; dir != NULL; dir = dir->dir->parent) {
+		if(dir == ancestor)
+			return true;
+	}
+	return false;
+}
+
+/** Lock two shards for writing, they can be one. */
+static void
+shard_lock_pair(struct name_shard *a, struct name_shard *b)
+{
+	/* Always in address order, to not deadlock with a reverse pair */
+	if(a > b) {
+		struct name_shard *tmp = a;
+		a = b;
+		b = tmp;
+	}
+	pthread_rwlock_wrlock(&a->lock);
+	if(b != a)
+		pthread_rwlock_wrlock(&b->lock);
+}
+
+static int
+path_rename(const char *src, const char *dst)
+{
+	pthread_once(&ufs_init_once, ufs_init);
+	const char *src_name, *dst_name;
+	size_t src_len, dst_len;
+	struct file *src_dir = path_parent(root_dir, src, true, &src_name, &src_len);
+	if(src_dir == NULL)
+		return -1;
+	struct file *dst_dir = path_parent(root_dir, dst, true, &dst_name, &dst_len);
+	if(dst_dir == NULL) {
+		lookup_unref(src_dir);
+		return -1;
+	}
+	char *new_name = NULL;
+	if(src_len == 0 || dst_len == 0)
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+	else if((new_name = (char *)meta_alloc(dst_len + 1)) == NULL)
+		ufs_error_code = UFS_ERR_NO_MEM;
+	if(new_name == NULL) {
+		lookup_unref(src_dir);
+		lookup_unref(dst_dir);
+		return -1;
+	}
+	memcpy(new_name, dst_name, dst_len);
+	new_name[dst_len] = 0;
+	uint32_t src_hash = name_hash(src_name, src_len);
+	uint32_t dst_hash = name_hash(dst_name, dst_len);
+	struct name_shard *src_shard = dir_shard(src_dir->dir, src_hash);
+	struct name_shard *dst_shard = dir_shard(dst_dir->dir, dst_hash);
+	struct file *file = NULL, *old = NULL;
+	int rc = -1;
+	/* Directory parents are stable under it, see dir_is_inside() */
+	pthread_mutex_lock(&namespace_lock);
+	shard_lock_pair(src_shard, dst_shard);
+	int64_t src_slot = name_index_find(&src_shard->index, src_name, src_len, src_hash);
+	int64_t dst_slot = name_index_find(&dst_shard->index, dst_name, dst_len, dst_hash);
+	if(src_slot >= 0)
+		file = src_shard->index.slots[src_slot].file;
+	if(dst_slot >= 0)
+		old = dst_shard->index.slots[dst_slot].file;
+	if(file == NULL || atomic_load(&dst_dir->dir->dead)) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+	}
+	else if(old == file) {
+		rc = 0;
+	}
+	else if(old != NULL && old->dir != NULL) {
+		ufs_error_code = UFS_ERR_EXISTS;
+	}
+	else if(old != NULL && file->dir != NULL) {
+		ufs_error_code = UFS_ERR_NOT_DIR;
+	}
+	else if(file->dir != NULL && dir_is_inside(dst_dir, file)) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+	}
+	else if(name_index_reserve(&dst_shard->index) != 0) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+	}
+	else {
+		/* Slots move on growth and removal, find them again */
+		if(old != NULL) {
+			dst_slot = name_index_find(&dst_shard->index, dst_name, dst_len, dst_hash);
+			name_index_remove(&dst_shard->index, dst_slot);
+		}
+		src_slot = name_index_find(&src_shard->index, src_name, src_len, src_hash);
+		name_index_remove(&src_shard->index, src_slot);
+		char *old_name = file->name;
+		file->name = new_name;
+		file->hash = dst_hash;
+		new_name = old_name;
+		dst_len = strlen(old_name);
+		/* Can not fail, the space is reserved */
+		name_index_insert(&dst_shard->index, file);
+		if(file->dir != NULL)
+			file->dir->parent = dst_dir;
+		rc = 0;
+	}
+	pthread_rwlock_unlock(&src_shard->lock);
+	if(dst_shard != src_shard)
+		pthread_rwlock_unlock(&dst_shard->lock);
+	if(rc == 0 && file->dir != NULL && old != file)
+		atomic_fetch_add(&namespace_gen, 1);
+	pthread_mutex_unlock(&namespace_lock);
+	/* The replaced file lives while it is opened, like a deleted one */
+	if(rc == 0 && old != NULL && old != file)
+		file_unref(old);
+	meta_free(new_name, dst_len + 1);
+	lookup_unref(src_dir);
+	lookup_unref(dst_dir);
+	return rc;
+}
+
+int
+ufs_rename(const char *src, const char *dst)
+{
+	uint64_t start = stats_start(UFS_OP_RENAME);
+	int rc = path_rename(src, dst);
+	stats_finish(UFS_OP_RENAME, start, rc, false);
+	return rc;
+}
+
+static int
+path_readdir(const char *path, struct ufs_dirlist *list)
+{
+	pthread_once(&ufs_init_once, ufs_init);
+	list->entries = NULL;
+	list->count = 0;
+	struct file *node = path_lookup(root_dir, path, true);
+	if(node == NULL)
+		return -1;
+	if(node->dir == NULL) {
+		lookup_unref(node);
+		ufs_error_code = UFS_ERR_NOT_DIR;
+		return -1;
+	}
+	/* Only this directory is visited, not the whole namespace */
+	struct dir *dir = node->dir;
+	int capacity = 0;
+	int rc = 0;
+	for(uint32_t i = 0; i <= dir->shard_mask && rc == 0; i++) {
+		struct name_shard *shard = &dir->shards[i];
+		pthread_rwlock_rdlock(&shard->lock);
+		struct name_index *index = &shard->index;
+		if(list->count + (int)index->count > capacity) {
+			int new_capacity = capacity * 2;
+			if(new_capacity < list->count + (int)index->count)
+				new_capacity = list->count + index->count;
+			struct ufs_dirent *entries = (struct ufs_dirent *)realloc(
+				list->entries, new_capacity * sizeof(*entries));
+			if(entries == NULL) {
+				rc = -1;
+			}
+			else {
+				list->entries = entries;
+				capacity = new_capacity;
+			}
+		}
+		for(uint32_t j = 0; j < index->capacity && rc == 0; j++) {
+			struct file *file = index->slots[j].file;
+			if(file == NULL)
+				continue;
+			struct ufs_dirent *entry = &list->entries[list->count];
+			if((entry->name = strdup(file->name)) == NULL) {
+				rc = -1;
+				break;
+			}
+			entry->is_dir = file->dir != NULL;
+			list->count++;
+		}
+		pthread_rwlock_unlock(&shard->lock);
+	}
+	lookup_unref(node);
+	if(rc != 0) {
+		ufs_dirlist_release(list);
+		ufs_error_code = UFS_ERR_NO_MEM;
+	}
+	return rc;
+}
+
+int
+ufs_readdir(const char *path, struct ufs_dirlist *list)
+{
+	uint64_t start = stats_start(UFS_OP_READDIR);
+	int rc = path_readdir(path, list);
+	stats_finish(UFS_OP_READDIR, start, rc, false);
+	return rc;
+}
+
+void
+ufs_dirlist_release(struct ufs_dirlist *list)
+{
+	for(int i = 0; i < list->count; i++)
+		free(list->entries[i].name);
+	free(list->entries);
+	list->entries = NULL;
+	list->count = 0;
+}
+
+/** Lock a file for reading and another one for writing. */
+static void
+file_lock_pair(struct file *rd, struct file *wr)
+{
+	/* Always in address order, to not deadlock with a reverse pair */
+	if(rd < wr) {
+		pthread_rwlock_rdlock(&rd->lock);
+		pthread_rwlock_wrlock(&wr->lock);
+	}
+	else {
+		pthread_rwlock_wrlock(&wr->lock);
+		pthread_rwlock_rdlock(&rd->lock);
+	}
+}
+
+static int
+path_clone(const char *src, const char *dst)
+{
+	struct file *src_file = file_lookup(src, 0);
+	if(src_file == NULL)
+		return -1;
+	struct file *dst_file = file_lookup(dst, 1);
+	if(dst_file == NULL) {
+		file_unref(src_file);
+		return -1;
+	}
+	int rc = 0;
+	if(src_file != dst_file) {
+		file_lock_pair(src_file, dst_file);
+		rc = file_clone_data(dst_file, src_file);
+		pthread_rwlock_unlock(&src_file->lock);
+		pthread_rwlock_unlock(&dst_file->lock);
+		if(rc != 0)
+			ufs_error_code = UFS_ERR_NO_MEM;
+	}
+	file_unref(src_file);
+	file_unref(dst_file);
+	return rc;
+}
+
+int
+ufs_clone(const char *src, const char *dst)
+{
+	uint64_t start = stats_start(UFS_OP_CLONE);
+	int rc = path_clone(src, dst);
+	stats_finish(UFS_OP_CLONE, start, rc, false);
+	return rc;
+}
+
+/**
+ * Copy bytes [@a src_off, @a src_off + @a len) of @a src, which
+ * are before its end, to @a dst at @a dst_off. An extent of
+ * @a dst covered whole by an extent of @a src becomes shared with
+ * it, holes stay holes, only the rest is copied. The caller locks
+ * @a dst exclusively and @a src shared, or @a dst only if it is
+ * the same file and the ranges do not overlap.
+ * @retval >= 0 How many bytes were copied. It is less than
+ *         @a len only if memory ran out in the middle.
+ * @retval -1 Error, ufs_error_code is set.
+ */
+static ssize_t
+file_copy_range(struct file *dst, size_t dst_off, struct file *src, size_t src_off, size_t len)
+{
+	if(dst_off > MAX_FILE_SIZE || MAX_FILE_SIZE - dst_off < len) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	/* A gap after the old end stays a hole, the size grows after the data is in */
+	size_t done = 0;
+	while(done < len) {
+		size_t dst_pos = dst_off + done;
+		size_t src_pos = src_off + done;
+		size_t dst_idx = extent_number(dst_pos);
+		size_t src_idx = extent_number(src_pos);
+		size_t in_dst = dst_pos - extent_start(dst_idx);
+		size_t in_src = src_pos - extent_start(src_idx);
+		size_t piece = extent_span(dst_idx) - in_dst;
+		if(piece > len - done)
+			piece = len - done;
+		struct extent *ext = extent_find(src, src_idx);
+		if(in_dst == 0 && in_src == 0 && piece == extent_span(dst_idx) &&
+		   piece == extent_span(src_idx) && (ext == NULL || atomic_load(&ext->mmaps) == 0)) {
+			struct extent **slot = extent_slot(dst, dst_idx);
+			if(slot == NULL) {
+				ufs_error_code = UFS_ERR_NO_MEM;
+				break;
+			}
+			if(ext != NULL) {
+				atomic_fetch_add(&ext->refs, 1);
+				if(ext->data == NULL)
+					dst->has_packed = true;
+			}
+			if(*slot != NULL)
+				extent_unref(*slot);
+			*slot = ext;
+			done += piece;
+			continue;
+		}
+		/* An edge, or the extents do not line up */
+		if(piece > extent_span(src_idx) - in_src)
+			piece = extent_span(src_idx) - in_src;
+		size_t filled = 0;
+		if(ext != NULL && in_src < ext->capacity)
+			filled = ext->capacity - in_src < piece ? ext->capacity - in_src : piece;
+		struct extent *dst_ext = NULL;
+		if(filled != 0 && (dst_ext = extent_get_writable(dst, dst_idx, in_dst + filled)) == NULL)
+			break;
+		if(dst_ext != NULL) {
+			/*
+			 * In one file that could copy, grow or replace the
+			 * source extent, so it is looked up again
+			 */
+			ext = extent_find(src, src_idx);
+			struct extent *unpacked = NULL;
+			if(ext->data == NULL) {
+				/* Shared extents are not changed, the copy is temporary */
+				unpacked = extent_unpacked_copy(ext, 0);
+				if(unpacked == NULL)
+					break;
+				ext = unpacked;
+			}
+			memcpy(dst_ext->data + in_dst, ext->data + in_src, filled);
+			if(unpacked != NULL)
+				extent_unref(unpacked);
+		}
+		if(extent_zero_range(dst, dst_idx, in_dst + filled, in_dst + piece) != 0)
+			break;
+		done += piece;
+	}
+	if(done > 0 && dst_off + done > dst->size)
+		file_set_size(dst, dst_off + done);
+	if(done == 0 && len != 0)
+		return -1;
+	return done;
+}
+
+static ssize_t
+filedesc_copy_range(struct filedesc *src_desc, size_t src_off, struct filedesc *dst_desc,
+		    size_t dst_off, size_t len)
+{
+	struct file *src = src_desc->file;
+	struct file *dst = dst_desc->file;
+	if(src == dst)
+		pthread_rwlock_wrlock(&dst->lock);
+	else
+		file_lock_pair(src, dst);
+	/* Like a read, the copy stops at the end of the source */
+	if(src_off >= src->size)
+		len = 0;
+	else if(len > src->size - src_off)
+		len = src->size - src_off;
+	ssize_t rc;
+	if(src == dst && len != 0 && src_off < dst_off + len && dst_off < src_off + len) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		rc = -1;
+	}
+	else if(src == dst) {
+		rc = file_copy_range(dst, dst_off, src, src_off, len);
+	}
+	else {
+		/* Shared extents are not written in place by appends */
+		file_block_appends(src);
+		rc = file_copy_range(dst, dst_off, src, src_off, len);
+		file_unblock_appends(src);
+		pthread_rwlock_unlock(&src->lock);
+	}
+	pthread_rwlock_unlock(&dst->lock);
+	return rc;
+}
+
+ssize_t
+ufs_copy_range(int src_fd, size_t src_off, int dst_fd, size_t dst_off, size_t len)
+{
+	uint64_t start = stats_start(UFS_OP_COPY_RANGE);
+	struct filedesc *src_desc = fd_get_for_read(src_fd);
+	struct filedesc *dst_desc = src_desc == NULL ? NULL : fd_get_for_write(dst_fd);
+	ssize_t rc = dst_desc == NULL ? -1 : filedesc_copy_range(src_desc, src_off, dst_desc, dst_off, len);
+	filedesc_put(src_desc);
+	filedesc_put(dst_desc);
+	stats_finish(UFS_OP_COPY_RANGE, start, rc, true);
+	return rc;
+}
+
+struct ufs_snapshot {
+	/**
+	 * Copy of the root directory. Its files share extents with
+	 * the originals, and nothing in the tree is ever changed, so
+	 * it is read without contention.
+	 */
+	struct file *root;
+};
+
+/**
+ * Make a copy of a file sharing its extents. The caller holds the
+ * file lock.
+ * @retval NULL Not enough memory.
+ */
+static struct file *
+file_clone(struct file *file)
+{
+	struct file *clone = file_new(file->name, strlen(file->name), file->hash, 1);
+	if(clone == NULL)
+		return NULL;
+	if(file_clone_data(clone, file) != 0) {
+		file_free(clone);
+		return NULL;
+	}
+	return clone;
+}
+
+/**
+ * Lock the entries of a tree and the content of its files for
+ * reading, top-down. The caller holds namespace_lock.
+ */
+static void
+tree_rdlock(struct file *node)
+{
+	if(node->dir == NULL) {
+		pthread_rwlock_rdlock(&node->lock);
+		return;
+	}
+	for(uint32_t i = 0; i <= node->dir->shard_mask; i++) {
+		struct name_shard *shard = &node->dir->shards[i];
+		pthread_rwlock_rdlock(&shard->lock);
+		for(uint32_t j = 0; j < shard->index.capacity; j++)
+			if(shard->index.slots[j].file != NULL)
+				tree_rdlock(shard->index.slots[j].file);
+	}
+}
+
+static void
+tree_unlock(struct file *node)
+{
+	if(node->dir == NULL) {
+		pthread_rwlock_unlock(&node->lock);
+		return;
+	}
+	for(uint32_t i = 0; i <= node->dir->shard_mask; i++) {
+		struct name_shard *shard = &node->dir->shards[i];
+		for(uint32_t j = 0; j < shard->index.capacity; j++)
+			if(shard->index.slots[j].file != NULL)
+				tree_unlock(shard->index.slots[j].file);
+		pthread_rwlock_unlock(&shard->lock);
+	}
+}
+
+/**
+ * Copy a tree, its files share extents with the originals. The
+ * tree must not change meanwhile.
+ * @param shard_count Number of shards of the copy of @a node,
+ *        used when it is a directory.
+ * @retval NULL Not enough memory.
+ */
+static struct file *
+tree_clone(struct file *node, uint32_t shard_count)
+{
+	if(node->dir == NULL)
+		return file_clone(node);
+	struct file *clone = dir_file_new(node->name, strlen(node->name), node->hash,
+					  1, shard_count);
+	if(clone == NULL)
+		return NULL;
+	for(uint32_t i = 0; i <= node->dir->shard_mask; i++) {
+		const struct name_index *index = &node->dir->shards[i].index;
+		for(uint32_t j = 0; j < index->capacity; j++) {
+			struct file *entry = index->slots[j].file;
+			if(entry == NULL)
+				continue;
+			struct file *entry_clone = tree_clone(entry, 1);
+			struct name_shard *shard = dir_shard(clone->dir, entry->hash);
+			if(entry_clone == NULL ||
+			   name_index_insert(&shard->index, entry_clone) != 0) {
+				if(entry_clone != NULL)
+					file_free(entry_clone);
+				file_free(clone);
+				return NULL;
+			}
+			if(entry_clone->dir != NULL)
+				entry_clone->dir->parent = clone;
+		}
+	}
+	return clone;
+}
+
+struct ufs_snapshot *
+ufs_snapshot(void)
+{
+	pthread_once(&ufs_init_once, ufs_init);
+	struct ufs_snapshot *snap = (struct ufs_snapshot *)malloc(sizeof(*snap));
+	if(snap == NULL) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return NULL;
+	}
+	/*
+	 * Directory locks freeze the tree, locks of all files
+	 * freeze their content, so the copy is taken at one point
+	 * in time. Shared locks are enough for both.
+	 */
+	pthread_mutex_lock(&namespace_lock);
+	tree_rdlock(root_dir);
+	snap->root = tree_clone(root_dir, 1);
+	tree_unlock(root_dir);
+	pthread_mutex_unlock(&namespace_lock);
+	if(snap->root == NULL) {
+		free(snap);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return NULL;
+	}
+	snap->root->dir->is_root = true;
+	return snap;
+}
+
+int
+ufs_snapshot_open(struct ufs_snapshot *snap, const char *filename)
+{
+	struct file *file = path_lookup(snap->root, filename, false);
+	if(file == NULL)
+		return -1;
+	if(file->dir != NULL) {
+		lookup_unref(file);
+		ufs_error_code = UFS_ERR_IS_DIR;
+		return -1;
+	}
+	return filedesc_open(file, UFS_READ_ONLY);
+}
+
+/**
+ * Replace the whole namespace with the entries of @a new_root, a
+ * tree built aside with NAME_SHARD_COUNT shards in the root. The
+ * old entries are deleted. Takes the reference to @a new_root.
+ */
+static void
+namespace_replace(struct file *new_root)
+{
+	struct dir *dir = new_root->dir;
+	for(int i = 0; i < NAME_SHARD_COUNT; i++) {
+		struct name_index *index = &dir->shards[i].index;
+		for(uint32_t j = 0; j < index->capacity; j++) {
+			struct file *entry = index->slots[j].file;
+			if(entry != NULL && entry->dir != NULL)
+				entry->dir->parent = root_dir;
+		}
+	}
+	pthread_mutex_lock(&namespace_lock);
+	for(int i = 0; i < NAME_SHARD_COUNT; i++)
+		pthread_rwlock_wrlock(&name_shards[i].lock);
+	for(int i = 0; i < NAME_SHARD_COUNT; i++) {
+		struct name_index old = name_shards[i].index;
+		name_shards[i].index = dir->shards[i].index;
+		dir->shards[i].index = old;
+	}
+	for(int i = 0; i < NAME_SHARD_COUNT; i++)
+		pthread_rwlock_unlock(&name_shards[i].lock);
+	/* Old files are deleted, opened descriptors keep them alive */
+	dir_kill(new_root);
+	atomic_fetch_add(&namespace_gen, 1);
+	pthread_mutex_unlock(&namespace_lock);
+	file_unref(new_root);
+}
+
+int
+ufs_snapshot_restore(struct ufs_snapshot *snap)
+{
+	pthread_once(&ufs_init_once, ufs_init);
+	/* Build the new namespace aside, so a failure changes nothing */
+	struct file *root = tree_clone(snap->root, NAME_SHARD_COUNT);
+	if(root == NULL) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	root->dir->is_root = true;
+	namespace_replace(root);
+	return 0;
+}
+
+void
+ufs_snapshot_delete(struct ufs_snapshot *snap)
+{
+	file_unref(snap->root);
+	free(snap);
+}
+
+/**
+ * Persistent image of the filesystem. The file consists of:
+ *
+ *     header | extents | file table | extents | file table | ...
+ *
+ * The header takes the first page and points to the latest file
+ * table. A table lists every directory and file with its path,
+ * a directory before its entries; files with their size and the
+ * image offsets and sizes of their extents. Holes are simply not
+ * listed, and extents shared by clones are stored once. Extent
+ * data is aligned by its size up to a page, so mapped extents are
+ * page-aligned like the ones in memory. Everything is written in
+ * the native byte order.
+ *
+ * A checkpoint into the image the filesystem was loaded from or
+ * last saved to is incremental: only extents changed since then
+ * are appended, followed by a new table, and then the header is
+ * rewritten to point at it. Data already in the file is never
+ * overwritten, so a crash in the middle leaves the previous
+ * checkpoint intact, and mappings of the file stay valid. When
+ * superseded data takes more than half of the file, or the image
+ * is another one, the checkpoint writes a fresh file aside and
+ * renames it over the old one.
+ *
+ * Loading maps the file and makes extents point into the mapping,
+ * nothing is read or copied until it is accessed. A mapped extent
+ * is copied into memory on the first write, see
+ * extent_get_writable().
+ */
+
+enum {
+	IMAGE_VERSION = 3,
+	/** How many extents are written by one system call. */
+	IMAGE_BATCH = 64,
+};
+
+static const char image_magic[8] = "UFSIMG\0\0";
+
+struct image_header {
+	char magic[8];
+	uint32_t version;
+	/** Extent layout, it must match the one of the loader. */
+	uint16_t extent_min_shift;
+	uint16_t extent_max_shift;
+	/** Position and size of the current file table. */
+	uint64_t table_offset;
+	uint64_t table_size;
+	uint64_t file_count;
+	/** Where the next checkpoint appends data. */
+	uint64_t end;
+};
+
+enum {
+	/** The record is a directory, it has no size and extents. */
+	IMAGE_FILE_DIR = 1,
+};
+
+/**
+ * A file or a directory in the table. It is followed by the path
+ * with a terminating zero padded to 8 bytes, and then by
+ * extent_count image_extent_record.
+ */
+struct image_file_record {
+	uint64_t size;
+	uint32_t name_len;
+	uint32_t extent_count;
+	uint32_t flags;
+	uint32_t unused;
+};
+
+/**
+ * Extent number index lies in the image from offset, its memory
+ * has size bytes.
+ */
+struct image_extent_record {
+	uint64_t index;
+	uint64_t offset;
+	uint64_t size;
+};
+
+/** A mapped image file. Extents pointing into it keep it mapped. */
+struct image_map {
+	void *addr;
+	size_t size;
+	atomic_int refs;
+};
+
+static void
+image_map_unref(struct image_map *map)
+{
+	if(atomic_fetch_sub(&map->refs, 1) != 1)
+		return;
+	munmap(map->addr, map->size);
+	free(map);
+}
+
+/**
+ * The image the filesystem is attached to: the last loaded or
+ * saved one. Extents with image_id equal to its id are already in
+ * this file.
+ */
+static struct {
+	/** Serializes loads and checkpoints. */
+	pthread_mutex_t lock;
+	/** Opened image file, -1 if there is none. */
+	int fd;
+	char *path;
+	uint32_t id;
+	uint64_t end;
+	/** How much of the file the current table refers to. */
+	uint64_t live;
+	/** The last id given to an image. */
+	uint32_t last_id;
+} image = {PTHREAD_MUTEX_INITIALIZER, -1, NULL, 0, 0, 0, 0};
+
+/** Forget the attached image. */
+static void
+image_detach(void)
+{
+	if(image.fd >= 0)
+		close(image.fd);
+	free(image.path);
+	image.fd = -1;
+	image.path = NULL;
+}
+
+/** Give a new image an id no extent has yet. */
+static uint32_t
+image_new_id(void)
+{
+	if(++image.last_id == 0)
+		++image.last_id;
+	return image.last_id;
+}
+
+/** Write a whole vector, retrying short writes. */
+static int
+image_pwritev(int fd, struct iovec *iov, int iovcnt, uint64_t offset)
+{
+	while(iovcnt > 0) {
+		ssize_t rc = pwritev(fd, iov, iovcnt, offset);
+		if(rc < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		offset += rc;
+		while(iovcnt > 0 && (size_t)rc >= iov->iov_len) {
+			rc -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+	return 0;
+}
+
+/** State of one checkpoint. */
+struct image_writer {
+	int fd;
+	uint32_t id;
+	/** Where the next extent goes. */
+	uint64_t end;
+	/**
+	 * Extents and alignment padding appended but not written
+	 * yet, they start at batch_off.
+	 */
+	struct iovec batch[2 * IMAGE_BATCH];
+	int batch_count;
+	uint64_t batch_off;
+	/** The file table being built. */
+	char *table;
+	size_t table_size;
+	size_t table_capacity;
+	/** How many bytes of extents the table refers to. */
+	uint64_t data_size;
+	uint64_t file_count;
+	/** Path of the directory being saved. */
+	char *path;
+	size_t path_len;
+	size_t path_capacity;
+	/** The first error, UFS_ERR_NO_ERR while there is none. */
+	enum ufs_error_code error;
+};
+
+static void
+image_flush(struct image_writer *w)
+{
+	if(w->batch_count == 0 || w->error != UFS_ERR_NO_ERR)
+		return;
+	if(image_pwritev(w->fd, w->batch, w->batch_count, w->batch_off) != 0)
+		w->error = UFS_ERR_IO;
+	w->batch_count = 0;
+}
+
+/**
+ * Append first @a size bytes of an extent to the image and
+ * remember where they are now.
+ */
+static void
+image_add_extent_data(struct image_writer *w, struct extent *ext, size_t size)
+{
+	if(w->batch_count == 0)
+		w->batch_off = w->end;
+	size_t align = size < EXTENT_MIN ? EXTENT_MIN_CAPACITY : EXTENT_MIN;
+	size_t pad = (align - w->end % align) % align;
+	if(pad != 0) {
+		w->batch[w->batch_count].iov_base = (void *)zero_data;
+		w->batch[w->batch_count].iov_len = pad;
+		w->batch_count++;
+		w->end += pad;
+	}
+	/* A packed extent is unpacked only while it is written */
+	char *unpacked = NULL;
+	if(ext->data == NULL) {
+		if((unpacked = (char *)malloc(size)) == NULL) {
+			w->error = UFS_ERR_NO_MEM;
+			return;
+		}
+		if(extent_unpack_to(ext, unpacked, size) != 0) {
+			free(unpacked);
+			w->error = UFS_ERR_IO;
+			return;
+		}
+	}
+	w->batch[w->batch_count].iov_base = unpacked != NULL ? unpacked : ext->data;
+	w->batch[w->batch_count].iov_len = size;
+	w->batch_count++;
+	ext->image_id = w->id;
+	ext->image_off = w->end;
+	ext->image_size = size;
+	w->end += size;
+	if(unpacked != NULL || w->batch_count >= 2 * IMAGE_BATCH - 1)
+		image_flush(w);
+	free(unpacked);
+}
+
+/**
+ * Reserve space in the table.
+ * @retval Offset of the space in the table, it can move.
+ */
+static size_t
+image_table_reserve(struct image_writer *w, size_t size)
+{
+	if(size == 0)
+		return w->table_size;
+	if(w->table_size + size > w->table_capacity) {
+		size_t capacity = w->table_capacity == 0 ? 4096 : w->table_capacity;
+		while(capacity < w->table_size + size)
+			capacity *= 2;
+		char *table = (char *)realloc(w->table, capacity);
+		if(table == NULL) {
+			w->error = UFS_ERR_NO_MEM;
+			return 0;
+		}
+		w->table = table;
+		w->table_capacity = capacity;
+	}
+	size_t offset = w->table_size;
+	memset(w->table + offset, 0, size);
+	w->table_size += size;
+	return offset;
+}
 
-struct filedesc {
-	struct file *file;
-	struct block *block_to_act;
-	/* The position of the filedescriptor in the file*/
-	int pos;
-	/* A regime of the work */
-	int regime;
-	/* PUT HERE OTHER MEMBERS */
-};
+static void
+image_save_node(struct image_writer *w, const struct file *file,
+		struct radix_node *node, int level, size_t base,
+		uint32_t *extent_count)
+{
+	for(int i = 0; i < RADIX_FANOUT && w->error == UFS_ERR_NO_ERR; i++) {
+		if(node->slots[i] == NULL)
+			continue;
+		size_t idx = base + i * radix_span(level);
+		if(level > 1) {
+			image_save_node(w, file, (struct radix_node *)node->slots[i], level - 1, idx, extent_count);
+			continue;
+		}
+		struct extent *ext = (struct extent *)node->slots[i];
+		/* Unchanged and shared extents are already there */
+		if(ext->image_id != w->id) {
+			/* Bytes after the end of file are zeros, not worth saving */
+			size_t used = extent_used(file, idx, ext);
+			if(used == 0)
+				continue;
+			image_add_extent_data(w, ext, used);
+		}
+		struct image_extent_record rec = {idx, ext->image_off, ext->image_size};
+		size_t pos = image_table_reserve(w, sizeof(rec));
+		if(w->error != UFS_ERR_NO_ERR)
+			return;
+		memcpy(w->table + pos, &rec, sizeof(rec));
+		w->data_size += ext->image_size;
+		++*extent_count;
+	}
+}
 
 /**
- * An array of file descriptors. When a file descriptor is
- * created, its pointer drops here. When a file descriptor is
- * closed, its place in this array is set to NULL and can be
- * taken by next ufs_open() call.
+ * Save a file: append its changed extents and its table record
+ * with w->path.
  */
-static struct filedesc **file_descriptors = NULL;
-static int file_descriptor_count = 0;
-static int file_descriptor_capacity = 2000;
+static void
+image_save_file(struct image_writer *w, struct file *file)
+{
+	struct image_file_record rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.size = file->size;
+	rec.name_len = w->path_len;
+	rec.flags = file->dir != NULL ? IMAGE_FILE_DIR : 0;
+	size_t name_space = (rec.name_len + 8) & ~(size_t)7;
+	size_t pos = image_table_reserve(w, sizeof(rec) + name_space);
+	if(w->error != UFS_ERR_NO_ERR)
+		return;
+	memcpy(w->table + pos + sizeof(rec), w->path, rec.name_len);
+	if(file->root != NULL)
+		image_save_node(w, file, file->root, file->height, 0, &rec.extent_count);
+	if(w->error == UFS_ERR_NO_ERR)
+		memcpy(w->table + pos, &rec, sizeof(rec));
+	w->file_count++;
+}
 
-enum ufs_error_code
-ufs_errno()
+/**
+ * Save the entries of a directory, and of directories in it. The
+ * tree must not change meanwhile, it is a snapshot copy.
+ */
+static void
+image_save_dir(struct image_writer *w, const struct file *dir)
 {
-	return ufs_error_code;
+	size_t dir_len = w->path_len;
+	for(uint32_t i = 0; i <= dir->dir->shard_mask; i++) {
+		const struct name_index *index = &dir->dir->shards[i].index;
+		for(uint32_t j = 0; j < index->capacity && w->error == UFS_ERR_NO_ERR; j++) {
+			struct file *file = index->slots[j].file;
+			if(file == NULL)
+				continue;
+			size_t name_len = strlen(file->name);
+			size_t len = dir_len + (dir_len != 0) + name_len;
+			if(len + 1 > w->path_capacity) {
+				size_t capacity = w->path_capacity == 0 ? 256 : w->path_capacity;
+				while(capacity < len + 1)
+					capacity *= 2;
+				char *path = (char *)realloc(w->path, capacity);
+				if(path == NULL) {
+					w->error = UFS_ERR_NO_MEM;
+					return;
+				}
+				w->path = path;
+				w->path_capacity = capacity;
+			}
+			if(dir_len != 0)
+				w->path[dir_len] = '/';
+			memcpy(w->path + len - name_len, file->name, name_len + 1);
+			w->path_len = len;
+			/* A directory goes before its entries, the loader needs it */
+			image_save_file(w, file);
+			if(file->dir != NULL)
+				image_save_dir(w, file);
+			w->path_len = dir_len;
+		}
+	}
 }
 
 int
-ufs_open(const char *filename, int flags)
+ufs_image_checkpoint(const char *path)
 {
-	if(file_descriptors == NULL) {
-		file_descriptors = (struct filedesc **)malloc(sizeof(struct filedesc *)*file_descriptor_capacity);
-		for(int i=0; i<file_descriptor_capacity; i++)
-			file_descriptors[i] = NULL;
+	pthread_once(&ufs_init_once, ufs_init);
+	pthread_mutex_lock(&image.lock);
+	bool incremental = image.fd >= 0 && strcmp(image.path, path) == 0 &&
+			   image.end / 2 <= image.live;
+	struct image_writer w;
+	memset(&w, 0, sizeof(w));
+	char *tmp_path = NULL;
+	if(incremental) {
+		w.fd = image.fd;
+		w.id = image.id;
+		w.end = image.end;
 	}
-	/* Return error if there are too many file descriptors */
-	if(file_descriptor_count == file_descriptor_capacity) {
-		ufs_error_code = UFS_ERR_NO_FILE;
-		return -1;
+	else {
+		/* Written aside, the old file can be still mapped */
+		tmp_path = (char *)malloc(strlen(path) + 5);
+		if(tmp_path == NULL) {
+			pthread_mutex_unlock(&image.lock);
+			ufs_error_code = UFS_ERR_NO_MEM;
+			return -1;
+		}
+		sprintf(tmp_path, "%s.tmp", path);
+		w.fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if(w.fd < 0) {
+			free(tmp_path);
+			pthread_mutex_unlock(&image.lock);
+			ufs_error_code = UFS_ERR_IO;
+			return -1;
+		}
+		w.id = image_new_id();
+		w.end = EXTENT_MIN;
 	}
-	struct filedesc *new_filedesc = (struct filedesc *)malloc(sizeof(struct filedesc));
-	/* A flag signaling that a file with 'filename' exists */
-	int file_ok = 0;
-	/* Try to find a file in the file_list and create file descriptor if it is success*/ 
-	struct file *probe = (struct file *)malloc(sizeof(struct file));
-	if(file_list != NULL)
-		probe->next = file_list;
-	else
-		probe->next = NULL;
-	while(probe->next != NULL) {
-		probe = probe->next;
-		if(strcmp(probe->name, filename) == 0) {
-			new_filedesc->file = probe;
-			new_filedesc->block_to_act = probe->block_list;
-			new_filedesc->pos = 0;
-			probe->refs ++;
-			file_ok = 1;
-			break;
+	/*
+	 * Save a snapshot, so the files can be changed meanwhile.
+	 * Its references to the extents also make writers copy them
+	 * instead of changing while they are being written out.
+	 */
+	struct image_header header;
+	memset(&header, 0, sizeof(header));
+	struct ufs_snapshot *snap = ufs_snapshot();
+	if(snap == NULL) {
+		w.error = UFS_ERR_NO_MEM;
+	}
+	else {
+		image_save_dir(&w, snap->root);
+		header.file_count = w.file_count;
+		image_flush(&w);
+	}
+	if(w.error == UFS_ERR_NO_ERR) {
+		memcpy(header.magic, image_magic, sizeof(header.magic));
+		header.version = IMAGE_VERSION;
+		header.extent_min_shift = EXTENT_MIN_SHIFT;
+		header.extent_max_shift = EXTENT_MAX_SHIFT;
+		header.table_offset = w.end;
+		header.table_size = w.table_size;
+		header.end = w.end + w.table_size;
+		struct iovec table = {w.table, w.table_size};
+		struct iovec head = {&header, sizeof(header)};
+		/* The header goes last, when everything it points to is durable */
+		if(image_pwritev(w.fd, &table, 1, header.table_offset) != 0 ||
+		   fdatasync(w.fd) != 0 || image_pwritev(w.fd, &head, 1, 0) != 0 ||
+		   fdatasync(w.fd) != 0 ||
+		   (!incremental && rename(tmp_path, path) != 0))
+			w.error = UFS_ERR_IO;
+	}
+	if(snap != NULL)
+		ufs_snapshot_delete(snap);
+	free(w.table);
+	free(w.path);
+	if(w.error == UFS_ERR_NO_ERR && !incremental) {
+		char *new_path = strdup(path);
+		image_detach();
+		if(new_path != NULL) {
+			image.fd = w.fd;
+			image.path = new_path;
+			image.id = w.id;
+		}
+		else {
+			/* Just not attached, the next checkpoint is a full one */
+			close(w.fd);
 		}
 	}
-	/* Create new file */
-	if(!file_ok) {
-		if(!(flags & UFS_CREATE)) {
-			ufs_error_code = UFS_ERR_NO_FILE;
-			return -1;
+	else if(w.error != UFS_ERR_NO_ERR) {
+		/*
+		 * Extents could be marked saved at offsets which were
+		 * not written. Forget the image, the next checkpoint
+		 * writes a new one with a new id.
+		 */
+		if(incremental) {
+			image_detach();
 		}
 		else {
-			struct file *new_file = (struct file *)malloc(sizeof(struct file));
-			new_file->block_list = (struct block *)malloc(sizeof(struct block));
-			new_file->block_list->memory = NULL;
-			new_file->block_list->next = NULL;
-			new_file->block_list->prev = NULL;
-			new_file->block_list->occupied = 0;
-			new_file->last_block = new_file->block_list;
-			new_file->name = (const char *)malloc(sizeof(char)*strlen(filename));
-			memcpy((char*)new_file->name, filename, strlen(filename)+1);
-			new_file->next = NULL;
-			new_file->refs = 1;
-			new_file->occupied = 0;
-			new_file->deleted = 0;
-			if(file_list != NULL) {
-				new_file->prev = probe;
-				probe->next = new_file;
-			}
-			else {
-				new_file->prev = NULL;
-				file_list = new_file;
-			}
-			new_filedesc->file = new_file;
-			new_filedesc->block_to_act = new_file->block_list;
-			new_filedesc->pos = 0;
+			close(w.fd);
+			unlink(tmp_path);
 		}
 	}
-	new_filedesc->regime = flags;
-	/* Add a new file descriptor to the file_descriptors */
-	for(int i = 0; i < file_descriptor_capacity; i++)
-		if(file_descriptors[i] == NULL) {
-			file_descriptors[i] = new_filedesc;
-			file_descriptor_count ++;
-			return i;
+	free(tmp_path);
+	if(w.error != UFS_ERR_NO_ERR) {
+		pthread_mutex_unlock(&image.lock);
+		ufs_error_code = w.error;
+		return -1;
+	}
+	image.end = header.end;
+	image.live = EXTENT_MIN + w.data_size + w.table_size;
+	pthread_mutex_unlock(&image.lock);
+	return 0;
+}
+
+/**
+ * Build files of an image in the tree of @a root. Their extents
+ * point into the mapping.
+ * @retval 0 Success.
+ * @retval -1 Error, ufs_error_code is set.
+ */
+static int
+image_parse(struct image_map *map, const struct image_header *header,
+	    uint32_t id, struct file *root)
+{
+	const char *base = (const char *)map->addr;
+	const char *pos = base + header->table_offset;
+	const char *end = pos + header->table_size;
+	for(uint64_t i = 0; i < header->file_count; i++) {
+		struct image_file_record rec;
+		if((size_t)(end - pos) < sizeof(rec))
+			goto corrupted;
+		memcpy(&rec, pos, sizeof(rec));
+		pos += sizeof(rec);
+		size_t name_space = ((size_t)rec.name_len + 8) & ~(size_t)7;
+		bool is_dir = (rec.flags & IMAGE_FILE_DIR) != 0;
+		if(rec.size > MAX_FILE_SIZE || (size_t)(end - pos) < name_space ||
+		   memchr(pos, 0, rec.name_len + 1) != pos + rec.name_len ||
+		   (is_dir && (rec.size != 0 || rec.extent_count != 0)))
+			goto corrupted;
+		const char *path = pos;
+		pos += name_space;
+		if((size_t)(end - pos) / sizeof(struct image_extent_record) < rec.extent_count)
+			goto corrupted;
+		/* The tree is private yet, the lookups are not contended */
+		const char *name;
+		size_t name_len;
+		struct file *dir = path_parent(root, path, false, &name, &name_len);
+		if(dir == NULL)
+			goto corrupted;
+		uint32_t hash = name_hash(name, name_len);
+		struct name_index *index = &dir_shard(dir->dir, hash)->index;
+		lookup_unref(dir);
+		if(name_len == 0 || name_index_find(index, name, name_len, hash) >= 0)
+			goto corrupted;
+		struct file *file = is_dir ? dir_file_new(name, name_len, hash, 1, 1) :
+				    file_new(name, name_len, hash, 1);
+		if(file == NULL)
+			goto no_mem;
+		file_set_size(file, rec.size);
+		if(is_dir)
+			file->dir->parent = dir;
+		if(name_index_insert(index, file) != 0) {
+			file_free(file);
+			goto no_mem;
+		}
+		size_t extent_end = rec.size == 0 ? 0 : extent_number(rec.size - 1) + 1;
+		for(uint32_t j = 0; j < rec.extent_count; j++) {
+			struct image_extent_record ext_rec;
+			memcpy(&ext_rec, pos, sizeof(ext_rec));
+			pos += sizeof(ext_rec);
+			if(ext_rec.index >= extent_end || ext_rec.size == 0 ||
+			   ext_rec.size > extent_span(ext_rec.index) ||
+			   ext_rec.offset < EXTENT_MIN || ext_rec.offset > header->table_offset ||
+			   ext_rec.size > header->table_offset - ext_rec.offset)
+				goto corrupted;
+			struct extent **slot = extent_slot(file, ext_rec.index);
+			if(slot == NULL)
+				goto no_mem;
+			if(*slot != NULL)
+				goto corrupted;
+			struct extent *ext = (struct extent *)meta_alloc(sizeof(struct extent));
+			if(ext == NULL)
+				goto no_mem;
+			stats_add(&stats_thread()->extents, 1);
+			atomic_init(&ext->refs, 1);
+			ext->image_id = id;
+			ext->image_off = ext_rec.offset;
+			ext->image_size = ext_rec.size;
+			ext->map = map;
+			ext->data = (char *)base + ext_rec.offset;
+			ext->capacity = ext_rec.size;
+			ext->packed = NULL;
+			ext->spilled = false;
+			atomic_init(&ext->touched, true);
+			ext->incompressible = false;
+			atomic_init(&ext->mmaps, 0);
+			atomic_fetch_add(&map->refs, 1);
+			*slot = ext;
 		}
+	}
+	return 0;
+corrupted:
+	ufs_error_code = UFS_ERR_INVALID_ARG;
+	return -1;
+no_mem:
+	ufs_error_code = UFS_ERR_NO_MEM;
 	return -1;
 }
 
-ssize_t
-ufs_write(int fd, const char *buf, size_t size)
+int
+ufs_image_load(const char *path)
 {
-	/* Check whether a file descriptor #fd exists */
-	if(fd < 0 || fd > file_descriptor_capacity - 1 || file_descriptors[fd] == NULL) {
-		ufs_error_code = UFS_ERR_NO_FILE;
+	pthread_once(&ufs_init_once, ufs_init);
+	int fd = open(path, O_RDWR);
+	if(fd < 0) {
+		ufs_error_code = UFS_ERR_IO;
 		return -1;
 	}
-	/* Check permissions of the work */
-	if(file_descriptors[fd]->regime & UFS_READ_ONLY) {
-		ufs_error_code = UFS_ERR_NO_PERMISSION;
+	struct stat st;
+	struct image_header header;
+	if(fstat(fd, &st) != 0) {
+		close(fd);
+		ufs_error_code = UFS_ERR_IO;
 		return -1;
 	}
-	/* Extract file from file descriptor */
-	struct file *file_to_write = file_descriptors[fd]->file;
-	/* Check whether the file is short enought to write 'buf' */
-	if(MAX_FILE_SIZE - file_descriptors[fd]->pos < size) {
+	if(st.st_size < EXTENT_MIN ||
+	   pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+	   memcmp(header.magic, image_magic, sizeof(header.magic)) != 0 ||
+	   header.version != IMAGE_VERSION ||
+	   header.extent_min_shift != EXTENT_MIN_SHIFT ||
+	   header.extent_max_shift != EXTENT_MAX_SHIFT ||
+	   header.end > (uint64_t)st.st_size ||
+	   header.table_offset < EXTENT_MIN || header.table_offset > header.end ||
+	   header.table_size > header.end - header.table_offset) {
+		close(fd);
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	struct image_map *map = (struct image_map *)malloc(sizeof(*map));
+	if(map == NULL) {
+		close(fd);
 		ufs_error_code = UFS_ERR_NO_MEM;
 		return -1;
 	}
-	/* The number of bytes left to write */
-	int left_to_write = size;
-	/* Choose the last block in the file */
-	struct block *cur_block = file_descriptors[fd]->block_to_act;
-	if(cur_block->memory == NULL)
-		cur_block->memory = (char *)malloc(sizeof(char)*BLOCK_SIZE);
-	/* Write the 'buf' totally if there is enought memory in the last block */
-	int offset = file_descriptors[fd]->pos % BLOCK_SIZE;
-	if(BLOCK_SIZE - offset >= left_to_write) {
-		memcpy(cur_block->memory + offset, buf, size);
-		if(cur_block->occupied < offset + left_to_write) {
-			file_to_write->occupied += offset + left_to_write - cur_block->occupied;
-			cur_block->occupied = offset + left_to_write;
-		}
-		/* Create new block if previous one is full */
-		if(BLOCK_SIZE - offset == left_to_write) {
-			struct block *new_block = (struct block *)malloc(sizeof(struct block));
-			new_block->memory = (char *)malloc(sizeof(char)*BLOCK_SIZE);
-			new_block->occupied = 0;
-			new_block->next = NULL;
-			new_block->prev = cur_block;
-			cur_block->next = new_block;
-			cur_block = new_block;
-			file_to_write->last_block = cur_block;
-		}
-		left_to_write = 0;
+	/* Pages are read on access, the load itself touches only the table */
+	map->addr = mmap(NULL, header.end, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(map->addr == MAP_FAILED) {
+		free(map);
+		close(fd);
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	map->size = header.end;
+	/* The loader holds one reference, the extents take the rest */
+	atomic_init(&map->refs, 1);
+	pthread_mutex_lock(&image.lock);
+	uint32_t id = image_new_id();
+	struct file *root = dir_file_new("", 0, 0, 1, NAME_SHARD_COUNT);
+	int rc = -1;
+	if(root == NULL) {
+		ufs_error_code = UFS_ERR_NO_MEM;
 	}
 	else {
-		/* Write to the current block until it becomes full */
-		memcpy(cur_block->memory + offset, buf + size - left_to_write, BLOCK_SIZE - offset);
-		left_to_write -= BLOCK_SIZE - offset;
-		if(cur_block->occupied < BLOCK_SIZE) {
-			file_to_write->occupied += BLOCK_SIZE - cur_block->occupied;
-			cur_block->occupied = BLOCK_SIZE;
-		}
-		/* Rewrite following blocks */
-		while(cur_block->next != NULL) {
-			cur_block = cur_block->next;
-			if(left_to_write <= BLOCK_SIZE) {
-				memcpy(cur_block->memory, buf + size - left_to_write, left_to_write);
-				if(cur_block->occupied < left_to_write) {
-					file_to_write->occupied += left_to_write - cur_block->occupied;
-					cur_block->occupied = left_to_write;
-				}
-				file_descriptors[fd]->block_to_act = cur_block;
-				file_descriptors[fd]->pos += size;
-				return size;
-			}
-			memcpy(cur_block->memory, buf + size - left_to_write, BLOCK_SIZE);
-			left_to_write -= BLOCK_SIZE;
-			if(cur_block->occupied < BLOCK_SIZE) {
-				file_to_write->occupied += BLOCK_SIZE - cur_block->occupied;
-				cur_block->occupied = BLOCK_SIZE;
+		root->dir->is_root = true;
+		rc = image_parse(map, &header, id, root);
+		if(rc == 0)
+			namespace_replace(root);
+		else
+			file_unref(root);
+	}
+	char *new_path = rc == 0 ? strdup(path) : NULL;
+	if(new_path != NULL) {
+		image_detach();
+		image.fd = fd;
+		image.path = new_path;
+		image.id = id;
+		image.end = header.end;
+		image.live = header.end;
+	}
+	else {
+		close(fd);
+	}
+	pthread_mutex_unlock(&image.lock);
+	image_map_unref(map);
+	return rc;
+}
+
+/** Buffers of one ufs_compress_cold() pass. */
+struct pack_pass {
+	/** Copy of the extent being packed. */
+	char *raw;
+	/** Its packed data. */
+	char *packed;
+	/** How many bytes packing saved. */
+	size_t saved;
+};
+
+/**
+ * Pack extent @a idx of a file if it was not touched since the
+ * previous pass, otherwise mark it untouched. The data is copied
+ * under the shared lock and packed without locks, so users of the
+ * file wait for a copy only. The packed data replaces the extent
+ * data unless someone touched it meanwhile.
+ */
+static void
+file_pack_extent(struct file *file, size_t idx, struct pack_pass *pass)
+{
+	pthread_rwlock_rdlock(&file->lock);
+	struct extent *ext = extent_find(file, idx);
+	/* Shared extents can be pinned by views, they are not packed */
+	if(ext == NULL || ext->data == NULL || ext->map != NULL || file->pinned ||
+	   ext->capacity < EXTENT_MIN || ext->incompressible ||
+	   atomic_load(&ext->refs) > 1 || atomic_exchange(&ext->touched, false)) {
+		pthread_rwlock_unlock(&file->lock);
+		return;
+	}
+	size_t used = extent_used(file, idx, ext);
+	memcpy(pass->raw, ext->data, used);
+	pthread_rwlock_unlock(&file->lock);
+	if(used == 0)
+		return;
+	/* Not worth it unless an eighth is saved */
+	size_t size = lz_compress(pass->raw, used, pass->packed, used - used / 8);
+	char *packed = NULL;
+	if(size != 0) {
+		if(!memory_charge(size))
+			return;
+		if((packed = (char *)meta_alloc(size)) == NULL) {
+			memory_uncharge(size);
+			return;
+		}
+	}
+	pthread_rwlock_wrlock(&file->lock);
+	/* A new extent at the same address is touched too */
+	if(extent_find(file, idx) != ext || ext->data == NULL || file->pinned ||
+	   atomic_load(&ext->touched) || atomic_load(&ext->refs) > 1) {
+		pthread_rwlock_unlock(&file->lock);
+		if(packed != NULL) {
+			meta_free(packed, size);
+			memory_uncharge(size);
+		}
+		return;
+	}
+	if(packed == NULL) {
+		ext->incompressible = true;
+		pthread_rwlock_unlock(&file->lock);
+		atomic_fetch_add(&pack_stats.rejects, 1);
+		return;
+	}
+	memcpy(packed, pass->packed, size);
+	extent_data_free(ext->data, ext->capacity);
+	ext->data = NULL;
+	ext->packed = packed;
+	ext->packed_size = size;
+	ext->packed_used = used;
+	file->has_packed = true;
+	pthread_rwlock_unlock(&file->lock);
+	pass->saved += used - size;
+	atomic_fetch_add(&pack_stats.extents, 1);
+	atomic_fetch_add(&pack_stats.raw_bytes, used);
+	atomic_fetch_add(&pack_stats.packed_bytes, size);
+	atomic_fetch_add(&pack_stats.compressions, 1);
+}
+
+/** Pack cold extents of a file, see file_pack_extent(). */
+static void
+file_pack_cold(struct file *file, void *arg)
+{
+	struct pack_pass *pass = (struct pack_pass *)arg;
+	pthread_rwlock_rdlock(&file->lock);
+	size_t count = file->size == 0 ? 0 : extent_number(file->size - 1) + 1;
+	pthread_rwlock_unlock(&file->lock);
+	for(size_t idx = 0; idx < count; idx++)
+		file_pack_extent(file, idx, pass);
+	/* Once all is unpacked, readers stop looking for packed extents */
+	pthread_rwlock_rdlock(&file->lock);
+	bool unpacked = file->has_packed && file_packed_size(file, 0, SIZE_MAX) == 0;
+	pthread_rwlock_unlock(&file->lock);
+	if(unpacked) {
+		pthread_rwlock_wrlock(&file->lock);
+		file->has_packed = file_packed_size(file, 0, SIZE_MAX) != 0;
+		pthread_rwlock_unlock(&file->lock);
+	}
+}
+
+/**
+ * Call @a func for all files under a directory. The entries are
+ * taken with references, so no shard is locked during the calls.
+ * @retval 0 Success.
+ * @retval -1 Not enough memory.
+ */
+static int
+dir_walk_files(struct file *dir, void (*func)(struct file *, void *), void *arg)
+{
+	struct file **entries = NULL;
+	size_t count = 0;
+	int rc = 0;
+	for(uint32_t i = 0; i <= dir->dir->shard_mask && rc == 0; i++) {
+		struct name_shard *shard = &dir->dir->shards[i];
+		pthread_rwlock_rdlock(&shard->lock);
+		const struct name_index *index = &shard->index;
+		struct file **grown = index->count == 0 ? entries :
+			(struct file **)realloc(entries, (count + index->count) * sizeof(*entries));
+		if(grown == NULL && index->count != 0) {
+			rc = -1;
+		}
+		else {
+			entries = grown;
+			for(uint32_t j = 0; j < index->capacity; j++) {
+				struct file *file = index->slots[j].file;
+				if(file == NULL)
+					continue;
+				atomic_fetch_add(&file->refs, 1);
+				entries[count++] = file;
 			}
 		}
-		/* Create new block and write 'buf' to them totally */
-		while(left_to_write >= BLOCK_SIZE) {
-			struct block *new_block = (struct block *)malloc(sizeof(struct block));
-			new_block->memory = (char *)malloc(sizeof(char)*BLOCK_SIZE);
-			memcpy(new_block->memory, buf + size - left_to_write, BLOCK_SIZE);
-			new_block->occupied = BLOCK_SIZE;
-			new_block->next = NULL;
-			new_block->prev = cur_block;
-			cur_block->next = new_block;
-			cur_block = new_block;
-			left_to_write -= BLOCK_SIZE;
-			file_to_write->last_block = cur_block;
-			file_to_write->occupied += BLOCK_SIZE;
-		}
-		/* Create new block and write last data to it partially */
-		if(left_to_write >= 0) {
-			struct block *new_block = (struct block *)malloc(sizeof(struct block));
-			new_block->memory = (char *)malloc(sizeof(char)*BLOCK_SIZE);
-			memcpy(new_block->memory, buf + size - left_to_write, left_to_write);
-			new_block->occupied = left_to_write;
-			new_block->next = NULL;
-			new_block->prev = cur_block;
-			cur_block->next = new_block;
-			cur_block = new_block;
-			file_to_write->last_block = cur_block;
-			file_to_write->occupied += left_to_write;
-			left_to_write = 0;
-		}
-	}
-	file_descriptors[fd]->block_to_act = cur_block;
-	file_descriptors[fd]->pos += size;
-	return size;
+		pthread_rwlock_unlock(&shard->lock);
+	}
+	for(size_t i = 0; i < count; i++) {
+		if(rc == 0 && entries[i]->dir != NULL)
+			rc = dir_walk_files(entries[i], func, arg);
+		else if(rc == 0)
+			func(entries[i], arg);
+		file_unref(entries[i]);
+	}
+	free(entries);
+	return rc;
 }
 
 ssize_t
-ufs_read(int fd, char *buf, size_t size)
+ufs_compress_cold(void)
 {
-	/* Check whether a file descriptor #fd exists */
-	if(fd < 0 || fd > file_descriptor_capacity - 1 || file_descriptors[fd] == NULL) {
-		ufs_error_code = UFS_ERR_NO_FILE;
+	pthread_once(&ufs_init_once, ufs_init);
+	struct pack_pass pass;
+	pass.raw = (char *)malloc(EXTENT_MAX);
+	pass.packed = (char *)malloc(EXTENT_MAX);
+	pass.saved = 0;
+	int rc = -1;
+	if(pass.raw != NULL && pass.packed != NULL)
+		rc = dir_walk_files(root_dir, file_pack_cold, &pass);
+	free(pass.raw);
+	free(pass.packed);
+	if(rc != 0) {
+		ufs_error_code = UFS_ERR_NO_MEM;
 		return -1;
 	}
-	/* Check permissions of the work */
-	if(file_descriptors[fd]->regime & UFS_WRITE_ONLY) {
-		ufs_error_code = UFS_ERR_NO_PERMISSION;
-		return -1;
+	return pass.saved;
+}
+
+void
+ufs_compress_stats(struct ufs_compress_stats *stats)
+{
+	stats->extents = atomic_load(&pack_stats.extents);
+	stats->raw_bytes = atomic_load(&pack_stats.raw_bytes);
+	stats->compressed_bytes = atomic_load(&pack_stats.packed_bytes);
+	stats->compressions = atomic_load(&pack_stats.compressions);
+	stats->hits = atomic_load(&pack_stats.hits);
+	stats->rejects = atomic_load(&pack_stats.rejects);
+}
+
+/** Counters of deduplication, see struct ufs_dedup_stats. */
+static struct {
+	atomic_uint_least64_t scanned;
+	atomic_uint_least64_t merges;
+	atomic_uint_least64_t holes;
+	atomic_uint_least64_t saved_bytes;
+	atomic_uint_least64_t collisions;
+} dedup_stats;
+
+static inline uint64_t
+rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/**
+ * Hash of extent data, @a size is a multiple of 32: four lanes
+ * of multiply-rotate over 8-byte words, in the xxHash style. It
+ * only finds candidates, they are compared byte by byte.
+ * @param[out] zero Whether all the bytes are zeros.
+ */
+static uint64_t
+dedup_hash(const char *data, size_t size, bool *zero)
+{
+	const uint64_t prime1 = 0x9e3779b185ebca87ull;
+	const uint64_t prime2 = 0xc2b2ae3d27d4eb4full;
+	uint64_t lanes[4] = {prime1 + prime2, prime2, 0, -prime1};
+	uint64_t any = 0;
+	for(size_t pos = 0; pos < size; pos += 32) {
+		for(int i = 0; i < 4; i++) {
+			uint64_t word;
+			memcpy(&word, data + pos + i * 8, 8);
+			any |= word;
+			lanes[i] = rotl64(lanes[i] + word * prime2, 31) * prime1;
+		}
 	}
-	/* The number of bytes left to read */
-	int left_to_read;
-	int available_to_read = file_descriptors[fd]->file->occupied - file_descriptors[fd]->pos;
-	if(available_to_read < size)
-		left_to_read = available_to_read;
-	else
-		left_to_read = size;
-	/* Choose the block to read */
-	struct block *cur_block = file_descriptors[fd]->block_to_act;
-	int offset = file_descriptors[fd]->pos % BLOCK_SIZE;
-	/* Check whether the file is not empty */
-	if(cur_block->memory == NULL)
-		return 0;
-	/* Read only a part of the block if the buf's size <= BLOCK_SIZE - offset */
-	if(left_to_read <= BLOCK_SIZE - offset) {
-		memcpy(buf, cur_block->memory + offset, left_to_read);
-		if(left_to_read == BLOCK_SIZE - offset)
-			cur_block = cur_block->next;
-		left_to_read = 0;
+	*zero = any == 0;
+	uint64_t h = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) +
+		     rotl64(lanes[3], 18) + size;
+	h ^= h >> 33;
+	h *= prime2;
+	h ^= h >> 29;
+	return h;
+}
+
+/**
+ * An entry of the table of a deduplication pass. The table holds
+ * a reference to the extent, so nobody changes its data in place
+ * during the pass, see extent_get_writable().
+ */
+struct dedup_slot {
+	uint64_t hash;
+	struct extent *ext;
+};
+
+struct dedup_pass {
+	/** Open addressing table, the size is a power of two. */
+	struct dedup_slot *slots;
+	size_t capacity;
+	size_t count;
+	/** How much memory merges freed. */
+	size_t saved;
+};
+
+/** Find an extent of @a span bytes by its hash, NULL if none. */
+static struct extent *
+dedup_find(const struct dedup_pass *pass, uint64_t hash, size_t span)
+{
+	size_t mask = pass->capacity - 1;
+	for(size_t i = hash & mask; pass->slots[i].ext != NULL; i = (i + 1) & mask) {
+		if(pass->slots[i].hash == hash && pass->slots[i].ext->capacity == span)
+			return pass->slots[i].ext;
 	}
-	else {
-		/* Read the last part of the block */
-		memcpy(buf, cur_block->memory + offset, BLOCK_SIZE - offset);
-		left_to_read -= cur_block->occupied - offset;
-		cur_block = cur_block->next;
-		while(cur_block != NULL) {
-			/* Read left data as a part of the block */
-			if(left_to_read <= BLOCK_SIZE) {
-				memcpy(buf + size - left_to_read, cur_block->memory, left_to_read);
-				left_to_read = 0;
-				return size;
-			}
-			/* Read whole block */
-			memcpy(buf + size - left_to_read, cur_block->memory, BLOCK_SIZE);
-			left_to_read -= cur_block->occupied;
-			cur_block = cur_block->next;
+	return NULL;
+}
+
+/**
+ * Add an extent to the table of the pass. Nothing is added when
+ * the table is full and can not grow, it only finds less then.
+ */
+static void
+dedup_insert(struct dedup_pass *pass, uint64_t hash, struct extent *ext)
+{
+	if((pass->count + 1) * 4 > pass->capacity * 3) {
+		size_t capacity = pass->capacity * 2;
+		struct dedup_slot *slots = (struct dedup_slot *)calloc(capacity, sizeof(*slots));
+		if(slots == NULL)
+			return;
+		for(size_t i = 0; i < pass->capacity; i++) {
+			if(pass->slots[i].ext == NULL)
+				continue;
+			size_t j = pass->slots[i].hash & (capacity - 1);
+			while(slots[j].ext != NULL)
+				j = (j + 1) & (capacity - 1);
+			slots[j] = pass->slots[i];
 		}
+		free(pass->slots);
+		pass->slots = slots;
+		pass->capacity = capacity;
+	}
+	size_t mask = pass->capacity - 1;
+	size_t i = hash & mask;
+	while(pass->slots[i].ext != NULL)
+		i = (i + 1) & mask;
+	atomic_fetch_add(&ext->refs, 1);
+	pass->slots[i].hash = hash;
+	pass->slots[i].ext = ext;
+	pass->count++;
+}
+
+/**
+ * Share extent @a idx of a file with an identical one met before
+ * in the pass, or drop it if it is all zeros. Only full extents
+ * are taken, so equal data means equal extents. The data is hashed
+ * under the shared lock, a match is compared and replaced under
+ * the exclusive one.
+ */
+static void
+file_dedup_extent(struct file *file, size_t idx, struct dedup_pass *pass)
+{
+	size_t span = extent_span(idx);
+	pthread_rwlock_rdlock(&file->lock);
+	struct extent *ext = extent_find(file, idx);
+	/* Mapped data can change any time */
+	if(ext == NULL || ext->data == NULL || ext->map != NULL || ext->capacity != span ||
+	   atomic_load(&ext->mmaps) > 0 || extent_start(idx) + span > file->size) {
+		pthread_rwlock_unlock(&file->lock);
+		return;
 	}
-	file_descriptors[fd]->block_to_act = cur_block;
-	if(available_to_read < size) {
-		file_descriptors[fd]->pos += available_to_read;
-		return available_to_read;
+	bool zero;
+	uint64_t hash = dedup_hash(ext->data, span, &zero);
+	atomic_fetch_add(&dedup_stats.scanned, 1);
+	struct extent *same = zero ? NULL : dedup_find(pass, hash, span);
+	if(!zero && same == NULL)
+		dedup_insert(pass, hash, ext);
+	pthread_rwlock_unlock(&file->lock);
+	if((!zero && same == NULL) || same == ext)
+		return;
+
+	pthread_rwlock_wrlock(&file->lock);
+	/* It could be freed and another one made at the address meanwhile */
+	bool merge = extent_find(file, idx) == ext && ext->data != NULL && ext->map == NULL &&
+		     ext->capacity == span && atomic_load(&ext->mmaps) == 0 &&
+		     extent_start(idx) + span <= file->size &&
+		     memcmp(ext->data, zero ? zero_data : same->data, span) == 0;
+	if(merge) {
+		/* Shared data is not freed, the sharers keep it */
+		bool freed = atomic_load(&ext->refs) == 1;
+		if(same != NULL)
+			atomic_fetch_add(&same->refs, 1);
+		*extent_slot(file, idx) = same;
+		extent_unref(ext);
+		if(freed) {
+			pass->saved += span;
+			atomic_fetch_add(&dedup_stats.saved_bytes, span);
+		}
+		atomic_fetch_add(zero ? &dedup_stats.holes : &dedup_stats.merges, 1);
 	}
-	else {
-		file_descriptors[fd]->pos += size;
-		return size;
+	else if(!zero) {
+		atomic_fetch_add(&dedup_stats.collisions, 1);
 	}
+	pthread_rwlock_unlock(&file->lock);
 }
 
-int
-ufs_close(int fd)
+/** Deduplicate the full extents of a file, see file_dedup_extent(). */
+static void
+file_dedup(struct file *file, void *arg)
 {
-	/* Check whether a file descriptor #fd exists */
-	if(fd < 0 || fd > file_descriptor_capacity - 1 || file_descriptors[fd] == NULL) {
-		ufs_error_code = UFS_ERR_NO_FILE;
+	pthread_rwlock_rdlock(&file->lock);
+	size_t count = file->size == 0 ? 0 : extent_number(file->size - 1) + 1;
+	pthread_rwlock_unlock(&file->lock);
+	for(size_t idx = 0; idx < count; idx++)
+		file_dedup_extent(file, idx, (struct dedup_pass *)arg);
+}
+
+ssize_t
+ufs_dedup(void)
+{
+	pthread_once(&ufs_init_once, ufs_init);
+	struct dedup_pass pass;
+	pass.capacity = 1024;
+	pass.count = 0;
+	pass.saved = 0;
+	pass.slots = (struct dedup_slot *)calloc(pass.capacity, sizeof(*pass.slots));
+	int rc = -1;
+	if(pass.slots != NULL)
+		rc = dir_walk_files(root_dir, file_dedup, &pass);
+	for(size_t i = 0; pass.slots != NULL && i < pass.capacity; i++) {
+		if(pass.slots[i].ext != NULL)
+			extent_unref(pass.slots[i].ext);
+	}
+	free(pass.slots);
+	if(rc != 0) {
+		ufs_error_code = UFS_ERR_NO_MEM;
 		return -1;
 	}
-	struct file *file = file_descriptors[fd]->file;
-	file->refs --;
-	/* Delete file if this is the last file_descriptor and the file is deleted */
-	if(file->refs == 0 && file->deleted == 1) {
-		struct block *curr = file->block_list->next;
-		while(curr != NULL) {
-			struct block *tmp = curr;
-			curr = curr->next;
-			free(tmp->memory);
-			free(tmp);
-		}
-		free(file->block_list->memory);
-		free(file->block_list);
-		free(file);
-	}
-	/* Delete file descriptor */
-	file_descriptor_count --;
-	file_descriptors[fd] = NULL;
-	return 0;
+	return pass.saved;
+}
+
+void
+ufs_dedup_stats(struct ufs_dedup_stats *stats)
+{
+	stats->scanned = atomic_load(&dedup_stats.scanned);
+	stats->merges = atomic_load(&dedup_stats.merges);
+	stats->holes = atomic_load(&dedup_stats.holes);
+	stats->saved_bytes = atomic_load(&dedup_stats.saved_bytes);
+	stats->collisions = atomic_load(&dedup_stats.collisions);
+}
+
+/**
+ * Evict extent @a idx of a file to the spill file, unless it was
+ * touched since the previous pass of the clock hand. Packed data
+ * is spilled as is, otherwise the data is spilled uncompressed.
+ * Like in file_pack_extent(), the data is written under the
+ * shared lock and dropped only if nobody touched it meanwhile.
+ * Files locked by others are skipped: the caller can hold file
+ * locks, waiting for one could be a deadlock.
+ * @param force Evict touched extents too.
+ */
+static void
+file_spill_extent(struct file *file, size_t idx, bool force)
+{
+	if(pthread_rwlock_tryrdlock(&file->lock) != 0)
+		return;
+	struct extent *ext = extent_find(file, idx);
+	if(ext == NULL || ext->spilled || ext->map != NULL || file->pinned ||
+	   atomic_load(&ext->refs) > 1 || (atomic_exchange(&ext->touched, false) && !force)) {
+		pthread_rwlock_unlock(&file->lock);
+		return;
+	}
+	char *data = ext->data;
+	size_t used = data != NULL ? extent_used(file, idx, ext) : ext->packed_used;
+	size_t size = data != NULL ? used : ext->packed_size;
+	uint64_t offset = size == 0 ? UINT64_MAX : spill_alloc(size);
+	int rc = offset == UINT64_MAX ? -1 :
+		 spill_io(data != NULL ? data : ext->packed, size, offset, true);
+	pthread_rwlock_unlock(&file->lock);
+	if(rc != 0) {
+		if(offset != UINT64_MAX)
+			spill_free(offset, size);
+		return;
+	}
+	if(pthread_rwlock_trywrlock(&file->lock) != 0) {
+		spill_free(offset, size);
+		return;
+	}
+	if(extent_find(file, idx) != ext || ext->data != data || ext->spilled || file->pinned ||
+	   (atomic_load(&ext->touched) && !force) || atomic_load(&ext->refs) > 1) {
+		pthread_rwlock_unlock(&file->lock);
+		spill_free(offset, size);
+		return;
+	}
+	if(data != NULL) {
+		extent_data_free(data, ext->capacity);
+		ext->data = NULL;
+	}
+	else {
+		extent_packed_free(ext);
+	}
+	ext->packed_size = size;
+	ext->packed_used = used;
+	ext->spilled = true;
+	ext->spill_off = offset;
+	file->has_packed = true;
+	pthread_rwlock_unlock(&file->lock);
+	atomic_fetch_add(&memory.spilled_extents, 1);
+	atomic_fetch_add(&memory.spilled_bytes, size);
+	atomic_fetch_add(&memory.evictions, 1);
+}
+
+/** Take a reference to a file unless it is being freed. */
+static bool
+file_tryref(struct file *file)
+{
+	int refs = atomic_load(&file->refs);
+	while(refs > 0) {
+		if(atomic_compare_exchange_weak(&file->refs, &refs, refs + 1))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Evict data until @a size more bytes fit into the memory limit.
+ * The clock hand visits files in turn and spills their extents
+ * not touched since its previous visit. When everything is
+ * touched again before the hand comes back, the third round
+ * spills whatever it meets, like LRU would. After that what is
+ * left is pinned, shared or locked, and allocations beyond the
+ * limit fail. It never waits for file locks, so it can be called
+ * under them.
+ */
+static void
+memory_make_room(size_t size)
+{
+	if(memory_fits(size) || atomic_load(&spill.fd) < 0)
+		return;
+	pthread_mutex_lock(&memory.reclaim_lock);
+	/* Empty rings count as visits, so the loop ends anyway */
+	size_t file_count = CLOCK_RING_COUNT;
+	for(int i = 0; i < CLOCK_RING_COUNT; i++) {
+		pthread_mutex_lock(&clock_rings[i].lock);
+		file_count += clock_rings[i].count;
+		pthread_mutex_unlock(&clock_rings[i].lock);
+	}
+	size_t visits = 0;
+	while(!memory_fits(size) && visits < 3 * file_count) {
+		bool force = visits >= 2 * file_count;
+		struct clock_ring *ring = &clock_rings[atomic_fetch_add(&clock_next_ring, 1) &
+							(CLOCK_RING_COUNT - 1)];
+		pthread_mutex_lock(&ring->lock);
+		struct file *file = ring->hand;
+		bool alive = false;
+		if(file != NULL) {
+			ring->hand = file->clock_next;
+			alive = file_tryref(file);
+		}
+		pthread_mutex_unlock(&ring->lock);
+		visits++;
+		if(!alive)
+			continue;
+		size_t count = 0;
+		if(pthread_rwlock_tryrdlock(&file->lock) == 0) {
+			count = file->size == 0 ? 0 : extent_number(file->size - 1) + 1;
+			pthread_rwlock_unlock(&file->lock);
+		}
+		for(size_t idx = 0; idx < count && !memory_fits(size); idx++)
+			file_spill_extent(file, idx, force);
+		file_unref(file);
+	}
+	pthread_mutex_unlock(&memory.reclaim_lock);
 }
 
 int
-ufs_delete(const char *filename)
+ufs_set_memory_limit(size_t limit, const char *spill_dir)
 {
-	/* Try to find a file in the file_list and delete it */ 
-	struct file *probe = (struct file *)malloc(sizeof(struct file));
-	if(file_list != NULL)
-		probe->next = file_list;
-	else
-		probe->next = NULL;
-	while(probe->next != NULL) {
-		probe = probe->next;
-		if(strcmp(probe->name, filename) == 0) {
-			/* Remove file from the file_list */
-			if(probe->prev != NULL) {
-				probe->prev->next = probe->next;
-				probe->next = NULL;
-			}
-			else {
-				if(probe->next != NULL) {
-					probe->next->prev = NULL;
-					file_list = probe->next;
-				}
-				else
-					file_list = NULL;
+	pthread_once(&ufs_init_once, ufs_init);
+	if(spill_dir != NULL) {
+		pthread_mutex_lock(&spill.lock);
+		if(atomic_load(&spill.fd) < 0) {
+			size_t len = strlen(spill_dir);
+			char *path = (char *)malloc(len + sizeof("/ufs_spill_XXXXXX"));
+			int fd = -1;
+			if(path != NULL) {
+				memcpy(path, spill_dir, len);
+				strcpy(path + len, "/ufs_spill_XXXXXX");
+				if((fd = mkstemp(path)) >= 0)
+					unlink(path);
+				free(path);
 			}
-			if(probe->refs == 0) {
-				/* Delete blocks of the file */
-				struct block *curr = probe->block_list->next;
-				while(curr != NULL) {
-					struct block *tmp = curr;
-					curr = curr->next;
-					free(tmp->memory);
-					free(tmp);
-				}
-				free(probe->block_list->memory);
-				free(probe->block_list);
-				free(probe);
+			if(fd < 0) {
+				pthread_mutex_unlock(&spill.lock);
+				ufs_error_code = path == NULL ? UFS_ERR_NO_MEM : UFS_ERR_IO;
+				return -1;
 			}
-			/* Or do it after the last file_descriptor will be closed */
-			else
-				probe->deleted = 1;
-			return 0;
+			atomic_store(&spill.fd, fd);
 		}
+		pthread_mutex_unlock(&spill.lock);
 	}
-	ufs_error_code = UFS_ERR_NO_FILE;
-	return -1;
+	atomic_store(&memory.limit, limit);
+	memory_make_room(0);
+	return 0;
 }
 
 int
-ufs_resize(int fd, size_t new_size)
+ufs_pin(int fd, int pin)
 {
-	/* Check whether a file descriptor #fd exists */
-	if(fd < 0 || fd > file_descriptor_capacity - 1 || file_descriptors[fd] == NULL) {
+	struct filedesc *desc = fd_get(fd);
+	if(desc == NULL) {
 		ufs_error_code = UFS_ERR_NO_FILE;
 		return -1;
 	}
-	struct file *file_to_resize = file_descriptors[fd]->file;
-	/* Increase the file size */ 
-	if(new_size > (file_to_resize->occupied / BLOCK_SIZE + 1)*BLOCK_SIZE) {
-		/* Check whether new_size is less than MAX_FILE_SIZE */ 
-		if(new_size > MAX_FILE_SIZE) {
-			ufs_error_code = UFS_ERR_NO_MEM;
-			return -1;
-		}
-		/* Create new block */
-		struct block *cur_block = file_to_resize->last_block;
-		for(int i = 0; i < (new_size / BLOCK_SIZE - file_to_resize->occupied / BLOCK_SIZE); i++) {
-			struct block *new_block = (struct block *)malloc(sizeof(struct block));
-			new_block->memory = (char *)malloc(sizeof(char)*BLOCK_SIZE);
-			new_block->occupied = 0;
-			new_block->next = NULL;
-			new_block->prev = cur_block;
-			cur_block->next = new_block;
-			cur_block = new_block;
-		}
-	}
-	/* Decrease the file size */
-	if(new_size < file_to_resize->occupied) {
-		/* Find the last block needed to save*/
-		int left = new_size;
-		struct block *cur_block = file_to_resize->block_list;
-		while(left >= BLOCK_SIZE) {
-			cur_block = cur_block->next;
-			left -= BLOCK_SIZE;
-		}
-		cur_block->next = NULL;
-		cur_block->occupied = left;
-		/* Change the pos of filedescriptors which points to the uot of new_size */
-		int refs = file_to_resize->refs;
-		int i = 0;
-		while(refs > 0) {
-			if(file_descriptors[i]->file == file_to_resize) {
-				if(file_descriptors[i]->pos > new_size) {
-					file_descriptors[i]->block_to_act = cur_block;
-					file_descriptors[i]->pos = new_size;
-				}
-				refs --;
-			}
-			i ++;
+	struct file *file = desc->file;
+	size_t need = 0;
+	if(pin) {
+		pthread_rwlock_rdlock(&file->lock);
+		need = file_packed_size(file, 0, SIZE_MAX);
+		pthread_rwlock_unlock(&file->lock);
+		memory_make_room(need);
+	}
+	pthread_rwlock_wrlock(&file->lock);
+	int rc = pin ? file_unpack_range(file, 0, SIZE_MAX) : 0;
+	if(rc == 0)
+		file->pinned = pin != 0;
+	pthread_rwlock_unlock(&file->lock);
+	filedesc_put(desc);
+	return rc;
+}
+
+void
+ufs_memory_stats(struct ufs_memory_stats *stats)
+{
+	stats->limit = atomic_load(&memory.limit);
+	stats->used = atomic_load(&memory.used);
+	stats->spilled_extents = atomic_load(&memory.spilled_extents);
+	stats->spilled_bytes = atomic_load(&memory.spilled_bytes);
+	stats->evictions = atomic_load(&memory.evictions);
+	stats->faults = atomic_load(&memory.faults);
+}
+
+static const char *const op_names[UFS_OP_COUNT] = {
+	[UFS_OP_OPEN] = "open",
+	[UFS_OP_CLOSE] = "close",
+	[UFS_OP_READ] = "read",
+	[UFS_OP_WRITE] = "write",
+	[UFS_OP_PREAD] = "pread",
+	[UFS_OP_PWRITE] = "pwrite",
+	[UFS_OP_READV] = "readv",
+	[UFS_OP_WRITEV] = "writev",
+	[UFS_OP_READ_VIEW] = "read_view",
+	[UFS_OP_LSEEK] = "lseek",
+	[UFS_OP_RESIZE] = "resize",
+	[UFS_OP_PUNCH_HOLE] = "punch_hole",
+	[UFS_OP_DELETE] = "delete",
+	[UFS_OP_MKDIR] = "mkdir",
+	[UFS_OP_RMDIR] = "rmdir",
+	[UFS_OP_RENAME] = "rename",
+	[UFS_OP_READDIR] = "readdir",
+	[UFS_OP_CLONE] = "clone",
+	[UFS_OP_MMAP] = "mmap",
+	[UFS_OP_COPY_RANGE] = "copy_range",
+};
+
+const char *
+ufs_op_name(enum ufs_op op)
+{
+	return op >= 0 && op < UFS_OP_COUNT ? op_names[op] : NULL;
+}
+
+void
+ufs_stats(struct ufs_stats *result)
+{
+	pthread_once(&ufs_init_once, ufs_init);
+	struct stats_thread sum;
+	memset(&sum, 0, sizeof(sum));
+	pthread_mutex_lock(&stats.lock);
+	stats_fold(&sum, &stats.retired);
+	stats_fold(&sum, &stats.shared);
+	for(struct stats_thread *t = stats.threads; t != NULL; t = t->next)
+		stats_fold(&sum, t);
+	pthread_mutex_unlock(&stats.lock);
+	for(int i = 0; i < UFS_OP_COUNT; i++) {
+		result->ops[i].calls = stats_get(&sum.ops[i].calls);
+		result->ops[i].errors = stats_get(&sum.ops[i].errors);
+		result->ops[i].bytes = stats_get(&sum.ops[i].bytes);
+		for(int j = 0; j < UFS_LATENCY_BUCKETS; j++)
+			result->ops[i].latency[j] = stats_get(&sum.ops[i].latency[j]);
+	}
+	/* Directories are files too */
+	result->dirs = stats_get(&sum.dirs);
+	result->files = stats_get(&sum.files) - result->dirs;
+	result->extents = stats_get(&sum.extents);
+	result->meta_bytes = stats_get(&sum.meta_bytes);
+	result->meta_slab_bytes = 0;
+	for(int i = SLAB_MIN_CLASS; i <= SLAB_MAX_CLASS; i++) {
+		struct slab_cache *cache = &size_classes[i - SLAB_MIN_CLASS];
+		pthread_mutex_lock(&cache->lock);
+		result->meta_slab_bytes += cache->slab_count * SLAB_SIZE;
+		pthread_mutex_unlock(&cache->lock);
+	}
+	ufs_memory_stats(&result->memory);
+	ufs_compress_stats(&result->compress);
+	ufs_dedup_stats(&result->dedup);
+}
+
+uint64_t
+ufs_latency_percentile(const struct ufs_op_stats *op, double q)
+{
+	uint64_t total = 0;
+	for(int i = 0; i < UFS_LATENCY_BUCKETS; i++)
+		total += op->latency[i];
+	if(total == 0)
+		return 0;
+	uint64_t rank = q * total, seen = 0;
+	for(int i = 0; i < UFS_LATENCY_BUCKETS - 1; i++) {
+		seen += op->latency[i];
+		if(seen > rank)
+			return (uint64_t)2 << i;
+	}
+	return UINT64_MAX;
+}
+
+/** Output of ufs_stats_dump(), cut at the buffer size. */
+struct dump {
+	char *buf;
+	size_t size;
+	/** Length of the whole output, even if it does not fit. */
+	size_t len;
+};
+
+static void __attribute__((format(printf, 2, 3)))
+dump_printf(struct dump *d, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int rc = vsnprintf(d->len < d->size ? d->buf + d->len : NULL,
+			   d->len < d->size ? d->size - d->len : 0, format, args);
+	va_end(args);
+	if(rc > 0)
+		d->len += rc;
+}
+
+size_t
+ufs_stats_dump(const struct ufs_stats *s, enum ufs_stats_format format,
+	       char *buf, size_t size)
+{
+	struct dump d = {buf, size, 0};
+	if(size > 0)
+		buf[0] = 0;
+	const struct ufs_memory_stats *mem = &s->memory;
+	const struct ufs_compress_stats *comp = &s->compress;
+	const struct ufs_dedup_stats *dedup = &s->dedup;
+	if(format == UFS_STATS_JSON) {
+		dump_printf(&d, "{\"files\":%zu,\"dirs\":%zu,\"extents\":%zu,"
+			    "\"meta_bytes\":%zu,\"meta_slab_bytes\":%zu,",
+			    s->files, s->dirs, s->extents, s->meta_bytes, s->meta_slab_bytes);
+		dump_printf(&d, "\"memory\":{\"limit\":%zu,\"used\":%zu,"
+			    "\"spilled_extents\":%zu,\"spilled_bytes\":%zu,"
+			    "\"evictions\":%llu,\"faults\":%llu},",
+			    mem->limit, mem->used, mem->spilled_extents, mem->spilled_bytes,
+			    (unsigned long long)mem->evictions, (unsigned long long)mem->faults);
+		dump_printf(&d, "\"compress\":{\"extents\":%zu,\"raw_bytes\":%zu,"
+			    "\"compressed_bytes\":%zu,\"compressions\":%llu,"
+			    "\"hits\":%llu,\"rejects\":%llu},",
+			    comp->extents, comp->raw_bytes, comp->compressed_bytes,
+			    (unsigned long long)comp->compressions,
+			    (unsigned long long)comp->hits, (unsigned long long)comp->rejects);
+		dump_printf(&d, "\"dedup\":{\"scanned\":%llu,\"merges\":%llu,"
+			    "\"holes\":%llu,\"saved_bytes\":%llu,\"collisions\":%llu},"
+			    "\"ops\":{", (unsigned long long)dedup->scanned,
+			    (unsigned long long)dedup->merges, (unsigned long long)dedup->holes,
+			    (unsigned long long)dedup->saved_bytes,
+			    (unsigned long long)dedup->collisions);
+		for(int i = 0; i < UFS_OP_COUNT; i++) {
+			const struct ufs_op_stats *op = &s->ops[i];
+			dump_printf(&d, "%s\"%s\":{\"calls\":%llu,\"errors\":%llu,"
+				    "\"bytes\":%llu,\"latency_ns_log2\":[", i == 0 ? "" : ",",
+				    op_names[i], (unsigned long long)op->calls,
+				    (unsigned long long)op->errors, (unsigned long long)op->bytes);
+			for(int j = 0; j < UFS_LATENCY_BUCKETS; j++)
+				dump_printf(&d, "%s%llu", j == 0 ? "" : ",",
+					    (unsigned long long)op->latency[j]);
+			dump_printf(&d, "]}");
 		}
+		dump_printf(&d, "}}\n");
+		return d.len;
+	}
+	dump_printf(&d, "files %zu\ndirs %zu\nextents %zu\nmeta_bytes %zu\n"
+		    "meta_slab_bytes %zu\n", s->files, s->dirs, s->extents,
+		    s->meta_bytes, s->meta_slab_bytes);
+	dump_printf(&d, "memory limit %zu used %zu spilled_extents %zu "
+		    "spilled_bytes %zu evictions %llu faults %llu\n",
+		    mem->limit, mem->used, mem->spilled_extents, mem->spilled_bytes,
+		    (unsigned long long)mem->evictions, (unsigned long long)mem->faults);
+	dump_printf(&d, "compress extents %zu raw_bytes %zu compressed_bytes %zu "
+		    "compressions %llu hits %llu rejects %llu\n",
+		    comp->extents, comp->raw_bytes, comp->compressed_bytes,
+		    (unsigned long long)comp->compressions,
+		    (unsigned long long)comp->hits, (unsigned long long)comp->rejects);
+	dump_printf(&d, "dedup scanned %llu merges %llu holes %llu saved_bytes %llu "
+		    "collisions %llu\n", (unsigned long long)dedup->scanned,
+		    (unsigned long long)dedup->merges, (unsigned long long)dedup->holes,
+		    (unsigned long long)dedup->saved_bytes,
+		    (unsigned long long)dedup->collisions);
+	/* Calls never made are skipped, percentiles are bucket bounds */
+	for(int i = 0; i < UFS_OP_COUNT; i++) {
+		const struct ufs_op_stats *op = &s->ops[i];
+		if(op->calls == 0)
+			continue;
+		dump_printf(&d, "op %s calls %llu errors %llu bytes %llu "
+			    "p50_ns %llu p99_ns %llu p999_ns %llu\n", op_names[i],
+			    (unsigned long long)op->calls, (unsigned long long)op->errors,
+			    (unsigned long long)op->bytes,
+			    (unsigned long long)ufs_latency_percentile(op, 0.5),
+			    (unsigned long long)ufs_latency_percentile(op, 0.99),
+			    (unsigned long long)ufs_latency_percentile(op, 0.999));
 	}
+	return d.len;
+}
+
+static int
+filedesc_resize(struct filedesc *desc, size_t new_size)
+{
+	struct file *file = desc->file;
+	/* Check whether new_size is less than MAX_FILE_SIZE */ 
+	if(new_size > MAX_FILE_SIZE) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	pthread_rwlock_wrlock(&file->lock);
+	/* Increase the file size, the new space is a hole */ 
+	if(new_size >= file->size) {
+		file_set_size(file, new_size);
+		pthread_rwlock_unlock(&file->lock);
+		return 0;
+	}
+	/*
+	 * Decrease the file size. First zero the tail of the last
+	 * kept extent, it can become visible on growth. It is done
+	 * before truncation, because copying an extent pinned by a
+	 * view can fail.
+	 */
+	size_t last = new_size == 0 ? 0 : extent_number(new_size - 1);
+	if(new_size != 0 &&
+	   extent_zero_range(file, last, new_size - extent_start(last), extent_span(last)) != 0) {
+		pthread_rwlock_unlock(&file->lock);
+		return -1;
+	}
+	file_drop_extents(file, new_size == 0 ? 0 : last + 1, SIZE_MAX);
+	file_set_size(file, new_size);
+	/* Descriptors behind the new end proceed from it */
+	pthread_mutex_lock(&file->desc_lock);
+	for(struct filedesc *other = file->desc_list; other != NULL; other = other->next)
+		if(other->pos > new_size)
+			other->pos = new_size;
+	pthread_mutex_unlock(&file->desc_lock);
+	pthread_rwlock_unlock(&file->lock);
 	return 0;
 }
+
+int
+ufs_resize(int fd, size_t new_size)
+{
+	uint64_t start = stats_start(UFS_OP_RESIZE);
+	struct filedesc *desc = fd_get_for_write(fd);
+	int rc = desc == NULL ? -1 : filedesc_resize(desc, new_size);
+	filedesc_put(desc);
+	stats_finish(UFS_OP_RESIZE, start, rc, false);
+	return rc;
+}
@@ -1,13 +1,19 @@
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #define NEED_RESIZE
 #define NEED_OPEN_FLAGS
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
- * Each file lies in the memory as an array of blocks. A file
- * has an unique file name, and there are no directories, so the
- * FS is a monolithic flat contiguous folder.
+ * Each file lies in the memory as an array of extents. Files are
+ * organized in a tree of directories and are named by paths:
+ * names separated by slashes, like "dir/subdir/file". A leading
+ * slash, a trailing one and repeated ones mean nothing, so "/a/b"
+ * and "a//b/" are the same path, and "" or "/" is the root
+ * directory. There are no "." and ".." entries, such names are
+ * invalid.
  */
 
 /**
@@ -51,6 +57,15 @@ enum open_flags {
 	 * into the file.
 	 */
 	UFS_READ_WRITE = 8,
+	/**
+	 * Each ufs_write() and ufs_writev() goes to the end of the
+	 * file as one record, even when other descriptors append
+	 * concurrently. Records are copied in parallel and appear
+	 * whole and in order, so readers can tail the file. The
+	 * position moves to the end of the record. ufs_pwrite()
+	 * still writes at its offset.
+	 */
+	UFS_APPEND = 16,
 
 #endif
 };
@@ -66,6 +81,26 @@ enum ufs_error_code {
 
 	UFS_ERR_NO_PERMISSION,
 #endif
+	UFS_ERR_INVALID_ARG,
+	UFS_ERR_IO,
+	/** A path component is a file, not a directory. */
+	UFS_ERR_NOT_DIR,
+	/** A directory is given where a file is expected. */
+	UFS_ERR_IS_DIR,
+	UFS_ERR_EXISTS,
+	UFS_ERR_NOT_EMPTY,
+	/** A linked call is not run as one before it failed, see ufs_ring.h. */
+	UFS_ERR_CANCELED,
+};
+
+/** Origin of an offset for ufs_lseek(). */
+enum ufs_seek_whence {
+	/** From the beginning of the file. */
+	UFS_SEEK_SET = 0,
+	/** From the current descriptor position. */
+	UFS_SEEK_CUR = 1,
+	/** From the end of the file. */
+	UFS_SEEK_END = 2,
 };
 
 /** Get code of the last error. */
@@ -73,14 +108,17 @@ enum ufs_error_code
 ufs_errno();
 
 /**
- * Open a file by filename.
- * @param filename Name of a file to open.
+ * Open a file by path.
+ * @param filename Path of a file to open.
  * @param flags Bitwise combination of open_flags.
  *
  * @retval > 0 File descriptor.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file, and UFS_CREATE flag is
- *       not specified.
+ *       not specified, or no directory to create it in.
+ *     - UFS_ERR_NOT_DIR - a component of the path is a file.
+ *     - UFS_ERR_IS_DIR - the path is a directory.
+ *     - UFS_ERR_INVALID_ARG - "." or ".." in the path.
  */
 int
 ufs_open(const char *filename, int flags);
@@ -109,10 +147,207 @@ ufs_write(int fd, const char *buf, size_t size);
  * @retval 0 EOF.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory to unpack compressed
+ *       or spilled data, see ufs_compress_cold() and
+ *       ufs_set_memory_limit().
+ *     - UFS_ERR_IO - spilled data can not be read or compressed
+ *       data is corrupted.
  */
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
+/**
+ * Write data to the file at the given offset. The descriptor
+ * position is not used and not changed. If @a offset is beyond
+ * the end of file, the gap reads as zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Position in the file to write at.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory or the file would
+ *       exceed the max file size.
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the file at the given offset. The descriptor
+ * position is not used and not changed.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Position in the file to read from.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 @a offset is at or beyond EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory to unpack compressed
+ *       or spilled data, see ufs_compress_cold() and
+ *       ufs_set_memory_limit().
+ *     - UFS_ERR_IO - spilled data can not be read or compressed
+ *       data is corrupted.
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
+/**
+ * Write data gathered from several buffers, as one call. The
+ * descriptor position moves like after ufs_write().
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to write.
+ * @param iovcnt Number of buffers.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ *     - UFS_ERR_INVALID_ARG - negative @a iovcnt.
+ */
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Read data scattering it over several buffers, as one call.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to fill one after another.
+ * @param iovcnt Number of buffers.
+ *
+ * @retval >= 0 How many bytes were read, 0 on EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory to unpack compressed
+ *       or spilled data, see ufs_compress_cold() and
+ *       ufs_set_memory_limit().
+ *     - UFS_ERR_IO - spilled data can not be read or compressed
+ *       data is corrupted.
+ *     - UFS_ERR_INVALID_ARG - negative @a iovcnt.
+ */
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Read-only view of file data without copying, see
+ * ufs_read_view().
+ */
+struct ufs_view {
+	/** Spans of file memory, can be passed to writev() as is. */
+	struct iovec *iov;
+	/** Number of spans. */
+	int iovcnt;
+	/** Total length of the spans. */
+	size_t size;
+	/** Private. */
+	void **pins;
+};
+
+/**
+ * Read data without copying: fill @a view with pointers into
+ * the file memory. The memory is pinned until the view is
+ * released: it stays valid and unchanged even if the file is
+ * written, truncated or deleted meanwhile. Only mapped data is
+ * changed in place, see ufs_mmap(). The descriptor position
+ * moves like after ufs_read(). Each span lies within one extent,
+ * so a big view can have more spans than writev() accepts at
+ * once (IOV_MAX).
+ * @param fd File descriptor from ufs_open().
+ * @param size Maximum bytes to view.
+ * @param[out] view View to fill, must be released with
+ *        ufs_view_release().
+ *
+ * @retval >= 0 How many bytes are in the view, 0 on EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_read_view(int fd, size_t size, struct ufs_view *view);
+
+/** Unpin the memory of a view filled by ufs_read_view(). */
+void
+ufs_view_release(struct ufs_view *view);
+
+/** File data mapped into the address space, see ufs_mmap(). */
+struct ufs_mapping {
+	/** Start of the mapped range. */
+	void *addr;
+	/** Length of the mapped range. */
+	size_t size;
+	/** Private. */
+	void *window;
+	size_t window_size;
+	void **pins;
+	int pin_count;
+};
+
+/**
+ * Map a range of file data: its memory is put at consecutive
+ * addresses, so it can be used in place like a memory-mapped
+ * file. Writes through the mapping change the file at once, and
+ * writes to the file are seen through it. To be mapped, the data
+ * is moved into a shared memory arena once, then it stays there.
+ *
+ * Only bytes of the range can be accessed, and only while they
+ * are in the file: the data dropped by truncation, a hole
+ * punched, a clone or a copied range over the file is detached
+ * from the file but stays mapped. Views of mapped data see
+ * writes through the mapping, while snapshots, clones and copies
+ * of ranges take a copy of it.
+ * @param fd File descriptor from ufs_open(). The mapping is
+ *        read-only when the descriptor is UFS_READ_ONLY.
+ * @param offset Start of the range.
+ * @param len Length of the range.
+ * @param[out] map Mapping to fill, must be unmapped with
+ *        ufs_munmap().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - the descriptor is UFS_WRITE_ONLY.
+ *     - UFS_ERR_INVALID_ARG - the range is empty or beyond the end
+ *       of file.
+ *     - UFS_ERR_NO_MEM - not enough memory or address space.
+ *     - UFS_ERR_IO - the arena can not be created.
+ */
+int
+ufs_mmap(int fd, size_t offset, size_t len, struct ufs_mapping *map);
+
+/** Unmap a range mapped with ufs_mmap() and unpin its data. */
+void
+ufs_munmap(struct ufs_mapping *map);
+
+/**
+ * Keep all new file data of a page and more in the arena of
+ * ufs_mmap(), so that mapping it does not move it. Data which is
+ * already in the memory stays where it is.
+ * @param on Not 0 to turn on, 0 to turn off.
+ *
+ * @retval 0 Success.
+ * @retval -1 UFS_ERR_IO - the arena can not be created.
+ */
+int
+ufs_set_mmap_storage(int on);
+
+/**
+ * Move the descriptor position. It is allowed to move it beyond
+ * the end of file, then the next write fills the gap with zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Offset relative to @a whence.
+ * @param whence One of ufs_seek_whence.
+ *
+ * @retval >= 0 New position.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - bad @a whence, or the position
+ *       would be negative or beyond the max file size.
+ */
+ssize_t
+ufs_lseek(int fd, ssize_t offset, int whence);
+
 /**
  * Close a file.
  * @param fd File descriptor from ufs_open().
@@ -131,32 +366,497 @@ ufs_close(int fd);
  * same name immediately and it should not affect existing opened
  * descriptors of the deleted file.
  *
- * @param filename Name of a file to delete.
+ * @param filename Path of a file to delete.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file.
+ *     - UFS_ERR_IS_DIR - the path is a directory, see ufs_rmdir().
  */
 int
 ufs_delete(const char *filename);
 
+/**
+ * Create a directory. Its parent must exist.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_EXISTS - the path already exists.
+ *     - UFS_ERR_NO_FILE - no parent directory.
+ *     - UFS_ERR_NOT_DIR - a component of the path is a file.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_mkdir(const char *path);
+
+/**
+ * Delete a directory. With @a recursive everything in it is
+ * deleted too, otherwise it must be empty. Like with ufs_delete(),
+ * opened descriptors keep their files.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NOT_DIR - the path is a file.
+ *     - UFS_ERR_NOT_EMPTY - the directory is not empty and
+ *       @a recursive is not set.
+ *     - UFS_ERR_INVALID_ARG - the path is the root.
+ */
+int
+ufs_rmdir(const char *path, int recursive);
+
+/**
+ * Move a file or a directory to another path. An existing file
+ * at @a dst is replaced like deleted, an existing directory is
+ * never replaced. Opened descriptors stay valid.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no @a src, or no directory for @a dst.
+ *     - UFS_ERR_EXISTS - @a dst is a directory.
+ *     - UFS_ERR_NOT_DIR - @a src is a directory and @a dst is a
+ *       file, or a component of a path is a file.
+ *     - UFS_ERR_INVALID_ARG - a directory would be moved into
+ *       itself, or one of the paths is the root.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_rename(const char *src, const char *dst);
+
+/** An entry of a directory, see ufs_readdir(). */
+struct ufs_dirent {
+	char *name;
+	/** Whether the entry is a directory. */
+	int is_dir;
+};
+
+/** Entries of a directory, see ufs_readdir(). */
+struct ufs_dirlist {
+	struct ufs_dirent *entries;
+	int count;
+};
+
+/**
+ * List a directory, in no particular order. It takes time
+ * proportional to the number of its entries, however many files
+ * are elsewhere. Entries created or deleted meanwhile can be
+ * listed or not.
+ * @param path Path of the directory.
+ * @param[out] list Entries, must be released with
+ *        ufs_dirlist_release().
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NOT_DIR - the path is a file.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_readdir(const char *path, struct ufs_dirlist *list);
+
+/** Free entries filled by ufs_readdir(). */
+void
+ufs_dirlist_release(struct ufs_dirlist *list);
+
+/**
+ * Make @a dst a copy of @a src without copying data: the files
+ * share all extents, and an extent is copied only when one of the
+ * files writes into it. @a dst is created if it does not exist,
+ * otherwise its content is replaced, and its opened descriptors
+ * behind the new end proceed from it.
+ * @param src Path of a file to copy.
+ * @param dst Path of the copy.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no file @a src.
+ *     - UFS_ERR_IS_DIR - one of the paths is a directory.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_clone(const char *src, const char *dst);
+
+/**
+ * Copy a range of one file to another one, or to another place
+ * of the same file, without a read and write loop. Extents which
+ * line up are shared like by ufs_clone(), holes stay holes, only
+ * the rest is copied. Extents line up when the offsets are equal,
+ * and beyond the first 4MB when they differ by a multiple of 4MB.
+ * Positions of the descriptors do not move.
+ * @param src_fd Descriptor to read from.
+ * @param src_off Start of the range in the source.
+ * @param dst_fd Descriptor to write to. The file grows if needed,
+ *        a gap between its end and @a dst_off is zero-filled.
+ * @param dst_off Start of the copy in the destination.
+ * @param len Length of the range.
+ *
+ * @retval >= 0 How many bytes were copied, less than @a len when
+ *         the source ends before the range does.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - @a src_fd is UFS_WRITE_ONLY or
+ *       @a dst_fd is UFS_READ_ONLY.
+ *     - UFS_ERR_INVALID_ARG - the ranges overlap in one file.
+ *     - UFS_ERR_NO_MEM - not enough memory, or the copy would
+ *       exceed the max file size.
+ */
+ssize_t
+ufs_copy_range(int src_fd, size_t src_off, int dst_fd, size_t dst_off, size_t len);
+
+/**
+ * Point-in-time copy of the whole filesystem, see ufs_snapshot().
+ */
+struct ufs_snapshot;
+
+/**
+ * Take a snapshot of all directories and files. It is built like
+ * ufs_clone(), so it costs only the extent index of each file,
+ * and the files stay shared until they are written. Calls changing files wait until
+ * the snapshot is taken, so it reflects one moment.
+ * @retval not NULL Snapshot, delete it with ufs_snapshot_delete().
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+struct ufs_snapshot *
+ufs_snapshot(void);
+
+/**
+ * Open a file of a snapshot for reading. The descriptor is a
+ * usual one, but writing into it is not permitted.
+ * @retval >= 0 File descriptor.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such file in the snapshot.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_snapshot_open(struct ufs_snapshot *snap, const char *filename);
+
+/**
+ * Make the filesystem look exactly like the snapshot: files and
+ * directories created after it are deleted, others get their
+ * content from it. Like with ufs_delete(), descriptors opened before stay on
+ * the old files. The snapshot stays valid.
+ * @retval 0 Success.
+ * @retval -1 Error occurred, nothing is changed. Check
+ *         ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_snapshot_restore(struct ufs_snapshot *snap);
+
+/**
+ * Delete a snapshot. Descriptors opened on its files stay valid
+ * until closed.
+ */
+void
+ufs_snapshot_delete(struct ufs_snapshot *snap);
+
+/**
+ * Save all directories and files into an image file at @a path. The first
+ * checkpoint writes the whole filesystem; the next ones into the
+ * same path append only the extents changed since the previous
+ * checkpoint or ufs_image_load(), and rewrite the image anew
+ * only when too much of it is outdated. Files can be used while
+ * a checkpoint is in progress, it saves them as they were at its
+ * start. A crash during a checkpoint leaves the previous one in
+ * the file.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ *     - UFS_ERR_IO - the file can not be written, see errno.
+ */
+int
+ufs_image_checkpoint(const char *path);
+
+/**
+ * Replace all files with the ones of an image file. The file is
+ * mapped into memory and its data is read only on access, so
+ * loading takes time proportional to the number of extents, not
+ * their size. The image file must not be changed by others while
+ * it is loaded. Like with ufs_snapshot_restore(), descriptors
+ * opened before stay on the old files.
+ * @retval 0 Success.
+ * @retval -1 Error occurred, nothing is changed. Check
+ *         ufs_errno() for a code.
+ *     - UFS_ERR_IO - the file can not be opened or mapped.
+ *     - UFS_ERR_INVALID_ARG - the file is not a valid image.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_image_load(const char *path);
+
+/**
+ * Compress data which was not accessed since the previous call,
+ * to keep more cold files in memory. Call it periodically, the
+ * period decides how long data must be idle to be compressed.
+ * Compressed data is decompressed on the first access, with a
+ * single delay for that access; data in use is never compressed,
+ * so hot files are not slowed down. Only extents of at least a
+ * page are compressed, and only if it saves an eighth of them.
+ * Files can be used during the call.
+ * @retval >= 0 How many bytes compression saved in this call.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_compress_cold(void);
+
+/** Counters of compression, see ufs_compress_stats(). */
+struct ufs_compress_stats {
+	/** Extents compressed now. */
+	size_t extents;
+	/** Size of their data uncompressed. */
+	size_t raw_bytes;
+	/**
+	 * Size of their data compressed. The compression ratio is
+	 * raw_bytes / compressed_bytes.
+	 */
+	size_t compressed_bytes;
+	/** How many times data was compressed. */
+	uint64_t compressions;
+	/**
+	 * Accesses to compressed data: how many times it was
+	 * decompressed.
+	 */
+	uint64_t hits;
+	/** Cold extents left uncompressed as not worth it. */
+	uint64_t rejects;
+};
+
+/** Get compression counters of the whole filesystem. */
+void
+ufs_compress_stats(struct ufs_compress_stats *stats);
+
+/**
+ * Deduplicate file data: full extents with equal data become one
+ * extent shared by the files, extents of zeros become holes. Data
+ * is found by a hash and compared byte by byte, so only really
+ * equal data is shared. A write to shared data copies the extent
+ * it writes to. Shared extents are not compressed or evicted, see
+ * ufs_compress_cold() and ufs_set_memory_limit(). Files can be
+ * used during the call, though writes to data seen in it copy it.
+ * @retval >= 0 How many bytes of memory it freed.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_dedup(void);
+
+/** Counters of deduplication, see ufs_dedup_stats(). */
+struct ufs_dedup_stats {
+	/** Full extents hashed. */
+	uint64_t scanned;
+	/** Extents replaced by an equal one. */
+	uint64_t merges;
+	/** Extents of zeros replaced by holes. */
+	uint64_t holes;
+	/**
+	 * Memory freed by merges and holes. Writes to shared data
+	 * take some of it back.
+	 */
+	uint64_t saved_bytes;
+	/** Equal hashes of different data. */
+	uint64_t collisions;
+};
+
+/** Get deduplication counters of the whole filesystem. */
+void
+ufs_dedup_stats(struct ufs_dedup_stats *stats);
+
+/**
+ * Limit the memory file data takes. Above the limit data not
+ * accessed recently is evicted to a spill file and read back on
+ * access; if nothing can be evicted, calls needing more memory
+ * fail with UFS_ERR_NO_MEM instead of exhausting the process.
+ * Only file data counts, not names and indexes.
+ * @param limit Bytes of file data, 0 to remove the limit.
+ * @param spill_dir Directory to create the spill file in. It is
+ *        created on the first call with a directory and deleted
+ *        with the process. NULL for no spill file: then the limit
+ *        is a quota.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - the spill file can not be created.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_set_memory_limit(size_t limit, const char *spill_dir);
+
+/**
+ * Pin the data of a file in memory or unpin it. A pinned file is
+ * read back from the spill file at once and is not evicted or
+ * compressed anymore, see ufs_set_memory_limit() and
+ * ufs_compress_cold().
+ * @param fd File descriptor from ufs_open().
+ * @param pin Not 0 to pin, 0 to unpin.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory for the whole file.
+ */
+int
+ufs_pin(int fd, int pin);
+
+/** Memory counters, see ufs_memory_stats(). */
+struct ufs_memory_stats {
+	/** The limit, 0 if there is none. */
+	size_t limit;
+	/** Memory of file data, compressed data included. */
+	size_t used;
+	/** Extents in the spill file and their size there. */
+	size_t spilled_extents;
+	size_t spilled_bytes;
+	/** How many times data was evicted. */
+	uint64_t evictions;
+	/** How many times spilled data was read back. */
+	uint64_t faults;
+};
+
+/** Get memory counters of the whole filesystem. */
+void
+ufs_memory_stats(struct ufs_memory_stats *stats);
+
+/** Calls counted by ufs_stats(). */
+enum ufs_op {
+	UFS_OP_OPEN,
+	UFS_OP_CLOSE,
+	UFS_OP_READ,
+	UFS_OP_WRITE,
+	UFS_OP_PREAD,
+	UFS_OP_PWRITE,
+	UFS_OP_READV,
+	UFS_OP_WRITEV,
+	UFS_OP_READ_VIEW,
+	UFS_OP_LSEEK,
+	UFS_OP_RESIZE,
+	UFS_OP_PUNCH_HOLE,
+	UFS_OP_DELETE,
+	UFS_OP_MKDIR,
+	UFS_OP_RMDIR,
+	UFS_OP_RENAME,
+	UFS_OP_READDIR,
+	UFS_OP_CLONE,
+	UFS_OP_MMAP,
+	UFS_OP_COPY_RANGE,
+	UFS_OP_COUNT,
+};
+
+enum {
+	/** Buckets of a latency histogram, see ufs_op_stats. */
+	UFS_LATENCY_BUCKETS = 32,
+};
+
+/** Counters of one call, see ufs_stats(). */
+struct ufs_op_stats {
+	uint64_t calls;
+	/** Calls which returned an error. */
+	uint64_t errors;
+	/** Bytes read or written by data calls. */
+	uint64_t bytes;
+	/**
+	 * Latency histogram: latency[i] counts calls which took from
+	 * 2^i to 2^(i + 1) nanoseconds, the last bucket counts all
+	 * the longer ones too. Only a sample of calls is timed, one
+	 * of each 16 calls of a thread, to keep the cost low.
+	 */
+	uint64_t latency[UFS_LATENCY_BUCKETS];
+};
+
+/** Statistics of the filesystem, see ufs_stats(). */
+struct ufs_stats {
+	/** Counters of each call, indexed by enum ufs_op. */
+	struct ufs_op_stats ops[UFS_OP_COUNT];
+	/** Files and directories in memory, also the ones of snapshots. */
+	size_t files;
+	size_t dirs;
+	/** Extents of file data, see memory.used for their memory. */
+	size_t extents;
+	/** Memory of metadata objects: files, names, indexes, extents. */
+	size_t meta_bytes;
+	/** Memory mapped for small metadata objects, free space included. */
+	size_t meta_slab_bytes;
+	struct ufs_memory_stats memory;
+	struct ufs_compress_stats compress;
+	struct ufs_dedup_stats dedup;
+};
+
+/**
+ * Get statistics of the filesystem. Counters are kept by each
+ * thread, so calls do not contend on them, and are summed here.
+ * Counters of exited threads are kept. The sum is not an atomic
+ * snapshot while other threads make calls.
+ */
+void
+ufs_stats(struct ufs_stats *stats);
+
+/** Name of a call, like "pread", or NULL for an unknown one. */
+const char *
+ufs_op_name(enum ufs_op op);
+
+/**
+ * Latency of a call at quantile @a q, from 0 to 1, estimated by
+ * its histogram: the upper bound of the bucket holding it.
+ * @retval 0 No call was timed.
+ * @retval UINT64_MAX It is in the last, unbounded bucket.
+ */
+uint64_t
+ufs_latency_percentile(const struct ufs_op_stats *op, double q);
+
+/** Formats of ufs_stats_dump(). */
+enum ufs_stats_format {
+	/**
+	 * Lines of a name and values, calls never made are skipped
+	 * and latencies are shown as percentiles.
+	 */
+	UFS_STATS_TEXT,
+	/**
+	 * One object with all the fields of ufs_stats, latency
+	 * histograms as arrays of bucket counts.
+	 */
+	UFS_STATS_JSON,
+};
+
+/**
+ * Print statistics into @a buf like snprintf(): the output is cut
+ * to fit @a size bytes with the terminating zero.
+ * @return Length of the whole output without the terminating
+ *         zero, if it is not less than @a size, the output is cut.
+ */
+size_t
+ufs_stats_dump(const struct ufs_stats *stats, enum ufs_stats_format format,
+	       char *buf, size_t size);
+
 #ifdef NEED_RESIZE
 
 /**
  * Resize a file opened by the file descriptor @a fd. If current
- * file size is less than @a new_size, then new empty blocks are
- * created and positions of opened file descriptors are not
- * changed. If the current size is bigger than @a new_size, then
- * the blocks are truncated. Opened file descriptors behind the
- * new file size should proceed from the new file end.
+ * file size is less than @a new_size, then the new space is a
+ * hole: it reads as zeros and takes memory only when written.
+ * Positions of opened file descriptors are not changed. If the
+ * current size is bigger than @a new_size, then the extents are
+ * truncated. Opened file descriptors behind the new file size
+ * should proceed from the new file end.
  *
  * @param fd File descriptor from ufs_open().
  * @param new_size New file size.
  * @retval 0 Success.
  * @retval -1 Error occurred.
  *     - UFS_ERR_NO_FILE - invalid file descriptor.
- *     - UFS_ERR_NO_MEM - not enough memory. Can appear only when
- *       @a new_size is bigger than the current size.
+ *     - UFS_ERR_NO_MEM - @a new_size is bigger than the max file
+ *       size, or not enough memory to copy the new last extent
+ *       when it is pinned by a view.
  */
 int
 ufs_resize(int fd, size_t new_size);
 
 #endif
+
+/**
+ * Release memory of a range of the file. Whole extents in the
+ * range are freed and become a hole, partially covered extents
+ * are zeroed. The file size does not change, the range reads as
+ * zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Start of the range.
+ * @param len Length of the range. It is cut at the end of file.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory to copy an edge
+ *       extent pinned by a view.
+ */
+int
+ufs_punch_hole(int fd, size_t offset, size_t len);